@@ -57,6 +57,8 @@
 
 #include <linux/io.h>	// virt_to_phys
 #include <linux/hrtimer.h>
+#include <linux/srcu.h>
+#include <linux/percpu.h>	// alloc_percpu(), this_cpu_add()
 
 #define printf(fmt, arg...)	printk(KERN_ERR fmt, ##arg)
 #define KASSERT(a, b)		BUG_ON(!(a))
@@ -79,6 +81,10 @@
 	memcpy((skb)->data, from, copy)
 #endif /* HAVE_SKB_COPY_LINEAR */
 
+#ifndef NETMAP_LINUX_HAVE_CONSUME_SKB_ANY
+#define dev_consume_skb_any(skb)	dev_kfree_skb_any(skb)
+#endif /* HAVE_CONSUME_SKB_ANY */
+
 #ifndef NETMAP_LINUX_HAVE_ACCESS_ONCE
 #define ACCESS_ONCE(x)	(x)
 #endif
@@ -168,11 +174,15 @@ struct thread;
 /* Atomic variables. */
 #define NM_ATOMIC_TEST_AND_SET(p)	test_and_set_bit(0, (p))
 #define NM_ATOMIC_CLEAR(p)		clear_bit(0, (p))
+/* bit i of an array of u_long */
+#define NM_BIT_SET(b, i)		set_bit((i), (b))
+#define NM_BIT_CLEAR(b, i)		clear_bit((i), (b))
 
 #define NM_ATOMIC_SET(p, v)             atomic_set(p, v)
 #define NM_ATOMIC_INC(p)                atomic_inc(p)
 #define NM_ATOMIC_READ_AND_CLEAR(p)     atomic_xchg(p, 0)
 #define NM_ATOMIC_READ(p)               atomic_read(p)
+#define atomic_add_long(p, v)           atomic_long_add(v, (atomic_long_t *)(p))
 
 
 // XXX maybe implement it as a proper function somewhere
@@ -284,9 +294,9 @@ static inline void mtx_unlock(safe_spinlock_t *m)
 #define mtx_unlock_spin(a)	mtx_unlock(a)
 
 /*
- * XXX these must be changed, as we cannot sleep within the RCU.
- * Must change to proper rwlock, and then can move the definitions
- * into the main netmap.c file.
+ * bdg_lock serializes the writers (attach/detach and
+ * configuration). The forwarding path runs within a SRCU
+ * read-side section instead, since it may sleep in copyin().
  */
 #define BDG_RWLOCK_T		struct rw_semaphore
 #define BDG_RWINIT(b)		init_rwsem(&(b)->bdg_lock)
@@ -295,9 +305,15 @@ static inline void mtx_unlock(safe_spinlock_t *m)
 #define BDG_WUNLOCK(b)		up_write(&(b)->bdg_lock)
 #define BDG_RLOCK(b)		down_read(&(b)->bdg_lock)
 #define BDG_RUNLOCK(b)		up_read(&(b)->bdg_lock)
-#define BDG_RTRYLOCK(b)		down_read_trylock(&(b)->bdg_lock)
-#define BDG_SET_VAR(lval, p)	((lval) = (p))
-#define BDG_GET_VAR(lval)	(lval)
+#define BDG_RCU_T		struct srcu_struct
+#define BDG_RCU_TRACKER_T	int
+#define BDG_RCU_INIT(b)		init_srcu_struct(&(b)->bdg_rcu)
+#define BDG_RCU_DESTROY(b)	cleanup_srcu_struct(&(b)->bdg_rcu)
+#define BDG_RCU_ENTER(b, t)	((t) = srcu_read_lock(&(b)->bdg_rcu))
+#define BDG_RCU_EXIT(b, t)	srcu_read_unlock(&(b)->bdg_rcu, (t))
+#define BDG_RCU_SYNC(b)		synchronize_srcu(&(b)->bdg_rcu)
+#define BDG_SET_VAR(lval, p)	do { smp_wmb(); (lval) = (p); } while (0)
+#define BDG_GET_VAR(lval)	ACCESS_ONCE(lval)
 #define BDG_FREE(p)		kfree(p)
 
 /* use volatile to fix a probable compiler error on 2.6.25 */
@@ -321,14 +337,25 @@ static inline int ilog2(uint64_t n)
 }
 #endif /* ilog2 */
 
-#define contigmalloc(sz, ty, flags, a, b, pgsz, c) ({		\
+/*
+ * node < 0 means any node, preferably the local one.
+ * Hugepage clusters (pgsz > PAGE_SIZE) are only requested by the
+ * allocator under its own mutex, where we can sleep: GFP_ATOMIC
+ * would almost never find a free order-9 block after boot, while
+ * GFP_KERNEL lets the kernel compact memory first.
+ */
+#define contigmalloc_node(sz, ty, flags, a, b, pgsz, c, node) ({	\
 	unsigned int order_ =					\
 		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
-	struct page *p_ = alloc_pages(GFP_ATOMIC | __GFP_ZERO,  \
-		order_);					\
+	struct page *p_ = alloc_pages_node((node),		\
+		((pgsz) > PAGE_SIZE ? GFP_KERNEL | __GFP_NOWARN :	\
+		 GFP_ATOMIC) | __GFP_ZERO, order_);		\
 	if (p_ != NULL) 					\
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
+
+#define contigmalloc(sz, ty, flags, a, b, pgsz, c)		\
+	contigmalloc_node(sz, ty, flags, a, b, pgsz, c, -1)
 	
 #define contigfree(va, sz, ty)					\
 	do {							\
@@ -459,6 +486,9 @@ int sysctl_handle_long(SYSCTL_HANDLER_ARGS);
 struct netmap_adapter;
 int netmap_linux_config(struct netmap_adapter *na, 
 		u_int *txr, u_int *rxr, u_int *txd, u_int *rxd);
+struct netmap_filter;
+int netmap_linux_rxnfc(struct netmap_adapter *na, struct netmap_filter *f,
+		int onoff);
 /* ---- namespaces ------ */
 #ifdef CONFIG_NET_NS
 int netmap_bns_register(void);
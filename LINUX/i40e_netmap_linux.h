@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2015 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * netmap support for: i40e (LINUX version)
+ *
+ * Same structure as ixgbe_netmap_linux.h, to which we refer for
+ * the general comments. Only the main VSI (the one with the netdev)
+ * is exported, with one netmap ring per queue pair.
+ *
+ * Differences with ixgbe:
+ * - the NIC tail registers are mapped in ring->tail;
+ * - tx completions are tracked with the head write-back that the
+ *   driver enables in the tx queue context (i40e_netmap_get_head()),
+ *   so the reclaim does not read NIC registers;
+ * - the rx buffer size is in the rx queue context, programmed by
+ *   the driver from rx_buf_len, which must fit a netmap buffer.
+ *   Jumbo frames and packet split are not supported.
+ *
+ * This file contains code but only static or inline functions used
+ * by a single driver. It is #included near the beginning of
+ * i40e_main.c (see the patch in final-patches).
+ */
+
+
+#include <bsd_glue.h>
+#include <net/netmap.h>
+#include <netmap/netmap_kern.h>
+
+#define SOFTC_T	i40e_vsi
+
+#define i40e_driver_name netmap_i40e_driver_name
+char i40e_driver_name[] = "i40e" NETMAP_LINUX_DRIVER_SUFFIX;
+
+/* the vsi of a netdev, or NULL */
+static inline struct i40e_vsi *
+i40e_netmap_vsi(struct net_device *netdev)
+{
+	struct i40e_netdev_priv *np = netdev_priv(netdev);
+
+	return np->vsi;
+}
+
+
+/*
+ * build_ctob() and i40e_get_head() are static in i40e_txrx.c on some
+ * kernels, and this file is included in i40e_main.c, so we carry our
+ * own copies.
+ */
+static inline __le64
+i40e_netmap_ctob(u32 td_cmd, u32 td_offset, unsigned int size, u32 td_tag)
+{
+	return cpu_to_le64(I40E_TX_DESC_DTYPE_DATA |
+			   ((u64)td_cmd << I40E_TXD_QW1_CMD_SHIFT) |
+			   ((u64)td_offset << I40E_TXD_QW1_OFFSET_SHIFT) |
+			   ((u64)size << I40E_TXD_QW1_TX_BUF_SZ_SHIFT) |
+			   ((u64)td_tag << I40E_TXD_QW1_L2TAG1_SHIFT));
+}
+
+/* the head write-back is right after the last descriptor */
+static inline u32
+i40e_netmap_get_head(struct i40e_ring *tx_ring)
+{
+	void *head = (struct i40e_tx_desc *)tx_ring->desc + tx_ring->count;
+
+	return le32_to_cpu(*(volatile __le32 *)head);
+}
+
+
+/*
+ * Register/unregister. We are already under netmap lock.
+ * Only called on the first register or the last unregister.
+ * The vsi is brought down and up again, so the rings are
+ * reinitialized through i40e_netmap_configure_*x_ring().
+ */
+static int
+i40e_netmap_reg(struct netmap_adapter *na, int onoff)
+{
+	struct ifnet *ifp = na->ifp;
+	struct i40e_vsi *vsi = i40e_netmap_vsi(ifp);
+	struct i40e_pf *pf = vsi->back;
+	int error = 0;
+
+	if (onoff && vsi->rx_buf_len > NETMAP_BUF_SIZE(na)) {
+		D("%s: rx buffers of %d bytes, netmap has %d", na->name,
+			vsi->rx_buf_len, NETMAP_BUF_SIZE(na));
+		return EINVAL;
+	}
+
+	/* protect against other reinit, same as in i40e_ethtool.c */
+	while (test_and_set_bit(__I40E_CONFIG_BUSY, &pf->state))
+		usleep_range(1000, 2000);
+
+	if (netif_running(ifp))
+		i40e_down(vsi);
+
+	/* enable or disable flags and callbacks in na and ifp */
+	if (onoff) {
+		nm_set_native_flags(na);
+	} else {
+		nm_clear_native_flags(na);
+	}
+
+	if (netif_running(ifp))
+		error = -i40e_up(vsi);	/* also enables intr */
+
+	clear_bit(__I40E_CONFIG_BUSY, &pf->state);
+	return error;
+}
+
+
+/*
+ * Reconcile kernel and user view of the transmit ring.
+ */
+static int
+i40e_netmap_txsync(struct netmap_kring *kring, int flags)
+{
+	struct netmap_adapter *na = kring->na;
+	struct ifnet *ifp = na->ifp;
+	struct netmap_ring *ring = kring->ring;
+	u_int ring_nr = kring->ring_id;
+	u_int nm_i;	/* index into the netmap ring */
+	u_int nic_i;	/* index into the NIC ring */
+	u_int n;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = kring->rhead;
+	/*
+	 * interrupts on every tx packet are expensive so request
+	 * them every half ring, or where NS_REPORT is set
+	 */
+	u_int report_frequency = kring->nkr_num_slots >> 1;
+
+	/* device-specific */
+	struct i40e_vsi *vsi = i40e_netmap_vsi(ifp);
+	struct i40e_ring *txr = vsi->tx_rings[ring_nr];
+
+	if (!netif_carrier_ok(ifp))
+		goto out;
+
+	/*
+	 * First part: process new packets to send.
+	 * As in ixgbe, nm_i == (nic_i + kring->nkr_hwofs) % ring_size
+	 */
+	nm_i = kring->nr_hwcur;
+	if (nm_i != head) {	/* we have new packets to send */
+		nic_i = netmap_idx_k2n(kring, nm_i);
+
+		__builtin_prefetch(&ring->slot[nm_i]);
+		__builtin_prefetch(I40E_TX_DESC(txr, nic_i));
+
+		for (n = 0; nm_i != head; n++) {
+			struct netmap_slot *slot = &ring->slot[nm_i];
+			u_int len = slot->len;
+			uint64_t paddr;
+			void *addr = PNMB(na, slot, &paddr);
+
+			/* device-specific */
+			struct i40e_tx_desc *curr = I40E_TX_DESC(txr, nic_i);
+			u32 cmd = I40E_TX_DESC_CMD_EOP | I40E_TX_DESC_CMD_ICRC;
+
+			if (slot->flags & NS_REPORT || nic_i == 0 ||
+			    nic_i == report_frequency)
+				cmd |= I40E_TX_DESC_CMD_RS;
+
+			/* prefetch for the next iteration */
+			__builtin_prefetch(&ring->slot[nm_next(nm_i, lim)]);
+			__builtin_prefetch(I40E_TX_DESC(txr, nm_next(nic_i, lim)));
+
+			NM_CHECK_ADDR_LEN(na, addr, len);
+
+			if (slot->flags & NS_BUF_CHANGED) {
+				/* buffer has changed, reload map */
+				// netmap_reload_map(pdev, DMA_TO_DEVICE, old_addr, addr);
+			}
+			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
+
+			/* Fill the slot in the NIC ring. */
+			curr->buffer_addr = htole64(paddr);
+			curr->cmd_type_offset_bsz = i40e_netmap_ctob(cmd, 0, len, 0);
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		kring->nr_hwcur = head;
+
+		wmb();	/* synchronize writes to the NIC ring */
+		/* (re)start the tx unit up to slot nic_i (excluded) */
+		writel(nic_i, txr->tail);
+	}
+
+	/*
+	 * Second part: reclaim buffers for completed transmissions.
+	 * The NIC writes the index of the next descriptor to process
+	 * right after the ring, so this is cheap and can be done on
+	 * every call.
+	 */
+	if (flags & NAF_FORCE_RECLAIM || nm_kr_txempty(kring) ||
+	    kring->nr_hwtail != nm_prev(kring->nr_hwcur, lim)) {
+		nic_i = i40e_netmap_get_head(txr);
+		if (unlikely(nic_i >= kring->nkr_num_slots)) {
+			D("TX head %d out of range", nic_i);
+			nic_i -= kring->nkr_num_slots;
+		}
+		txr->next_to_clean = nic_i;
+		kring->nr_hwtail = nm_prev(netmap_idx_n2k(kring, nic_i), lim);
+	}
+out:
+	nm_txsync_finalize(kring);
+
+	return 0;
+}
+
+
+/*
+ * Reconcile kernel and user view of the receive ring.
+ */
+static int
+i40e_netmap_rxsync(struct netmap_kring *kring, int flags)
+{
+	struct netmap_adapter *na = kring->na;
+	struct ifnet *ifp = na->ifp;
+	struct netmap_ring *ring = kring->ring;
+	u_int ring_nr = kring->ring_id;
+	u_int nm_i;	/* index into the netmap ring */
+	u_int nic_i;	/* index into the NIC ring */
+	u_int n;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = nm_rxsync_prologue(kring);
+	int force_update = (flags & NAF_FORCE_READ) || kring->nr_kflags & NKR_PENDINTR;
+
+	/* device-specific */
+	struct i40e_vsi *vsi = i40e_netmap_vsi(ifp);
+	struct i40e_ring *rxr = vsi->rx_rings[ring_nr];
+
+	if (!netif_carrier_ok(ifp))
+		return 0;
+
+	if (head > lim)
+		return netmap_ring_reinit(kring);
+
+	rmb();
+
+	/*
+	 * First part: import newly received packets.
+	 * nic_i = rxr->next_to_clean, as in ixgbe.
+	 */
+	if (netmap_no_pendintr || force_update) {
+		uint16_t slot_flags = kring->nkr_slot_flags;
+
+		nic_i = rxr->next_to_clean;
+		nm_i = netmap_idx_n2k(kring, nic_i);
+
+		for (n = 0; ; n++) {
+			union i40e_rx_desc *curr = I40E_RX_DESC(rxr, nic_i);
+			uint64_t qword = le64toh(curr->wb.qword1.status_error_len);
+			uint32_t status = (qword & I40E_RXD_QW1_STATUS_MASK) >>
+				I40E_RXD_QW1_STATUS_SHIFT;
+
+			if ((status & (1 << I40E_RX_DESC_STATUS_DD_SHIFT)) == 0)
+				break;
+			ring->slot[nm_i].len = (qword & I40E_RXD_QW1_LENGTH_PBUF_MASK)
+				>> I40E_RXD_QW1_LENGTH_PBUF_SHIFT;
+			ring->slot[nm_i].flags = slot_flags;
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		if (n) { /* update the state variables */
+			rxr->next_to_clean = nic_i;
+			kring->nr_hwtail = nm_i;
+		}
+		kring->nr_kflags &= ~NKR_PENDINTR;
+	}
+
+	/*
+	 * Second part: skip past packets that userspace has released.
+	 */
+	nm_i = kring->nr_hwcur;
+	if (nm_i != head) {
+		nic_i = netmap_idx_k2n(kring, nm_i);
+		for (n = 0; nm_i != head; n++) {
+			struct netmap_slot *slot = &ring->slot[nm_i];
+			uint64_t paddr;
+			void *addr = PNMB(na, slot, &paddr);
+
+			union i40e_rx_desc *curr = I40E_RX_DESC(rxr, nic_i);
+			if (addr == NETMAP_BUF_BASE(na)) /* bad buf */
+				goto ring_reset;
+
+			if (slot->flags & NS_BUF_CHANGED) {
+				/* buffer has changed, reload map */
+				// netmap_reload_map(pdev, DMA_TO_DEVICE, old_addr, addr);
+				slot->flags &= ~NS_BUF_CHANGED;
+			}
+			curr->read.pkt_addr = htole64(paddr);
+			curr->read.hdr_addr = 0; /* also clears DD */
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		kring->nr_hwcur = head;
+		rxr->next_to_use = nic_i;
+		wmb();
+		/*
+		 * IMPORTANT: we must leave one free slot in the ring,
+		 * so move nic_i back by one unit
+		 */
+		nic_i = nm_prev(nic_i, lim);
+		writel(nic_i, rxr->tail);
+	}
+
+	/* tell userspace that there might be new packets */
+	nm_rxsync_finalize(kring);
+
+	return 0;
+
+ring_reset:
+	return netmap_ring_reinit(kring);
+}
+
+
+/*
+ * Called at the end of i40e_configure_tx_ring(). Nothing to do
+ * except resetting the ring, the addresses go in the descriptors on
+ * each txsync. Return 1 in netmap mode.
+ */
+static int
+i40e_netmap_configure_tx_ring(struct i40e_ring *ring)
+{
+	struct netmap_adapter *na;
+
+	if (!ring->netdev)
+		return 0;
+	na = NA(ring->netdev);
+	if (netmap_reset(na, NR_TX, ring->queue_index, 0) == NULL)
+		return 0;	// not in native netmap mode
+	ring->next_to_use = ring->next_to_clean = 0;
+	return 1;
+}
+
+
+/*
+ * Called from i40e_configure_rx_ring() in place of the allocation of
+ * the skb buffers. As in ixgbe, the buffers owned by userspace are
+ * left at the end of the NIC ring, so the tail stops before them.
+ * Return 1 in netmap mode.
+ */
+static int
+i40e_netmap_configure_rx_ring(struct i40e_ring *ring)
+{
+	struct netmap_adapter *na;
+	struct netmap_slot *slot;
+	struct netmap_kring *kring;
+	int lim, i;
+
+	if (!ring->netdev)
+		return 0;
+	na = NA(ring->netdev);
+	slot = netmap_reset(na, NR_RX, ring->queue_index, 0);
+	if (!slot)
+		return 0;	// not in native netmap mode
+
+	kring = &na->rx_rings[ring->queue_index];
+	lim = na->num_rx_desc - 1 - nm_kr_rxspace(kring);
+
+	for (i = 0; i < na->num_rx_desc; i++) {
+		int si = netmap_idx_n2k(kring, i);
+		union i40e_rx_desc *curr = I40E_RX_DESC(ring, i);
+		uint64_t paddr;
+
+		PNMB(na, slot + si, &paddr);
+		curr->read.pkt_addr = htole64(paddr);
+		curr->read.hdr_addr = 0;
+	}
+	ring->next_to_clean = 0;
+	ring->next_to_use = lim;
+	wmb();
+	writel(lim, ring->tail);
+	return 1;
+}
+
+
+/*
+ * The attach routine, called when the main vsi registers its netdev.
+ * It cannot fail, in the worst case (such as no memory)
+ * netmap mode will be disabled and the driver will only
+ * operate in standard mode.
+ */
+static void
+i40e_netmap_attach(struct i40e_vsi *vsi)
+{
+	struct netmap_adapter na;
+
+	bzero(&na, sizeof(na));
+
+	na.ifp = vsi->netdev;
+	na.pdev = &vsi->back->pdev->dev;
+	na.num_tx_desc = vsi->num_desc;
+	na.num_rx_desc = vsi->num_desc;
+	na.nm_txsync = i40e_netmap_txsync;
+	na.nm_rxsync = i40e_netmap_rxsync;
+	na.nm_register = i40e_netmap_reg;
+	na.num_tx_rings = vsi->num_queue_pairs;
+	na.num_rx_rings = vsi->num_queue_pairs;
+	/* flow director sideband filters, see ethtool -N */
+	na.nm_filter = netmap_linux_rxnfc;
+	netmap_attach(&na);
+}
+
+/* end of file */
@@ -73,6 +73,48 @@ char ixgbe_driver_name[] = "ixgbe" NETMAP_LINUX_DRIVER_SUFFIX;
 #define NM_IXGBE_RX_RING(a, r)		(&(a)->rx_ring[(r)])
 #endif
 
+/*
+ * Hardware timestamps (NR_HWTS). The 82599 and X540 latch the
+ * SYSTIME of one rx and one tx frame at a time in the RXSTMP and
+ * TXSTMP registers; reading the high word releases the latch.
+ * Which rx frames are stamped depends on the filter programmed
+ * by the driver's PTP code (SIOCSHWTSTAMP), tx frames are stamped
+ * on request (NS_REPORT), one at a time. This is enough for
+ * round trip measurements. Other NICs of the family put the
+ * timestamp in the buffer and are not supported here.
+ */
+#if defined(NETMAP_LINUX_HAVE_IXGBE_HW_TC)
+#define NM_IXGBE_TC(a)	(&(a)->hw_tc)
+#elif defined(NETMAP_LINUX_HAVE_IXGBE_TC)
+#define NM_IXGBE_TC(a)	(&(a)->tc)
+#endif
+
+#ifdef NM_IXGBE_TC
+/* return the latched timestamp in ns, 0 if none is available */
+static inline uint64_t
+ixgbe_netmap_ts(struct SOFTC_T *adapter, u32 ctl, u32 valid, u32 lo, u32 hi)
+{
+	struct ixgbe_hw *hw = &adapter->hw;
+	unsigned long flags;
+	u64 regval;
+	uint64_t ns;
+
+	if (!(IXGBE_READ_REG(hw, ctl) & valid))
+		return 0;
+	regval = (u64)IXGBE_READ_REG(hw, lo);
+	regval |= (u64)IXGBE_READ_REG(hw, hi) << 32;
+	spin_lock_irqsave(&adapter->tmreg_lock, flags);
+	ns = timecounter_cyc2time(NM_IXGBE_TC(adapter), regval);
+	spin_unlock_irqrestore(&adapter->tmreg_lock, flags);
+	return ns;
+}
+#define NM_IXGBE_RXTS(a)	ixgbe_netmap_ts(a, IXGBE_TSYNCRXCTL, \
+	IXGBE_TSYNCRXCTL_VALID, IXGBE_RXSTMPL, IXGBE_RXSTMPH)
+#define NM_IXGBE_TXTS(a)	ixgbe_netmap_ts(a, IXGBE_TSYNCTXCTL, \
+	IXGBE_TSYNCTXCTL_VALID, IXGBE_TXSTMPL, IXGBE_TXSTMPH)
+#endif /* NM_IXGBE_TC */
+
+
 /*
  * Register/unregister. We are already under netmap lock.
  * Only called on the first register or the last unregister.
@@ -108,6 +150,283 @@ ixgbe_netmap_reg(struct netmap_adapter *na, int onoff)
 }
 
 
+/*
+ * Tx offloadings (NAF_OFFLOAD_TX). When na->tx_hdr_len is set each
+ * frame in the tx rings starts with a virtio-net header, which is
+ * not transmitted but turned into an advanced context descriptor
+ * (L4 checksum, TSO) in front of the data descriptors. Frames may
+ * span multiple slots with NS_MOREFRAG, so a TSO frame can be up
+ * to 64KB.
+ *
+ * Context descriptors break the 1:1 mapping between netmap and NIC
+ * slots, so in this mode the NIC tail is kept in txr->next_to_use,
+ * kring->nkr_txmap[] holds the netmap slot of each NIC descriptor,
+ * and the txsync stops early if the NIC ring is full.
+ */
+#define NM_IXGBE_TX_MAXFRAGS	40	/* data descriptors per packet */
+
+struct nm_ixgbe_txctx {
+	u32 vlan_macip_lens;
+	u32 type_tucmd_mlhl;
+	u32 mss_l4len_idx;
+	u32 olinfo;	/* POPTS bits for the data descriptors */
+	u32 dcmd;	/* IXGBE_ADVTXD_DCMD_TSE or 0 */
+	u_int hdrlen;	/* L2-L4 headers of a TSO frame */
+};
+
+/*
+ * Fill c from the virtio-net header vh and the first fragment of the
+ * frame (buf, len). The protocol headers must be in that fragment.
+ * Return 1 if a context descriptor is needed, 0 if the frame can go
+ * as it is, -1 if the hardware cannot handle it (e.g. UFO).
+ */
+static int
+ixgbe_netmap_tx_ctx(struct nm_vnet_hdr *vh, uint8_t *buf, u_int len,
+	struct nm_ixgbe_txctx *c)
+{
+	u_int gso = vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+	u_int maclen = ETH_HLEN, l4 = vh->csum_start;
+	u16 ethertype;
+
+	memset(c, 0, sizeof(*c));
+	if (!(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		return gso == VIRTIO_NET_HDR_GSO_NONE ? 0 : -1;
+
+	ethertype = be16_to_cpu(*(__be16 *)(buf + 12));
+	if (ethertype == ETH_P_8021Q) {
+		maclen += VLAN_HLEN;
+		ethertype = be16_to_cpu(*(__be16 *)(buf + 16));
+	}
+	if (l4 <= maclen || l4 + vh->csum_offset + 2 > len)
+		return -1;
+	if (ethertype == ETH_P_IP)
+		c->type_tucmd_mlhl = IXGBE_ADVTXD_TUCMD_IPV4;
+	else if (ethertype == ETH_P_IPV6)
+		c->type_tucmd_mlhl = IXGBE_ADVTXD_TUCMD_IPV6;
+	else
+		return -1;
+	if (vh->csum_offset == offsetof(struct tcphdr, check))
+		c->type_tucmd_mlhl |= IXGBE_ADVTXD_TUCMD_L4T_TCP;
+	else if (vh->csum_offset == 6)	/* UDP checksum */
+		c->type_tucmd_mlhl |= IXGBE_ADVTXD_TUCMD_L4T_UDP;
+	else
+		return -1;
+	c->type_tucmd_mlhl |= IXGBE_TXD_CMD_DEXT | IXGBE_ADVTXD_DTYP_CTXT;
+	c->vlan_macip_lens = (maclen << IXGBE_ADVTXD_MACLEN_SHIFT) |
+		(l4 - maclen);
+	c->olinfo = IXGBE_TXD_POPTS_TXSM << IXGBE_ADVTXD_POPTS_SHIFT;
+
+	if (gso == VIRTIO_NET_HDR_GSO_TCPV4 || gso == VIRTIO_NET_HDR_GSO_TCPV6) {
+		struct tcphdr *th = (struct tcphdr *)(buf + l4);
+		u_int l4len;
+
+		if (!(c->type_tucmd_mlhl & IXGBE_ADVTXD_TUCMD_L4T_TCP) ||
+		    vh->gso_size == 0 || l4 + sizeof(*th) > len)
+			return -1;
+		l4len = th->doff * 4;
+		c->hdrlen = l4 + l4len;
+		if (c->hdrlen > len)
+			return -1;
+		/* as in ixgbe_tso(): the hardware wants zero lengths
+		 * and a pseudo-header checksum without the length.
+		 */
+		if (ethertype == ETH_P_IP) {
+			struct iphdr *iph = (struct iphdr *)(buf + maclen);
+
+			iph->tot_len = 0;
+			iph->check = 0;
+			th->check = ~csum_tcpudp_magic(iph->saddr,
+				iph->daddr, 0, IPPROTO_TCP, 0);
+			c->olinfo |= IXGBE_TXD_POPTS_IXSM <<
+				IXGBE_ADVTXD_POPTS_SHIFT;
+		} else {
+			struct ipv6hdr *ip6h = (struct ipv6hdr *)(buf + maclen);
+
+			ip6h->payload_len = 0;
+			th->check = ~csum_ipv6_magic(&ip6h->saddr,
+				&ip6h->daddr, 0, IPPROTO_TCP, 0);
+		}
+		c->mss_l4len_idx = (vh->gso_size << IXGBE_ADVTXD_MSS_SHIFT) |
+			(l4len << IXGBE_ADVTXD_L4LEN_SHIFT);
+		c->dcmd = IXGBE_ADVTXD_DCMD_TSE;
+	} else if (gso != VIRTIO_NET_HDR_GSO_NONE) {
+		return -1;	/* no UFO on this hardware */
+	}
+	return 1;
+}
+
+/* does the NIC slot range [start, end] contain slot x ? */
+static inline int
+ixgbe_netmap_covers(u_int start, u_int end, u_int x, u_int n)
+{
+	return (x + n - start) % n <= (end + n - start) % n;
+}
+
+static int
+ixgbe_netmap_txsync_offload(struct netmap_kring *kring, int flags)
+{
+	struct netmap_adapter *na = kring->na;
+	struct ifnet *ifp = na->ifp;
+	struct netmap_ring *ring = kring->ring;
+	u_int ring_nr = kring->ring_id;
+	u_int nm_i, nic_i;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = kring->rhead;
+	u_int const hlen = na->tx_hdr_len;
+	u_int report_frequency = kring->nkr_num_slots >> 1;
+	uint32_t *txmap = kring->nkr_txmap;
+
+	/* device-specific */
+	struct SOFTC_T *adapter = netdev_priv(ifp);
+	struct ixgbe_ring *txr = NM_IXGBE_TX_RING(adapter, ring_nr);
+
+	if (!netif_carrier_ok(ifp)) {
+		goto out;
+	}
+
+	/*
+	 * First part: process new packets to send, one complete
+	 * packet (all its fragments) at a time.
+	 */
+	nm_i = kring->nr_hwcur;
+	nic_i = txr->next_to_use;
+	while (nm_i != head) {
+		struct netmap_slot *slot = &ring->slot[nm_i];
+		u_int len = slot->len;
+		uint64_t paddr;
+		void *addr = PNMB(na, slot, &paddr);
+		struct nm_ixgbe_txctx c;
+		u_int last, frags = 1, tot, space, start = nic_i;
+		u32 olinfo;
+		int ctx, bad = 0;
+
+		NM_CHECK_ADDR_LEN(na, addr, len);
+		/* find the last fragment */
+		tot = len;
+		for (last = nm_i; ring->slot[last].flags & NS_MOREFRAG; frags++) {
+			u_int l;
+
+			last = nm_next(last, lim);
+			if (last == head)
+				break;
+			l = ring->slot[last].len;
+			bad |= (l == 0 || l > NETMAP_BUF_SIZE(na));
+			tot += l;
+		}
+		if (last == head)
+			break;	/* wait for the rest of the packet */
+
+		if (bad || len < hlen || tot == hlen ||
+		    frags > NM_IXGBE_TX_MAXFRAGS)
+			ctx = -1;
+		else
+			ctx = ixgbe_netmap_tx_ctx(addr, (uint8_t *)addr + hlen,
+				len - hlen, &c);
+		if (ctx < 0) {
+			RD(5, "%s: dropping packet in slot %u", kring->name, nm_i);
+			nm_i = nm_next(last, lim);
+			continue;
+		}
+
+		/* make sure the NIC ring has room for the packet */
+		space = txr->next_to_clean + lim - nic_i;
+		if (space > lim)
+			space -= lim + 1;
+		if (space < frags + ctx) {
+			txr->next_to_clean = IXGBE_READ_REG(&adapter->hw,
+				IXGBE_TDH(ring_nr));
+			space = txr->next_to_clean + lim - nic_i;
+			if (space > lim)
+				space -= lim + 1;
+			if (space < frags + ctx)
+				break;
+		}
+
+		if (ctx) {
+			struct ixgbe_adv_tx_context_desc *cd =
+				(struct ixgbe_adv_tx_context_desc *)
+				NM_IXGBE_TX_DESC(txr, nic_i);
+
+			cd->vlan_macip_lens = htole32(c.vlan_macip_lens);
+			cd->seqnum_seed = 0;
+			cd->type_tucmd_mlhl = htole32(c.type_tucmd_mlhl);
+			cd->mss_l4len_idx = htole32(c.mss_l4len_idx);
+			txmap[nic_i] = nm_i;
+			nic_i = nm_next(nic_i, lim);
+		}
+		/* on TSO the payload length excludes the headers */
+		olinfo = htole32(((tot - hlen - c.hdrlen) <<
+			IXGBE_ADVTXD_PAYLEN_SHIFT) | c.olinfo);
+
+		/* the data descriptors, the first one skips the header */
+		paddr += hlen;
+		len -= hlen;
+		for (;;) {
+			if (len > 0) {
+				union ixgbe_adv_tx_desc *curr =
+					NM_IXGBE_TX_DESC(txr, nic_i);
+				u32 cmd = len | c.dcmd | IXGBE_ADVTXD_DTYP_DATA |
+					IXGBE_ADVTXD_DCMD_DEXT |
+					IXGBE_ADVTXD_DCMD_IFCS;
+
+				/* interrupts every half ring, as in
+				 * ixgbe_netmap_txsync(), or on NS_REPORT
+				 */
+				if (nm_i == last) {
+					cmd |= IXGBE_TXD_CMD_EOP;
+					if (slot->flags & NS_REPORT ||
+					    ixgbe_netmap_covers(start, nic_i,
+						0, lim + 1) ||
+					    ixgbe_netmap_covers(start, nic_i,
+						report_frequency, lim + 1))
+						cmd |= IXGBE_TXD_CMD_RS;
+				}
+				curr->read.buffer_addr = htole64(paddr);
+				curr->read.olinfo_status = olinfo;
+				curr->read.cmd_type_len = htole32(cmd);
+				txmap[nic_i] = nm_i;
+				nic_i = nm_next(nic_i, lim);
+			}
+			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
+			if (nm_i == last)
+				break;
+			nm_i = nm_next(nm_i, lim);
+			slot = &ring->slot[nm_i];
+			len = slot->len;
+			addr = PNMB(na, slot, &paddr);
+		}
+		nm_i = nm_next(nm_i, lim);
+	}
+	/* the NIC slot after the last one belongs to the next packet */
+	txmap[nic_i] = nm_i;
+	kring->nr_hwcur = nm_i;
+	if (nic_i != txr->next_to_use) {
+		txr->next_to_use = nic_i;
+		wmb();	/* synchronize writes to the NIC ring */
+		IXGBE_WRITE_REG(&adapter->hw, IXGBE_TDT(txr->reg_idx), nic_i);
+	}
+
+	/*
+	 * Second part: reclaim buffers for completed transmissions.
+	 * Only RS on packet boundaries is meaningful here, so always
+	 * use TDH, and only when the ring is full or on request.
+	 */
+	if (flags & NAF_FORCE_RECLAIM || nm_kr_txempty(kring)) {
+		nic_i = IXGBE_READ_REG(&adapter->hw, IXGBE_TDH(ring_nr));
+		if (nic_i >= kring->nkr_num_slots) { /* XXX can it happen ? */
+			D("TDH wrap %d", nic_i);
+			nic_i -= kring->nkr_num_slots;
+		}
+		txr->next_to_clean = nic_i;
+		kring->nr_hwtail = nm_prev(txmap[nic_i], lim);
+	}
+out:
+	nm_txsync_finalize(kring);
+
+	return 0;
+}
+
+
 /*
  * Reconcile kernel and user view of the transmit ring.
  *
@@ -147,6 +466,24 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 	struct ixgbe_ring *txr = NM_IXGBE_TX_RING(adapter, ring_nr);
 	int reclaim_tx;
 
+	if (na->tx_hdr_len)
+		return ixgbe_netmap_txsync_offload(kring, flags);
+
+#ifdef NM_IXGBE_TC
+	if (kring->nkr_ts_pend) {
+		/* collect the timestamp of the last NS_REPORT frame */
+		uint64_t ts = NM_IXGBE_TXTS(adapter);
+
+		if (ts) {
+			kring->nkr_ts[kring->nkr_ts_pend - 1] = ts;
+			kring->nkr_ts_pend = 0;
+		} else if (!(IXGBE_READ_REG(&adapter->hw, IXGBE_TSYNCTXCTL) &
+				IXGBE_TSYNCTXCTL_ENABLED)) {
+			kring->nkr_ts_pend = 0; /* timestamping was disabled */
+		}
+	}
+#endif /* NM_IXGBE_TC */
+
 	/*
 	 * First part: process new packets to send.
 	 * nm_i is the current index in the netmap ring,
@@ -207,6 +544,17 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 				/* buffer has changed, reload map */
 				// netmap_reload_map(pdev, DMA_TO_DEVICE, old_addr, addr);
 			}
+#ifdef NM_IXGBE_TC
+			if (unlikely(kring->nkr_ts != NULL)) {
+				kring->nkr_ts[nm_i] = 0;
+				if ((slot->flags & NS_REPORT) &&
+						!kring->nkr_ts_pend) {
+					/* one frame at a time */
+					flags |= IXGBE_ADVTXD_MAC_TSTAMP;
+					kring->nkr_ts_pend = nm_i + 1;
+				}
+			}
+#endif /* NM_IXGBE_TC */
 			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
 
 			/* Fill the slot in the NIC ring. */
@@ -335,6 +683,7 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 	 */
 	if (netmap_no_pendintr || force_update) {
 		uint16_t slot_flags = kring->nkr_slot_flags;
+		uint64_t *ts = kring->nkr_ts;
 
 		nic_i = rxr->next_to_clean;
 		nm_i = netmap_idx_n2k(kring, nic_i);
@@ -347,6 +696,12 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 				break;
 			ring->slot[nm_i].len = le16toh(curr->wb.upper.length);
 			ring->slot[nm_i].flags = slot_flags;
+#ifdef NM_IXGBE_TC
+			if (unlikely(ts != NULL)) {
+				ts[nm_i] = (staterr & IXGBE_RXDADV_STAT_TS) ?
+					NM_IXGBE_RXTS(adapter) : 0;
+			}
+#endif /* NM_IXGBE_TC */
 			nm_i = nm_next(nm_i, lim);
 			nic_i = nm_next(nic_i, lim);
 		}
@@ -422,6 +777,16 @@ ixgbe_netmap_configure_tx_ring(struct SOFTC_T *adapter, int ring_nr)
         slot = netmap_reset(na, NR_TX, ring_nr, 0);
 	if (!slot)
 		return 0;	// not in native netmap mode
+	if (na->tx_hdr_len) {
+		/* the reset NIC ring starts at nr_hwcur */
+		struct netmap_kring *kring = &na->tx_rings[ring_nr];
+		struct ixgbe_ring *txr = NM_IXGBE_TX_RING(adapter, ring_nr);
+
+		txr->next_to_use = txr->next_to_clean = 0;
+		kring->nkr_txmap[0] = kring->nr_hwcur;
+	}
+	/* a pending tx timestamp has been lost with the reset */
+	na->tx_rings[ring_nr].nkr_ts_pend = 0;
 #if 0
 	/*
 	 * on a generic card we should set the address in the slot.
@@ -545,6 +910,14 @@ ixgbe_netmap_attach(struct SOFTC_T *adapter)
 	na.nm_register = ixgbe_netmap_reg;
 	na.num_tx_rings = adapter->num_tx_queues;
 	na.num_rx_rings = adapter->num_rx_queues;
+	na.na_flags = NAF_OFFLOAD_TX;
+	/* flow director perfect filters, see ethtool -K ntuple on */
+	na.nm_filter = netmap_linux_rxnfc;
+#ifdef NM_IXGBE_TC
+	if (adapter->hw.mac.type == ixgbe_mac_82599EB ||
+	    adapter->hw.mac.type == ixgbe_mac_X540)
+		na.na_flags |= NAF_HW_TS;
+#endif /* NM_IXGBE_TC */
 	netmap_attach(&na);
 }
 
@@ -723,6 +723,8 @@ mlx4_netmap_attach(struct SOFTC_T *priv)
 	na.nm_rxsync = mlx4_netmap_rxsync;
 	na.nm_register = mlx4_netmap_reg;
 	na.nm_config = mlx4_netmap_config;
+	/* flow steering rules, also for mac addresses */
+	na.nm_filter = netmap_linux_rxnfc;
 	netmap_attach(&na);
 }
 #endif /* NETMAP_MLX4_MAIN */
@@ -25,11 +25,15 @@
 
 #include "bsd_glue.h"
 #include <linux/file.h>   /* fget(int fd) */
+#include <linux/kthread.h>
+#include <linux/eventfd.h>	/* passthrough kicks and interrupts */
 
 #include <net/netmap.h>
 #include <dev/netmap/netmap_kern.h>
 #include <dev/netmap/netmap_mem2.h>
 #include <linux/rtnetlink.h>
+#include <linux/ethtool.h>
+#include <linux/in.h>	/* IPPROTO_*, filters */
 #include <linux/nsproxy.h>
 
 #include "netmap_linux_config.h"
@@ -63,6 +67,14 @@ int nm_iommu_group_id(struct device *dev)
 }
 #endif /* HAVE_IOMMU */
 
+/*
+ * Returns the NUMA node of the device, -1 if unknown.
+ */
+int nm_numa_node(struct device *dev)
+{
+	return dev ? dev_to_node(dev) : -1;
+}
+
 /* #################### VALE OFFLOADINGS SUPPORT ################## */
 
 /* Compute and return a raw checksum over (data, len), using 'cur_sum'
@@ -186,7 +198,6 @@ void netmap_mitigation_cleanup(struct nm_generic_mit *mit)
 }
 
 
-
 /* #################### GENERIC ADAPTER SUPPORT ################### */
 
 /*
@@ -317,10 +328,57 @@ void netmap_catch_tx(struct netmap_generic_adapter *gna, int enable)
     }
 }
 
+#if defined(NETMAP_LINUX_HAVE_XMIT_MORE) || \
+    defined(NETMAP_LINUX_HAVE_NETDEV_XMIT_MORE)
+#define NM_GENERIC_DIRECT_XMIT
+/* Pass the skb straight to the driver, skipping the qdisc, so that
+ * xmit_more can tell it to ring the doorbell only on the last packet
+ * of a batch. Locking is the same as in dev_hard_start_xmit().
+ * If the queue is stopped the driver has already flushed the
+ * previous packets.
+ * Unlike dev_queue_xmit(), this skips tc, the taps (tcpdump does
+ * not see the frames) and validate_xmit_skb(). The latter is not
+ * needed here, as the skb is linear and requests no offloads.
+ */
+static int
+generic_direct_xmit(struct ifnet *ifp, struct mbuf *m, u_int ring_nr,
+	int more)
+{
+    struct netmap_generic_adapter *gna =
+                        (struct netmap_generic_adapter *)NA(ifp);
+    struct netdev_queue *txq = netdev_get_tx_queue(ifp, ring_nr);
+    netdev_tx_t ret = NETDEV_TX_BUSY;
+
+    local_bh_disable();
+    HARD_TX_LOCK(ifp, txq, smp_processor_id());
+    if (!netif_xmit_frozen_or_stopped(txq)) {
+#ifdef NETMAP_LINUX_HAVE_NETDEV_XMIT_MORE
+        __this_cpu_write(softnet_data.xmit.more, more);
+#else
+        m->xmit_more = more;
+#endif
+        ret = gna->save_start_xmit(m, ifp);
+        if (dev_xmit_complete(ret))
+            txq_trans_update(txq);
+    }
+    HARD_TX_UNLOCK(ifp, txq);
+    local_bh_enable();
+
+    if (likely(ret == NETDEV_TX_OK))
+        return 0;
+    if (!dev_xmit_complete(ret)) {
+        /* not consumed, drop the reference taken for the driver */
+        atomic_dec(&m->users);
+    }
+    return -1;
+}
+#endif /* NM_GENERIC_DIRECT_XMIT */
+
 /* Transmit routine used by generic_netmap_txsync(). Returns 0 on success
-   and -1 on error (which may be packet drops or other errors). */
+   and -1 on error (which may be packet drops or other errors).
+   'more' tells that other packets follow immediately. */
 int generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
-	void *addr, u_int len, u_int ring_nr)
+	void *addr, u_int len, u_int ring_nr, int more)
 {
     netdev_tx_t ret;
 
@@ -338,6 +396,10 @@ int generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
     m->priority = NM_MAGIC_PRIORITY_TX;
     skb_set_queue_mapping(m, ring_nr);
 
+#ifdef NM_GENERIC_DIRECT_XMIT
+    if (netmap_generic_txdirect && ring_nr < ifp->real_num_tx_queues)
+        return generic_direct_xmit(ifp, m, ring_nr, more);
+#endif /* NM_GENERIC_DIRECT_XMIT */
     ret = dev_queue_xmit(m);
 
     if (likely(ret == NET_XMIT_SUCCESS)) {
@@ -410,6 +472,376 @@ out:
 }
 
 
+/*
+ * nm_filter callback for NICs that support ntuple filters through
+ * ethtool (ETHTOOL_SRXCLSRLINS). The driver keeps the rules across
+ * resets, and nf_id is the rule location, as in ethtool -N ... loc.
+ */
+int
+netmap_linux_rxnfc(struct netmap_adapter *na, struct netmap_filter *f,
+		int onoff)
+{
+#ifdef NETMAP_LINUX_HAVE_RXNFC
+	struct ifnet *ifp = na->ifp;
+	struct ethtool_rxnfc cmd;
+	struct ethtool_rx_flow_spec *fs = &cmd.fs;
+	int error;
+
+	bzero(&cmd, sizeof(cmd));
+	fs->location = f->nf_id;
+	if (!onoff) {
+		cmd.cmd = ETHTOOL_SRXCLSRLDEL;
+	} else if (f->nf_type == NETMAP_FILTER_MAC) {
+		cmd.cmd = ETHTOOL_SRXCLSRLINS;
+		fs->flow_type = ETHER_FLOW;
+		memcpy(fs->h_u.ether_spec.h_dest, f->nf_mac, ETH_ALEN);
+		memset(fs->m_u.ether_spec.h_dest, 0xff, ETH_ALEN);
+	} else if (f->nf_proto == IPPROTO_TCP || f->nf_proto == IPPROTO_UDP ||
+			f->nf_proto == IPPROTO_SCTP) {
+		/* the masks select the fields to compare */
+		struct ethtool_tcpip4_spec *h = &fs->h_u.tcp_ip4_spec;
+		struct ethtool_tcpip4_spec *m = &fs->m_u.tcp_ip4_spec;
+
+		cmd.cmd = ETHTOOL_SRXCLSRLINS;
+		fs->flow_type = f->nf_proto == IPPROTO_TCP ? TCP_V4_FLOW :
+			(f->nf_proto == IPPROTO_UDP ? UDP_V4_FLOW : SCTP_V4_FLOW);
+		h->ip4src = f->nf_src_ip;
+		m->ip4src = f->nf_src_ip ? htonl(0xffffffff) : 0;
+		h->ip4dst = f->nf_dst_ip;
+		m->ip4dst = f->nf_dst_ip ? htonl(0xffffffff) : 0;
+		h->psrc = f->nf_src_port;
+		m->psrc = f->nf_src_port ? htons(0xffff) : 0;
+		h->pdst = f->nf_dst_port;
+		m->pdst = f->nf_dst_port ? htons(0xffff) : 0;
+	} else {
+		struct ethtool_usrip4_spec *h = &fs->h_u.usr_ip4_spec;
+		struct ethtool_usrip4_spec *m = &fs->m_u.usr_ip4_spec;
+
+		if (f->nf_src_port || f->nf_dst_port)
+			return EINVAL; /* no ports without a protocol */
+		cmd.cmd = ETHTOOL_SRXCLSRLINS;
+		fs->flow_type = IP_USER_FLOW;
+		h->ip_ver = ETH_RX_NFC_IP4;
+		h->ip4src = f->nf_src_ip;
+		m->ip4src = f->nf_src_ip ? htonl(0xffffffff) : 0;
+		h->ip4dst = f->nf_dst_ip;
+		m->ip4dst = f->nf_dst_ip ? htonl(0xffffffff) : 0;
+		h->proto = f->nf_proto;
+		m->proto = f->nf_proto ? 0xff : 0;
+	}
+	fs->ring_cookie = f->nf_ring;
+
+	rtnl_lock();
+	if (ifp == NULL || ifp->ethtool_ops == NULL ||
+	    ifp->ethtool_ops->set_rxnfc == NULL) {
+		error = EOPNOTSUPP;
+	} else {
+		error = -ifp->ethtool_ops->set_rxnfc(ifp, &cmd);
+	}
+	rtnl_unlock();
+	if (error)
+		D("%s: filter %d failed: %d (is ntuple on?)", na->name,
+			f->nf_id, error);
+	return error;
+#else /* !NETMAP_LINUX_HAVE_RXNFC */
+	return EOPNOTSUPP;
+#endif /* NETMAP_LINUX_HAVE_RXNFC */
+}
+
+
+/* ################### KERNEL THREADS AND TIMERS ################### */
+
+struct nm_kthread {
+	struct task_struct *task;
+	nm_kthread_worker_fn_t worker;
+	void *arg;
+	wait_queue_head_t wq;
+	int pending;	/* set by nm_kthread_wakeup() */
+};
+
+static int
+nm_kthread_main(void *data)
+{
+	struct nm_kthread *t = data;
+
+	/* the first wakeup starts the worker, pending stays set */
+	wait_event_interruptible(t->wq,
+		ACCESS_ONCE(t->pending) || kthread_should_stop());
+	while (!kthread_should_stop()) {
+		t->worker(t->arg);
+		cond_resched();
+	}
+	return 0;
+}
+
+struct nm_kthread *
+nm_kthread_start(nm_kthread_worker_fn_t worker, void *arg, const char *name)
+{
+	struct nm_kthread *t;
+
+	t = malloc(sizeof(*t), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (t == NULL)
+		return NULL;
+	t->worker = worker;
+	t->arg = arg;
+	init_waitqueue_head(&t->wq);
+	t->task = kthread_run(nm_kthread_main, t, "%s", name);
+	if (IS_ERR(t->task)) {
+		D("cannot start %s: %ld", name, PTR_ERR(t->task));
+		free(t, M_DEVBUF);
+		return NULL;
+	}
+	return t;
+}
+
+void
+nm_kthread_stop(struct nm_kthread *t)
+{
+	kthread_stop(t->task);	/* also wakes up nm_kthread_wait() */
+	free(t, M_DEVBUF);
+}
+
+void
+nm_kthread_wait(struct nm_kthread *t)
+{
+	wait_event_interruptible(t->wq,
+		ACCESS_ONCE(t->pending) || kthread_should_stop());
+	t->pending = 0;
+	smp_mb(); /* clear before looking at the rings */
+}
+
+void
+nm_kthread_wakeup(struct nm_kthread *t)
+{
+	t->pending = 1;
+	smp_mb();
+	wake_up_interruptible(&t->wq);
+}
+
+int
+nm_kthread_set_affinity(struct nm_kthread *t, u_int cpu)
+{
+	return -set_cpus_allowed_ptr(t->task,
+		cpumask_of(cpu % num_online_cpus()));
+}
+
+#ifdef WITH_PTNETMAP
+/*
+ * eventfds for the passthrough rings. As vhost and the KVM irqfds, we
+ * get the callback by adding our own entry to the wait queue of the
+ * eventfd, through its poll method. The counter is never read, the
+ * thread looks at the rings anyway.
+ */
+struct nm_eventfd {
+	struct file *filp;
+	struct eventfd_ctx *ctx;
+	void (*cb)(void *);
+	void *arg;
+	wait_queue_t wait;
+	wait_queue_head_t *wqh;
+	poll_table pt;
+};
+
+static int
+nm_eventfd_wakeup(wait_queue_t *wait, unsigned mode, int sync, void *key)
+{
+	struct nm_eventfd *e = container_of(wait, struct nm_eventfd, wait);
+
+	if ((unsigned long)key & POLLIN)
+		e->cb(e->arg);
+	return 0;
+}
+
+static void
+nm_eventfd_ptable(struct file *filp, wait_queue_head_t *wqh, poll_table *pt)
+{
+	struct nm_eventfd *e = container_of(pt, struct nm_eventfd, pt);
+
+	e->wqh = wqh;
+	add_wait_queue(wqh, &e->wait);
+}
+
+struct nm_eventfd *
+nm_eventfd_get(int fd, void (*cb)(void *), void *arg, int *error)
+{
+	struct nm_eventfd *e;
+
+	e = malloc(sizeof(*e), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (e == NULL) {
+		*error = ENOMEM;
+		return NULL;
+	}
+	e->filp = eventfd_fget(fd);
+	if (IS_ERR(e->filp)) {
+		*error = -PTR_ERR(e->filp);
+		goto fail;
+	}
+	e->ctx = eventfd_ctx_fileget(e->filp);
+	if (IS_ERR(e->ctx)) {
+		*error = -PTR_ERR(e->ctx);
+		fput(e->filp);
+		goto fail;
+	}
+	if (cb != NULL) {
+		e->cb = cb;
+		e->arg = arg;
+		init_waitqueue_func_entry(&e->wait, nm_eventfd_wakeup);
+		init_poll_funcptr(&e->pt, nm_eventfd_ptable);
+		e->filp->f_op->poll(e->filp, &e->pt);
+	}
+	return e;
+
+fail:
+	free(e, M_DEVBUF);
+	return NULL;
+}
+
+void
+nm_eventfd_signal(struct nm_eventfd *e)
+{
+	eventfd_signal(e->ctx, 1);
+}
+
+void
+nm_eventfd_put(struct nm_eventfd *e)
+{
+	if (e->wqh)	/* no more callbacks after this */
+		remove_wait_queue(e->wqh, &e->wait);
+	eventfd_ctx_put(e->ctx);
+	fput(e->filp);
+	free(e, M_DEVBUF);
+}
+#endif /* WITH_PTNETMAP */
+
+static NETMAP_LINUX_TIMER_RTYPE
+nm_notify_timer_handler(struct hrtimer *t)
+{
+	struct netmap_kring *kring =
+		container_of(t, struct netmap_kring, nkr_notify_timer);
+
+	netmap_notify_timeout(kring);
+	return HRTIMER_NORESTART;
+}
+
+void
+nm_notify_timer_init(struct netmap_kring *kring)
+{
+	hrtimer_init(&kring->nkr_notify_timer, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL);
+	kring->nkr_notify_timer.function = &nm_notify_timer_handler;
+}
+
+void
+nm_notify_timer_arm(struct netmap_kring *kring, u_int us)
+{
+	hrtimer_start(&kring->nkr_notify_timer, ktime_set(0, us * 1000),
+		HRTIMER_MODE_REL);
+}
+
+int
+nm_notify_timer_cancel(struct netmap_kring *kring)
+{
+	return hrtimer_try_to_cancel(&kring->nkr_notify_timer) == 1;
+}
+
+void
+nm_notify_timer_fini(struct netmap_kring *kring)
+{
+	hrtimer_cancel(&kring->nkr_notify_timer);
+}
+
+/* kring counters, one struct nm_kstats per cpu */
+int
+nm_kstats_init(struct netmap_kring *kring)
+{
+	kring->nkr_stats = alloc_percpu(struct nm_kstats);
+	return kring->nkr_stats ? 0 : ENOMEM;
+}
+
+void
+nm_kstats_fini(struct netmap_kring *kring)
+{
+	if (kring->nkr_stats)
+		free_percpu(kring->nkr_stats);
+	kring->nkr_stats = NULL;
+}
+
+void
+nm_kstats_fetch(struct netmap_kring *kring, uint64_t *v)
+{
+	int cpu, i;
+
+	for (i = 0; i < NM_STAT_NUM; i++)
+		v[i] = 0;
+	if (kring->nkr_stats == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct nm_kstats *ks = per_cpu_ptr(kring->nkr_stats, cpu);
+
+		for (i = 0; i < NM_STAT_NUM; i++)
+			v[i] += ks->ks_val[i];
+	}
+}
+
+/* totals of all krings, see netmap_kstat_drop() */
+DEFINE_PER_CPU(struct nm_kstats, netmap_kstat_totals);
+
+int
+nm_kstat_totals_init(void)
+{
+	return 0;	/* static per-cpu data is zeroed */
+}
+
+void
+nm_kstat_totals_fini(void)
+{
+}
+
+uint64_t
+nm_kstat_total(u_int i)
+{
+	uint64_t v = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		v += per_cpu(netmap_kstat_totals, cpu).ks_val[i];
+	return v;
+}
+
+/*
+ * The dev.netmap.retry, drop_* and txerr sysctls of netmap.c,
+ * as read only module parameters. kp->arg is the counter index.
+ */
+static int
+nm_kstat_param_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%llu",
+		(unsigned long long)nm_kstat_total(*(u_int *)kp->arg));
+}
+
+static const struct kernel_param_ops nm_kstat_param_ops = {
+	.get = nm_kstat_param_get,
+};
+
+static u_int nm_kstat_ids[NM_STAT_NUM] = {
+	[NM_STAT_RETRY] = NM_STAT_RETRY,
+	[NM_STAT_DROP_NOSPACE] = NM_STAT_DROP_NOSPACE,
+	[NM_STAT_DROP_LOOKUP] = NM_STAT_DROP_LOOKUP,
+	[NM_STAT_DROP_MONITOR] = NM_STAT_DROP_MONITOR,
+	[NM_STAT_TXERR] = NM_STAT_TXERR,
+};
+module_param_cb(retry, &nm_kstat_param_ops,
+	&nm_kstat_ids[NM_STAT_RETRY], 0444);
+module_param_cb(drop_nospace, &nm_kstat_param_ops,
+	&nm_kstat_ids[NM_STAT_DROP_NOSPACE], 0444);
+module_param_cb(drop_lookup, &nm_kstat_param_ops,
+	&nm_kstat_ids[NM_STAT_DROP_LOOKUP], 0444);
+module_param_cb(drop_monitor, &nm_kstat_param_ops,
+	&nm_kstat_ids[NM_STAT_DROP_MONITOR], 0444);
+module_param_cb(txerr, &nm_kstat_param_ops,
+	&nm_kstat_ids[NM_STAT_TXERR], 0444);
+
+
 /* ######################## FILE OPERATIONS ####################### */
 
 struct net_device *
@@ -480,6 +912,83 @@ static struct vm_operations_struct linux_netmap_mmap_ops = {
 	.fault = linux_netmap_fault,
 };
 
+#ifdef NETMAP_LINUX_HAVE_PMD_FAULT
+/*
+ * Memory with hugepage clusters (see netmap_hugepages) is mapped
+ * as a VM_PFNMAP area, so that the clusters can be mapped with a
+ * single pmd. The offsets that are not hugepage aligned (rings,
+ * netmap_if) are mapped one page at a time.
+ * This uses .pmd_fault, which only exists in linux 4.5 to 4.10
+ * (later kernels have .huge_fault, with a different fault API
+ * that the rest of this file does not support yet). Elsewhere
+ * the hugepage clusters are mapped with normal pages.
+ */
+static int
+linux_netmap_pfn_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	struct netmap_adapter *na = priv->np_na;
+	unsigned long addr = (unsigned long)vmf->virtual_address & PAGE_MASK;
+	unsigned long off = (vma->vm_pgoff << PAGE_SHIFT) +
+		(addr - vma->vm_start);
+	unsigned long pa;
+	int error;
+
+	pa = netmap_mem_ofstophys(na->nm_mem, off);
+	if (pa == 0)
+		return VM_FAULT_SIGBUS;
+	error = vm_insert_pfn(vma, addr, pa >> PAGE_SHIFT);
+	if (error && error != -EBUSY)
+		return (error == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS);
+	return VM_FAULT_NOPAGE;
+}
+
+static int
+linux_netmap_pmd_fault(struct vm_area_struct *vma, unsigned long addr,
+	pmd_t *pmd, unsigned int flags)
+{
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	struct netmap_adapter *na = priv->np_na;
+	unsigned long start = addr & PMD_MASK;
+	unsigned long off = (vma->vm_pgoff << PAGE_SHIFT) +
+		(start - vma->vm_start);
+	unsigned long pa;
+
+	if (start < vma->vm_start || start + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	pa = netmap_mem_ofstophys_huge(na->nm_mem, off);
+	if (pa == 0)
+		return VM_FAULT_FALLBACK;
+	return vmf_insert_pfn_pmd(vma, start, pmd, phys_to_pfn_t(pa, 0),
+		flags & FAULT_FLAG_WRITE);
+}
+
+static struct vm_operations_struct linux_netmap_huge_mmap_ops = {
+	.fault = linux_netmap_pfn_fault,
+	.pmd_fault = linux_netmap_pmd_fault,
+};
+
+/*
+ * Pick a mapping address congruent to the file offset modulo
+ * PMD_SIZE, so that the hugepage clusters can be mapped with pmds.
+ */
+static unsigned long
+linux_netmap_get_unmapped_area(struct file *f, unsigned long addr,
+	unsigned long len, unsigned long pgoff, unsigned long flags)
+{
+	unsigned long ret, off = (pgoff << PAGE_SHIFT) & ~PMD_MASK;
+
+	if ((flags & MAP_FIXED) || len < PMD_SIZE || !netmap_hugepages)
+		return current->mm->get_unmapped_area(f, addr, len,
+			pgoff, flags);
+	ret = current->mm->get_unmapped_area(f, 0, len + PMD_SIZE,
+		pgoff, flags);
+	if (IS_ERR_VALUE(ret))
+		return ret;
+	return ret + ((off - ret) & ~PMD_MASK);
+}
+#endif /* NETMAP_LINUX_HAVE_PMD_FAULT */
+
 static int
 linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 {
@@ -500,7 +1009,7 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 	mb();
 
 	/* check that [off, off + vsize) is within our memory */
-	error = netmap_mem_get_info(na->nm_mem, &memsize, &memflags, NULL);
+	error = netmap_mem_get_info(na->nm_mem, &memsize, &memflags, NULL, NULL);
 	ND("get_info returned %d", error);
 	if (error)
 		return -error;
@@ -520,13 +1029,20 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 				pa >> PAGE_SHIFT,
 				vma->vm_end - vma->vm_start,
 				vma->vm_page_prot);
-	} else {
-		/* non contiguous memory, we serve 
-		 * page faults as they come
-		 */
+	}
+#ifdef NETMAP_LINUX_HAVE_PMD_FAULT
+	if ((memflags & NETMAP_MEM_HUGEPAGES) && (vma->vm_flags & VM_SHARED)) {
+		vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND;
 		vma->vm_private_data = priv;
-		vma->vm_ops = &linux_netmap_mmap_ops;
+		vma->vm_ops = &linux_netmap_huge_mmap_ops;
+		return 0;
 	}
+#endif /* NETMAP_LINUX_HAVE_PMD_FAULT */
+	/* non contiguous memory, we serve
+	 * page faults as they come
+	 */
+	vma->vm_private_data = priv;
+	vma->vm_ops = &linux_netmap_mmap_ops;
 	return 0;
 }
 
@@ -575,6 +1091,7 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 	union {
 		struct nm_ifreq ifr;
 		struct nmreq nmr;
+		struct nm_stats_req stats;
 	} arg;
 	size_t argsize = 0;
 
@@ -585,6 +1102,9 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 	case NIOCCONFIG:
 		argsize = sizeof(arg.ifr);
 		break;
+	case NIOCGSTATS:
+		argsize = sizeof(arg.stats);
+		break;
 	default:
 		argsize = sizeof(arg.nmr);
 		break;
@@ -634,6 +1154,9 @@ static struct file_operations netmap_fops = {
     .owner = THIS_MODULE,
     .open = linux_netmap_open,
     .mmap = linux_netmap_mmap,
+#ifdef NETMAP_LINUX_HAVE_PMD_FAULT
+    .get_unmapped_area = linux_netmap_get_unmapped_area,
+#endif
     LIN_IOCTL_NAME = linux_netmap_ioctl,
     .poll = linux_netmap_poll,
     .release = linux_netmap_release,
@@ -796,17 +1319,126 @@ struct file* netmap_backend_get_file(void *opaque)
 }
 EXPORT_SYMBOL(netmap_backend_get_file);
 
+/*
+ * With backend_indirect, frames sent by a backend (v1000 or the netmap
+ * socket used by vhost-net) to a VALE port are not copied in full:
+ * the slots after the first NM_BE_HDR_COPY bytes (plus the virtio-net
+ * header) point to the guest pages with NS_INDIRECT, and the switch
+ * copies from there to the destination. The headers stay in a netmap
+ * buffer, as the switch reads them. This is only done when the txsync
+ * happens before we return, as the caller may then reuse the pages.
+ */
+int netmap_be_indirect = 1;
+SYSCTL_INT(_dev_netmap, OID_AUTO, backend_indirect, CTLFLAG_RW,
+    &netmap_be_indirect, 0, "Backends send from the guest pages");
+
+#define NM_BE_HDR_COPY	128	/* ethernet, IP and TCP headers */
+
+/* bytes of a frame to copy in the tx ring, the rest is NS_INDIRECT */
+static inline u_int
+netmap_be_copy_len(struct netmap_adapter *na, unsigned flags)
+{
+	if (!netmap_be_indirect || !(na->na_flags & NAF_TX_INDIRECT) ||
+	    (flags & MSG_MORE))
+		return ~0U;
+	return ((struct netmap_vp_adapter *)na)->virt_hdr_len + NM_BE_HDR_COPY;
+}
+
+/*
+ * Put the frame described by m in the tx ring from slot *cur on,
+ * copying the first 'copy' bytes and pointing to the rest
+ * (see netmap_be_indirect). Does not sync. Return 0 if the
+ * frame does not fit, otherwise advance *cur.
+ */
+static int netmap_be_put_frame(struct netmap_adapter *na,
+		struct netmap_ring *ring, struct msghdr *m, u_int *cur,
+		u_int copy)
+{
+	struct iovec *iov = m->msg_iov;
+	size_t iovcnt = m->msg_iovlen;
+	u_int nm_buf_size = ring->nr_buf_size;
+	/* indirect slots must also fit the normal buffers */
+	u_int ind_size = min_t(u_int, nm_buf_size, NETMAP_BUF_SIZE(na));
+	u_int i = *cur, last = i, lim = ring->num_slots - 1;
+	u_int avail = ring->tail + ring->num_slots - *cur;
+	u_int done = 0, fill = 0;
+	struct netmap_slot *slot = NULL;
+	unsigned j;
+
+	if (avail >= ring->num_slots)
+		avail -= ring->num_slots;
+	for (j = 0; j < iovcnt; j++) {
+		uint8_t __user *base = iov[j].iov_base;
+		size_t left = iov[j].iov_len;
+
+		while (left) {
+			u_int n;
+
+			if (done < copy) {
+				/* append to the current copied slot */
+				if (slot == NULL || fill == nm_buf_size ||
+				    (slot->flags & NS_INDIRECT)) {
+					if (unlikely(avail == 0))
+						return 0;
+					slot = &ring->slot[i];
+					slot->flags = NS_MOREFRAG;
+					fill = 0;
+					last = i;
+					i = nm_next(i, lim);
+					avail--;
+				}
+				n = min_t(size_t, left, nm_buf_size - fill);
+				n = min(n, copy - done);
+				if (copy_from_user(NMB(na, slot) + fill, base, n))
+					D("copy_from_user() error");
+				fill += n;
+				slot->len = fill;
+			} else {
+				/* one slot per piece of the iovec */
+				if (unlikely(avail == 0))
+					return 0;
+				slot = &ring->slot[i];
+				n = min_t(size_t, left, ind_size);
+				slot->ptr = (uintptr_t)base;
+				slot->len = n;
+				slot->flags = NS_MOREFRAG | NS_INDIRECT;
+				last = i;
+				i = nm_next(i, lim);
+				avail--;
+			}
+			base += n;
+			left -= n;
+			done += n;
+		}
+	}
+	if (slot)
+		ring->slot[last].flags &= ~NS_MOREFRAG;
+	*cur = i;
+	return 1;
+}
+
+/*
+ * Publish the frames in the tx ring up to slot cur and sync them,
+ * as NIOCTXSYNC does.
+ */
+static void netmap_be_txsync(struct netmap_kring *kring, u_int cur)
+{
+	struct netmap_ring *ring = kring->ring;
+
+	ring->head = ring->cur = cur;
+	if (nm_txsync_prologue(kring) >= kring->nkr_num_slots) {
+		netmap_ring_reinit(kring);
+		return;
+	}
+	kring->nm_sync(kring, 0);
+}
+
 static int netmap_common_sendmsg(struct netmap_adapter *na, struct msghdr *m,
                           size_t len, unsigned flags)
 {
     struct netmap_ring *ring;
     struct netmap_kring *kring;
-    unsigned i, last;
-    unsigned avail;
-    unsigned j;
-    unsigned nm_buf_size;
-    struct iovec *iov = m->msg_iov;
-    size_t iovcnt = m->msg_iovlen;
+    u_int cur, copy;
 
     ND("message_len %d, %p", (int)len, na_sock);
 
@@ -818,70 +1450,28 @@ static int netmap_common_sendmsg(struct netmap_adapter *na, struct msghdr *m,
     /* Grab the netmap ring normally used from userspace. */
     kring = &na->tx_rings[0];
     ring = kring->ring;
-    nm_buf_size = ring->nr_buf_size;
-
-    i = last = ring->cur;
-    avail = ring->tail + ring->num_slots - ring->cur;
-    if (avail >= ring->num_slots)
-	avail -= ring->num_slots;
-
-    ND("A) cur=%d avail=%d, hwcur=%d, hwtail=%d\n",
-	i, avail, na->tx_rings[0].nr_hwcur, na->tx_rings[0].nr_hwtail);
-    if (avail < iovcnt) {
-        /* Not enough netmap slots. */
-        return 0;
-    }
-
-    for (j=0; j<iovcnt; j++) {
-        uint8_t *iov_frag = iov[j].iov_base;
-        unsigned iov_frag_size = iov[j].iov_len;
-        unsigned offset = 0;
-#if 0
-        unsigned k = 0;
-        uint8_t ch;
-
-        printk("len=%d: ", iov_frag_size);
-        for (k=0; k<iov_frag_size && k<36; k++) {
-            if(copy_from_user(&ch, iov_frag + k, 1)) {
-                D("failed");
-            }
-            printk("%02x:", ch);
-        }printk("\n");
-#endif
-        while (iov_frag_size) {
-            unsigned nm_frag_size = min(iov_frag_size, nm_buf_size);
-            uint8_t *dst;
 
-            if (unlikely(avail == 0)) {
-                return 0;
-            }
-
-            dst = NMB(na, &ring->slot[i]);
-
-            ring->slot[i].len = nm_frag_size;
-            ring->slot[i].flags = NS_MOREFRAG;
-            if (copy_from_user(dst, iov_frag + offset, nm_frag_size)) {
-                D("copy_from_user() error");
-            }
-
-            last = i;
-            if (unlikely(++i == ring->num_slots))
-                i = 0;
-            avail--;
-
-            offset += nm_frag_size;
-            iov_frag_size -= nm_frag_size;
+    ND("A) cur=%d tail=%d, hwcur=%d, hwtail=%d\n",
+	ring->cur, ring->tail, kring->nr_hwcur, kring->nr_hwtail);
+    cur = ring->cur;
+    copy = netmap_be_copy_len(na, flags);
+    if (!netmap_be_put_frame(na, ring, m, &cur, copy)) {
+        /* The ring may be full of frames held back by MSG_MORE,
+         * push them out and try once more.
+         */
+        netmap_be_txsync(kring, ring->cur);
+        cur = ring->cur;
+        if (!netmap_be_put_frame(na, ring, m, &cur, copy)) {
+            /* Not enough netmap slots. */
+            return 0;
         }
     }
-
-    ring->slot[last].flags &= ~NS_MOREFRAG;
-
-    ring->cur = i;
+    ring->cur = cur;
 
     if (!(flags & MSG_MORE))
-        kring->nm_sync(kring, 0);
-    ND("B) cur=%d avail=%d, hwcur=%d, hwtail=%d\n",
-	i, avail, na->tx_rings[0].nr_hwcur, na->tx_rings[0].nr_hwtail);
+        netmap_be_txsync(kring, cur);
+    ND("B) cur=%d tail=%d, hwcur=%d, hwtail=%d\n",
+	cur, ring->tail, kring->nr_hwcur, kring->nr_hwtail);
 
     return len;
 }
@@ -1291,7 +1881,9 @@ static int netmap_socket_sendmsg(struct kiocb *iocb, struct socket *sock,
 {
     struct netmap_sock *nm_sock = container_of(sock, struct netmap_sock, sock);
 
-    return netmap_common_sendmsg(nm_sock->na, m, total_len, 0);
+    /* vhost-net sets MSG_MORE when more frames follow, sync once */
+    return netmap_common_sendmsg(nm_sock->na, m, total_len,
+		m->msg_flags & MSG_MORE);
 }
 
 static int netmap_socket_recvmsg(struct kiocb *iocb, struct socket *sock,
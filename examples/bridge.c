@@ -9,10 +9,21 @@
  * $FreeBSD: head/tools/tools/netmap/bridge.c 228975 2011-12-30 00:04:11Z uqs $
  */
 
+#define _GNU_SOURCE	/* for CPU_SET() */
 #include <stdio.h>
 #define NETMAP_WITH_LIBS
 #include <net/netmap_user.h>
 #include <sys/poll.h>
+#include <pthread.h>
+
+#ifdef linux
+#define cpuset_t        cpu_set_t
+#endif  /* linux */
+
+#ifdef __FreeBSD__
+#include <pthread_np.h> /* pthread w/ affinity */
+#include <sys/cpuset.h> /* cpu_set */
+#endif  /* __FreeBSD__ */
 
 int verbose = 0;
 
@@ -27,6 +38,39 @@ sigint_h(int sig)
 	signal(SIGINT, SIG_DFL);
 }
 
+/* with -p, one thread per ring pair, each on its own core */
+struct bridge_thread {
+	pthread_t thread;
+	struct nm_desc *pa, *pb;
+	u_int burst;
+	int affinity;
+};
+
+/* same as in pkt-gen */
+static int
+setaffinity(pthread_t me, int i)
+{
+#if defined(linux) || defined(__FreeBSD__)
+	cpuset_t cpumask;
+
+	if (i == -1)
+		return 0;
+
+	/* Set thread affinity affinity.*/
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
+
+	if (pthread_setaffinity_np(me, sizeof(cpuset_t), &cpumask) != 0) {
+		D("Unable to set affinity: %s", strerror(errno));
+		return 1;
+	}
+#else
+	(void)me;
+	(void)i;
+#endif
+	return 0;
+}
+
 
 /*
  * how many packets on this set of queues ?
@@ -138,12 +182,184 @@ move(struct nm_desc *src, struct nm_desc *dst, u_int limit)
 	return (m);
 }
 
+/*
+ * Forward in both directions between pa and pb until ^C.
+ */
+static void
+bridge_loop(struct nm_desc *pa, struct nm_desc *pb, u_int burst)
+{
+	struct pollfd pollfd[2];
+
+	/* setup poll(2) variables. */
+	memset(pollfd, 0, sizeof(pollfd));
+	pollfd[0].fd = pa->fd;
+	pollfd[1].fd = pb->fd;
+
+	while (!do_abort) {
+		int n0, n1, ret;
+		pollfd[0].events = pollfd[1].events = 0;
+		pollfd[0].revents = pollfd[1].revents = 0;
+		n0 = pkt_queued(pa, 0);
+		n1 = pkt_queued(pb, 0);
+		if (n0)
+			pollfd[1].events |= POLLOUT;
+		else
+			pollfd[0].events |= POLLIN;
+		if (n1)
+			pollfd[0].events |= POLLOUT;
+		else
+			pollfd[1].events |= POLLIN;
+		ret = poll(pollfd, 2, 2500);
+		if (ret <= 0 || verbose)
+		    D("poll %s [0] ev %x %x rx %d@%d tx %d,"
+			     " [1] ev %x %x rx %d@%d tx %d",
+				ret <= 0 ? "timeout" : "ok",
+				pollfd[0].events,
+				pollfd[0].revents,
+				pkt_queued(pa, 0),
+				NETMAP_RXRING(pa->nifp, pa->cur_rx_ring)->cur,
+				pkt_queued(pa, 1),
+				pollfd[1].events,
+				pollfd[1].revents,
+				pkt_queued(pb, 0),
+				NETMAP_RXRING(pb->nifp, pb->cur_rx_ring)->cur,
+				pkt_queued(pb, 1)
+			);
+		if (ret < 0)
+			continue;
+		if (pollfd[0].revents & POLLERR) {
+			struct netmap_ring *rx = NETMAP_RXRING(pa->nifp, pa->cur_rx_ring);
+			D("error on fd0, rx [%d,%d,%d)",
+				rx->head, rx->cur, rx->tail);
+		}
+		if (pollfd[1].revents & POLLERR) {
+			struct netmap_ring *rx = NETMAP_RXRING(pb->nifp, pb->cur_rx_ring);
+			D("error on fd1, rx [%d,%d,%d)",
+				rx->head, rx->cur, rx->tail);
+		}
+		if (pollfd[0].revents & POLLOUT) {
+			move(pb, pa, burst);
+			// XXX we don't need the ioctl */
+			// ioctl(me[0].fd, NIOCTXSYNC, NULL);
+		}
+		if (pollfd[1].revents & POLLOUT) {
+			move(pa, pb, burst);
+			// XXX we don't need the ioctl */
+			// ioctl(me[1].fd, NIOCTXSYNC, NULL);
+		}
+	}
+}
+
+static void *
+bridge_thread_body(void *data)
+{
+	struct bridge_thread *t = data;
+
+	if (setaffinity(pthread_self(), t->affinity) == 0)
+		bridge_loop(t->pa, t->pb, t->burst);
+	return (NULL);
+}
+
+/*
+ * open ring 'ring' of the port already open in parent, same memory.
+ * ifname is the name parent was opened with, nm_open() wants the
+ * netmap: or vale prefix while parent->req.nr_name has none.
+ */
+static struct nm_desc *
+open_ring(const char *ifname, struct nm_desc *parent, int ring)
+{
+	struct nm_desc d = *parent; /* copy, we overwrite ringid */
+
+	d.self = &d;
+	d.req.nr_flags = NR_REG_ONE_NIC;
+	d.req.nr_ringid = ring;
+	return nm_open(ifname, NULL, NM_OPEN_IFNAME | NM_OPEN_NO_MMAP, &d);
+}
+
+/*
+ * Bridge ring i of pa with ring i of pb in thread i, pinned to
+ * core first_cpu + i. nthreads 0 means one per ring pair.
+ * Each thread serves a single ring pair, so the two ports must have
+ * the same number of rings and nthreads must match it, or some rings
+ * would never be read.
+ * The threads run until ^C, return -1 if we could not start them.
+ */
+static int
+start_threads(const char *ifa, struct nm_desc *pa,
+	const char *ifb, struct nm_desc *pb, u_int burst,
+	int nthreads, int first_cpu)
+{
+	struct bridge_thread *t;
+	int i, n, ret = 0, rings, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if ((pa->req.nr_flags & NR_REG_MASK) != NR_REG_ALL_NIC ||
+	    (pb->req.nr_flags & NR_REG_MASK) != NR_REG_ALL_NIC) {
+		D("-p needs two ports with all hw rings (no host, no -N)");
+		return -1;
+	}
+	rings = pa->req.nr_rx_rings;
+	if (rings != pa->req.nr_tx_rings || rings != pb->req.nr_rx_rings ||
+	    rings != pb->req.nr_tx_rings) {
+		D("-p needs the same number of tx and rx rings on both ports");
+		return -1;
+	}
+	if (nthreads == 0)
+		nthreads = rings;
+	if (nthreads != rings) {
+		D("%d threads but %d ring pairs, use -p 0 or -p %d",
+		    nthreads, rings, rings);
+		return -1;
+	}
+	if (ncpus < 1)
+		ncpus = 1;
+	t = calloc(nthreads, sizeof(*t));
+	if (t == NULL)
+		return -1;
+	n = nthreads;
+	for (i = 0; i < nthreads; i++) {
+		t[i].burst = burst;
+		t[i].affinity = first_cpu < 0 ? -1 : (first_cpu + i) % ncpus;
+		t[i].pa = open_ring(ifa, pa, i);
+		t[i].pb = open_ring(ifb, pb, i);
+		if (t[i].pa == NULL || t[i].pb == NULL) {
+			D("cannot open ring %d", i);
+			ret = -1;
+			goto done;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&t[i].thread, NULL, bridge_thread_body,
+		    &t[i])) {
+			D("cannot create thread %d", i);
+			do_abort = 1;
+			nthreads = i;
+			break;
+		}
+		D("thread %d: ring %d on cpu %d", i, i, t[i].affinity);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(t[i].thread, NULL);
+done:
+	for (i = 0; i < n; i++) {
+		if (t[i].pb)
+			nm_close(t[i].pb);
+		if (t[i].pa)
+			nm_close(t[i].pa);
+	}
+	free(t);
+	return ret;
+}
+
 
 static void
 usage(void)
 {
 	fprintf(stderr,
-	    "usage: bridge [-v] [-i ifa] [-i ifb] [-b burst] [-w wait_time] [iface]\n");
+	    "usage: bridge [-v] [-i ifa] [-i ifb] [-b burst] [-w wait_time]"
+	    " [-p threads] [-a first_cpu] [iface]\n"
+	    "\t-p n\tone thread per hw ring pair, n is 0 or the number"
+	    " of rings\n"
+	    "\t-a cpu\tpin thread i to cpu + i (-1: do not pin)\n");
 	exit(1);
 }
 
@@ -157,8 +373,7 @@ usage(void)
 int
 main(int argc, char **argv)
 {
-	struct pollfd pollfd[2];
-	int ch;
+	int ch, nthreads = 1, affinity = 0;
 	u_int burst = 1024, wait_link = 4;
 	struct nm_desc *pa = NULL, *pb = NULL;
 	char *ifa = NULL, *ifb = NULL;
@@ -167,15 +382,21 @@ main(int argc, char **argv)
 	fprintf(stderr, "%s built %s %s\n",
 		argv[0], __DATE__, __TIME__);
 
-	while ( (ch = getopt(argc, argv, "b:ci:vw:")) != -1) {
+	while ( (ch = getopt(argc, argv, "a:b:ci:p:vw:")) != -1) {
 		switch (ch) {
 		default:
 			D("bad option %c %s", ch, optarg);
 			usage();
 			break;
+		case 'a':	/* first cpu for -p, -1 no affinity */
+			affinity = atoi(optarg);
+			break;
 		case 'b':	/* burst */
 			burst = atoi(optarg);
 			break;
+		case 'p':	/* threads, 0 one per ring pair */
+			nthreads = atoi(optarg);
+			break;
 		case 'i':	/* interface */
 			if (ifa == NULL)
 				ifa = optarg;
@@ -217,6 +438,10 @@ main(int argc, char **argv)
 		D("invalid burst %d, set to 1024", burst);
 		burst = 1024;
 	}
+	if (nthreads < 0) {
+		D("invalid threads %d, set to 1", nthreads);
+		nthreads = 1;
+	}
 	if (wait_link > 100) {
 		D("invalid wait_link %d, set to 4", wait_link);
 		wait_link = 4;
@@ -243,71 +468,20 @@ main(int argc, char **argv)
 	zerocopy = zerocopy && (pa->mem == pb->mem);
 	D("------- zerocopy %ssupported", zerocopy ? "" : "NOT ");
 
-	/* setup poll(2) variables. */
-	memset(pollfd, 0, sizeof(pollfd));
-	pollfd[0].fd = pa->fd;
-	pollfd[1].fd = pb->fd;
-
 	D("Wait %d secs for link to come up...", wait_link);
 	sleep(wait_link);
 	D("Ready to go, %s 0x%x/%d <-> %s 0x%x/%d.",
 		pa->req.nr_name, pa->first_rx_ring, pa->req.nr_rx_rings,
 		pb->req.nr_name, pb->first_rx_ring, pb->req.nr_rx_rings);
 
-	/* main loop */
 	signal(SIGINT, sigint_h);
-	while (!do_abort) {
-		int n0, n1, ret;
-		pollfd[0].events = pollfd[1].events = 0;
-		pollfd[0].revents = pollfd[1].revents = 0;
-		n0 = pkt_queued(pa, 0);
-		n1 = pkt_queued(pb, 0);
-		if (n0)
-			pollfd[1].events |= POLLOUT;
-		else
-			pollfd[0].events |= POLLIN;
-		if (n1)
-			pollfd[0].events |= POLLOUT;
-		else
-			pollfd[1].events |= POLLIN;
-		ret = poll(pollfd, 2, 2500);
-		if (ret <= 0 || verbose)
-		    D("poll %s [0] ev %x %x rx %d@%d tx %d,"
-			     " [1] ev %x %x rx %d@%d tx %d",
-				ret <= 0 ? "timeout" : "ok",
-				pollfd[0].events,
-				pollfd[0].revents,
-				pkt_queued(pa, 0),
-				NETMAP_RXRING(pa->nifp, pa->cur_rx_ring)->cur,
-				pkt_queued(pa, 1),
-				pollfd[1].events,
-				pollfd[1].revents,
-				pkt_queued(pb, 0),
-				NETMAP_RXRING(pb->nifp, pb->cur_rx_ring)->cur,
-				pkt_queued(pb, 1)
-			);
-		if (ret < 0)
-			continue;
-		if (pollfd[0].revents & POLLERR) {
-			struct netmap_ring *rx = NETMAP_RXRING(pa->nifp, pa->cur_rx_ring);
-			D("error on fd0, rx [%d,%d,%d)",
-				rx->head, rx->cur, rx->tail);
-		}
-		if (pollfd[1].revents & POLLERR) {
-			struct netmap_ring *rx = NETMAP_RXRING(pb->nifp, pb->cur_rx_ring);
-			D("error on fd1, rx [%d,%d,%d)",
-				rx->head, rx->cur, rx->tail);
-		}
-		if (pollfd[0].revents & POLLOUT) {
-			move(pb, pa, burst);
-			// XXX we don't need the ioctl */
-			// ioctl(me[0].fd, NIOCTXSYNC, NULL);
-		}
-		if (pollfd[1].revents & POLLOUT) {
-			move(pa, pb, burst);
-			// XXX we don't need the ioctl */
-			// ioctl(me[1].fd, NIOCTXSYNC, NULL);
-		}
+	if (nthreads == 1) {
+		bridge_loop(pa, pb, burst);
+	} else if (start_threads(ifa, pa, ifb, pb, burst, nthreads,
+	    affinity) < 0) {
+		nm_close(pb);
+		nm_close(pa);
+		return (1);
 	}
 	D("exiting");
 	nm_close(pb);
@@ -0,0 +1,237 @@
+#!/bin/sh
+#
+# Run a standard matrix of netmap datapath benchmarks with pkt-gen
+# and print the results as CSV, one line per run, so that results
+# from different kernels or commits can be compared (see -c).
+#
+# Tests (-t, comma separated, default all but nic):
+#	vale		pkt-gen tx -> VALE switch -> pkt-gen rx
+#	pipe		pkt-gen tx -> netmap pipe -> pkt-gen rx, 1 thread
+#	monitor		as vale, with a zero-copy monitor on the receiver
+#	monitor-copy	as vale, with a copy monitor (snaplen 128)
+#	nic		pkt-gen tx -> VALE switch -> NIC (-i ifname),
+#			attached with vale-ctl, tx rate only
+#	rtt		ping/pong over a VALE switch, latency only
+#
+# Each combination of packet size (-s), burst (-b) and threads (-p)
+# is run for -n packets (per run). Throughput is what the receiver
+# got (the sender for nic); cycles/pkt is the CPU time (user+sys)
+# of all pkt-gen processes in the run times the clock rate, per
+# packet, so it includes busy polling.
+#
+# Usage:
+#	nm-bench.sh [-t tests] [-s sizes] [-b bursts] [-p threads]
+#		[-n count] [-i nic] [-P pkt-gen] [-V vale-ctl] > out.csv
+#	nm-bench.sh -c old.csv new.csv [-T percent]
+#
+
+BIN=$(dirname "$0")
+PKTGEN=${BIN}/pkt-gen
+VALECTL=${BIN}/vale-ctl
+TESTS="vale,pipe,monitor,monitor-copy,rtt"
+SIZES="60 508 1514"
+BURSTS="64 512"
+THREADS="1 2 4"
+COUNT=10000000
+NIC=""
+THRESHOLD=5
+COMPARE=""
+TMP=${TMPDIR:-/tmp}/nm-bench.$$
+SW=0		# a new VALE switch for each run
+
+usage() {
+	sed -n '/^# Usage/,/^$/p' "$0" | sed 's/^#//'
+	exit 1
+}
+
+# compare two result files: mpps on matching lines, and p99 for rtt
+compare() {
+	awk -F, -v thr="${THRESHOLD}" '
+	/^#/ || $1 == "test" { next }
+	{ key = $1 "," $2 "," $3 "," $4 }
+	FNR == NR { mpps[key] = $6; p99[key] = $11; next }
+	!(key in mpps) { next }
+	{
+		bad = 0
+		if ($1 == "rtt") {
+			old = p99[key]; new = $11
+			r = old > 0 ? new / old : 1
+			bad = r > 1 + thr / 100
+			what = "p99"
+		} else {
+			old = mpps[key]; new = $6
+			r = old > 0 ? new / old : 1
+			bad = r < 1 - thr / 100
+			what = "mpps"
+		}
+		fails += bad
+		printf("%s%s %s %s -> %s (%+.1f%%)\n", bad ? "REGRESSION " : "",
+			key, what, old, new, (r - 1) * 100)
+	}
+	END { exit fails > 0 }' "$1" "$2"
+}
+
+# CPU clock in Hz, for cycles per packet
+cpu_hz() {
+	case $(uname) in
+	Linux)
+		awk '/^cpu MHz/ { print int($4 * 1000000); exit }' /proc/cpuinfo
+		;;
+	*)
+		mhz=$(sysctl -n dev.cpu.0.freq 2>/dev/null || \
+			sysctl -n hw.clockrate 2>/dev/null)
+		echo $((${mhz:-0} * 1000000))
+		;;
+	esac
+}
+
+# run "$@" under time -p, output and the times go to $TMP.$tag
+timed() {
+	tag=$1; shift
+	/usr/bin/time -p "$@" > "${TMP}.${tag}" 2>&1
+}
+
+# sum of user+sys seconds in the given logs
+cpu_time() {
+	cat "$@" | awk '/^(user|sys) / { t += $2 } END { printf("%.3f", t) }'
+}
+
+# print a result line from the receiver (or sender) log and the others
+result() {
+	test=$1 size=$2 burst=$3 thr=$4 log=$5; shift 5
+	pkts=$(awk '/^(Received|Sent) / { print $2; exit }' "${log}")
+	secs=$(awk '/^Received / { print $5; exit }
+		/^Sent / { print $8; exit }' "${log}")
+	lat=$(awk '/total rtt/ {
+		for (i = 1; i < NF; i++) {
+			if ($i == "p50") p50 = $(i + 1)
+			if ($i == "p90") p90 = $(i + 1)
+			if ($i == "p99") p99 = $(i + 1)
+			if ($i == "p99.9") p999 = $(i + 1)
+		}
+	} END { printf("%s,%s,%s,%s", p50, p90, p99, p999) }' "${log}")
+	cpu=$(cpu_time "${log}" "$@")
+	echo "${pkts:-0} ${secs:-0} ${cpu} ${HZ} ${size}" | awk -v pre="${test},${size},${burst},${thr}" -v lat="${lat}" '{
+		pps = $2 > 0 ? $1 / $2 : 0
+		cyc = $1 > 0 ? $3 * $4 / $1 : 0
+		printf("%s,%d,%.3f,%.3f,%.1f,%s\n", pre, $1,
+			pps / 1e6, pps * $5 * 8 / 1e9, cyc, lat)
+	}'
+}
+
+# sender and receiver on the two ports, and an optional third program
+run_pair() {
+	test=$1 size=$2 burst=$3 thr=$4 tx=$5 rx=$6 mon=$7
+	cfg=""	# VALE ports have one ring pair unless asked
+	[ ${thr} -gt 1 ] && cfg="-C 1024,1024,${thr},${thr}"
+	common="-l ${size} -b ${burst} -p ${thr} -c ${thr} -w 1"
+
+	timed rx ${PKTGEN} -f rx -i "${rx}" ${cfg} ${common} -W &
+	rxpid=$!
+	logs="${TMP}.tx"
+	if [ -n "${mon}" ]; then
+		sleep 1
+		timed mon ${PKTGEN} -f rx -i "${rx}" -m ${mon} ${common} -W &
+		monpid=$!
+		logs="${logs} ${TMP}.mon"
+	fi
+	sleep 1
+	timed tx ${PKTGEN} -f tx -i "${tx}" ${cfg} ${common} -n ${COUNT}
+	wait ${rxpid}
+	[ -n "${mon}" ] && wait ${monpid}
+	result ${test} ${size} ${burst} ${thr} "${TMP}.rx" ${logs}
+}
+
+run_nic() {
+	size=$1 burst=$2 thr=$3
+	sw=vale${SW}
+	${VALECTL} -a ${sw}:${NIC} > /dev/null || return
+	timed tx ${PKTGEN} -f tx -i ${sw}:a -l ${size} -b ${burst} \
+		-n ${COUNT}
+	${VALECTL} -d ${sw}:${NIC} > /dev/null
+	result nic ${size} ${burst} ${thr} "${TMP}.tx"
+}
+
+run_rtt() {
+	size=$1 burst=$2
+	sw=vale${SW}
+	timed pong ${PKTGEN} -f pong -i ${sw}:b -l ${size} -w 1 &
+	pongpid=$!
+	sleep 1
+	timed ping ${PKTGEN} -f ping -i ${sw}:a -l ${size} -w 1 \
+		-n $((COUNT / 1000))
+	# time(1) does not pass on SIGINT
+	pkill -INT -f "pkt-gen -f pong -i ${sw}:b"
+	wait ${pongpid}
+	result rtt ${size} ${burst} 1 "${TMP}.ping" "${TMP}.pong"
+}
+
+while getopts "t:s:b:p:n:i:P:V:cT:h" opt; do
+	case ${opt} in
+	t) TESTS=${OPTARG} ;;
+	s) SIZES=$(echo ${OPTARG} | tr , ' ') ;;
+	b) BURSTS=$(echo ${OPTARG} | tr , ' ') ;;
+	p) THREADS=$(echo ${OPTARG} | tr , ' ') ;;
+	n) COUNT=${OPTARG} ;;
+	i) NIC=${OPTARG} ;;
+	P) PKTGEN=${OPTARG} ;;
+	V) VALECTL=${OPTARG} ;;
+	c) COMPARE=1 ;;
+	T) THRESHOLD=${OPTARG} ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ -n "${COMPARE}" ]; then
+	[ $# -eq 2 ] || usage
+	compare "$1" "$2"
+	exit
+fi
+
+[ -x "${PKTGEN}" ] || { echo "no pkt-gen at ${PKTGEN}" >&2; exit 1; }
+HZ=$(cpu_hz)
+trap 'rm -f ${TMP}.*' EXIT
+
+# enough to tell later where the numbers come from
+echo "# $(date -u '+%Y-%m-%dT%H:%M:%SZ') $(uname -srm)"
+echo "# commit $(git -C "${BIN}" describe --always --dirty 2>/dev/null)"
+echo "# cpu_hz ${HZ} count ${COUNT}"
+echo "test,size,burst,threads,pkts,mpps,gbps,cycles_pkt,p50_ns,p90_ns,p99_ns,p99.9_ns"
+
+for test in $(echo ${TESTS} | tr , ' '); do
+	for size in ${SIZES}; do
+	for burst in ${BURSTS}; do
+	for thr in ${THREADS}; do
+		SW=$((SW + 1))
+		sw=vale${SW}
+		case ${test} in
+		vale)
+			run_pair vale ${size} ${burst} ${thr} ${sw}:a ${sw}:b
+			;;
+		pipe)	# one ring pair per pipe
+			[ ${thr} -eq 1 ] && run_pair pipe ${size} ${burst} ${thr} "${sw}:p{1" "${sw}:p}1"
+			;;
+		monitor)
+			run_pair monitor ${size} ${burst} ${thr} ${sw}:a ${sw}:b rx
+			;;
+		monitor-copy)
+			run_pair monitor-copy ${size} ${burst} ${thr} ${sw}:a ${sw}:b rx:128
+			;;
+		nic)
+			[ -n "${NIC}" ] || { echo "nic needs -i ifname" >&2; break 3; }
+			[ ${thr} -eq 1 ] && run_nic ${size} ${burst} ${thr}
+			;;
+		rtt)	# one pinger, bursts and threads do not apply
+			[ ${thr} -eq 1 ] && [ ${burst} = ${BURSTS%% *} ] && \
+				run_rtt ${size} ${burst}
+			;;
+		*)
+			echo "unknown test ${test}" >&2
+			break 3
+			;;
+		esac
+	done
+	done
+	done
+done
@@ -0,0 +1,662 @@
+/*
+ * Copyright (C) 2014 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Capture the traffic of a netmap port to disk, in pcapng format.
+ *
+ * We attach a monitor (NR_MONITOR_TX|NR_MONITOR_RX, a copy monitor
+ * by default, so the monitored application is not disturbed) to each
+ * ring of the port, with one capture thread per ring. Each thread
+ * packs the frames into large aligned blocks, which a writer thread
+ * of the same ring writes to the file of the ring with O_DIRECT, so
+ * there is no copy through the page cache and no per-packet syscall.
+ * The capture thread only stops when all the blocks of its ring are
+ * waiting to be written, in which case the monitor drops frames; we
+ * report those drops (NM_STAT_DROP_MONITOR, from NIOCGSTATS).
+ *
+ * Each file is a valid pcapng file at all times, made of whole blocks:
+ * the writes must be multiples of the alignment, so the tail of each
+ * block is filled with a custom block, that readers skip.
+ */
+
+#define _GNU_SOURCE	/* for CPU_SET() and O_DIRECT */
+#include <stdio.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+#include <sys/poll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef linux
+#define cpuset_t        cpu_set_t
+#endif  /* linux */
+
+#ifdef __FreeBSD__
+#include <pthread_np.h> /* pthread w/ affinity */
+#include <sys/cpuset.h> /* cpu_set */
+#endif  /* __FreeBSD__ */
+
+#ifndef O_DIRECT
+#define O_DIRECT	0	/* not available, go through the cache */
+#endif
+
+/* pcapng block types and options */
+#define PCAPNG_SHB	0x0A0D0D0A	/* section header */
+#define PCAPNG_IDB	0x00000001	/* interface description */
+#define PCAPNG_EPB	0x00000006	/* enhanced packet */
+#define PCAPNG_CB	0x40000BAD	/* custom block, not to be copied */
+#define PCAPNG_MAGIC	0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET	1
+#define PCAPNG_OPT_IFNAME	2
+#define PCAPNG_OPT_TSRESOL	9
+
+#define CAP_ALIGN	4096	/* of buffers, writes and file offsets */
+#define CAP_PAD_MIN	16	/* the smallest custom block */
+#define CAP_EPB_LEN	32	/* enhanced packet block, without data */
+
+#define ROUND4(x)	(((x) + 3) & ~3U)
+
+static int verbose = 0;
+static int do_abort = 0;
+
+struct cap_block {
+	char *buf;
+	u_int len;	/* bytes to write, a multiple of CAP_ALIGN */
+};
+
+struct cap_arg;
+
+/* a ring of the port, with its capture and writer threads */
+struct cap_ring {
+	struct cap_arg *g;
+	pthread_t thread;
+	pthread_t writer;
+	struct nm_desc *d;
+	u_int ring;
+	int affinity;
+	int fd;			/* of the output file */
+	char path[256];
+
+	/* blocks, filled in order by the capture thread */
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	struct cap_block *blk;
+	u_int nblk;
+	u_int fill;		/* being filled by the capture thread */
+	u_int used;		/* bytes in blk[fill] */
+	u_int next_wr;		/* next block to write */
+	u_int queued;		/* blocks waiting for the writer */
+	int done;		/* no more blocks */
+	int error;		/* the writer failed, stop */
+
+	/* counters, read by the main thread */
+	volatile uint64_t pkts;
+	volatile uint64_t bytes;	/* written to the file */
+	volatile uint64_t stalls;	/* waits for a free block */
+};
+
+struct cap_arg {
+	const char *ifname;
+	const char *prefix;
+	uint32_t mon_flags;	/* NR_MONITOR_* */
+	u_int snaplen;		/* 0: whole frames */
+	u_int blksize;
+	u_int nblk;
+	int affinity;
+	int hwts;
+	int direct;
+	int report_ms;
+	struct cap_ring *rings;
+	u_int nrings;
+};
+
+static void
+sigint_h(int sig)
+{
+	(void)sig;	/* UNUSED */
+	do_abort = 1;
+	signal(SIGINT, SIG_DFL);
+}
+
+/* same as in pkt-gen */
+static int
+setaffinity(pthread_t me, int i)
+{
+#if defined(linux) || defined(__FreeBSD__)
+	cpuset_t cpumask;
+
+	if (i == -1)
+		return 0;
+
+	/* Set thread affinity affinity.*/
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
+
+	if (pthread_setaffinity_np(me, sizeof(cpuset_t), &cpumask) != 0) {
+		D("Unable to set affinity: %s", strerror(errno));
+		return 1;
+	}
+#else
+	(void)me;
+	(void)i;
+#endif
+	return 0;
+}
+
+static inline void
+put32(char *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void
+put16(char *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+/* a block of type t and total length len at p, body already there */
+static void
+pcapng_frame(char *p, uint32_t t, uint32_t len)
+{
+	put32(p, t);
+	put32(p + 4, len);
+	put32(p + len - 4, len);
+}
+
+/* the section header and the interface, at the start of a file */
+static u_int
+pcapng_header(char *p, const char *ifname, u_int snaplen)
+{
+	uint64_t seclen = (uint64_t)-1;	/* unknown */
+	u_int namelen = strlen(ifname), l;
+	char *o;
+
+	put32(p + 8, PCAPNG_MAGIC);
+	put16(p + 12, 1);	/* version 1.0 */
+	put16(p + 14, 0);
+	memcpy(p + 16, &seclen, sizeof(seclen));
+	pcapng_frame(p, PCAPNG_SHB, 28);
+	p += 28;
+
+	put16(p + 8, PCAPNG_LINKTYPE_ETHERNET);
+	put16(p + 10, 0);
+	put32(p + 12, snaplen ? snaplen : 65535);
+	o = p + 16;
+	put16(o, PCAPNG_OPT_IFNAME);
+	put16(o + 2, namelen);
+	memset(o + 4, 0, ROUND4(namelen));
+	memcpy(o + 4, ifname, namelen);
+	o += 4 + ROUND4(namelen);
+	put16(o, PCAPNG_OPT_TSRESOL);
+	put16(o + 2, 1);
+	put32(o + 4, 0);
+	o[4] = 9;		/* nanoseconds */
+	o += 8;
+	put32(o, 0);		/* end of options */
+	o += 4;
+	l = o + 4 - p;
+	pcapng_frame(p, PCAPNG_IDB, l);
+	return 28 + l;
+}
+
+/*
+ * Close blk[fill] for the writer, padding it to CAP_ALIGN with a
+ * custom block (PEN 0, no data), and wait until the next one is free.
+ */
+static int
+cap_flush(struct cap_ring *r)
+{
+	struct cap_block *b = &r->blk[r->fill];
+	u_int pad;
+
+	if (r->used % CAP_ALIGN) {
+		pad = (r->used + CAP_PAD_MIN + CAP_ALIGN - 1) /
+			CAP_ALIGN * CAP_ALIGN - r->used;
+		memset(b->buf + r->used, 0, pad);
+		pcapng_frame(b->buf + r->used, PCAPNG_CB, pad);
+		r->used += pad;
+	}
+	b->len = r->used;
+	r->used = 0;
+
+	pthread_mutex_lock(&r->mtx);
+	r->queued++;
+	pthread_cond_broadcast(&r->cv);
+	r->fill = (r->fill + 1) % r->nblk;
+	if (r->queued == r->nblk)
+		r->stalls++;
+	while (r->queued == r->nblk && !r->error)
+		pthread_cond_wait(&r->cv, &r->mtx);
+	pthread_mutex_unlock(&r->mtx);
+	return r->error;
+}
+
+static void *
+writer_body(void *data)
+{
+	struct cap_ring *r = data;
+	struct cap_block *b;
+	ssize_t n;
+
+	for (;;) {
+		pthread_mutex_lock(&r->mtx);
+		while (r->queued == 0 && !r->done)
+			pthread_cond_wait(&r->cv, &r->mtx);
+		if (r->queued == 0) {
+			pthread_mutex_unlock(&r->mtx);
+			break;
+		}
+		b = &r->blk[r->next_wr];
+		pthread_mutex_unlock(&r->mtx);
+
+		n = write(r->fd, b->buf, b->len);
+		if (n != (ssize_t)b->len) {
+			D("%s: write of %u bytes returns %d: %s", r->path,
+				b->len, (int)n, strerror(errno));
+			pthread_mutex_lock(&r->mtx);
+			r->error = 1;
+			pthread_cond_broadcast(&r->cv);
+			pthread_mutex_unlock(&r->mtx);
+			break;
+		}
+		r->bytes += n;
+
+		pthread_mutex_lock(&r->mtx);
+		r->next_wr = (r->next_wr + 1) % r->nblk;
+		r->queued--;
+		pthread_cond_broadcast(&r->cv);
+		pthread_mutex_unlock(&r->mtx);
+	}
+	return NULL;
+}
+
+/* append the frame in slot i of ring, return nonzero to stop */
+static inline int
+cap_frame(struct cap_ring *r, struct netmap_ring *ring, u_int i)
+{
+	struct cap_arg *g = r->g;
+	u_int blksize = g->blksize;
+	struct netmap_slot *slot = &ring->slot[i];
+	u_int len = slot->len, caplen, need;
+	uint64_t ts = 0;
+	char *p;
+
+	caplen = (g->snaplen && len > g->snaplen) ? g->snaplen : len;
+	need = CAP_EPB_LEN + ROUND4(caplen);
+	if (r->used + need + CAP_PAD_MIN > blksize) {
+		if (need + CAP_PAD_MIN > blksize) {
+			RD(1, "frame of %u bytes does not fit a block", len);
+			return 0;
+		}
+		if (cap_flush(r))
+			return 1;
+	}
+	if (g->hwts)
+		ts = NETMAP_RING_TS(ring)[i];
+	if (ts == 0)
+		ts = (uint64_t)ring->ts.tv_sec * 1000000000 +
+			(uint64_t)ring->ts.tv_usec * 1000;
+
+	p = r->blk[r->fill].buf + r->used;
+	put32(p + 8, 0);		/* interface */
+	put32(p + 12, ts >> 32);
+	put32(p + 16, ts & 0xffffffff);
+	put32(p + 20, caplen);
+	put32(p + 24, len);
+	memcpy(p + 28, NETMAP_BUF(ring, slot->buf_idx), caplen);
+	memset(p + 28 + caplen, 0, ROUND4(caplen) - caplen);
+	pcapng_frame(p, PCAPNG_EPB, need);
+	r->used += need;
+	r->pkts++;
+	return 0;
+}
+
+static void *
+capture_body(void *data)
+{
+	struct cap_ring *r = data;
+	struct pollfd pfd = { .fd = r->d->fd, .events = POLLIN };
+	struct netmap_ring *ring = NETMAP_RXRING(r->d->nifp, r->d->first_rx_ring);
+	u_int i;
+	int n;
+
+	if (setaffinity(r->thread, r->affinity))
+		goto out;
+	r->used = pcapng_header(r->blk[0].buf, r->g->ifname, r->g->snaplen);
+	while (!do_abort && !r->error) {
+		n = poll(&pfd, 1, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			D("poll error on ring %u: %s", r->ring, strerror(errno));
+			break;
+		}
+		if (pfd.revents & POLLERR) {
+			D("poll err on ring %u", r->ring);
+			break;
+		}
+		if (n == 0) {
+			/* quiet, make what we have visible in the file */
+			if (r->used && cap_flush(r))
+				break;
+			continue;
+		}
+		for (i = ring->head; i != ring->tail; i = nm_ring_next(ring, i)) {
+			if (cap_frame(r, ring, i))
+				break;
+		}
+		ring->head = ring->cur = i;
+	}
+	if (r->used)
+		cap_flush(r);
+out:
+	pthread_mutex_lock(&r->mtx);
+	r->done = 1;
+	pthread_cond_broadcast(&r->cv);
+	pthread_mutex_unlock(&r->mtx);
+	return NULL;
+}
+
+/* frames dropped by the monitor ring, 0 if unknown */
+static uint64_t
+monitor_drops(struct cap_ring *r)
+{
+	struct nm_stats_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.ns_ring = r->ring;
+	req.ns_tx = 0;
+	if (ioctl(r->d->fd, NIOCGSTATS, &req))
+		return 0;
+	return req.ns_stat[NM_STAT_DROP_MONITOR];
+}
+
+static int
+ring_open(struct cap_arg *g, struct cap_ring *r, const struct nm_desc *base)
+{
+	struct nm_desc nmd = *base; /* copy, we overwrite ringid */
+	uint64_t flags = NM_OPEN_IFNAME | NETMAP_NO_TX_POLL;
+	u_int i;
+
+	nmd.self = &nmd;
+	nmd.req.nr_flags = NR_REG_ONE_NIC | g->mon_flags;
+	nmd.req.nr_ringid = r->ring;
+	if (g->hwts)
+		flags |= NM_OPEN_HWTS;
+	r->d = nm_open(g->ifname, NULL, flags, &nmd);
+	if (r->d == NULL) {
+		D("Unable to open %s ring %u: %s", g->ifname, r->ring,
+			strerror(errno));
+		return 1;
+	}
+
+	snprintf(r->path, sizeof(r->path), "%s-%u.pcapng", g->prefix, r->ring);
+	r->fd = open(r->path, O_WRONLY | O_CREAT | O_TRUNC |
+		(g->direct ? O_DIRECT : 0), 0644);
+	if (r->fd < 0 && g->direct && errno == EINVAL) {
+		D("%s: no O_DIRECT on this filesystem, using the cache",
+			r->path);
+		r->fd = open(r->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (r->fd < 0) {
+		D("Unable to open %s: %s", r->path, strerror(errno));
+		return 1;
+	}
+
+	r->nblk = g->nblk;
+	r->blk = calloc(r->nblk, sizeof(*r->blk));
+	if (r->blk == NULL)
+		return 1;
+	for (i = 0; i < r->nblk; i++) {
+		if (posix_memalign((void **)&r->blk[i].buf, CAP_ALIGN,
+				g->blksize)) {
+			D("no memory for the blocks");
+			return 1;
+		}
+	}
+	pthread_mutex_init(&r->mtx, NULL);
+	pthread_cond_init(&r->cv, NULL);
+	r->g = g;
+	return 0;
+}
+
+static void
+usage(void)
+{
+	const char *cmd = "nm-capture";
+	fprintf(stderr,
+		"Usage:\n"
+		"%s arguments\n"
+		"\t-i port		netmap:ifname or valeX:port to capture\n"
+		"\t-w prefix		files are prefix-<ring>.pcapng "
+			"(default nm-capture)\n"
+		"\t-m tx|rx|txrx		traffic to capture (default txrx)\n"
+		"\t-s snaplen		bytes stored per frame (0 all)\n"
+		"\t-z			zero-copy monitor, the monitored "
+			"application loses the frames\n"
+		"\t-b block_kb		size of the blocks written (default 1024)\n"
+		"\t-q blocks		blocks per ring (default 8)\n"
+		"\t-a cpu_id		pin the thread of ring i to cpu_id + i\n"
+		"\t-H			hardware timestamps (NR_HWTS)\n"
+		"\t-D			no O_DIRECT, write through the cache\n"
+		"\t-T report_ms		milliseconds between reports\n"
+		"\t-v			verbose\n"
+		"",
+		cmd);
+
+	exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct cap_arg g;
+	struct nm_desc base;
+	struct nmreq req;
+	uint64_t prev_pkts = 0, prev_bytes = 0, prev_drops = 0;
+	u_int i, nrings = 0;
+	int ch, fd;
+
+	memset(&g, 0, sizeof(g));
+	g.prefix = "nm-capture";
+	g.mon_flags = NR_MONITOR_TX | NR_MONITOR_RX | NR_MONITOR_COPY;
+	g.blksize = 1024 * 1024;
+	g.nblk = 8;
+	g.affinity = -1;
+	g.direct = 1;
+	g.report_ms = 1000;
+
+	while ( (ch = getopt(argc, argv, "i:w:m:s:zb:q:a:HDT:v")) != -1) {
+		switch (ch) {
+		default:
+			D("bad option %c %s", ch, optarg);
+			usage();
+			break;
+		case 'i':
+			g.ifname = optarg;
+			break;
+		case 'w':
+			g.prefix = optarg;
+			break;
+		case 'm':
+			g.mon_flags &= NR_MONITOR_COPY;
+			if (!strcmp(optarg, "tx"))
+				g.mon_flags |= NR_MONITOR_TX;
+			else if (!strcmp(optarg, "rx"))
+				g.mon_flags |= NR_MONITOR_RX;
+			else if (!strcmp(optarg, "txrx"))
+				g.mon_flags |= NR_MONITOR_TX | NR_MONITOR_RX;
+			else {
+				D("unrecognized monitor mode %s", optarg);
+				usage();
+			}
+			break;
+		case 's':
+			g.snaplen = atoi(optarg);
+			break;
+		case 'z':
+			g.mon_flags &= ~NR_MONITOR_COPY;
+			break;
+		case 'b':
+			g.blksize = atoi(optarg) * 1024;
+			break;
+		case 'q':
+			g.nblk = atoi(optarg);
+			break;
+		case 'a':
+			g.affinity = atoi(optarg);
+			break;
+		case 'H':
+			g.hwts = 1;
+			break;
+		case 'D':
+			g.direct = 0;
+			break;
+		case 'T':
+			g.report_ms = atoi(optarg);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+	if (g.ifname == NULL) {
+		D("missing port name");
+		usage();
+	}
+	if (g.blksize < 2 * CAP_ALIGN || g.blksize % CAP_ALIGN) {
+		D("the block size must be a multiple of %d KB, at least %d KB",
+			CAP_ALIGN / 1024, 2 * CAP_ALIGN / 1024);
+		usage();
+	}
+	if (g.nblk < 2)
+		g.nblk = 2;
+	if (g.report_ms <= 0)
+		g.report_ms = 1000;
+
+	/* how many rings to monitor */
+	memset(&req, 0, sizeof(req));
+	req.nr_version = NETMAP_API;
+	if (!strncmp(g.ifname, "netmap:", 7))
+		strncpy(req.nr_name, g.ifname + 7, sizeof(req.nr_name) - 1);
+	else
+		strncpy(req.nr_name, g.ifname, sizeof(req.nr_name) - 1);
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0 || ioctl(fd, NIOCGINFO, &req)) {
+		D("Unable to get the rings of %s: %s", req.nr_name,
+			strerror(errno));
+		return 1;
+	}
+	close(fd);
+	if (g.mon_flags & NR_MONITOR_RX)
+		nrings = req.nr_rx_rings;
+	if ((g.mon_flags & NR_MONITOR_TX) && req.nr_tx_rings > nrings)
+		nrings = req.nr_tx_rings;
+
+	g.rings = calloc(nrings, sizeof(*g.rings));
+	if (g.rings == NULL)
+		return 1;
+	g.nrings = nrings;
+	memset(&base, 0, sizeof(base));
+	base.self = &base;
+	memcpy(base.req.nr_name, req.nr_name, sizeof(base.req.nr_name));
+	base.req.nr_version = NETMAP_API;
+	for (i = 0; i < nrings; i++) {
+		struct cap_ring *r = &g.rings[i];
+
+		r->ring = i;
+		r->fd = -1;
+		r->affinity = g.affinity >= 0 ? g.affinity + (int)i : -1;
+		if (ring_open(&g, r, &base))
+			return 1;
+	}
+
+	signal(SIGINT, sigint_h);
+	D("capturing %u rings of %s, %s monitor, blocks of %u KB%s",
+		nrings, g.ifname,
+		g.mon_flags & NR_MONITOR_COPY ? "copy" : "zero-copy",
+		g.blksize / 1024, g.direct ? ", O_DIRECT" : "");
+	for (i = 0; i < nrings; i++) {
+		struct cap_ring *r = &g.rings[i];
+
+		if (pthread_create(&r->writer, NULL, writer_body, r) ||
+		    pthread_create(&r->thread, NULL, capture_body, r)) {
+			D("Unable to create the threads of ring %u", i);
+			do_abort = 1;
+			break;
+		}
+	}
+
+	while (!do_abort) {
+		uint64_t pkts = 0, bytes = 0, drops = 0, stalls = 0;
+		int running = 0;
+
+		usleep(g.report_ms * 1000);
+		for (i = 0; i < nrings; i++) {
+			struct cap_ring *r = &g.rings[i];
+
+			pkts += r->pkts;
+			bytes += r->bytes;
+			stalls += r->stalls;
+			drops += monitor_drops(r);
+			running += !r->done;
+			if (verbose)
+				D("ring %u: %llu pkts, %llu bytes, %llu stalls",
+					i, (unsigned long long)r->pkts,
+					(unsigned long long)r->bytes,
+					(unsigned long long)r->stalls);
+		}
+		D("%llu pps, %.3f MB/s to disk, %llu dropped by the monitor"
+			" (%llu total), %llu stalls",
+			(unsigned long long)(pkts - prev_pkts) * 1000 / g.report_ms,
+			(double)(bytes - prev_bytes) * 1000 / g.report_ms / 1e6,
+			(unsigned long long)(drops - prev_drops),
+			(unsigned long long)drops, (unsigned long long)stalls);
+		prev_pkts = pkts;
+		prev_bytes = bytes;
+		prev_drops = drops;
+		if (running == 0)
+			break;
+	}
+
+	do_abort = 1;
+	for (i = 0; i < nrings; i++) {
+		struct cap_ring *r = &g.rings[i];
+
+		if (r->thread)
+			pthread_join(r->thread, NULL);
+		if (r->writer)
+			pthread_join(r->writer, NULL);
+		D("%s: %llu packets, %llu bytes, %llu dropped by the monitor",
+			r->path, (unsigned long long)r->pkts,
+			(unsigned long long)r->bytes,
+			(unsigned long long)monitor_drops(r));
+		close(r->fd);
+		nm_close(r->d);
+	}
+	return 0;
+}
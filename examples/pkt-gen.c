@@ -48,6 +48,7 @@
 #include <sys/poll.h>
 #include <arpa/inet.h>	/* ntohs */
 #include <sys/sysctl.h>	/* sysctl */
+#include <sys/stat.h>	/* fstat */
 #include <ifaddrs.h>	/* getifaddrs */
 #include <net/ethernet.h>
 #include <netinet/in.h>
@@ -181,6 +182,8 @@ struct glob_arg {
 #define OPT_DUMP	64	/* dump rx/tx traffic */
 #define OPT_MONITOR_TX  128
 #define OPT_MONITOR_RX  256
+#define OPT_MONITOR_COPY 512	/* copy, with snaplen */
+#define OPT_HWTS	1024	/* hardware timestamps, ping/pong */
 	int dev_type;
 #ifndef NO_PCAP
 	pcap_t *p;
@@ -200,9 +203,104 @@ struct glob_arg {
 	int dummy_send;
 	int virt_header;	/* send also the virt_header */
 	int extra_bufs;		/* goes in nr_arg3 */
+	int snaplen;		/* copy monitors, also in nr_arg3 */
+	int filter_id;		/* first hw filter for the rx flow, -1 none */
+	int probe_rate;		/* ping: probes per second, 0 one at a time */
+	int bg_threads;		/* ping: threads sending background traffic */
+	char *replay_file;	/* tx: pcap trace to replay */
+	double replay_speed;	/* 1 original timing, 0 max rate */
+	struct pcap_trace *trace;
 };
 enum dev_type { DEV_NONE, DEV_NETMAP, DEV_PCAP, DEV_TAP };
 
+/*
+ * Latency histogram, HDR style: values (ns) below LAT_SUB have
+ * their own bucket, above that each power of two is split in
+ * LAT_SUB linear buckets, so a value is known within 1/LAT_SUB.
+ * Each pinger only adds to its own histogram, main_thread() takes
+ * the difference with the previous report and merges the threads.
+ */
+#define LAT_SUB_BITS	4
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_BUCKETS	((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t b[LAT_BUCKETS];
+};
+
+static inline u_int
+lat_bucket(uint64_t v)
+{
+	int shift;
+
+	if (v < LAT_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+	return (shift + 1) * LAT_SUB + ((v >> shift) & (LAT_SUB - 1));
+}
+
+/* the middle of bucket i */
+static uint64_t
+lat_value(u_int i)
+{
+	int shift;
+
+	if (i < LAT_SUB)
+		return i;
+	shift = i / LAT_SUB - 1;
+	return ((uint64_t)(LAT_SUB + i % LAT_SUB) << shift) +
+		((1ULL << shift) >> 1);
+}
+
+static inline void
+lat_add(struct lat_hist *h, uint64_t v)
+{
+	h->b[lat_bucket(v)]++;
+	h->count++;
+}
+
+/* the value below which there are pct percent of the samples */
+static uint64_t
+lat_pct(const struct lat_hist *h, double pct)
+{
+	uint64_t want = (uint64_t)(h->count * pct / 100 + 0.5), sum = 0;
+	u_int i;
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		sum += h->b[i];
+		if (sum >= want)
+			return lat_value(i);
+	}
+	return 0;
+}
+
+static void
+lat_print(const char *what, const struct lat_hist *h)
+{
+	int i;
+
+	if (h->count == 0)
+		return;
+	for (i = LAT_BUCKETS - 1; i > 0 && h->b[i] == 0; i--)
+		;
+	D("%s %llu samples, ns p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu",
+		what, (unsigned long long)h->count,
+		(unsigned long long)lat_pct(h, 50),
+		(unsigned long long)lat_pct(h, 90),
+		(unsigned long long)lat_pct(h, 99),
+		(unsigned long long)lat_pct(h, 99.9),
+		(unsigned long long)lat_value(i));
+}
+
+static inline uint64_t
+ts_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
 
 /*
  * Arguments for a new thread. The same structure is used by
@@ -221,6 +319,7 @@ struct targ {
 	pthread_t thread;
 	int affinity;
 
+	struct lat_hist hist;	/* pinger round trip times */
 	struct pkt pkt;
 };
 
@@ -735,6 +834,19 @@ send_packets(struct netmap_ring *ring, struct pkt *pkt, void *frame,
  */
 #define	PAY_OFS	42	/* where in the pkt... */
 
+/*
+ * A probe carries a sequence number, the send time and PING_MAGIC,
+ * so replies to background traffic (-B) are told apart.
+ */
+#define PING_MAGIC	0x6e6d7067	/* "nmpg" */
+
+/*
+ * Send pings and measure the round trip time of the replies.
+ * With -L rate probes go out at a fixed rate, otherwise one at a
+ * time, each on the reply to the previous one (or on a timeout).
+ * Replies can come back on any ring of any pinger thread, the
+ * send time is in the probe.
+ */
 static void *
 pinger_body(void *data)
 {
@@ -745,26 +857,39 @@ pinger_body(void *data)
 	void *frame;
 	int size;
 	uint32_t sent = 0;
-	struct timespec ts, now, last_print;
-	uint32_t count = 0, min = 1000000000, av = 0;
+	struct timespec ts, now;
+	int hwts = targ->g->options & OPT_HWTS;
+	struct netmap_ring *txring =
+		NETMAP_TXRING(nifp, targ->nmd->first_tx_ring);
+	u_int txslot = 0;	/* slot of the last ping */
+	uint64_t period = 0, next = 0;	/* ns, with -L */
+	uint32_t magic = PING_MAGIC;
 
 	frame = &targ->pkt;
 	frame += sizeof(targ->pkt.vh) - targ->g->virt_header;
 	size = targ->g->pkt_size + targ->g->virt_header;
 
-
-	if (targ->g->nthreads > 1) {
-		D("can only ping with 1 thread");
-		return NULL;
+	if (size < 58) {
+		D("packets too short for the probes");
+		goto quit;
 	}
+	if (setaffinity(targ->thread, targ->affinity))
+		goto quit;
 
-	clock_gettime(CLOCK_REALTIME_PRECISE, &last_print);
-	now = last_print;
-	while (n == 0 || (int)sent < n) {
-		struct netmap_ring *ring = NETMAP_TXRING(nifp, 0);
+	clock_gettime(CLOCK_REALTIME_PRECISE, &now);
+	targ->tic = now;
+	if (targ->g->probe_rate > 0) {
+		period = 1000000000ULL / targ->g->probe_rate;
+		next = ts_ns(&now);
+	}
+	while (!targ->cancel && (n == 0 || (int)sent < n)) {
+		struct netmap_ring *ring = txring;
 		struct netmap_slot *slot;
 		char *p;
-	    for (i = 0; i < 1; i++) { /* XXX why the loop for 1 pkt ? */
+		int timeout = 3000;
+
+		if (period && ts_ns(&now) < next)
+			goto wait;	/* not yet */
 		slot = &ring->slot[ring->cur];
 		slot->len = size;
 		p = NETMAP_BUF(ring, slot->buf_idx);
@@ -779,27 +904,42 @@ pinger_body(void *data)
 			tp = (struct tstamp *)(p+46);
 			tp->sec = (uint32_t)ts.tv_sec;
 			tp->nsec = (uint32_t)ts.tv_nsec;
+			bcopy(&magic, p+54, sizeof(magic));
 			sent++;
+			if (hwts)	/* ask for the tx timestamp */
+				slot->flags |= NS_REPORT;
+			txslot = ring->cur;
 			ring->head = ring->cur = nm_ring_next(ring, ring->cur);
 		}
-	    }
-		/* should use a parameter to decide how often to send */
-		if (poll(&pfd, 1, 3000) <= 0) {
+		if (period) {
+			next += period;
+			if (next < ts_ns(&now))	/* too late, do not burst */
+				next = ts_ns(&now) + period;
+		}
+wait:
+		if (period) /* poll() has 1 ms resolution, spin below */
+			timeout = (next - ts_ns(&now)) / 1000000;
+		i = poll(&pfd, 1, timeout);
+		if (i < 0 || (i == 0 && !period)) {
 			D("poll error/timeout on queue %d: %s", targ->me,
 				strerror(errno));
+			clock_gettime(CLOCK_REALTIME_PRECISE, &now);
 			continue;
 		}
+		clock_gettime(CLOCK_REALTIME_PRECISE, &now);
 		/* see what we got back */
-		for (i = targ->nmd->first_tx_ring;
-			i <= targ->nmd->last_tx_ring; i++) {
+		for (i = targ->nmd->first_rx_ring;
+			i <= targ->nmd->last_rx_ring; i++) {
 			ring = NETMAP_RXRING(nifp, i);
 			while (!nm_ring_empty(ring)) {
-				uint32_t seq;
+				uint32_t seq, m;
 				struct tstamp *tp;
 				slot = &ring->slot[ring->cur];
 				p = NETMAP_BUF(ring, slot->buf_idx);
 
-				clock_gettime(CLOCK_REALTIME_PRECISE, &now);
+				bcopy(p+54, &m, sizeof(m));
+				if (slot->len < 58 || m != PING_MAGIC)
+					goto next; /* not a probe */
 				bcopy(p+42, &seq, sizeof(seq));
 				tp = (struct tstamp *)(p+46);
 				ts.tv_sec = (time_t)tp->sec;
@@ -810,33 +950,37 @@ pinger_body(void *data)
 					ts.tv_nsec += 1000000000;
 					ts.tv_sec--;
 				}
-				if (1) D("seq %d/%d delta %d.%09d", seq, sent,
+				if (hwts && seq + 1 == sent) {
+					/* same NIC clock on both sides */
+					uint64_t t1 = NETMAP_RING_TS(ring)[ring->cur];
+					uint64_t t0 = NETMAP_RING_TS(txring)[txslot];
+
+					if (t0 == 0) { /* not collected yet */
+						ioctl(targ->fd, NIOCTXSYNC, NULL);
+						t0 = NETMAP_RING_TS(txring)[txslot];
+					}
+					if (t0 != 0 && t1 > t0) {
+						ts.tv_sec = (t1 - t0) / 1000000000;
+						ts.tv_nsec = (t1 - t0) % 1000000000;
+					} else {
+						RD(1, "no hw timestamps, using sw");
+					}
+				}
+				if (verbose) D("seq %d/%d delta %d.%09d", seq, sent,
 					(int)ts.tv_sec, (int)ts.tv_nsec);
-				if (ts.tv_nsec < (int)min)
-					min = ts.tv_nsec;
-				count ++;
-				av += ts.tv_nsec;
-				ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+				if (ts.tv_sec >= 0)
+					lat_add(&targ->hist, ts_ns(&ts));
 				rx++;
+next:
+				ring->head = ring->cur = nm_ring_next(ring, ring->cur);
 			}
 		}
-		//D("tx %d rx %d", sent, rx);
-		//usleep(100000);
-		ts.tv_sec = now.tv_sec - last_print.tv_sec;
-		ts.tv_nsec = now.tv_nsec - last_print.tv_nsec;
-		if (ts.tv_nsec < 0) {
-			ts.tv_nsec += 1000000000;
-			ts.tv_sec--;
-		}
-		if (ts.tv_sec >= 1) {
-			D("count %d min %d av %d",
-				count, min, av/count);
-			count = 0;
-			av = 0;
-			min = 100000000;
-			last_print = now;
-		}
+		targ->count = rx;
 	}
+	clock_gettime(CLOCK_REALTIME_PRECISE, &targ->toc);
+	targ->completed = 1;
+quit:
+	targ->used = 0;
 	return NULL;
 }
 
@@ -852,12 +996,21 @@ ponger_body(void *data)
 	struct netmap_if *nifp = targ->nmd->nifp;
 	struct netmap_ring *txring, *rxring;
 	int i, rx = 0, sent = 0, n = targ->g->npackets;
+	/* with hw timestamps, measure the turnaround of one reply
+	 * at a time: rx timestamp of the ping, tx slot of the pong.
+	 */
+	int hwts = targ->g->options & OPT_HWTS;
+	uint64_t rxts = 0;
+	u_int txslot = 0;
+	uint32_t count = 0, min = 1000000000, av = 0;
+	struct timespec now, last_print;
 
 	if (targ->g->nthreads > 1) {
 		D("can only reply ping with 1 thread");
 		return NULL;
 	}
 	D("understood ponger %d but don't know how to do it", n);
+	clock_gettime(CLOCK_REALTIME_PRECISE, &last_print);
 	while (n == 0 || sent < n) {
 		uint32_t txcur, txavail;
 //#define BUSYWAIT
@@ -871,6 +1024,31 @@ ponger_body(void *data)
 		}
 #endif
 		txring = NETMAP_TXRING(nifp, 0);
+		if (rxts) {
+			uint64_t txts = NETMAP_RING_TS(txring)[txslot];
+
+			if (txts > rxts) {
+				uint32_t d = (uint32_t)(txts - rxts);
+
+				if (d < min)
+					min = d;
+				av += d;
+				count++;
+				rxts = 0;
+			} else if (txts != 0) {
+				rxts = 0; /* stale, try the next one */
+			}
+		}
+		if (hwts && count) {
+			clock_gettime(CLOCK_REALTIME_PRECISE, &now);
+			if (now.tv_sec > last_print.tv_sec) {
+				D("turnaround count %d min %d av %d",
+					count, min, av/count);
+				count = av = 0;
+				min = 1000000000;
+				last_print = now;
+			}
+		}
 		txcur = txring->cur;
 		txavail = nm_ring_space(txring);
 		/* see what we got back */
@@ -900,6 +1078,13 @@ ponger_body(void *data)
 				dpkt[4] = spkt[1];
 				dpkt[5] = spkt[2];
 				txring->slot[txcur].len = slot->len;
+				if (hwts && rxts == 0) {
+					rxts = NETMAP_RING_TS(rxring)[cur];
+					if (rxts) {
+						txring->slot[txcur].flags |= NS_REPORT;
+						txslot = txcur;
+					}
+				}
 				/* XXX swap src dst mac */
 				txcur = nm_ring_next(txring, txcur);
 				txavail--;
@@ -1130,6 +1315,387 @@ quit:
 	return (NULL);
 }
 
+/*
+ * pcap replay (-P file). The trace is mmapped and indexed once at
+ * startup: each packet goes to the thread chosen by a hash of its
+ * addresses and ports, so a flow always leaves from the same ring
+ * and in order. Threads only walk their own index, copy from the
+ * mapping and prefetch a few packets ahead, so no file access or
+ * parsing is left on the transmit path.
+ * Packets go out at their original time divided by -x speed
+ * (1 original timing, 0 as fast as possible), all threads using
+ * the same time base so the trace keeps its shape across rings.
+ */
+#define PCAP_MAGIC	0xa1b2c3d4	/* usec timestamps */
+#define PCAP_MAGIC_NS	0xa1b23c4d	/* nsec timestamps */
+#define PCAP_LINKTYPE_ETHERNET	1
+#define REPLAY_PREFETCH	4	/* packets ahead */
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_frac;	/* usec or nsec, from the magic */
+	uint32_t caplen;
+	uint32_t len;
+};
+
+struct trace_pkt {
+	uint64_t ts;		/* ns from the first packet */
+	const u_char *data;	/* in the mapping */
+	uint32_t len;
+};
+
+struct pcap_trace {
+	void *map;
+	size_t maplen;
+	u_int npkts;
+	struct trace_pkt *pkts;
+	u_int *idx;		/* packet numbers, grouped by thread */
+	u_int *first;		/* thread i has idx[first[i]..first[i+1]) */
+	uint64_t duration;	/* ns, one pass */
+	uint64_t bytes;
+	struct timespec t0;	/* common start time */
+};
+
+static __inline uint32_t
+pcap_get32(uint32_t v, int swap)
+{
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+/* hash of addresses, protocol and ports, 0 for non ip */
+static uint32_t
+trace_hash(const u_char *p, u_int len)
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+	u_int ofs = 14, l3len = 0, proto = 0, i;
+	uint16_t type;
+
+	if (len < ofs)
+		return 0;
+	type = (p[12] << 8) | p[13];
+	if (type == ETHERTYPE_VLAN && len >= ofs + 4) {
+		type = (p[16] << 8) | p[17];
+		ofs += 4;
+	}
+	if (type == ETHERTYPE_IP && len >= ofs + 20) {
+		proto = p[ofs + 9];
+		l3len = (p[ofs] & 0xf) * 4;
+		if (l3len < 20)
+			l3len = 20;
+		ofs += 12;	/* src and dst */
+		i = 8;
+	} else if (type == ETHERTYPE_IPV6 && len >= ofs + 40) {
+		proto = p[ofs + 6];
+		l3len = 40;
+		ofs += 8;
+		i = 32;
+	} else {
+		return 0;
+	}
+	for (; i > 0; i--, ofs++)
+		h = (h ^ p[ofs]) * 16777619;
+	h = (h ^ proto) * 16777619;
+	ofs += l3len - (type == ETHERTYPE_IP ? 20 : 40);
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+	    len >= ofs + 4) {
+		for (i = 0; i < 4; i++, ofs++)
+			h = (h ^ p[ofs]) * 16777619;
+	}
+	return h;
+}
+
+/*
+ * Map and index the trace for g->nthreads threads. Packets longer
+ * than maxlen (the netmap buffer) are skipped.
+ * Return 0 on success, -1 on error.
+ */
+static int
+trace_load(struct glob_arg *g, const char *name, u_int maxlen)
+{
+	struct pcap_trace *tr;
+	struct pcap_file_hdr fh;
+	struct stat st;
+	const u_char *p, *end;
+	uint64_t ts0 = 0, last = 0;
+	u_int i, n, skipped = 0, *count;
+	int fd, swap, nsec;
+
+	tr = calloc(1, sizeof(*tr));
+	if (tr == NULL)
+		return -1;
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		D("cannot open %s: %s", name, strerror(errno));
+		goto fail;
+	}
+	tr->maplen = st.st_size;
+	if (tr->maplen < sizeof(fh)) {
+		D("%s: too short for a pcap file", name);
+		goto fail;
+	}
+	tr->map = mmap(NULL, tr->maplen, PROT_READ, MAP_PRIVATE
+#ifdef MAP_POPULATE
+		| MAP_POPULATE
+#endif
+		, fd, 0);
+	close(fd);
+	fd = -1;
+	if (tr->map == MAP_FAILED) {
+		D("cannot map %s: %s", name, strerror(errno));
+		tr->map = NULL;
+		goto fail;
+	}
+	madvise(tr->map, tr->maplen, MADV_WILLNEED);
+
+	memcpy(&fh, tr->map, sizeof(fh));
+	swap = (fh.magic == __builtin_bswap32(PCAP_MAGIC) ||
+		fh.magic == __builtin_bswap32(PCAP_MAGIC_NS));
+	fh.magic = pcap_get32(fh.magic, swap);
+	nsec = (fh.magic == PCAP_MAGIC_NS);
+	if (fh.magic != PCAP_MAGIC && !nsec) {
+		D("%s: not a pcap file (magic 0x%x)", name, fh.magic);
+		goto fail;
+	}
+	if (pcap_get32(fh.linktype, swap) != PCAP_LINKTYPE_ETHERNET) {
+		D("%s: linktype %d, only ethernet is supported", name,
+			pcap_get32(fh.linktype, swap));
+		goto fail;
+	}
+
+	/* first pass, count */
+	end = (const u_char *)tr->map + tr->maplen;
+	for (n = 0, p = (const u_char *)tr->map + sizeof(fh);
+	    p + sizeof(struct pcap_rec_hdr) <= end; n++) {
+		struct pcap_rec_hdr rh;
+
+		memcpy(&rh, p, sizeof(rh));
+		p += sizeof(rh) + pcap_get32(rh.caplen, swap);
+	}
+	tr->pkts = calloc(n + 1, sizeof(*tr->pkts));
+	tr->idx = calloc(n + 1, sizeof(*tr->idx));
+	tr->first = calloc(g->nthreads + 1, sizeof(*tr->first));
+	count = calloc(g->nthreads, sizeof(*count));
+	if (!tr->pkts || !tr->idx || !tr->first || !count) {
+		D("no memory to index %d packets", n);
+		free(count);
+		goto fail;
+	}
+
+	/* second pass, timestamps and threads */
+	for (p = (const u_char *)tr->map + sizeof(fh);
+	    p + sizeof(struct pcap_rec_hdr) <= end; ) {
+		struct trace_pkt *t = &tr->pkts[tr->npkts];
+		struct pcap_rec_hdr rh;
+		uint64_t ts;
+
+		memcpy(&rh, p, sizeof(rh));
+		rh.caplen = pcap_get32(rh.caplen, swap);
+		p += sizeof(rh);
+		if (p + rh.caplen > end) {
+			D("%s: truncated at packet %d", name, tr->npkts);
+			break;
+		}
+		ts = (uint64_t)pcap_get32(rh.ts_sec, swap) * 1000000000 +
+			pcap_get32(rh.ts_frac, swap) * (nsec ? 1 : 1000);
+		if (tr->npkts == 0 && skipped == 0)
+			ts0 = ts;
+		/* do not go back in time */
+		last = (ts < ts0 || ts - ts0 < last) ? last : ts - ts0;
+		if (rh.caplen > maxlen || rh.caplen < 14) {
+			skipped++;
+		} else {
+			t->ts = last;
+			t->data = p;
+			t->len = rh.caplen;
+			/* the thread goes in idx[] for now */
+			tr->idx[tr->npkts] = trace_hash(p, rh.caplen) %
+				g->nthreads;
+			count[tr->idx[tr->npkts]]++;
+			tr->bytes += rh.caplen;
+			tr->npkts++;
+		}
+		p += rh.caplen;
+	}
+	if (tr->npkts == 0) {
+		D("%s: no packets to send", name);
+		free(count);
+		goto fail;
+	}
+	tr->duration = last;
+
+	/* group the packets by thread, keeping the trace order */
+	for (i = 0; (int)i < g->nthreads; i++) {
+		tr->first[i + 1] = tr->first[i] + count[i];
+		count[i] = tr->first[i];
+	}
+	{
+		u_int *thr = tr->idx;
+
+		tr->idx = calloc(tr->npkts, sizeof(*tr->idx));
+		if (tr->idx == NULL) {
+			tr->idx = thr;
+			free(count);
+			goto fail;
+		}
+		for (i = 0; i < tr->npkts; i++)
+			tr->idx[count[thr[i]]++] = i;
+		free(thr);
+	}
+	free(count);
+
+	D("%s: %d packets, %llu bytes, %llu.%09llu s, %d skipped", name,
+		tr->npkts, (unsigned long long)tr->bytes,
+		(unsigned long long)(tr->duration / 1000000000),
+		(unsigned long long)(tr->duration % 1000000000), skipped);
+	for (i = 0; (int)i < g->nthreads; i++)
+		D("   thread %d: %d packets", i, tr->first[i + 1] - tr->first[i]);
+	g->trace = tr;
+	return 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	if (tr->map)
+		munmap(tr->map, tr->maplen);
+	free(tr->pkts);
+	free(tr->idx);
+	free(tr->first);
+	free(tr);
+	return -1;
+}
+
+/* when packet k of pass 'pass' is due */
+static __inline struct timespec
+trace_time(struct pcap_trace *tr, const struct trace_pkt *t, u_int pass,
+	double speed)
+{
+	uint64_t ns = (uint64_t)((t->ts + pass * tr->duration) / speed);
+	struct timespec d = { ns / 1000000000, ns % 1000000000 };
+
+	return timespec_add(tr->t0, d);
+}
+
+static void *
+replay_body(void *data)
+{
+	struct targ *targ = (struct targ *) data;
+	struct glob_arg *g = targ->g;
+	struct pcap_trace *tr = g->trace;
+	struct pollfd pfd = { .fd = targ->fd, .events = POLLOUT };
+	struct netmap_if *nifp = targ->nmd->nifp;
+	struct netmap_ring *txring;
+	const u_int *idx = tr->idx + tr->first[targ->me];
+	u_int n = tr->first[targ->me + 1] - tr->first[targ->me];
+	u_int k = 0, pass = 0;
+	int64_t sent = 0, limit = g->npackets / g->nthreads;
+	double speed = g->replay_speed;
+	int i, vh = g->virt_header;
+
+	D("start, fd %d, %d packets", targ->fd, n);
+	if (setaffinity(targ->thread, targ->affinity))
+		goto quit;
+	/* prefetch what we send first */
+	for (i = 0; i < REPLAY_PREFETCH && (u_int)i < n; i++)
+		__builtin_prefetch(tr->pkts[idx[i]].data);
+
+	wait_time(tr->t0);
+	clock_gettime(CLOCK_REALTIME_PRECISE, &targ->tic);
+	/* without -n send the trace once */
+	while (n > 0 && !targ->cancel && (limit == 0 ? pass == 0 : sent < limit)) {
+		struct timespec now = { 0, 0 }, when;
+
+		if (speed > 0) {
+			/* sleep until the next packet is due */
+			when = trace_time(tr, &tr->pkts[idx[k]], pass, speed);
+			now = wait_time(when);
+		}
+		if (poll(&pfd, 1, 2000) <= 0) {
+			if (targ->cancel)
+				break;
+			D("poll error/timeout on queue %d: %s", targ->me,
+				strerror(errno));
+		}
+		if (pfd.revents & POLLERR) {
+			D("poll error");
+			goto quit;
+		}
+		for (i = targ->nmd->first_tx_ring; i <= targ->nmd->last_tx_ring; i++) {
+			u_int cur, last = 0, space, m;
+
+			txring = NETMAP_TXRING(nifp, i);
+			space = nm_ring_space(txring);
+			if (space > (u_int)g->burst)
+				space = g->burst;
+			cur = txring->cur;
+			for (m = 0; m < space; m++) {
+				const struct trace_pkt *t = &tr->pkts[idx[k]];
+				struct netmap_slot *slot = &txring->slot[cur];
+				char *p = NETMAP_BUF(txring, slot->buf_idx);
+
+				if (limit == 0 ? pass > 0 : sent + m >= limit)
+					break;
+				if (speed > 0) {
+					when = trace_time(tr, t, pass, speed);
+					if (!timespec_ge(&now, &when))
+						break;
+				}
+				__builtin_prefetch(
+				    tr->pkts[idx[(k + REPLAY_PREFETCH) % n]].data);
+				if (vh)
+					memset(p, 0, vh);
+				memcpy(p + vh, t->data, t->len);
+				if (g->options & OPT_DUMP)
+					dump_payload(p, t->len + vh, txring, cur);
+				slot->len = t->len + vh;
+				slot->flags = 0;
+				last = cur;
+				cur = nm_ring_next(txring, cur);
+				if (++k == n) {
+					k = 0;
+					pass++;
+				}
+			}
+			if (m > 0) {
+				txring->slot[last].flags |= NS_REPORT;
+				txring->head = txring->cur = cur;
+				sent += m;
+				targ->count = sent;
+			}
+			if (speed > 0)
+				clock_gettime(CLOCK_REALTIME_PRECISE, &now);
+		}
+	}
+	/* flush and wait for the TX queues to be empty. */
+	ioctl(pfd.fd, NIOCTXSYNC, NULL);
+	for (i = targ->nmd->first_tx_ring; i <= targ->nmd->last_tx_ring; i++) {
+		txring = NETMAP_TXRING(nifp, i);
+		while (nm_tx_pending(txring)) {
+			ioctl(pfd.fd, NIOCTXSYNC, NULL);
+			usleep(1); /* wait 1 tick */
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME_PRECISE, &targ->toc);
+	targ->completed = 1;
+	targ->count = sent;
+
+quit:
+	/* reset the ``used`` flag. */
+	targ->used = 0;
+
+	return (NULL);
+}
+
 
 #ifndef NO_PCAP
 static void
@@ -1325,17 +1891,67 @@ usage(void)
 		"\t-c cores		cores to use\n"
 		"\t-p threads		processes/threads to use\n"
 		"\t-T report_ms		milliseconds between reports\n"
-		"\t-P			use libpcap instead of netmap\n"
+		"\t-P file.pcap		tx: replay the trace, once or -n packets\n"
+		"\t-x speed		replay speedup, 1 original timing, 0 max rate\n"
 		"\t-w wait_for_link_time	in seconds\n"
 		"\t-R rate		in packets per second\n"
 		"\t-X			dump payload\n"
 		"\t-H len		add empty virtio-net-header with size 'len'\n"
+		"\t-m tx|rx[:snaplen]	monitor, copy snaplen bytes (0 all)\n"
+		"\t-t			hardware timestamps (ping, pong)\n"
+		"\t-Q filter_id		steer the -s/-d udp flow to the ring\n"
+		"\t-L rate			ping: probes per second, not one at a time\n"
+		"\t-B threads		ping: of the -p threads, send background traffic\n"
 		"",
 		cmd);
 
 	exit(0);
 }
 
+/*
+ * Steer the udp flow given with -s/-d to the ring of thread i,
+ * using hw filter g->filter_id + i. Thread i gets the flow to
+ * destination port port0 + i, so each ring has its own.
+ */
+static void
+install_filter(struct targ *t, int i)
+{
+	struct glob_arg *g = t->g;
+	struct nmreq req;
+
+	bzero(&req, sizeof(req));
+	req.nr_version = NETMAP_API;
+	strncpy(req.nr_name, t->nmd->req.nr_name, sizeof(req.nr_name));
+	req.nr_cmd = NETMAP_RING_FILTER;
+	req.nr_arg1 = NETMAP_FILTER_5TUPLE;
+	req.nr_arg2 = g->filter_id + i;
+	req.nr_arg3 = IPPROTO_UDP;
+	req.nr_offset = htonl(g->src_ip.start);
+	req.nr_tx_slots = htons(g->src_ip.port0);
+	req.nr_memsize = htonl(g->dst_ip.start);
+	req.nr_rx_slots = htons(g->dst_ip.port0 + i);
+	if (ioctl(t->fd, NIOCREGIF, &req))
+		D("cannot install filter %d: %s", req.nr_arg2,
+			strerror(errno));
+	else
+		D("filter %d: udp to port %d on this ring", req.nr_arg2,
+			g->dst_ip.port0 + i);
+}
+
+
+/*
+ * the last bg_threads pingers send background traffic instead,
+ * senders replay the trace if there is one
+ */
+static void *(*thread_body(struct glob_arg *g, int i))(void *)
+{
+	if (g->td_body == pinger_body && i >= g->nthreads - g->bg_threads)
+		return sender_body;
+	if (g->td_body == sender_body && g->trace)
+		return replay_body;
+	return g->td_body;
+}
+
 static void
 start_threads(struct glob_arg *g)
 {
@@ -1346,7 +1962,7 @@ start_threads(struct glob_arg *g)
 	 * Now create the desired number of threads, each one
 	 * using a single descriptor.
  	 */
-	for (i = 0; i < g->nthreads; i++) {
+	for (i = 0; (int)i < g->nthreads; i++) {
 		struct targ *t = &targs[i];
 
 		bzero(t, sizeof(*t));
@@ -1375,6 +1991,13 @@ start_threads(struct glob_arg *g)
 			nmd.req.nr_flags |= NR_MONITOR_TX;
 		if (g->options & OPT_MONITOR_RX)
 			nmd.req.nr_flags |= NR_MONITOR_RX;
+		if (g->options & OPT_MONITOR_COPY) {
+			nmd.req.nr_flags |= NR_MONITOR_COPY;
+			nmd.req.nr_arg3 = g->snaplen;
+			nmd_flags |= NM_OPEN_ARG3;
+		}
+		if (g->options & OPT_HWTS)
+			nmd_flags |= NM_OPEN_HWTS;
 
 		t->nmd = nm_open(t->g->ifname, NULL, nmd_flags |
 			NM_OPEN_IFNAME | NM_OPEN_NO_MMAP, &nmd);
@@ -1384,6 +2007,8 @@ start_threads(struct glob_arg *g)
 			continue;
 		}
 		t->fd = t->nmd->fd;
+		if (g->filter_id >= 0)
+			install_filter(t, i);
 
 	    } else {
 		targs[i].fd = g->main_fd;
@@ -1401,7 +2026,7 @@ start_threads(struct glob_arg *g)
 		/* default, init packets */
 		initialize_packet(t);
 
-		if (pthread_create(&t->thread, NULL, g->td_body, t) == -1) {
+		if (pthread_create(&t->thread, NULL, thread_body(g, i), t) == -1) {
 			D("Unable to create thread %d: %s", i, strerror(errno));
 			t->used = 0;
 		}
@@ -1417,6 +2042,19 @@ main_thread(struct glob_arg *g)
 	uint64_t count = 0;
 	double delta_t;
 	struct timeval tic, toc;
+	/* ping: the histograms at the previous report, and the sum */
+	struct lat_hist *last = NULL, *lat = NULL;
+
+	if (g->td_body == pinger_body) {
+		last = calloc(g->nthreads, sizeof(*last));
+		lat = calloc(1, sizeof(*lat));
+		if (last == NULL || lat == NULL) {
+			D("no memory for the histograms");
+			free(last);
+			free(lat);
+			last = lat = NULL;
+		}
+	}
 
 	gettimeofday(&toc, NULL);
 	for (;;) {
@@ -1444,6 +2082,25 @@ main_thread(struct glob_arg *g)
 			(unsigned long long)pps,
 			(unsigned long long)npkts,
 			(unsigned long long)usec);
+		if (lat) { /* merge what the pingers added since last time */
+			int j;
+
+			bzero(lat, sizeof(*lat));
+			for (i = 0; i < g->nthreads; i++) {
+				struct lat_hist *h = &targs[i].hist;
+
+				if (thread_body(g, i) != pinger_body)
+					continue;
+				for (j = 0; j < LAT_BUCKETS; j++) {
+					uint64_t v = h->b[j];
+
+					lat->b[j] += v - last[i].b[j];
+					lat->count += v - last[i].b[j];
+					last[i].b[j] = v;
+				}
+			}
+			lat_print("rtt", lat);
+		}
 		prev = my_count;
 		toc = now;
 		if (done == g->nthreads)
@@ -1452,7 +2109,9 @@ main_thread(struct glob_arg *g)
 
 	timerclear(&tic);
 	timerclear(&toc);
-	for (i = 0; i < g->nthreads; i++) {
+	if (lat)
+		bzero(lat, sizeof(*lat));
+	for (i = 0; (int)i < g->nthreads; i++) {
 		struct timespec t_tic, t_toc;
 		/*
 		 * Join active threads, unregister interfaces and close
@@ -1470,6 +2129,14 @@ main_thread(struct glob_arg *g)
 		 * how long it took to send all the packets.
 		 */
 		count += targs[i].count;
+		if (lat && thread_body(g, i) == pinger_body) {
+			int j;
+
+			for (j = 0; j < LAT_BUCKETS; j++) {
+				lat->b[j] += targs[i].hist.b[j];
+				lat->count += targs[i].hist.b[j];
+			}
+		}
 		t_tic = timeval2spec(&tic);
 		t_toc = timeval2spec(&toc);
 		if (!timerisset(&tic) || timespec_ge(&targs[i].tic, &t_tic))
@@ -1481,10 +2148,17 @@ main_thread(struct glob_arg *g)
 	/* print output. */
 	timersub(&toc, &tic, &toc);
 	delta_t = toc.tv_sec + 1e-6* toc.tv_usec;
-	if (g->td_body == sender_body)
+	if (g->td_body == sender_body && g->trace)
+		tx_output(count, g->trace->bytes / g->trace->npkts, delta_t);
+	else if (g->td_body == sender_body)
 		tx_output(count, g->pkt_size, delta_t);
 	else
 		rx_output(count, delta_t);
+	if (lat) {
+		lat_print("total rtt", lat);
+		free(lat);
+		free(last);
+	}
 
 	if (g->dev_type == DEV_NETMAP) {
 		munmap(g->nmd->mem, g->nmd->req.nr_memsize);
@@ -1599,9 +2273,11 @@ main(int arc, char **argv)
 	g.frags = 1;
 	g.nmr_config = "";
 	g.virt_header = 0;
+	g.filter_id = -1;
+	g.replay_speed = 1;
 
 	while ( (ch = getopt(arc, argv,
-			"a:f:F:n:i:Il:d:s:D:S:b:c:o:p:T:w:WvR:XC:H:e:m:")) != -1) {
+			"a:f:F:n:i:Il:d:s:D:S:b:c:o:p:T:w:WvR:XC:H:e:m:tQ:L:B:P:x:")) != -1) {
 		struct sf *fn;
 
 		switch(ch) {
@@ -1735,14 +2411,37 @@ main(int arc, char **argv)
 		case 'e': /* extra bufs */
 			g.extra_bufs = atoi(optarg);
 			break;
+		case 't':
+			g.options |= OPT_HWTS;
+			break;
+		case 'Q':
+			g.filter_id = atoi(optarg);
+			break;
+		case 'L':
+			g.probe_rate = atoi(optarg);
+			break;
+		case 'B':
+			g.bg_threads = atoi(optarg);
+			break;
+		case 'P':
+			g.replay_file = optarg;
+			break;
+		case 'x':
+			g.replay_speed = atof(optarg);
+			break;
 		case 'm':
-			if (strcmp(optarg, "tx") == 0) {
+			/* tx or rx, :snaplen for a copy monitor */
+			if (strncmp(optarg, "tx", 2) == 0) {
 				g.options |= OPT_MONITOR_TX;
-			} else if (strcmp(optarg, "rx") == 0) {
+			} else if (strncmp(optarg, "rx", 2) == 0) {
 				g.options |= OPT_MONITOR_RX;
 			} else {
 				D("unrecognized monitor mode %s", optarg);
 			}
+			if (optarg[2] == ':') {
+				g.options |= OPT_MONITOR_COPY;
+				g.snaplen = atoi(optarg + 3);
+			}
 			break;
 		}
 	}
@@ -1792,6 +2491,17 @@ main(int arc, char **argv)
 		usage();
 	}
 
+	if (g.replay_file) {
+		/* replay implies tx, on netmap */
+		if (g.td_body == receiver_body)
+			g.td_body = sender_body;
+		if (g.td_body != sender_body || g.dev_type != DEV_NETMAP ||
+		    g.dummy_send || g.replay_speed < 0) {
+			D("-P needs tx on a netmap port and -x speed >= 0");
+			usage();
+		}
+	}
+
     if (g.dev_type == DEV_TAP) {
 	D("want to use tap %s", g.ifname);
 	g.main_fd = tap_alloc(g.ifname);
@@ -1850,6 +2560,21 @@ main(int arc, char **argv)
 		D("bad nthreads %d, have %d queues", g.nthreads, devqueues);
 		// continue, fail later
 	}
+	if (g.bg_threads < 0 || (g.bg_threads && (g.td_body != pinger_body ||
+	    g.bg_threads >= g.nthreads))) {
+		D("-B %d needs ping and more than that many threads",
+			g.bg_threads);
+		usage();
+	}
+	if (g.replay_file) {
+		struct netmap_ring *ring = NETMAP_TXRING(g.nmd->nifp, 0);
+
+		if (g.nthreads < 1 || trace_load(&g, g.replay_file,
+		    ring->nr_buf_size - g.virt_header) < 0) {
+			D("cannot replay %s", g.replay_file);
+			usage();
+		}
+	}
 
 	if (verbose) {
 		struct netmap_if *nifp = g.nmd->nifp;
@@ -1931,6 +2656,11 @@ out:
 	global_nthreads = g.nthreads;
 	signal(SIGINT, sigint_h);
 
+	if (g.trace) {	/* give all threads time to start */
+		clock_gettime(CLOCK_REALTIME_PRECISE, &g.trace->t0);
+		g.trace->t0.tv_sec++;
+	}
+
 	start_threads(&g);
 	main_thread(&g);
 	return 0;
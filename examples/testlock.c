@@ -717,6 +717,85 @@ test_memcpy(struct targ *t)
 #include <sys/socket.h>	// OSX
 #include <net/if.h>
 #include <net/netmap.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>	/* nm_pkt_copy */
+
+/*
+ * Packet copies, e.g. -l 60, 512, 1514, 9000. The destination walks
+ * over a buffer much larger than the caches, as it happens on a ring.
+ * "pktcopy" uses nm_pkt_copy(), "pktcopy-scalar" is the plain
+ * 64-bit loop at all sizes and "pktcopy-memcpy" is memcpy(),
+ * for comparison.
+ */
+#define PKT_BUFSZ	16384
+#define PKT_SLOTS	4096
+static char pkt_src[PKT_BUFSZ] __attribute__ ((aligned(64)));
+static char pkt_dst[PKT_SLOTS][PKT_BUFSZ] __attribute__ ((aligned(64)));
+
+static int
+pkt_copy_len(struct targ *t)
+{
+	int len = t->g->arg;
+
+	if (len > PKT_BUFSZ)
+		len = PKT_BUFSZ;
+	if (len < 1)
+		len = 1;
+	return len;
+}
+
+void
+test_pktcopy(struct targ *t)
+{
+        int64_t m;
+	int len = pkt_copy_len(t);
+
+	D("nm_pkt_copy %d bytes", len);
+        for (m = 0; m < t->g->m_cycles; m++) {
+		nm_pkt_copy(pkt_src, pkt_dst[m & (PKT_SLOTS - 1)], len);
+		t->count+=1;
+        }
+}
+
+void
+test_pktcopy_scalar(struct targ *t)
+{
+        int64_t m;
+	int len = pkt_copy_len(t);
+
+	D("scalar copy %d bytes", len);
+        for (m = 0; m < t->g->m_cycles; m++) {
+		uint64_t *src = (uint64_t *)pkt_src;
+		uint64_t *dst = (uint64_t *)pkt_dst[m & (PKT_SLOTS - 1)];
+		int l;
+
+		for (l = len; l > 0; l -= 64) {
+			*dst++ = *src++;
+			*dst++ = *src++;
+			*dst++ = *src++;
+			*dst++ = *src++;
+			*dst++ = *src++;
+			*dst++ = *src++;
+			*dst++ = *src++;
+			*dst++ = *src++;
+		}
+		t->count+=1;
+        }
+}
+
+void
+test_pktcopy_memcpy(struct targ *t)
+{
+        int64_t m;
+	int len = pkt_copy_len(t);
+
+	D("memcpy %d bytes", len);
+        for (m = 0; m < t->g->m_cycles; m++) {
+		memcpy(pkt_dst[m & (PKT_SLOTS - 1)], pkt_src, len);
+		t->count+=1;
+        }
+}
+
 void
 test_netmap(struct targ *t)
 {
@@ -760,6 +839,9 @@ struct entry tests[] = {
 	{ test_memcpy, "memcpy", 1000, 100000000 },
 	{ test_fastcopy, "fastcopy", 1000, 100000000 },
 	{ test_asmcopy, "asmcopy", 1000, 100000000 },
+	{ test_pktcopy, "pktcopy", 1000, 100000000 },
+	{ test_pktcopy_scalar, "pktcopy-scalar", 1000, 100000000 },
+	{ test_pktcopy_memcpy, "pktcopy-memcpy", 1000, 100000000 },
 	{ test_add, "add", ONE_MILLION, 100000000 },
 	{ test_nop, "nop", ONE_MILLION, 100000000 },
 	{ test_atomic_add, "atomic-add", ONE_MILLION, 100000000 },
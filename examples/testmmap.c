@@ -660,8 +660,11 @@ do_nmr_dump()
 	if (curr_nmr.nr_flags & NR_MONITOR_RX) {
 		printf(", MONITOR_RX");
 	}
+	if (curr_nmr.nr_flags & NR_JBUF) {
+		printf(", JBUF");
+	}
 	printf("]\n");
-	printf("spare2[0]: %x\n", curr_nmr.spare2[0]);
+	printf("nr_jbuf_size: %u\n", curr_nmr.nr_jbuf_size);
 }
 
 void
@@ -152,6 +152,48 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 
 		break;
 
+	case NETMAP_BDG_VNET_HDR:
+		/* name is port,N with N the header length */
+		{
+			char *p = strrchr(nmr.nr_name, ',');
+
+			if (p == NULL) {
+				D("missing header length in %s", name);
+				error = -1;
+				break;
+			}
+			nmr.nr_arg1 = atoi(p + 1);
+			*p = '\0';
+		}
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1)
+			perror(name);
+		else
+			D("%s: virtio-net header %u bytes", nmr.nr_name,
+			    nmr.nr_arg1);
+		break;
+
+	case NETMAP_BDG_HASHSIZE:
+		/* name is valeX:N, N is the new size (empty to query) */
+		{
+			char *p = strrchr(nmr.nr_name, ':');
+
+			if (p == NULL) {
+				D("invalid bridge name %s", name);
+				error = -1;
+				break;
+			}
+			nmr.nr_arg3 = atoi(p + 1);
+			p[1] = '\0';
+		}
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1)
+			perror(name);
+		else
+			D("%s forwarding table: %u entries", nmr.nr_name,
+			    nmr.nr_arg3);
+		break;
+
 	default: /* GINFO */
 		nmr.nr_cmd = nmr.nr_arg1 = nmr.nr_arg2 = 0;
 		error = ioctl(fd, NIOCGINFO, &nmr);
@@ -186,11 +228,13 @@ usage:
 			"\t-r interface	interface name to be deleted\n"
 			"\t-l list all or specified bridge's interfaces (default)\n"
 			"\t-C string ring/slot setting of an interface creating by -n\n"
+			"\t-H bridge:[N] get or set the forwarding table size of bridge\n"
+			"\t-o port,N set the virtio-net header length of a port or NIC\n"
 			"", command);
 		return 0;
 	}
 
-	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:H:o:")) != -1) {
 		name = optarg; /* default */
 		switch (ch) {
 		default:
@@ -223,6 +267,12 @@ usage:
 		case 'C':
 			nmr_config = strdup(optarg);
 			break;
+		case 'H':
+			nr_cmd = NETMAP_BDG_HASHSIZE;
+			break;
+		case 'o':
+			nr_cmd = NETMAP_BDG_VNET_HDR;
+			break;
 		}
 		if (optind != argc) {
 			// fprintf(stderr, "optind %d argc %d\n", optind, argc);
@@ -506,7 +506,7 @@ char *netmap_buffer_base;	/* also address of an invalid buffer */
 /* user-controlled variables */
 int netmap_verbose;
 
-static int netmap_no_timestamp; /* don't timestamp on rxsync */
+int netmap_no_timestamp; /* don't timestamp on rxsync */
 
 SYSCTL_NODE(_dev, OID_AUTO, netmap, CTLFLAG_RW, 0, "Netmap args");
 SYSCTL_INT(_dev_netmap, OID_AUTO, verbose,
@@ -518,6 +518,9 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, mitigate, CTLFLAG_RW, &netmap_mitigate, 0, "")
 int netmap_no_pendintr = 1;
 SYSCTL_INT(_dev_netmap, OID_AUTO, no_pendintr,
     CTLFLAG_RW, &netmap_no_pendintr, 0, "Always look for new received packets.");
+int netmap_poll_pending = 1;
+SYSCTL_INT(_dev_netmap, OID_AUTO, poll_pending,
+    CTLFLAG_RW, &netmap_poll_pending, 0, "poll() only visits notified rx rings");
 int netmap_txsync_retry = 2;
 SYSCTL_INT(_dev_netmap, OID_AUTO, txsync_retry, CTLFLAG_RW,
     &netmap_txsync_retry, 0 , "Number of txsync loops in bridge's flush.");
@@ -543,6 +546,8 @@ static int netmap_admode = NETMAP_ADMODE_BEST;
 int netmap_generic_mit = 100*1000;   /* Generic mitigation interval in nanoseconds. */
 int netmap_generic_ringsize = 1024;   /* Generic ringsize. */
 int netmap_generic_rings = 1;   /* number of queues in generic. */
+int netmap_generic_rxdirect = 0;   /* generic rx copies in the rx handler. */
+int netmap_generic_txdirect = 0;   /* generic tx skips the qdisc, batches. */
 
 SYSCTL_INT(_dev_netmap, OID_AUTO, flags, CTLFLAG_RW, &netmap_flags, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, fwd, CTLFLAG_RW, &netmap_fwd, 0 , "");
@@ -551,6 +556,38 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, admode, CTLFLAG_RW, &netmap_admode, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit, CTLFLAG_RW, &netmap_generic_mit, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW, &netmap_generic_ringsize, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW, &netmap_generic_rings, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rxdirect, CTLFLAG_RW, &netmap_generic_rxdirect, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txdirect, CTLFLAG_RW, &netmap_generic_txdirect, 0 , "");
+
+/*
+ * Drops and retries of all rings, per ring with NIOCGSTATS.
+ * On linux these are read only module parameters, see
+ * nm_kstat_param_ops in netmap_linux.c.
+ */
+#ifdef __FreeBSD__
+static int
+netmap_sysctl_kstat(SYSCTL_HANDLER_ARGS)
+{
+	uint64_t v = nm_kstat_total(arg2);
+
+	return sysctl_handle_64(oidp, &v, 0, req);
+}
+SYSCTL_PROC(_dev_netmap, OID_AUTO, retry, CTLTYPE_U64 | CTLFLAG_RD,
+    NULL, NM_STAT_RETRY, netmap_sysctl_kstat, "QU",
+    "Retries on full rings");
+SYSCTL_PROC(_dev_netmap, OID_AUTO, drop_nospace, CTLTYPE_U64 | CTLFLAG_RD,
+    NULL, NM_STAT_DROP_NOSPACE, netmap_sysctl_kstat, "QU",
+    "Drops on full rings");
+SYSCTL_PROC(_dev_netmap, OID_AUTO, drop_lookup, CTLTYPE_U64 | CTLFLAG_RD,
+    NULL, NM_STAT_DROP_LOOKUP, netmap_sysctl_kstat, "QU",
+    "Drops by the VALE lookup");
+SYSCTL_PROC(_dev_netmap, OID_AUTO, drop_monitor, CTLTYPE_U64 | CTLFLAG_RD,
+    NULL, NM_STAT_DROP_MONITOR, netmap_sysctl_kstat, "QU",
+    "Drops on full monitors");
+SYSCTL_PROC(_dev_netmap, OID_AUTO, txerr, CTLTYPE_U64 | CTLFLAG_RD,
+    NULL, NM_STAT_TXERR, netmap_sysctl_kstat, "QU",
+    "Frames refused by the NIC");
+#endif /* __FreeBSD__ */
 
 NMG_LOCK_T	netmap_global_lock;
 
@@ -801,6 +838,8 @@ netmap_rxsync_from_host_compat(struct netmap_kring *kring, int flags)
  *                    |          |  } tailroom bytes
  *                    |          | /
  *                    +----------+
+ * na->rx_pending --->|          |    one bit per rx kring
+ *                    +----------+
  *
  * Note: for compatibility, host krings are created even when not needed.
  * The tailroom space is currently used by vale ports for allocating leases.
@@ -809,7 +848,7 @@ netmap_rxsync_from_host_compat(struct netmap_kring *kring, int flags)
 int
 netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 {
-	u_int i, len, ndesc;
+	u_int i, len, ndesc, nlongs;
 	struct netmap_kring *kring;
 	u_int ntx, nrx;
 
@@ -817,7 +856,10 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 	ntx = na->num_tx_rings + 1;
 	nrx = na->num_rx_rings + 1;
 
-	len = (ntx + nrx) * sizeof(struct netmap_kring) + tailroom;
+	tailroom = roundup(tailroom, sizeof(u_long));
+	nlongs = (nrx + NM_LONG_BITS - 1) / NM_LONG_BITS;
+	len = (ntx + nrx) * sizeof(struct netmap_kring) + tailroom +
+		nlongs * sizeof(u_long);
 
 	na->tx_rings = malloc((size_t)len, M_DEVBUF, M_NOWAIT | M_ZERO);
 	if (na->tx_rings == NULL) {
@@ -851,7 +893,9 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 		ND("ktx %s h %d c %d t %d",
 			kring->name, kring->rhead, kring->rcur, kring->rtail);
 		mtx_init(&kring->q_lock, "nm_txq_lock", NULL, MTX_DEF);
+		mtx_init(&kring->nkr_pt_lock, "nm_pt_lock", NULL, MTX_DEF);
 		init_waitqueue_head(&kring->si);
+		nm_notify_timer_init(kring);
 	}
 
 	ndesc = na->num_rx_desc;
@@ -872,12 +916,25 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 		ND("krx %s h %d c %d t %d",
 			kring->name, kring->rhead, kring->rcur, kring->rtail);
 		mtx_init(&kring->q_lock, "nm_rxq_lock", NULL, MTX_DEF);
+		mtx_init(&kring->nkr_pt_lock, "nm_pt_lock", NULL, MTX_DEF);
 		init_waitqueue_head(&kring->si);
+		nm_notify_timer_init(kring);
 	}
 	init_waitqueue_head(&na->tx_si);
 	init_waitqueue_head(&na->rx_si);
 
 	na->tailroom = na->rx_rings + nrx;
+	/* all rings pending, the first poll visits them all */
+	na->rx_pending = (u_long *)((char *)na->tailroom + tailroom);
+	memset(na->rx_pending, 0xff, nlongs * sizeof(u_long));
+
+	for (kring = na->tx_rings; kring != na->tailroom; kring++) {
+		if (nm_kstats_init(kring)) {
+			D("Cannot allocate counters for %s", kring->name);
+			netmap_krings_delete(na);
+			return ENOMEM;
+		}
+	}
 
 	return 0;
 }
@@ -905,11 +962,19 @@ netmap_krings_delete(struct netmap_adapter *na)
 
 	/* we rely on the krings layout described above */
 	for ( ; kring != na->tailroom; kring++) {
+#ifdef WITH_MONITOR
+		if (kring->monitors)
+			free(kring->monitors, M_DEVBUF);
+#endif /* WITH_MONITOR */
+		nm_notify_timer_fini(kring);
+		nm_kstats_fini(kring);
 		mtx_destroy(&kring->q_lock);
+		mtx_destroy(&kring->nkr_pt_lock);
 		netmap_knlist_destroy(&kring->si);
 	}
 	free(na->tx_rings, M_DEVBUF);
 	na->tx_rings = na->rx_rings = na->tailroom = NULL;
+	na->rx_pending = NULL;
 }
 
 
@@ -924,9 +989,16 @@ netmap_hw_krings_delete(struct netmap_adapter *na)
 {
 	struct mbq *q = &na->rx_rings[na->num_rx_rings].rx_queue;
 
+	u_int i;
+
 	ND("destroy sw mbq with len %d", mbq_len(q));
 	mbq_purge(q);
-	mbq_safe_destroy(q);
+	mbq_destroy(q);
+	mbq_mp_destroy(&na->rx_rings[na->num_rx_rings].host_rxq);
+	for (i = 0; i < na->num_tx_rings; i++) {
+		if (na->tx_rings[i].nkr_txmap)
+			free(na->tx_rings[i].nkr_txmap, M_DEVBUF);
+	}
 	netmap_krings_delete(na);
 }
 
@@ -945,6 +1017,22 @@ netmap_do_unregif(struct netmap_priv_d *priv)
 	struct netmap_adapter *na = priv->np_na;
 
 	NMG_LOCK_ASSERT();
+	if (priv->np_kthread) {
+		/* stop syncing before the rings go away */
+		nm_kthread_stop(priv->np_kthread);
+		priv->np_kthread = NULL;
+	}
+#ifdef WITH_PTNETMAP
+	netmap_pt_host_delete(priv);
+#endif /* WITH_PTNETMAP */
+	while (priv->np_nfilters > 0) {
+		/* give the traffic back to the host stack */
+		struct netmap_filter f;
+
+		bzero(&f, sizeof(f));
+		f.nf_id = priv->np_filters[--priv->np_nfilters];
+		na->nm_filter(na, &f, 0);
+	}
 	na->active_fds--;
 	if (na->active_fds <= 0) {	/* last instance */
 
@@ -1131,7 +1219,7 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 /*
  * Send to the NIC rings packets marked NS_FORWARD between
  * kring->nr_hwcur and kring->rhead
- * Called under kring->rx_queue.lock on the sw rx ring,
+ * Called from rxsync_from_host(), with the sw rx ring busy.
  */
 static u_int
 netmap_sw_to_nic(struct netmap_adapter *na)
@@ -1216,8 +1304,10 @@ netmap_txsync_to_host(struct netmap_adapter *na)
 
 /*
  * rxsync backend for packets coming from the host stack.
- * They have been put in kring->rx_queue by netmap_transmit().
- * We protect access to the kring using kring->rx_queue.lock
+ * They have been put in kring->host_rxq by netmap_transmit(),
+ * we move them to kring->rx_queue in one go, then to the ring.
+ * The caller must hold the kring busy (nm_kr_tryget()), so that we
+ * are the only consumer of rx_queue and the only writer of hwcur/hwtail.
  *
  * This routine also does the selrecord if called from the poll handler
  * (we know because td != NULL).
@@ -1241,9 +1331,8 @@ netmap_rxsync_from_host(struct netmap_adapter *na, struct thread *td, void *pwai
 	(void)pwait;	/* disable unused warnings */
 	(void)td;
 
-	mbq_lock(q);
-
 	/* First part: import newly received packets */
+	mbq_mp_drain(&kring->host_rxq, q);
 	n = mbq_len(q);
 	if (n) { /* grab packets from the queue */
 		struct mbuf *m;
@@ -1266,6 +1355,11 @@ netmap_rxsync_from_host(struct netmap_adapter *na, struct thread *td, void *pwai
 			m_freem(m);
 		}
 		kring->nr_hwtail = nm_i;
+		/* keep at most a ring worth for the next round */
+		for (n = 0; mbq_len(q) > lim; n++)
+			m_freem(mbq_dequeue(q));
+		if (n)
+			netmap_kstat_drop(kring, NM_STAT_DROP_NOSPACE, n);
 	}
 
 	/*
@@ -1284,7 +1378,6 @@ netmap_rxsync_from_host(struct netmap_adapter *na, struct thread *td, void *pwai
 	if (kring->rcur == kring->rtail && td) /* no bufs available */
 		OS_selrecord(td, &kring->si);
 
-	mbq_unlock(q);
 	return ret;
 }
 
@@ -1556,6 +1649,9 @@ nm_txsync_prologue(struct netmap_kring *kring)
 			ring->tail, kring->rtail);
 		ring->tail = kring->rtail;
 	}
+	/* the slots after the previous head are new transmissions */
+	if (head != kring->rhead)
+		nm_kstats_count(kring, kring->rhead, head);
 	kring->rhead = head;
 	kring->rcur = cur;
 	return head;
@@ -1680,11 +1776,11 @@ netmap_ring_reinit(struct netmap_kring *kring)
 	for (i = 0; i <= lim; i++) {
 		u_int idx = ring->slot[i].buf_idx;
 		u_int len = ring->slot[i].len;
-		if (idx < 2 || idx >= netmap_total_buffers) {
+		if (idx < 2 || idx >= kring->na->na_lut_objtotal) {
 			RD(5, "bad index at slot %d idx %d len %d ", i, idx, len);
 			ring->slot[i].buf_idx = 0;
 			ring->slot[i].len = 0;
-		} else if (len > NETMAP_BUF_SIZE(kring->na)) {
+		} else if (len > NMB_SIZE(kring->na, &ring->slot[i])) {
 			ring->slot[i].len = 0;
 			RD(5, "bad len at slot %d idx %d len %d", i, idx, len);
 		}
@@ -1727,6 +1823,12 @@ netmap_interp_ringid(struct netmap_priv_d *priv, uint16_t ringid, uint32_t flags
 		}
 		D("deprecated API, old ringid 0x%x -> ringid %x reg %d", ringid, i, reg);
 	}
+	if ((reg == NR_REG_PIPE_MASTER || reg == NR_REG_PIPE_SLAVE) &&
+	    (flags & NR_PIPE_RING_MASK)) {
+		/* a single ring of a pipe group */
+		i = ((flags & NR_PIPE_RING_MASK) >> NR_PIPE_RING_SHIFT) - 1;
+		reg = NR_REG_ONE_NIC;
+	}
 	switch (reg) {
 	case NR_REG_ALL_NIC:
 	case NR_REG_PIPE_MASTER:
@@ -1910,8 +2012,13 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 {
 	struct netmap_if *nifp = NULL;
 	int error;
+	u_int i;
 
 	NMG_LOCK_ASSERT();
+	if ((flags & NR_HWTS) && !(na->na_flags & NAF_HW_TS)) {
+		D("%s: no hardware timestamps", na->name);
+		return EOPNOTSUPP;
+	}
 	/* ring configuration may have changed, fetch from the card */
 	netmap_update_config(na);
 	priv->np_na = na;     /* store the reference */
@@ -1921,6 +2028,30 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 	error = netmap_mem_finalize(na->nm_mem, na);
 	if (error)
 		goto err;
+	if ((flags & NR_JBUF) && (!(na->na_flags & NAF_JBUF) ||
+	    netmap_mem_get_jbufsize(na->nm_mem) == 0)) {
+		D("%s: no large buffers", na->name);
+		error = EOPNOTSUPP;
+		goto err_drop_mem;
+	}
+	if ((flags & NR_JBUF) && na->active_fds > 0) {
+		/* the rings exist already, and keep their buffers */
+		for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
+			if (i < na->num_tx_rings &&
+			    !(na->tx_rings[i].nr_kflags & NKR_JBUF))
+				error = EBUSY;
+		}
+		for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
+			if (i < na->num_rx_rings &&
+			    !(na->rx_rings[i].nr_kflags & NKR_JBUF))
+				error = EBUSY;
+		}
+		if (error) {
+			D("%s: rings already in use with normal buffers",
+			    na->name);
+			goto err_drop_mem;
+		}
+	}
 
 	if (na->active_fds == 0) {
 		/*
@@ -1937,6 +2068,21 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 		if (error)
 			goto err_drop_mem;
 
+		if (flags & NR_JBUF) {
+			/* the bound rings get large buffers, for as
+			 * long as they exist. Host rings keep the
+			 * normal ones, they must fit an mbuf.
+			 */
+			for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
+				if (i < na->num_tx_rings)
+					na->tx_rings[i].nr_kflags |= NKR_JBUF;
+			}
+			for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
+				if (i < na->num_rx_rings)
+					na->rx_rings[i].nr_kflags |= NKR_JBUF;
+			}
+		}
+
 		/* create all missing netmap rings */
 		error = netmap_mem_rings_create(na);
 		if (error)
@@ -1949,6 +2095,25 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 		error = ENOMEM;
 		goto err_del_rings;
 	}
+	/* the kernel thread does not update the pending rx rings */
+	if (!(flags & NR_BUSY_POLL))
+		*(uint32_t *)(uintptr_t)&nifp->ni_flags |= NI_RX_PENDING;
+
+	if (flags & NR_HWTS) {
+		/* start filling the timestamps of the bound NIC rings,
+		 * until the rings are deleted. Host rings have none.
+		 */
+		for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
+			struct netmap_kring *kring = &na->tx_rings[i];
+			if (i < na->num_tx_rings && kring->nkr_ts == NULL)
+				kring->nkr_ts = nm_ring_ts(kring->ring);
+		}
+		for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
+			struct netmap_kring *kring = &na->rx_rings[i];
+			if (i < na->num_rx_rings && kring->nkr_ts == NULL)
+				kring->nkr_ts = nm_ring_ts(kring->ring);
+		}
+	}
 
 	na->active_fds++;
 	if (!nm_netmap_on(na)) {
@@ -1960,6 +2125,8 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 		ND("%p->na_lut == %p", na, na->na_lut);
 		na->na_lut_objtotal = netmap_mem_get_buftotal(na->nm_mem);
 		na->na_lut_objsize = netmap_mem_get_bufsize(na->nm_mem);
+		na->na_lut_jtotal = netmap_mem_get_jbuftotal(na->nm_mem);
+		na->na_lut_jsize = netmap_mem_get_jbufsize(na->nm_mem);
 		error = na->nm_register(na, 1); /* mode on */
 		if (error) 
 			goto err_del_if;
@@ -1979,6 +2146,8 @@ err_del_if:
 	na->na_lut = NULL;
 	na->na_lut_objtotal = 0;
 	na->na_lut_objsize = 0;
+	na->na_lut_jtotal = 0;
+	na->na_lut_jsize = 0;
 	na->active_fds--;
 	netmap_mem_if_delete(na, nifp);
 err_del_rings:
@@ -1996,6 +2165,297 @@ err:
 
 
 
+/*
+ * NETMAP_RING_NOTIFY: set the notification thresholds of the rings
+ * bound to priv (see netmap_notify()). The delay is capped to one
+ * second, the values in use are returned in nmr.
+ */
+/* call with NMG_LOCK held */
+static int
+netmap_set_notify(struct netmap_priv_d *priv, struct nmreq *nmr)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_kring *kring;
+	u_int i, us = nmr->nr_arg3;
+
+	if (priv->np_nifp == NULL || na == NULL)
+		return ENXIO;
+	if (us > 1000000)
+		us = 1000000;
+	for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
+		kring = &na->tx_rings[i];
+		kring->nkr_notify_slots = nmr->nr_arg1 ?
+		    nmr->nr_arg1 : kring->nkr_num_slots;
+		kring->nkr_notify_us = us;
+	}
+	for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
+		kring = &na->rx_rings[i];
+		kring->nkr_notify_slots = nmr->nr_arg1 ?
+		    nmr->nr_arg1 : kring->nkr_num_slots;
+		kring->nkr_notify_us = us;
+	}
+	nmr->nr_arg3 = us;
+	if (netmap_verbose)
+		D("%s: wake up after %d slots or %d us", na->name,
+		    nmr->nr_arg1, us);
+	return 0;
+}
+
+
+/*
+ * NETMAP_RING_FILTER: install or remove a hardware filter that
+ * steers frames to the rx ring bound to priv. The ids of the
+ * filters are remembered in priv, so only the owner can remove
+ * them, and netmap_do_unregif() removes what is left.
+ */
+/* call with NMG_LOCK held */
+static int
+netmap_set_filter(struct netmap_priv_d *priv, struct nmreq *nmr)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_filter f;
+	u_int i;
+	int error;
+
+	if (priv->np_nifp == NULL || na == NULL)
+		return ENXIO;
+	if (na->nm_filter == NULL)
+		return EOPNOTSUPP;
+	if (priv->np_rxqlast != priv->np_rxqfirst + 1 ||
+	    priv->np_rxqfirst >= na->num_rx_rings) {
+		D("%s: bind a single NIC ring to install filters", na->name);
+		return EINVAL;
+	}
+	for (i = 0; i < priv->np_nfilters; i++) {
+		if (priv->np_filters[i] == nmr->nr_arg2)
+			break;
+	}
+	bzero(&f, sizeof(f));
+	f.nf_type = nmr->nr_arg1;
+	f.nf_ring = priv->np_rxqfirst;
+	f.nf_id = nmr->nr_arg2;
+	switch (f.nf_type) {
+	case NETMAP_FILTER_DEL:
+		if (i == priv->np_nfilters)
+			return ENOENT;
+		error = na->nm_filter(na, &f, 0);
+		if (error == 0)
+			priv->np_filters[i] =
+			    priv->np_filters[--priv->np_nfilters];
+		return error;
+
+	case NETMAP_FILTER_5TUPLE:
+		f.nf_proto = nmr->nr_arg3;
+		f.nf_src_ip = nmr->nr_offset;
+		f.nf_dst_ip = nmr->nr_memsize;
+		f.nf_src_port = nmr->nr_tx_slots;
+		f.nf_dst_port = nmr->nr_rx_slots;
+		break;
+
+	case NETMAP_FILTER_MAC:
+		f.nf_mac[0] = nmr->nr_offset >> 24;
+		f.nf_mac[1] = nmr->nr_offset >> 16;
+		f.nf_mac[2] = nmr->nr_offset >> 8;
+		f.nf_mac[3] = nmr->nr_offset;
+		f.nf_mac[4] = nmr->nr_memsize >> 8;
+		f.nf_mac[5] = nmr->nr_memsize;
+		break;
+
+	default:
+		return EINVAL;
+	}
+	/* replacing one of our filters does not take a new entry */
+	if (i == NM_PRIV_FILTERS)
+		return ENOSPC;
+	error = na->nm_filter(na, &f, 1);
+	if (error == 0 && i == priv->np_nfilters)
+		priv->np_filters[priv->np_nfilters++] = f.nf_id;
+	if (netmap_verbose)
+		D("%s: filter %d type %d to ring %d: %d", na->name,
+		    f.nf_id, f.nf_type, f.nf_ring, error);
+	return error;
+}
+
+
+/*
+ * NETMAP_BDG_VNET_HDR on a NIC name: frames in the tx rings start
+ * with a virtio-net header of nr_arg1 bytes, that the driver turns
+ * into checksum/TSO offloadings. Only for NICs with NAF_OFFLOAD_TX,
+ * and only while nobody is using the NIC. A bwrap created later
+ * passes the headers of the VALE ports through (see rx_hdr_len).
+ */
+/* call with NMG_LOCK held */
+static int
+netmap_set_tx_hdr(struct nmreq *nmr)
+{
+	struct netmap_adapter *na;
+	int error;
+
+	if (nmr->nr_arg1 != 0 &&
+	    nmr->nr_arg1 != sizeof(struct nm_vnet_hdr) &&
+	    nmr->nr_arg1 != 12)
+		return EINVAL;
+	error = netmap_get_na(nmr, &na, 0 /* don't create */);
+	if (error)
+		return error;
+	if (!(na->na_flags & NAF_OFFLOAD_TX)) {
+		error = EOPNOTSUPP;
+	} else if (na->tx_rings != NULL) {
+		error = EBUSY;
+	} else {
+		na->tx_hdr_len = nmr->nr_arg1;
+		D("%s: vnet_hdr_len %d on the tx rings", na->name,
+		    na->tx_hdr_len);
+	}
+	netmap_adapter_put(na);
+	return error;
+}
+
+/*
+ * Busy poll mode (NR_BUSY_POLL). A kernel thread runs this function
+ * in a loop, doing on the rings bound to priv what NIOCTXSYNC and
+ * NIOCRXSYNC would do. txsync is skipped on the rings where there
+ * is nothing new to send or reclaim. As with the ioctls, the thread
+ * only looks at head/cur, and only updates tail, so the application
+ * can spin on the shared rings without system calls.
+ */
+static void
+netmap_busy_poll(void *arg)
+{
+	struct netmap_priv_d *priv = arg;
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_kring *kring;
+	u_int i;
+
+	if (na == NULL || !nm_netmap_on(na))
+		return;
+	mb(); /* make sure following reads are not from cache */
+
+	for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
+		kring = &na->tx_rings[i];
+		if (kring->ring->head == kring->nr_hwcur &&
+		    kring->nr_hwtail == nm_prev(kring->nr_hwcur,
+				kring->nkr_num_slots - 1))
+			continue;
+		if (nm_kr_tryget(kring))
+			continue;
+		if (nm_txsync_prologue(kring) >= kring->nkr_num_slots) {
+			netmap_ring_reinit(kring);
+		} else if (kring->nm_sync(kring, NAF_FORCE_RECLAIM) == 0 &&
+			   kring->rcur != kring->rtail) {
+			/* notify other listeners */
+			na->nm_notify(na, i, NR_TX, 0);
+		}
+		nm_kr_put(kring);
+	}
+
+	for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
+		u_int tail;
+
+		kring = &na->rx_rings[i];
+		if (nm_kr_tryget(kring))
+			continue;
+		tail = kring->nr_hwtail;
+		if (kring->nm_sync(kring, 0) == 0 &&
+		    kring->nr_hwtail != tail &&
+		    (netmap_no_timestamp == 0 ||
+		     kring->ring->flags & NR_TIMESTAMP)) {
+			microtime(&kring->ring->ts);
+		}
+		nm_kr_put(kring);
+	}
+}
+
+
+/*
+ * NIOCGSTATS: return the counters of one of the rings of the port
+ * bound to priv. Any ring can be read, not only the bound ones.
+ */
+static int
+netmap_get_stats(struct netmap_priv_d *priv, struct nm_stats_req *req)
+{
+	struct netmap_adapter *na;
+	struct netmap_kring *kring;
+	u_int n;
+
+	NMG_LOCK();
+	na = priv->np_na;
+	if (priv->np_nifp == NULL || na == NULL) {
+		NMG_UNLOCK();
+		return ENXIO;
+	}
+	/* the host rings are always there, after the hw rings */
+	n = req->ns_tx ? na->num_tx_rings : na->num_rx_rings;
+	if (req->ns_ring > n) {
+		NMG_UNLOCK();
+		return EINVAL;
+	}
+	kring = (req->ns_tx ? na->tx_rings : na->rx_rings) + req->ns_ring;
+	bzero(req->ns_stat, sizeof(req->ns_stat));
+	nm_kstats_fetch(kring, req->ns_stat);
+	NMG_UNLOCK();
+	return 0;
+}
+
+
+/*
+ * na->rx_pending lets netmap_poll() skip the rx rings that were
+ * empty at its last visit and have not been notified since.
+ * netmap_notify() sets the bit of a ring, netmap_poll() clears it
+ * before a sync and sets it again if the ring is not empty, so a
+ * ring with slots for userspace is never skipped.
+ * With dev.netmap.poll_pending=0 (or no bitmap) all rings are visited.
+ */
+static inline u_int
+nm_rx_pending_next(struct netmap_adapter *na, u_int i, u_int lim)
+{
+	u_long w;
+
+	if (na->rx_pending == NULL || !netmap_poll_pending)
+		return i;
+	while (i < lim) {
+		w = na->rx_pending[i / NM_LONG_BITS] >> (i % NM_LONG_BITS);
+		if (w)
+			return i + __builtin_ctzl(w);
+		i = (i / NM_LONG_BITS + 1) * NM_LONG_BITS;
+	}
+	return lim;
+}
+
+static inline void
+nm_rx_pending_set(struct netmap_adapter *na, u_int i)
+{
+	if (na->rx_pending)
+		NM_BIT_SET(na->rx_pending, i);
+}
+
+static inline void
+nm_rx_pending_clear(struct netmap_adapter *na, u_int i)
+{
+	if (na->rx_pending && netmap_poll_pending)
+		NM_BIT_CLEAR(na->rx_pending, i);
+}
+
+/*
+ * Copy the bitmap to the netmap_if, so that nm_dispatch() and
+ * friends can also skip the rx rings (see NI_RX_PENDING).
+ * Rings notified later show up after the next sync.
+ */
+static void
+netmap_rx_pending_export(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	uint32_t *dst = NETMAP_IF_RX_PENDING(priv->np_nifp);
+	u_int i, n = na->num_rx_rings + 1;
+
+	if (na->rx_pending == NULL)
+		return;
+	for (i = 0; i < n; i += 32)
+		dst[i / 32] = (uint32_t)(na->rx_pending[i / NM_LONG_BITS] >>
+			(i % NM_LONG_BITS));
+}
+
+
 /*
  * ioctl(2) support for the "netmap" device.
  *
@@ -2005,6 +2465,7 @@ err:
  * - NIOCREGIF
  * - NIOCTXSYNC
  * - NIOCRXSYNC
+ * - NIOCGSTATS
  *
  * Return 0 on success, errno otherwise.
  */
@@ -2058,7 +2519,7 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 		do {
 			/* memsize is always valid */
 			struct netmap_mem_d *nmd = &nm_mem;
-			u_int memflags;
+			u_int memflags, jbufsize;
 
 			if (nmr->nr_name[0] != '\0') {
 				/* get a refcount */
@@ -2069,11 +2530,15 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 			}
 
 			error = netmap_mem_get_info(nmd, &nmr->nr_memsize, &memflags,
-				&nmr->nr_arg2);
+				&nmr->nr_arg2, &jbufsize);
 			if (error)
 				break;
+			nmr->nr_jbuf_size = jbufsize;
+			nmr->nr_node = netmap_mem_get_node(nmd);
 			if (na == NULL) /* only memory info */
 				break;
+			if (nmr->nr_node < 0 && na->pdev)
+				nmr->nr_node = nm_numa_node(na->pdev);
 			nmr->nr_offset = 0;
 			nmr->nr_rx_slots = nmr->nr_tx_slots = 0;
 			netmap_update_config(na);
@@ -2089,12 +2554,43 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 	case NIOCREGIF:
 		/* possibly attach/detach NIC and VALE switch */
 		i = nmr->nr_cmd;
-		if (i == NETMAP_BDG_ATTACH || i == NETMAP_BDG_DETACH
+		if (i == NETMAP_BDG_VNET_HDR
+#ifdef WITH_VALE
+		    && strncmp(nmr->nr_name, NM_NAME, strlen(NM_NAME))
+#endif /* WITH_VALE */
+		    ) {
+			/* a NIC, not a switch port */
+			NMG_LOCK();
+			error = netmap_set_tx_hdr(nmr);
+			NMG_UNLOCK();
+			break;
+		} else if (i == NETMAP_BDG_ATTACH || i == NETMAP_BDG_DETACH
 				|| i == NETMAP_BDG_VNET_HDR
 				|| i == NETMAP_BDG_NEWIF
-				|| i == NETMAP_BDG_DELIF) {
+				|| i == NETMAP_BDG_DELIF
+				|| i == NETMAP_BDG_HASHSIZE) {
 			error = netmap_bdg_ctl(nmr, NULL);
 			break;
+		} else if (i == NETMAP_RING_NOTIFY) {
+			NMG_LOCK();
+			error = netmap_set_notify(priv, nmr);
+			NMG_UNLOCK();
+			break;
+		} else if (i == NETMAP_RING_FILTER) {
+			NMG_LOCK();
+			error = netmap_set_filter(priv, nmr);
+			NMG_UNLOCK();
+			break;
+		} else if (i == NETMAP_PT_HOST_CREATE ||
+			   i == NETMAP_PT_HOST_DELETE) {
+#ifdef WITH_PTNETMAP
+			NMG_LOCK();
+			error = netmap_pt_host_ctl(priv, nmr);
+			NMG_UNLOCK();
+#else
+			error = EOPNOTSUPP;
+#endif /* WITH_PTNETMAP */
+			break;
 		} else if (i != 0) {
 			D("nr_cmd must be 0 not %d", i);
 			error = EINVAL;
@@ -2104,7 +2600,7 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 		/* protect access to priv from concurrent NIOCREGIF */
 		NMG_LOCK();
 		do {
-			u_int memflags;
+			u_int memflags, jbufsize;
 
 			if (priv->np_nifp != NULL) {	/* thread already registered */
 				error = EBUSY;
@@ -2133,12 +2629,16 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 			nmr->nr_rx_slots = na->num_rx_desc;
 			nmr->nr_tx_slots = na->num_tx_desc;
 			error = netmap_mem_get_info(na->nm_mem, &nmr->nr_memsize, &memflags,
-				&nmr->nr_arg2);
+				&nmr->nr_arg2, &jbufsize);
 			if (error) {
 				netmap_do_unregif(priv);
 				netmap_adapter_put(na);
 				break;
 			}
+			nmr->nr_jbuf_size = jbufsize;
+			nmr->nr_node = netmap_mem_get_node(na->nm_mem);
+			if (nmr->nr_node < 0 && na->pdev)
+				nmr->nr_node = nm_numa_node(na->pdev);
 			if (memflags & NETMAP_MEM_PRIVATE) {
 				*(uint32_t *)(uintptr_t)&nifp->ni_flags |= NI_PRIV_MEM;
 			}
@@ -2154,6 +2654,22 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 				D("got %d extra buffers", nmr->nr_arg3);
 			}
 			nmr->nr_offset = netmap_mem_if_offset(na->nm_mem, nifp);
+
+			if (priv->np_flags & NR_BUSY_POLL) {
+				char name[32];
+
+				snprintf(name, sizeof(name), "nm_poll:%s",
+				    na->name);
+				priv->np_kthread = nm_kthread_start(
+				    netmap_busy_poll, priv, name);
+				if (priv->np_kthread == NULL) {
+					netmap_do_unregif(priv);
+					netmap_adapter_put(na);
+					error = ENOMEM;
+					break;
+				}
+				nm_kthread_wakeup(priv->np_kthread);
+			}
 		} while (0);
 		NMG_UNLOCK();
 		break;
@@ -2217,7 +2733,13 @@ netmap_ioctl(struct cdev *dev, u_long cmd, caddr_t data,
 			}
 			nm_kr_put(kring);
 		}
+		if (cmd == NIOCRXSYNC)
+			netmap_rx_pending_export(priv);
+
+		break;
 
+	case NIOCGSTATS:
+		error = netmap_get_stats(priv, (struct nm_stats_req *)data);
 		break;
 
 #ifdef WITH_VALE
@@ -2288,6 +2810,7 @@ netmap_poll(struct cdev *dev, int events, struct thread *td)
 	struct netmap_adapter *na;
 	struct netmap_kring *kring;
 	u_int i, check_all_tx, check_all_rx, want_tx, want_rx, revents = 0;
+	u_int lim;
 	struct mbq q;		/* packets from hw queues to host stack */
 	void *pwait = dev;	/* linux compatibility */
 	int is_kevent = 0;
@@ -2355,7 +2878,9 @@ netmap_poll(struct cdev *dev, int events, struct thread *td)
 	 * slots available. If this fails, then lock and call the sync
 	 * routines.
 	 */
-	for (i = priv->np_rxqfirst; want_rx && i < priv->np_rxqlast; i++) {
+	lim = priv->np_rxqlast;
+	for (i = nm_rx_pending_next(na, priv->np_rxqfirst, lim);
+	    want_rx && i < lim; i = nm_rx_pending_next(na, i + 1, lim)) {
 		kring = &na->rx_rings[i];
 		/* XXX compare ring->cur and kring->tail */
 		if (!nm_ring_empty(kring->ring)) {
@@ -2443,12 +2968,17 @@ flush_tx:
 		int send_down = 0; /* transparent mode */
 		/* two rounds here for race avoidance */
 do_retry_rx:
-		for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
+		lim = priv->np_rxqlast;
+		for (i = nm_rx_pending_next(na, priv->np_rxqfirst, lim);
+		    i < lim; i = nm_rx_pending_next(na, i + 1, lim)) {
 			int found = 0;
 
 			kring = &na->rx_rings[i];
 
+			/* before the sync, a notify from now on sets it */
+			nm_rx_pending_clear(na, i);
 			if (nm_kr_tryget(kring)) {
+				nm_rx_pending_set(na, i);
 				if (netmap_verbose)
 					RD(2, "%p lost race on rxring %d, ok",
 					    priv, i);
@@ -2479,6 +3009,7 @@ do_retry_rx:
 			if (found) {
 				revents |= want_rx;
 				retry_rx = 0;
+				nm_rx_pending_set(na, i);
 				na->nm_notify(na, i, NR_RX, 0);
 			}
 		}
@@ -2489,8 +3020,12 @@ do_retry_rx:
 			if (check_all_rx
 			    && (netmap_fwd || kring->ring->flags & NR_FORWARD)) {
 				/* XXX fix to use kring fields */
-				if (nm_ring_empty(kring->ring))
+				/* skip it if an rxsync is using the kring */
+				if (nm_ring_empty(kring->ring) &&
+				    nm_kr_tryget(kring) == 0) {
 					send_down = netmap_rxsync_from_host(na, td, dev);
+					nm_kr_put(kring);
+				}
 				if (!nm_ring_empty(kring->ring))
 					revents |= want_rx;
 			}
@@ -2523,6 +3058,9 @@ do_retry_rx:
 	if (q.head && na->ifp != NULL)
 		netmap_send_up(na->ifp, &q);
 
+	if (events & (POLLIN | POLLRDNORM))
+		netmap_rx_pending_export(priv);
+
 	return (revents);
 }
 
@@ -2531,29 +3069,66 @@ do_retry_rx:
 
 static int netmap_hw_krings_create(struct netmap_adapter *);
 
-/* default notify callback */
-static int
-netmap_notify(struct netmap_adapter *na, u_int n_ring,
-	enum txrx tx, int flags)
+static void
+netmap_notify_wakeup(struct netmap_adapter *na, struct netmap_kring *kring,
+	enum txrx tx)
 {
-	struct netmap_kring *kring;
-
+	NM_KSTAT_ADD(kring, NM_STAT_NOTIFY, 1);
+#ifdef WITH_PTNETMAP
+	if (kring->nkr_pt != NULL)	/* a guest syncs it, look again locked */
+		netmap_pt_notify(kring);
+#endif /* WITH_PTNETMAP */
+	OS_selwakeup(&kring->si, PI_NET);
+	/* optimization: avoid a wake up on the global
+	 * queue if nobody has registered for more
+	 * than one ring
+	 */
 	if (tx == NR_TX) {
-		kring = na->tx_rings + n_ring;
-		OS_selwakeup(&kring->si, PI_NET);
-		/* optimization: avoid a wake up on the global
-		 * queue if nobody has registered for more
-		 * than one ring
-		 */
 		if (na->tx_si_users > 0)
 			OS_selwakeup(&na->tx_si, PI_NET);
 	} else {
-		kring = na->rx_rings + n_ring;
-		OS_selwakeup(&kring->si, PI_NET);
-		/* optimization: same as above */
 		if (na->rx_si_users > 0)
 			OS_selwakeup(&na->rx_si, PI_NET);
 	}
+}
+
+/* a wakeup held back by netmap_notify() is due */
+void
+netmap_notify_timeout(struct netmap_kring *kring)
+{
+	struct netmap_adapter *na = kring->na;
+
+	NM_ATOMIC_CLEAR(&kring->nkr_notify_armed);
+	netmap_notify_wakeup(na, kring,
+	    kring < na->rx_rings ? NR_TX : NR_RX);
+}
+
+/* default notify callback */
+static int
+netmap_notify(struct netmap_adapter *na, u_int n_ring,
+	enum txrx tx, int flags)
+{
+	struct netmap_kring *kring;
+
+	kring = (tx == NR_TX ? na->tx_rings : na->rx_rings) + n_ring;
+	if (tx == NR_RX)	/* also when the wakeup is held back */
+		nm_rx_pending_set(na, n_ring);
+	if (kring->nkr_notify_us) {
+		/* slots the reader finds on its next sync */
+		int ready = kring->nr_hwtail - kring->rhead;
+
+		if (ready < 0)
+			ready += kring->nkr_num_slots;
+		if ((u_int)ready < kring->nkr_notify_slots) {
+			/* hold it back, the timer wakes up the reader */
+			if (!NM_ATOMIC_TEST_AND_SET(&kring->nkr_notify_armed))
+				nm_notify_timer_arm(kring, kring->nkr_notify_us);
+			return 0;
+		}
+		if (nm_notify_timer_cancel(kring))
+			NM_ATOMIC_CLEAR(&kring->nkr_notify_armed);
+	}
+	netmap_notify_wakeup(na, kring, tx);
 	return 0;
 }
 
@@ -2604,8 +3179,8 @@ netmap_attach_common(struct netmap_adapter *na)
 	na->active_fds = 0;
 
 	if (na->nm_mem == NULL)
-		/* use the global allocator */
-		na->nm_mem = &nm_mem;
+		/* use the global allocator (possibly, the NUMA local one) */
+		na->nm_mem = netmap_mem_global_get(na);
 #ifdef WITH_VALE
 	if (na->nm_bdg_attach == NULL)
 		/* no special nm_bdg_attach callback. On VALE
@@ -2762,12 +3337,33 @@ int
 netmap_hw_krings_create(struct netmap_adapter *na)
 {
 	int ret = netmap_krings_create(na, 0);
-	if (ret == 0) {
-		/* initialize the mbq for the sw rx ring */
-		mbq_safe_init(&na->rx_rings[na->num_rx_rings].rx_queue);
-		ND("initialized sw rx queue %d", na->num_rx_rings);
+	struct netmap_kring *hkring;
+	u_int i;
+
+	if (ret)
+		return ret;
+	/* initialize the queues for the sw rx ring */
+	hkring = &na->rx_rings[na->num_rx_rings];
+	mbq_init(&hkring->rx_queue);
+	if (mbq_mp_init(&hkring->host_rxq, hkring->nkr_num_slots)) {
+		netmap_krings_delete(na);
+		return ENOMEM;
 	}
-	return ret;
+	ND("initialized sw rx queue %d", na->num_rx_rings);
+	if (na->tx_hdr_len == 0)
+		return 0;
+	/* descriptor map for the tx offloadings */
+	for (i = 0; i < na->num_tx_rings; i++) {
+		struct netmap_kring *kring = &na->tx_rings[i];
+
+		kring->nkr_txmap = malloc(kring->nkr_num_slots *
+		    sizeof(*kring->nkr_txmap), M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (kring->nkr_txmap == NULL) {
+			netmap_hw_krings_delete(na);
+			return ENOMEM;
+		}
+	}
+	return 0;
 }
 
 
@@ -2803,7 +3399,8 @@ netmap_detach(struct ifnet *ifp)
  * Intercept packets from the network stack and pass them
  * to netmap as incoming packets on the 'software' ring.
  *
- * We only store packets in a bounded mbq and then copy them
+ * We only store packets in a bounded per-cpu queue (no locks, so
+ * CPUs sending to the host ring do not serialize) and then copy them
  * in the relevant rxsync routine.
  *
  * We rely on the OS to make sure that the ifp and na do not go
@@ -2818,8 +3415,6 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	struct netmap_kring *kring;
 	u_int len = MBUF_LEN(m);
 	u_int error = ENOBUFS;
-	struct mbq *q;
-	int space;
 
 	// XXX [Linux] we do not need this lock
 	// if we follow the down/configure/up protocol -gl
@@ -2832,7 +3427,6 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	}
 
 	kring = &na->rx_rings[na->num_rx_rings];
-	q = &kring->rx_queue;
 
 	// XXX reconsider long packets if we handle fragments
 	if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
@@ -2841,29 +3435,19 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 		goto done;
 	}
 
-	/* protect against rxsync_from_host(), netmap_sw_to_nic()
-	 * and maybe other instances of netmap_transmit (the latter
-	 * not possible on Linux).
-	 * Also avoid overflowing the queue.
+	/* Each cpu may queue up to a ring worth of packets, racing
+	 * with other instances of netmap_transmit() and with
+	 * rxsync_from_host(), which drops what does not fit the ring.
 	 */
-	mbq_lock(q);
-
-        space = kring->nr_hwtail - kring->nr_hwcur;
-        if (space < 0)
-                space += kring->nkr_num_slots;
-	if (space + mbq_len(q) >= kring->nkr_num_slots - 1) { // XXX
-		RD(10, "%s full hwcur %d hwtail %d qlen %d len %d m %p",
-			na->name, kring->nr_hwcur, kring->nr_hwtail, mbq_len(q),
-			len, m);
+	if (mbq_mp_enqueue(&kring->host_rxq, m)) {
+		RD(10, "%s full hwcur %d hwtail %d len %d m %p",
+			na->name, kring->nr_hwcur, kring->nr_hwtail, len, m);
+		netmap_kstat_drop(kring, NM_STAT_DROP_NOSPACE, 1);
 	} else {
-		mbq_enqueue(q, m);
-		ND(10, "%s %d bufs in queue len %d m %p",
-			na->name, mbq_len(q), len, m);
-		/* notify outside the lock */
+		ND(10, "%s queued len %d m %p", na->name, len, m);
 		m = NULL;
 		error = 0;
 	}
-	mbq_unlock(q);
 
 done:
 	if (m)
@@ -3058,6 +3642,7 @@ netmap_fini(void)
 	if (netmap_dev)
 		destroy_dev(netmap_dev);
 	netmap_mem_fini();
+	nm_kstat_totals_fini();
 	NMG_LOCK_DESTROY();
 	printf("netmap: unloaded module.\n");
 }
@@ -3070,6 +3655,10 @@ netmap_init(void)
 
 	NMG_LOCK_INIT();
 
+	error = nm_kstat_totals_init();
+	if (error != 0)
+		goto fail;
+
 	error = netmap_mem_init();
 	if (error != 0)
 		goto fail;
@@ -32,6 +32,11 @@
 #include <sys/poll.h>  /* POLLIN, POLLOUT */
 #include <sys/kernel.h> /* types used in module initialization */
 #include <sys/conf.h>	/* DEV_MODULE */
+#include <sys/kthread.h> /* kthread_add() */
+#include <sys/proc.h>	/* td_tid */
+#include <sys/cpuset.h> /* cpuset_setthread() */
+#include <sys/smp.h>	/* mp_ncpus */
+#include <sys/callout.h>
 #include <sys/endian.h>
 
 #include <sys/rwlock.h>
@@ -64,21 +69,49 @@
 
 /* ======================== FREEBSD-SPECIFIC ROUTINES ================== */
 
+/*
+ * Sum 32-bit words in native byte order into a 64-bit accumulator,
+ * four at a time, and fix the byte order at the end (RFC 1071).
+ * The data can be unaligned (e.g. a TCP header after the ethernet
+ * header), memcpy() turns into plain loads where that is allowed.
+ */
 rawsum_t
 nm_csum_raw(uint8_t *data, size_t len, rawsum_t cur_sum)
 {
-	/* TODO XXX please use the FreeBSD implementation for this. */
-	uint16_t *words = (uint16_t *)data;
-	int nw = len / 2;
-	int i;
+	uint64_t sum = 0;
+	uint32_t w[4];
+	uint16_t h;
 
-	for (i = 0; i < nw; i++)
-		cur_sum += be16toh(words[i]);
-
-	if (len & 1)
-		cur_sum += (data[len-1] << 8);
-
-	return cur_sum;
+	for (; len >= sizeof(w); data += sizeof(w), len -= sizeof(w)) {
+		memcpy(w, data, sizeof(w));
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+	}
+	for (; len >= 4; data += 4, len -= 4) {
+		memcpy(w, data, 4);
+		sum += w[0];
+	}
+	if (len >= 2) {
+		memcpy(&h, data, 2);
+		sum += h;
+		data += 2;
+		len -= 2;
+	}
+	if (len) {
+#if _BYTE_ORDER == _LITTLE_ENDIAN
+		sum += data[0];
+#else
+		sum += data[0] << 8;
+#endif
+	}
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	/* the callers keep big endian words in host order */
+	sum = be16toh((uint16_t)sum);
+
+	return nm_csum_add(cur_sum, (rawsum_t)sum, 0);
 }
 
 /* Fold a raw checksum: 'cur_sum' is in host byte order, while the
@@ -212,7 +245,7 @@ netmap_catch_tx(struct netmap_generic_adapter *gna, int enable)
  */
 int
 generic_xmit_frame(struct ifnet *ifp, struct mbuf *m,
-	void *addr, u_int len, u_int ring_nr)
+	void *addr, u_int len, u_int ring_nr, __unused int more)
 {
 	int ret;
 
@@ -315,6 +348,208 @@ netmap_mitigation_cleanup(struct nm_generic_mit *mit)
 	ND("called");
 }
 
+/*
+ * Kernel threads.
+ * nt_stop is set to 1 by nm_kthread_stop(), and to 2 by the
+ * thread when it is about to exit.
+ * nt_pending is set by nm_kthread_wakeup(), under nt_mtx.
+ */
+struct nm_kthread {
+	struct thread *nt_td;
+	nm_kthread_worker_fn_t nt_worker;
+	void *nt_arg;
+	volatile int nt_stop;
+	struct mtx nt_mtx;
+	int nt_pending;
+};
+
+static void
+nm_kthread_main(void *data)
+{
+	struct nm_kthread *t = data;
+
+	/* the first wakeup starts the worker, nt_pending stays set */
+	mtx_lock(&t->nt_mtx);
+	while (!t->nt_pending && !t->nt_stop)
+		msleep(&t->nt_pending, &t->nt_mtx, 0, "nmkstart", 0);
+	mtx_unlock(&t->nt_mtx);
+	while (!t->nt_stop) {
+		t->nt_worker(t->nt_arg);
+		maybe_yield();
+	}
+	t->nt_stop = 2;
+	wakeup(t);
+	kthread_exit();
+}
+
+struct nm_kthread *
+nm_kthread_start(nm_kthread_worker_fn_t worker, void *arg, const char *name)
+{
+	struct nm_kthread *t;
+	int error;
+
+	t = malloc(sizeof(*t), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (t == NULL)
+		return NULL;
+	t->nt_worker = worker;
+	t->nt_arg = arg;
+	mtx_init(&t->nt_mtx, "nm_kthread", NULL, MTX_DEF);
+	error = kthread_add(nm_kthread_main, t, NULL, &t->nt_td,
+	    0, 0, "%s", name);
+	if (error) {
+		D("cannot start %s: %d", name, error);
+		mtx_destroy(&t->nt_mtx);
+		free(t, M_DEVBUF);
+		return NULL;
+	}
+	return t;
+}
+
+void
+nm_kthread_stop(struct nm_kthread *t)
+{
+	mtx_lock(&t->nt_mtx);
+	t->nt_stop = 1;
+	wakeup(&t->nt_pending);
+	mtx_unlock(&t->nt_mtx);
+	while (t->nt_stop != 2)
+		tsleep(t, 0, "nmkstop", hz / 100 + 1);
+	mtx_destroy(&t->nt_mtx);
+	free(t, M_DEVBUF);
+}
+
+void
+nm_kthread_wait(struct nm_kthread *t)
+{
+	mtx_lock(&t->nt_mtx);
+	while (!t->nt_pending && !t->nt_stop)
+		msleep(&t->nt_pending, &t->nt_mtx, 0, "nmkwait", 0);
+	t->nt_pending = 0;
+	mtx_unlock(&t->nt_mtx);
+}
+
+void
+nm_kthread_wakeup(struct nm_kthread *t)
+{
+	mtx_lock(&t->nt_mtx);
+	t->nt_pending = 1;
+	wakeup_one(&t->nt_pending);
+	mtx_unlock(&t->nt_mtx);
+}
+
+int
+nm_kthread_set_affinity(struct nm_kthread *t, u_int cpu)
+{
+	cpuset_t mask;
+
+	CPU_SETOF(cpu % mp_ncpus, &mask);
+	return cpuset_setthread(t->nt_td->td_tid, &mask);
+}
+
+/* kring notification timers */
+static void
+nm_notify_timer_handler(void *arg)
+{
+	netmap_notify_timeout(arg);
+}
+
+void
+nm_notify_timer_init(struct netmap_kring *kring)
+{
+	callout_init(&kring->nkr_notify_timer, 1 /* MPSAFE */);
+}
+
+void
+nm_notify_timer_arm(struct netmap_kring *kring, u_int us)
+{
+	callout_reset_sbt(&kring->nkr_notify_timer, SBT_1US * us, 0,
+	    nm_notify_timer_handler, kring, 0);
+}
+
+int
+nm_notify_timer_cancel(struct netmap_kring *kring)
+{
+	return callout_stop(&kring->nkr_notify_timer) == 1;
+}
+
+void
+nm_notify_timer_fini(struct netmap_kring *kring)
+{
+	callout_drain(&kring->nkr_notify_timer);
+}
+
+/* kring counters, on counter(9) */
+int
+nm_kstats_init(struct netmap_kring *kring)
+{
+	int i;
+
+	for (i = 0; i < NM_STAT_NUM; i++) {
+		kring->nkr_stats.ks_val[i] = counter_u64_alloc(M_NOWAIT);
+		if (kring->nkr_stats.ks_val[i] == NULL) {
+			nm_kstats_fini(kring);
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+void
+nm_kstats_fini(struct netmap_kring *kring)
+{
+	int i;
+
+	for (i = 0; i < NM_STAT_NUM; i++) {
+		if (kring->nkr_stats.ks_val[i] == NULL)
+			continue;
+		counter_u64_free(kring->nkr_stats.ks_val[i]);
+		kring->nkr_stats.ks_val[i] = NULL;
+	}
+}
+
+void
+nm_kstats_fetch(struct netmap_kring *kring, uint64_t *v)
+{
+	int i;
+
+	for (i = 0; i < NM_STAT_NUM; i++)
+		v[i] = kring->nkr_stats.ks_val[i] ?
+		    counter_u64_fetch(kring->nkr_stats.ks_val[i]) : 0;
+}
+
+/* totals of all krings, see netmap_kstat_drop() */
+struct nm_kstats netmap_kstat_totals;
+
+int
+nm_kstat_totals_init(void)
+{
+	int i;
+
+	for (i = 0; i < NM_STAT_NUM; i++)
+		netmap_kstat_totals.ks_val[i] = counter_u64_alloc(M_WAITOK);
+	return 0;
+}
+
+void
+nm_kstat_totals_fini(void)
+{
+	int i;
+
+	for (i = 0; i < NM_STAT_NUM; i++) {
+		if (netmap_kstat_totals.ks_val[i] == NULL)
+			continue;
+		counter_u64_free(netmap_kstat_totals.ks_val[i]);
+		netmap_kstat_totals.ks_val[i] = NULL;
+	}
+}
+
+uint64_t
+nm_kstat_total(u_int i)
+{
+	return netmap_kstat_totals.ks_val[i] ?
+	    counter_u64_fetch(netmap_kstat_totals.ks_val[i]) : 0;
+}
+
 static int
 nm_vi_dummy(struct ifnet *ifp, u_long cmd, caddr_t addr)
 {
@@ -277,12 +277,17 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 		for (r=0; r<na->num_rx_rings; r++) {
 			mbq_safe_init(&na->rx_rings[r].rx_queue);
 		}
+		/* the rx mode cannot change while in netmap mode */
+		gna->rxdirect = netmap_generic_rxdirect;
 
 		/*
 		 * Preallocate packet buffers for the tx rings.
 		 */
-		for (r=0; r<na->num_tx_rings; r++)
+		for (r=0; r<na->num_tx_rings; r++) {
 			na->tx_rings[r].tx_pool = NULL;
+			na->tx_rings[r].tx_event = NR_NOSLOT;
+			na->tx_rings[r].tx_event_frac = 8; /* the middle */
+		}
 		for (r=0; r<na->num_tx_rings; r++) {
 			na->tx_rings[r].tx_pool = malloc(na->num_tx_desc * sizeof(struct mbuf *),
 					M_DEVBUF, M_NOWAIT | M_ZERO);
@@ -432,13 +437,15 @@ generic_netmap_tx_clean(struct netmap_kring *kring)
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int nm_i = nm_next(kring->nr_hwtail, lim);
 	u_int hwcur = kring->nr_hwcur;
-	u_int n = 0;
+	u_int n = 0, event = 0;
 	struct mbuf **tx_pool = kring->tx_pool;
 
 	while (nm_i != hwcur) { /* buffers not completed */
 		struct mbuf *m = tx_pool[nm_i];
 
 		if (unlikely(m == NULL)) {
+			if (nm_i == kring->tx_event)
+				event = 1;
 			/* this is done, try to replenish the entry */
 			tx_pool[nm_i] = m = netmap_get_mbuf(NETMAP_BUF_SIZE(kring->na));
 			if (unlikely(m == NULL)) {
@@ -472,29 +479,43 @@ generic_netmap_tx_clean(struct netmap_kring *kring)
 	kring->nr_hwtail = nm_prev(nm_i, lim);
 	ND("tx completed [%d] -> hwtail %d", n, kring->nr_hwtail);
 
+	if (event) {
+		/*
+		 * The last requested completion has fired. If the driver
+		 * has run out of packets meanwhile, the event came too late
+		 * and the next one is asked earlier; otherwise the next one
+		 * is moved later, to take fewer notifications.
+		 */
+		kring->tx_event = NR_NOSLOT;
+		if (nm_i == hwcur) {
+			if (kring->tx_event_frac > 2)
+				kring->tx_event_frac--;
+		} else if (kring->tx_event_frac < 14) {
+			kring->tx_event_frac++;
+		}
+	}
+
 	return n;
 }
 
 
 /*
  * We have pending packets in the driver between nr_hwtail +1 and hwcur.
- * Compute a position in the middle, to be used to generate
- * a notification.
+ * Compute the position to be used to generate a notification,
+ * tx_event_frac/16 of the way between the two (see
+ * generic_netmap_tx_clean() for how the fraction adapts).
  */
 static inline u_int
-generic_tx_event_middle(struct netmap_kring *kring, u_int hwcur)
+generic_tx_event_pos(struct netmap_kring *kring, u_int hwcur)
 {
 	u_int n = kring->nkr_num_slots;
 	u_int ntc = nm_next(kring->nr_hwtail, n-1);
-	u_int e;
+	u_int pending, e;
 
-	if (hwcur >= ntc) {
-		e = (hwcur + ntc) / 2;
-	} else { /* wrap around */
-		e = (hwcur + n + ntc) / 2;
-		if (e >= n) {
-			e -= n;
-		}
+	pending = (hwcur >= ntc) ? hwcur - ntc : hwcur + n - ntc;
+	e = ntc + pending * kring->tx_event_frac / 16;
+	if (e >= n) {
+		e -= n;
 	}
 
 	if (unlikely(e >= n)) {
@@ -507,7 +528,7 @@ generic_tx_event_middle(struct netmap_kring *kring, u_int hwcur)
 
 /*
  * We have pending packets in the driver between nr_hwtail+1 and hwcur.
- * Schedule a notification approximately in the middle of the two.
+ * Schedule a notification somewhere in between.
  * There is a race but this is only called within txsync which does
  * a double check.
  */
@@ -520,7 +541,7 @@ generic_set_tx_event(struct netmap_kring *kring, u_int hwcur)
 	if (nm_next(kring->nr_hwtail, kring->nkr_num_slots -1) == hwcur) {
 		return; /* all buffers are free */
 	}
-	e = generic_tx_event_middle(kring, hwcur);
+	e = generic_tx_event_pos(kring, hwcur);
 
 	m = kring->tx_pool[e];
 	ND(5, "Request Event at %d mbuf %p refcnt %d", e, m, m ? GET_MBUF_REFCNT(m) : -2 );
@@ -530,6 +551,7 @@ generic_set_tx_event(struct netmap_kring *kring, u_int hwcur)
 		return;
 	}
 	kring->tx_pool[e] = NULL;
+	kring->tx_event = e;
 	SET_MBUF_DESTRUCTOR(m, generic_mbuf_destructor);
 
 	// XXX wmb() ?
@@ -575,7 +597,7 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 
 			/* device-specific */
 			struct mbuf *m;
-			int tx_ret;
+			int tx_ret, more;
 
 			NM_CHECK_ADDR_LEN(na, addr, len);
 
@@ -589,14 +611,18 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 					break;
 				}
 			}
-			/* XXX we should ask notifications when NS_REPORT is set,
-			 * or roughly every half frame. We can optimize this
-			 * by lazily requesting notifications only when a
-			 * transmission fails. Probably the best way is to
-			 * break on failures and set notifications when
-			 * ring->cur == ring->tail || nm_i != cur
+			/*
+			 * Notifications are only requested when a
+			 * transmission fails or the ring is full, see
+			 * generic_set_tx_event().
+			 * Tell the driver if more packets follow, so it
+			 * can defer the doorbell (only if the next mbuf is
+			 * there, so we do not stop right after).
 			 */
-			tx_ret = generic_xmit_frame(ifp, m, addr, len, ring_nr);
+			more = nm_next(nm_i, lim) != head &&
+			    kring->tx_pool[nm_next(nm_i, lim)] != NULL;
+			tx_ret = generic_xmit_frame(ifp, m, addr, len, ring_nr,
+			    more);
 			if (unlikely(tx_ret)) {
 				ND(5, "start_xmit failed: err %d [nm_i %u, head %u, hwtail %u]",
 						tx_ret, nm_i, head, kring->nr_hwtail);
@@ -614,8 +640,10 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 				 * is preallocated). The bridge has a similar problem
 				 * and we solve it there by dropping the excess packets.
 				 */
+				netmap_kstat_drop(kring, NM_STAT_TXERR, 1);
 				generic_set_tx_event(kring, nm_i);
 				if (generic_netmap_tx_clean(kring)) { /* space now available */
+					netmap_kstat_drop(kring, NM_STAT_RETRY, 1);
 					continue;
 				} else {
 					break;
@@ -659,6 +687,55 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
  * Stolen packets are put in a queue where the
  * generic_netmap_rxsync() callback can extract them.
  */
+/*
+ * Direct rx mode (dev.netmap.generic_rxdirect).
+ * Instead of queueing the mbuf for generic_netmap_rxsync(), copy the
+ * frame into the next free slot of the netmap ring right away, while
+ * it is still hot in the cache, and release the mbuf on the CPU
+ * that received it. rxsync then only publishes the new slots.
+ * The frame is dropped if the ring is full.
+ * The rx handler may run concurrently on the same ring (e.g. with RPS)
+ * so the ring is protected by the kring lock, which generic rxsync
+ * also takes in this mode.
+ *
+ * This is still one copy per frame, and the driver still allocates
+ * an skb for each of them: it only saves the queue, its locking and
+ * a second pass over cold data. Receiving into netmap buffers would
+ * need a hook in the refill of each driver (netmap buffers as page
+ * frags, or a page_pool, linux 4.18 on, backed by our allocator),
+ * which the emulated adapter, sitting on unmodified drivers, does
+ * not have. Native support remains the way to avoid the copy.
+ */
+static void
+generic_rx_direct(struct netmap_kring *kring, struct mbuf *m)
+{
+	struct netmap_adapter *na = kring->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int nm_i, len = MBUF_LEN(m);
+	void *addr;
+
+	mtx_lock(&kring->q_lock);
+	nm_i = kring->nr_hwtail;
+	addr = NMB(na, &ring->slot[nm_i]);
+	if (unlikely(kring->nkr_stopped ||
+	    nm_i == nm_prev(kring->nr_hwcur, lim) ||
+	    addr == NETMAP_BUF_BASE(na) || len > NETMAP_BUF_SIZE(na))) {
+		/* stopped, full, bad buffer or frame too long */
+		mtx_unlock(&kring->q_lock);
+		m_freem(m);
+		netmap_kstat_drop(kring, NM_STAT_DROP_NOSPACE, 1);
+		return;
+	}
+	m_copydata(m, 0, len, addr);
+	ring->slot[nm_i].len = len;
+	ring->slot[nm_i].flags = kring->nkr_slot_flags;
+	kring->nr_hwtail = nm_next(nm_i, lim);
+	mtx_unlock(&kring->q_lock);
+	MBUF_CONSUME(m);	/* delivered, not a drop */
+	IFRATE(rate_ctx.new.rxpkt++);
+}
+
 void
 generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 {
@@ -671,9 +748,12 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 		rr = rr % na->num_rx_rings; // XXX expensive...
 	}
 
-	/* limit the size of the queue */
-	if (unlikely(mbq_len(&na->rx_rings[rr].rx_queue) > 1024)) {
+	if (gna->rxdirect) {
+		generic_rx_direct(&na->rx_rings[rr], m);
+	} else if (unlikely(mbq_len(&na->rx_rings[rr].rx_queue) > 1024)) {
+		/* limit the size of the queue */
 		m_freem(m);
+		netmap_kstat_drop(&na->rx_rings[rr], NM_STAT_DROP_NOSPACE, 1);
 	} else {
 		mbq_safe_enqueue(&na->rx_rings[rr].rx_queue, m);
 	}
@@ -708,6 +788,7 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 {
 	struct netmap_ring *ring = kring->ring;
 	struct netmap_adapter *na = kring->na;
+	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
 	u_int nm_i;	/* index into the netmap ring */ //j,
 	u_int n;
 	u_int const lim = kring->nkr_num_slots - 1;
@@ -719,8 +800,12 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 	/*
 	 * First part: import newly received packets.
+	 * In direct mode the rx handler already did it.
 	 */
-	if (netmap_no_pendintr || force_update) {
+	if (gna->rxdirect) {
+		mtx_lock(&kring->q_lock);
+		kring->nr_kflags &= ~NKR_PENDINTR;
+	} else if (netmap_no_pendintr || force_update) {
 		/* extract buffers from the rx queue, stop at most one
 		 * slot before nr_hwcur (stop_i)
 		 */
@@ -776,6 +861,8 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 	}
 	/* tell userspace that there might be new packets. */
 	nm_rxsync_finalize(kring);
+	if (gna->rxdirect)
+		mtx_unlock(&kring->q_lock);
 	IFRATE(rate_ctx.new.rxsync++);
 
 	return 0;
@@ -51,6 +51,9 @@
 #if defined(CONFIG_NETMAP_V1000)
 #define WITH_V1000
 #endif
+#if defined(CONFIG_NETMAP_PTNETMAP)
+#define WITH_PTNETMAP
+#endif
 
 #else /* not linux */
 
@@ -76,8 +79,11 @@
 #define NM_MTX_ASSERT(m)	sx_assert(&(m), SA_XLOCKED)
 
 #define	NM_SELINFO_T	struct nm_selinfo
+#include <sys/_callout.h>
+#define	NM_TIMER_T	struct callout	/* kring notification timer */
 #define	MBUF_LEN(m)	((m)->m_pkthdr.len)
 #define	MBUF_IFP(m)	((m)->m_pkthdr.rcvif)
+#define	MBUF_CONSUME(m)	m_freem(m)	/* release a delivered mbuf */
 #define	NM_SEND_UP(ifp, m)	((NA(ifp))->if_input)(ifp, m)
 
 #define NM_ATOMIC_T	volatile int	// XXX ?
@@ -85,6 +91,11 @@
 #include <machine/atomic.h>
 #define NM_ATOMIC_TEST_AND_SET(p)       (!atomic_cmpset_acq_int((p), 0, 1))
 #define NM_ATOMIC_CLEAR(p)              atomic_store_rel_int((p), 0)
+/* bit i of an array of u_long */
+#define NM_BIT_SET(b, i)	\
+	atomic_set_long(&(b)[(i) / NM_LONG_BITS], 1UL << ((i) % NM_LONG_BITS))
+#define NM_BIT_CLEAR(b, i)	\
+	atomic_clear_long(&(b)[(i) / NM_LONG_BITS], 1UL << ((i) % NM_LONG_BITS))
 
 #if __FreeBSD_version >= 1100030
 #define	WNA(_ifp)	(_ifp)->if_netmap
@@ -125,12 +136,26 @@ struct hrtimer {
 #define NM_BNS_GET(b)
 #define NM_BNS_PUT(b)
 
+/* per-CPU kring counters, see nm_kstats_init() */
+#include <sys/counter.h>
+struct nm_kstats {
+	counter_u64_t	ks_val[NM_STAT_NUM];
+};
+#define	NM_KSTATS_T	struct nm_kstats
+#define	NM_KSTAT_ADD(k, i, n)	counter_u64_add((k)->nkr_stats.ks_val[i], (n))
+extern struct nm_kstats netmap_kstat_totals;
+#define	NM_KSTAT_TOTAL_ADD(i, n)	\
+	counter_u64_add(netmap_kstat_totals.ks_val[i], (n))
+
 #elif defined (linux)
 
 #define	NM_LOCK_T	safe_spinlock_t	// see bsd_glue.h
 #define	NM_SELINFO_T	wait_queue_head_t
+#define	NM_TIMER_T	struct hrtimer	/* kring notification timer */
 #define	MBUF_LEN(m)	((m)->len)
 #define	MBUF_IFP(m)	((m)->dev)
+/* release a delivered skb, m_freem() would account it as a drop */
+#define	MBUF_CONSUME(m)	dev_consume_skb_any(m)
 #define	NM_SEND_UP(ifp, m)  \
                         do { \
                             m->priority = NM_MAGIC_PRIORITY_RX; \
@@ -146,6 +171,16 @@ struct hrtimer {
 #define NM_MTX_UNLOCK(m)	mutex_unlock(&(m))
 #define NM_MTX_ASSERT(m)	mutex_is_locked(&(m))
 
+/* per-CPU kring counters, see nm_kstats_init() */
+struct nm_kstats {
+	uint64_t	ks_val[NM_STAT_NUM];
+};
+#define	NM_KSTATS_T	struct nm_kstats __percpu *
+#define	NM_KSTAT_ADD(k, i, n)	this_cpu_add((k)->nkr_stats->ks_val[i], (n))
+DECLARE_PER_CPU(struct nm_kstats, netmap_kstat_totals);
+#define	NM_KSTAT_TOTAL_ADD(i, n)	\
+	this_cpu_add(netmap_kstat_totals.ks_val[i], (n))
+
 #ifndef DEV_NETMAP
 #define DEV_NETMAP
 #endif /* DEV_NETMAP */
@@ -158,6 +193,7 @@ struct hrtimer {
 #define	NM_LOCK_T	IOLock *
 #define	NM_SELINFO_T	struct selinfo
 #define	MBUF_LEN(m)	((m)->m_pkthdr.len)
+#define	MBUF_CONSUME(m)	m_freem(m)
 #define	NM_SEND_UP(ifp, m)	((ifp)->if_input)(ifp, m)
 
 #else
@@ -256,9 +292,12 @@ extern NMG_LOCK_T	netmap_global_lock;
  * by nm_kr_(try)lock() which in turn uses nr_busy. This is all we need
  * for NIC rings, and for TX rings attached to the host stack.
  *
- * RX rings attached to the host stack use an mbq (rx_queue) on both
- * rxsync_from_host() and netmap_transmit(). The mbq is protected
- * by its internal lock.
+ * RX rings attached to the host stack receive mbufs from
+ * netmap_transmit() on any CPU through a lock-free mbq_mp (host_rxq),
+ * which rxsync_from_host() drains into rx_queue. rx_queue is only
+ * used by rxsync_from_host(). Its callers (nm_sync() and the
+ * transparent mode in netmap_poll()) must get the kring busy with
+ * nm_kr_tryget() first, as for NIC rings.
  *
  * RX rings attached to the VALE switch are accessed by both senders
  * and receiver. They are protected through the q_lock on the RX ring.
@@ -280,6 +319,7 @@ struct netmap_kring {
 
 	uint32_t	nr_kflags;	/* private driver flags */
 #define NKR_PENDINTR	0x1		// Pending interrupt.
+#define NKR_JBUF	0x2		// large buffers (NR_JBUF)
 	uint32_t	nkr_num_slots;
 
 	/*
@@ -289,6 +329,22 @@ struct netmap_kring {
 	 */
 	int32_t		nkr_hwofs;
 
+	/* On tx rings of NICs with offloadings (see tx_hdr_len in
+	 * the netmap_adapter) the driver may need extra descriptors
+	 * (e.g. context descriptors), so nkr_hwofs is not enough.
+	 * nkr_txmap[i] is the netmap slot of NIC descriptor i.
+	 */
+	uint32_t	*nkr_txmap;
+
+	/* Hardware timestamps (NR_HWTS). If not NULL, nkr_ts points
+	 * to the array that follows the slots in the netmap ring, and
+	 * the driver stores there the timestamp of each slot.
+	 * NICs that latch a single tx timestamp at a time keep in
+	 * nkr_ts_pend the netmap slot (plus 1) waiting for it.
+	 */
+	uint64_t	*nkr_ts;
+	uint32_t	nkr_ts_pend;
+
 	uint16_t	nkr_slot_flags;	/* initial value for flags */
 
 	/* last_reclaim is opaque marker to help reduce the frequency
@@ -302,10 +358,38 @@ struct netmap_kring {
 	NM_LOCK_T	q_lock;		/* protects kring and ring. */
 	NM_ATOMIC_T	nr_busy;	/* prevent concurrent syscalls */
 
+	/*
+	 * Notification thresholds (NETMAP_RING_NOTIFY), used by
+	 * netmap_notify(). If nkr_notify_us is set, a wakeup is held
+	 * back until nkr_notify_slots slots are ready or the timer
+	 * armed by the first held wakeup expires.
+	 */
+	uint32_t	nkr_notify_slots;
+	uint32_t	nkr_notify_us;
+	NM_ATOMIC_T	nkr_notify_armed;	/* timer pending */
+	NM_TIMER_T	nkr_notify_timer;
+
+	/*
+	 * Counters returned by NIOCGSTATS, one copy per CPU so the
+	 * writers (syncs, VALE senders, interrupts) need no lock.
+	 * Update them with NM_KSTAT_ADD(), or netmap_kstat_drop()
+	 * for the drops and retries.
+	 */
+	NM_KSTATS_T	nkr_stats;
+
+	/* passthrough state (NETMAP_PT_HOST_CREATE), if a guest
+	 * syncs this kring. Notifications then wake up its thread.
+	 * nkr_pt_lock protects the pointer against ptn_kring_delete(),
+	 * the notifications do not own the kring.
+	 */
+	struct ptn_kring *nkr_pt;
+	NM_LOCK_T	nkr_pt_lock;
+
 	struct netmap_adapter *na;
 
 	/* The following fields are for VALE switch support */
 	struct nm_bdg_fwd *nkr_ft;
+	u_int		nkr_bdg_batch;	/* adaptive batch, nm_bdg_preflush() */
 	uint32_t	*nkr_leases;
 #define NR_NOSLOT	((uint32_t)~0)	/* used in nkr_*lease* */
 	uint32_t	nkr_hwlease;
@@ -326,8 +410,14 @@ struct netmap_kring {
 	 * a rxsync.
 	 */
 	struct mbuf **tx_pool;
+	/* tx completion event: slot (or NR_NOSLOT) and position, in
+	 * 1/16 of the pending slots, adapted by generic_netmap_tx_clean()
+	 */
+	uint32_t	tx_event;
+	uint32_t	tx_event_frac;
 	// u_int nr_ntc;		/* Emulation of a next-to-clean RX ring pointer. */
 	struct mbq rx_queue;            /* intercepted rx mbufs. */
+	struct mbq_mp host_rxq;		/* host rx ring, from netmap_transmit() */
 
 	uint32_t	ring_id;	/* debugging */
 	char name[64];			/* diagnostic */
@@ -348,6 +438,8 @@ struct netmap_kring {
 #ifdef WITH_PIPES
 	struct netmap_kring *pipe;	/* if this is a pipe ring,
 					 * pointer to the other end
+					 * (the first of the slave rx rings
+					 * for the tx ring of a pipe group)
 					 */
 	struct netmap_ring *save_ring;	/* pointer to hidden rings
        					 * (see netmap_pipe.c for details)
@@ -355,9 +447,14 @@ struct netmap_kring {
 #endif /* WITH_PIPES */
 
 #ifdef WITH_MONITOR
-	/* pointer to the adapter that is monitoring this kring (if any)
+	/* pointer to the zero-copy monitor of this kring (if any)
 	 */
 	struct netmap_monitor_adapter *monitor;
+	/* copy monitors (NR_MONITOR_COPY) of this kring, any number.
+	 * Only changed while the kring is stopped.
+	 */
+	struct netmap_monitor_adapter **monitors;
+	uint32_t n_monitors, max_monitors;
 	/*
 	 * Monitors work by intercepting the txsync and/or rxsync of the
 	 * monitored krings. This is implemented by replacing
@@ -385,6 +482,16 @@ nm_prev(uint32_t i, uint32_t lim)
 }
 
 
+#define NM_LONG_BITS	(sizeof(u_long) * 8)
+
+/* the timestamp array that follows the slots (NAF_HW_TS) */
+static inline uint64_t *
+nm_ring_ts(struct netmap_ring *ring)
+{
+	return (uint64_t *)(void *)&ring->slot[ring->num_slots];
+}
+
+
 /*
  *
  * Here is the layout for the Rx and Tx rings.
@@ -440,6 +547,21 @@ enum txrx { NR_RX = 0, NR_TX = 1 };
 
 struct netmap_vp_adapter; // forward
 
+/*
+ * A hardware filter (NETMAP_RING_FILTER) steering the matching
+ * frames to rx ring nf_ring. Zero fields match anything.
+ * Addresses and ports are in network byte order.
+ */
+struct netmap_filter {
+	u_int		nf_type;	/* NETMAP_FILTER_* */
+	u_int		nf_ring;	/* destination rx ring */
+	u_int		nf_id;		/* index in the NIC table */
+	u_int		nf_proto;	/* IPPROTO_*, NETMAP_FILTER_5TUPLE */
+	uint32_t	nf_src_ip, nf_dst_ip;
+	uint16_t	nf_src_port, nf_dst_port;
+	uint8_t		nf_mac[6];	/* dst address, NETMAP_FILTER_MAC */
+};
+
 /*
  * The "struct netmap_adapter" extends the "struct adapter"
  * (or equivalent) device descriptor.
@@ -480,6 +602,20 @@ struct netmap_adapter {
 				 */
 #define NAF_HOST_RINGS  64	/* the adapter supports the host rings */
 #define NAF_FORCE_NATIVE 128	/* the adapter is always NATIVE */
+#define NAF_OFFLOAD_TX	256	/* the driver can program checksum and
+				 * TSO offloadings from a virtio-net
+				 * header in front of each tx frame
+				 */
+#define NAF_HW_TS	512	/* the driver can report hardware
+				 * timestamps (NR_HWTS), the netmap
+				 * rings have room for them
+				 */
+#define NAF_JBUF	1024	/* the rings can have the large
+				 * buffers of the allocator (NR_JBUF)
+				 */
+#define NAF_TX_INDIRECT	2048	/* txsync copies the NS_INDIRECT
+				 * slots before returning
+				 */
 #define	NAF_BUSY	(1U<<31) /* the adapter is used internally and
 				  * cannot be registered from userspace
 				  */
@@ -493,6 +629,12 @@ struct netmap_adapter {
 	u_int num_tx_desc; /* number of descriptor in each queue */
 	u_int num_rx_desc;
 
+	/* NAF_OFFLOAD_TX: if non zero, frames in the tx rings start
+	 * with a virtio-net header of this length (10 or 12), which
+	 * is not transmitted. Only changed while there are no krings.
+	 */
+	u_int tx_hdr_len;
+
 	/* tx_rings and rx_rings are private but allocated
 	 * as a contiguous chunk of memory. Each array has
 	 * N+1 entries, for the adapter queues and for the host queue.
@@ -502,6 +644,10 @@ struct netmap_adapter {
 
 	void *tailroom;		       /* space below the rings array */
 				       /* (used for leases) */
+	/* rx rings that may have something for netmap_poll(),
+	 * one bit per rx kring, set by netmap_notify()
+	 */
+	u_long *rx_pending;
 
 
 	NM_SELINFO_T tx_si, rx_si;	/* global wait queues */
@@ -574,6 +720,13 @@ struct netmap_adapter {
 	void (*nm_krings_delete)(struct netmap_adapter *);
 	int (*nm_notify)(struct netmap_adapter *,
 		u_int ring, enum txrx, int flags);
+	/*
+	 * nm_filter() installs (onoff = 1) or removes hardware filter f,
+	 *	see NETMAP_RING_FILTER. NULL if the NIC cannot steer frames.
+	 *	Called with NMG_LOCK held, may sleep.
+	 */
+	int (*nm_filter)(struct netmap_adapter *,
+		struct netmap_filter *f, int onoff);
 #ifdef WITH_VALE
 	/*
 	 * nm_bdg_attach() initializes the na_vp field to point
@@ -613,6 +766,14 @@ struct netmap_adapter {
 	struct lut_entry *na_lut;
 	uint32_t na_lut_objtotal;	/* max buffer index */
 	uint32_t na_lut_objsize;	/* buffer size */
+	uint32_t na_lut_jtotal;		/* the last jtotal ones are */
+	uint32_t na_lut_jsize;		/* large, of this size */
+	/* buffers taken by the rings and the extra buffers of the
+	 * adapter, and their limit (0: none, used by the VALE ports on
+	 * a shared allocator). Protected by the lock of nm_mem.
+	 */
+	u_int na_buf_used;
+	u_int na_buf_quota;
 
 	/* additional information attached to this adapter
 	 * by other netmap subsystems. Currently used by
@@ -660,6 +821,11 @@ struct netmap_vp_adapter {	/* VALE software port */
 
 	/* Offset of ethernet header for each packet. */
 	u_int virt_hdr_len;
+	/* Same, for the packets delivered to the port. It is equal to
+	 * virt_hdr_len, except on bwraps of NICs with tx offloadings,
+	 * where it is the tx_hdr_len of the NIC.
+	 */
+	u_int rx_hdr_len;
 	/* Maximum Frame Size, used in bdg_mismatch_datapath() */
 	u_int mfs;
 };
@@ -697,6 +863,8 @@ struct netmap_generic_adapter {	/* emulated device */
 	 */
 	struct net_device_ops generic_ndo;
 	void (*save_if_input)(struct ifnet *, struct mbuf *);
+	/* rx copies done by the rx handler, see generic_rx_direct() */
+	int rxdirect;
 
 	struct nm_generic_mit *mit;
 #ifdef linux
@@ -782,6 +950,14 @@ struct netmap_bwrap_adapter {
 	 * are attached to a bridge.
 	 */
 	struct netmap_priv_d *na_kpriv;
+
+	/*
+	 * If bridge_kthreads is set when the port is registered, each
+	 * hwna rx ring gets a kernel thread that forwards its packets
+	 * to the switch, and the interrupt only wakes it up.
+	 */
+	struct netmap_bwrap_worker *workers;
+	u_int nworkers;
 };
 int netmap_bwrap_attach(const char *name, struct netmap_adapter *);
 
@@ -978,12 +1154,33 @@ uint32_t nm_txsync_prologue(struct netmap_kring *);
 uint32_t nm_rxsync_prologue(struct netmap_kring *);
 
 
+/*
+ * Account the packets and bytes in slots [i, end) of the ring.
+ * A packet in several slots (NS_MOREFRAG) is counted once.
+ */
+static inline void
+nm_kstats_count(struct netmap_kring *kring, u_int i, u_int end)
+{
+	struct netmap_slot *slot = kring->ring->slot;
+	u_int const lim = kring->nkr_num_slots - 1;
+	uint64_t pkts = 0, bytes = 0;
+
+	for ( ; i != end; i = nm_next(i, lim)) {
+		bytes += slot[i].len;
+		pkts += !(slot[i].flags & NS_MOREFRAG);
+	}
+	NM_KSTAT_ADD(kring, NM_STAT_PACKETS, pkts);
+	NM_KSTAT_ADD(kring, NM_STAT_BYTES, bytes);
+}
+
+
 /*
  * update kring and ring at the end of txsync.
  */
 static inline void
 nm_txsync_finalize(struct netmap_kring *kring)
 {
+	NM_KSTAT_ADD(kring, NM_STAT_SYNCS, 1);
 	/* update ring tail to what the kernel knows */
 	kring->ring->tail = kring->rtail = kring->nr_hwtail;
 
@@ -1006,6 +1203,10 @@ nm_rxsync_finalize(struct netmap_kring *kring)
 	//struct netmap_ring *ring = kring->ring;
 	ND("head %d cur %d tail %d -> %d", ring->head, ring->cur, ring->tail,
 		kring->nr_hwtail);
+	NM_KSTAT_ADD(kring, NM_STAT_SYNCS, 1);
+	/* the new slots are the ones received since the last round */
+	if (kring->rtail != kring->nr_hwtail)
+		nm_kstats_count(kring, kring->rtail, kring->nr_hwtail);
 	kring->ring->tail = kring->rtail = kring->nr_hwtail;
 	/* make a copy of the state for next round */
 	kring->rhead = kring->ring->head;
@@ -1104,19 +1305,32 @@ int netmap_get_hw_na(struct ifnet *ifp, struct netmap_adapter **na);
  * function can return 0 .. NM_BDG_MAXPORTS-1 for regular ports,
  * NM_BDG_MAXPORTS for broadcast, NM_BDG_MAXPORTS+1 for unknown.
  * XXX in practice "unknown" might be handled same as broadcast.
+ *
+ * lookup_batch, if set, is used instead of lookup on a whole batch
+ * of n entries of ft: for each packet (i = 0, i += ft[i].ft_frags)
+ * it stores the port in dst_port[i] and the ring in dst_ring[i],
+ * which on entry holds the default (the source ring). This saves
+ * an indirect call per packet and lets the lookup prefetch.
  */
 typedef u_int (*bdg_lookup_fn_t)(struct nm_bdg_fwd *ft, uint8_t *ring_nr,
 		const struct netmap_vp_adapter *);
+typedef void (*bdg_lookup_batch_fn_t)(struct nm_bdg_fwd *ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		const struct netmap_vp_adapter *);
 typedef int (*bdg_config_fn_t)(struct nm_ifreq *);
 typedef void (*bdg_dtor_fn_t)(const struct netmap_vp_adapter *);
 struct netmap_bdg_ops {
 	bdg_lookup_fn_t lookup;
 	bdg_config_fn_t config;
 	bdg_dtor_fn_t	dtor;
+	bdg_lookup_batch_fn_t lookup_batch;	/* optional */
 };
 
 u_int netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		const struct netmap_vp_adapter *);
+void netmap_bdg_learning_batch(struct nm_bdg_fwd *ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		const struct netmap_vp_adapter *);
 
 #define	NM_BDG_MAXPORTS		254	/* up to 254 */
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
@@ -1227,6 +1441,8 @@ int netmap_adapter_put(struct netmap_adapter *na);
 #define NETMAP_BUF_SIZE(na)	((na)->na_lut_objsize)
 extern int netmap_mitigate;	// XXX not really used
 extern int netmap_no_pendintr;
+extern int netmap_no_timestamp;
+extern int netmap_poll_pending;
 extern int netmap_verbose;	// XXX debugging
 enum {                                  /* verbose flags */
 	NM_VERB_ON = 1,                 /* generic verbose */
@@ -1243,6 +1459,26 @@ extern int netmap_txsync_retry;
 extern int netmap_generic_mit;
 extern int netmap_generic_ringsize;
 extern int netmap_generic_rings;
+extern int netmap_generic_rxdirect;
+extern int netmap_generic_txdirect;
+
+/*
+ * Totals over all rings of the counters from NM_STAT_RETRY on,
+ * exported as the dev.netmap.retry, drop_* and txerr sysctls.
+ * They are per-CPU as the kring ones, and nm_kstat_total()
+ * adds up the copies when the sysctl is read.
+ */
+int nm_kstat_totals_init(void);
+void nm_kstat_totals_fini(void);
+uint64_t nm_kstat_total(u_int i);
+
+/* account n drops (or retries, errors) of type i on kring */
+static inline void
+netmap_kstat_drop(struct netmap_kring *kring, u_int i, u_int n)
+{
+	NM_KSTAT_ADD(kring, i, n);
+	NM_KSTAT_TOTAL_ADD(i, n);
+}
 
 /*
  * NA returns a pointer to the struct netmap adapter from the ifp,
@@ -1287,6 +1523,13 @@ extern int netmap_generic_rings;
  * Returns -ENOMEM in case the domain is different */
 #define nm_iommu_group_id(dev) (0)
 
+/* NUMA node of the device, not available from a dma tag */
+#define nm_numa_node(dev) (-1)
+
+/* XXX no domain aware contigmalloc() yet, the node is only a hint */
+#define contigmalloc_node(sz, ty, flags, lo, hi, align, bound, node)	\
+	contigmalloc(sz, ty, flags, lo, hi, align, bound)
+
 /* Callback invoked by the dma machinery after a successful dmamap_load */
 static void netmap_dmamap_cb(__unused void *arg,
     __unused bus_dma_segment_t * segs, __unused int nseg, __unused int error)
@@ -1328,6 +1571,7 @@ netmap_reload_map(struct netmap_adapter *na,
 #else /* linux */
 
 int nm_iommu_group_id(bus_dma_tag_t dev);
+int nm_numa_node(bus_dma_tag_t dev);
 extern size_t     netmap_mem_get_bufsize(struct netmap_mem_d *);
 #include <linux/dma-mapping.h>
 
@@ -1461,6 +1705,16 @@ NMB(struct netmap_adapter *na, struct netmap_slot *slot)
 		lut[0].vaddr : lut[i].vaddr;
 }
 
+/* size of the buffer of a slot, which may be a large one (NR_JBUF) */
+static inline u_int
+NMB_SIZE(struct netmap_adapter *na, struct netmap_slot *slot)
+{
+	uint32_t i = slot->buf_idx;
+
+	return (unlikely(i >= na->na_lut_objtotal - na->na_lut_jtotal &&
+	    i < na->na_lut_objtotal)) ? na->na_lut_jsize : NETMAP_BUF_SIZE(na);
+}
+
 static inline void *
 PNMB(struct netmap_adapter *na, struct netmap_slot *slot, uint64_t *pp)
 {
@@ -1522,8 +1776,90 @@ struct netmap_priv_d {
 	 */
 	NM_SELINFO_T *np_rxsi, *np_txsi;
 	struct thread	*np_td;		/* kqueue, just debugging */
+
+	struct nm_kthread *np_kthread;	/* busy poll thread, NR_BUSY_POLL */
+	struct ptn_kring *np_pt;	/* passthrough rings, a list */
+
+	/* hardware filters installed through this file descriptor,
+	 * removed on unregister (NETMAP_RING_FILTER)
+	 */
+#define NM_PRIV_FILTERS	16
+	u_int		np_nfilters;
+	uint16_t	np_filters[NM_PRIV_FILTERS];
 };
 
+/*
+ * Kernel threads, used by the busy poll mode (NR_BUSY_POLL) and
+ * by the bridge rx workers (bridge_kthreads).
+ * nm_kthread_start() creates a thread that calls worker(arg) in a
+ * loop, giving up the CPU only when the scheduler asks for it,
+ * until nm_kthread_stop() is called. The first call comes after the
+ * first nm_kthread_wakeup(), so the caller can first store the
+ * handle where the worker looks for it. nm_kthread_stop() waits for
+ * the worker to return, and can sleep.
+ * A worker that is not busy polling calls nm_kthread_wait(), which
+ * sleeps until the next nm_kthread_wakeup() (safe in interrupt
+ * context) or nm_kthread_stop(). Wakeups are not counted, one
+ * that comes while the worker runs makes the next wait return.
+ * nm_kthread_set_affinity() binds the thread to cpu (modulo the
+ * number of CPUs).
+ */
+struct nm_kthread;
+typedef void (*nm_kthread_worker_fn_t)(void *arg);
+struct nm_kthread *nm_kthread_start(nm_kthread_worker_fn_t worker,
+	void *arg, const char *name);
+void nm_kthread_stop(struct nm_kthread *);
+void nm_kthread_wait(struct nm_kthread *);
+void nm_kthread_wakeup(struct nm_kthread *);
+int nm_kthread_set_affinity(struct nm_kthread *, u_int cpu);
+
+#ifdef WITH_PTNETMAP
+/*
+ * Passthrough rings for guest VMs (netmap_pt.c).
+ * netmap_pt_host_ctl() handles NETMAP_PT_HOST_CREATE/DELETE,
+ * netmap_pt_host_delete() gives back all the rings of priv, on
+ * unregister. netmap_pt_notify() is called instead of the wakeup of
+ * the selinfo when a kring with nkr_pt is notified.
+ *
+ * The threads are woken up and wake up the guest through eventfds:
+ * nm_eventfd_get() takes a reference to the eventfd fd; if cb is not
+ * NULL, cb(arg) is then called (in any context) each time the eventfd
+ * is signalled. nm_eventfd_signal() signals it, nm_eventfd_put()
+ * drops the reference (and the callback), and can sleep.
+ */
+struct ptn_kring;
+int netmap_pt_host_ctl(struct netmap_priv_d *, struct nmreq *);
+void netmap_pt_host_delete(struct netmap_priv_d *);
+void netmap_pt_notify(struct netmap_kring *);
+
+struct nm_eventfd;
+struct nm_eventfd *nm_eventfd_get(int fd, void (*cb)(void *), void *arg,
+	int *error);
+void nm_eventfd_signal(struct nm_eventfd *);
+void nm_eventfd_put(struct nm_eventfd *);
+#endif /* WITH_PTNETMAP */
+
+/*
+ * One shot timers for the held notifications of a kring.
+ * On expiration they call netmap_notify_timeout(kring).
+ * nm_notify_timer_cancel() returns 1 if it stopped a pending timer,
+ * nm_notify_timer_fini() also waits for a running handler.
+ */
+void nm_notify_timer_init(struct netmap_kring *);
+void nm_notify_timer_arm(struct netmap_kring *, u_int us);
+int nm_notify_timer_cancel(struct netmap_kring *);
+void nm_notify_timer_fini(struct netmap_kring *);
+void netmap_notify_timeout(struct netmap_kring *);
+
+/*
+ * Per-CPU counters of a kring. nm_kstats_init() returns an errno,
+ * nm_kstats_fetch() adds up the copies of all CPUs in
+ * v[NM_STAT_NUM], without stopping the writers.
+ */
+int nm_kstats_init(struct netmap_kring *);
+void nm_kstats_fini(struct netmap_kring *);
+void nm_kstats_fetch(struct netmap_kring *, uint64_t *v);
+
 #ifdef WITH_MONITOR
 
 struct netmap_monitor_adapter {
@@ -1531,6 +1867,7 @@ struct netmap_monitor_adapter {
 
 	struct netmap_priv_d priv;
 	uint32_t flags;
+	u_int snaplen;	/* bytes copied per frame, NR_MONITOR_COPY */
 };
 
 #endif /* WITH_MONITOR */
@@ -1546,7 +1883,8 @@ int generic_netmap_attach(struct ifnet *ifp);
 int netmap_catch_rx(struct netmap_adapter *na, int intercept);
 void generic_rx_handler(struct ifnet *ifp, struct mbuf *m);;
 void netmap_catch_tx(struct netmap_generic_adapter *na, int enable);
-int generic_xmit_frame(struct ifnet *ifp, struct mbuf *m, void *addr, u_int len, u_int ring_nr);
+int generic_xmit_frame(struct ifnet *ifp, struct mbuf *m, void *addr, u_int len,
+	u_int ring_nr, int more);
 int generic_find_num_desc(struct ifnet *ifp, u_int *tx, u_int *rx);
 void generic_find_num_queues(struct ifnet *ifp, u_int *txq, u_int *rxq);
 
@@ -1587,6 +1925,7 @@ struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
 	uint16_t ft_len;	/* src fragment len */
 	uint16_t ft_next;	/* next packet to same destination */
+	struct netmap_slot *ft_slot;	/* source slot, for zero-copy */
 };
 
 /* struct 'virtio_net_hdr' from linux. */
@@ -1655,6 +1994,88 @@ struct nm_ipv6hdr {
 	uint8_t		daddr[16];
 };
 
+/*
+ * Flow hash used to spread traffic over multiple rings.
+ * The hash is symmetric, so that both directions of a connection
+ * map to the same value. It uses the 5-tuple for TCP, UDP and SCTP
+ * over IPv4 and IPv6 (no extension headers), the address pair for
+ * other IP traffic and IP fragments, and the MAC pair otherwise.
+ * 'buf' points to the ethernet header, 'len' is the number of
+ * bytes available in the buffer.
+ */
+static inline uint32_t
+nm_hash_fmix(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+#define NM_RD16(p)	((uint32_t)(p)[0] << 8 | (p)[1])
+#define NM_RD32(p)	(NM_RD16(p) << 16 | NM_RD16((p) + 2))
+#define NM_SORT2(a, b)	do {					\
+	if ((a) > (b)) { uint32_t _t = (a); (a) = (b); (b) = _t; } \
+} while (0)
+
+static inline uint32_t
+nm_flow_hash(const uint8_t *buf, u_int len)
+{
+	u_int l3 = 14, l4 = 0;
+	uint32_t ethertype, a, b, ports = 0, proto = 0;
+
+	if (len < 14)
+		return 0;
+	ethertype = NM_RD16(buf + 12);
+	if (ethertype == 0x8100 && len >= 18) { /* skip one vlan tag */
+		ethertype = NM_RD16(buf + 16);
+		l3 += 4;
+	}
+	if (ethertype == 0x0800 && len >= l3 + 20) {
+		const uint8_t *ip = buf + l3;
+		u_int ihl = (ip[0] & 0xf) << 2;
+
+		a = NM_RD32(ip + 12);
+		b = NM_RD32(ip + 16);
+		proto = ip[9];
+		/* fragments have no ports, except the first one */
+		if (ihl >= 20 && (NM_RD16(ip + 6) & 0x3fff) == 0)
+			l4 = l3 + ihl;
+	} else if (ethertype == 0x86DD && len >= l3 + 40) {
+		const uint8_t *ip6 = buf + l3;
+		int i;
+
+		a = b = 0;
+		for (i = 0; i < 16; i += 4) {
+			a = nm_hash_fmix(a ^ NM_RD32(ip6 + 8 + i));
+			b = nm_hash_fmix(b ^ NM_RD32(ip6 + 24 + i));
+		}
+		proto = ip6[6];
+		l4 = l3 + 40;
+	} else {
+		/* MAC pair */
+		a = NM_RD32(buf) ^ NM_RD16(buf + 4);
+		b = NM_RD32(buf + 6) ^ NM_RD16(buf + 10);
+		NM_SORT2(a, b);
+		return nm_hash_fmix(a ^ nm_hash_fmix(b));
+	}
+	if (l4 && (proto == 6 || proto == 17 || proto == 132) &&
+	    len >= l4 + 4) {
+		uint32_t sp = NM_RD16(buf + l4), dp = NM_RD16(buf + l4 + 2);
+
+		NM_SORT2(sp, dp);
+		ports = (sp << 16) | dp;
+	}
+	NM_SORT2(a, b);
+	return nm_hash_fmix(a ^ nm_hash_fmix(b ^ nm_hash_fmix(ports ^ proto)));
+}
+
+#undef NM_SORT2
+#undef NM_RD32
+#undef NM_RD16
+
 /* Type used to store a checksum (in host byte order) that hasn't been
  * folded yet.
  */
@@ -1668,6 +2089,25 @@ void nm_csum_tcpudp_ipv6(struct nm_ipv6hdr *ip6h, void *data,
 		      size_t datalen, uint16_t *check);
 uint16_t nm_csum_fold(rawsum_t cur_sum);
 
+/* Add to 'sum' the raw checksum 'part' of a block that starts
+ * 'offset' bytes into the data being summed. Blocks at odd offsets
+ * have their bytes in the wrong lanes, so the folded value is swapped.
+ * This lets us sum data in pieces, e.g. while copying it.
+ */
+static inline rawsum_t
+nm_csum_add(rawsum_t sum, rawsum_t part, size_t offset)
+{
+	uint64_t s;
+
+	if (offset & 1) {
+		part = (part & 0xffff) + (part >> 16);
+		part = (part & 0xffff) + (part >> 16);
+		part = ((part & 0xff) << 8) | (part >> 8);
+	}
+	s = (uint64_t)sum + part;
+	return (rawsum_t)((s & 0xffffffff) + (s >> 32));
+}
+
 void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			   struct netmap_vp_adapter *dst_na,
 			   struct nm_bdg_fwd *ft_p, struct netmap_ring *ring,
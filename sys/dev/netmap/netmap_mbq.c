@@ -30,12 +30,32 @@
 
 #ifdef linux
 #include "bsd_glue.h"
+
+#define MBQ_CAS_REL(p, o, n)	(cmpxchg((p), (o), (n)) == (o))
+#define MBQ_CAS_ACQ(p, o, n)	(cmpxchg((p), (o), (n)) == (o))
+#define MBQ_ADD(p, v)		atomic_add((v), (atomic_t *)(p))
+#define MBQ_SUB(p, v)		atomic_sub((v), (atomic_t *)(p))
+#define MBQ_CURCPU()		raw_smp_processor_id()
+#define MBQ_NCPUS		nr_cpu_ids
 #else   /* __FreeBSD__ */
 #include <sys/param.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/systm.h>
 #include <sys/mbuf.h>
+#include <sys/malloc.h>
+#include <sys/pcpu.h>	/* curcpu */
+#include <sys/smp.h>	/* mp_maxid */
+#include <machine/atomic.h>
+
+#define MBQ_CAS_REL(p, o, n)	atomic_cmpset_rel_ptr((volatile uintptr_t *)(p), \
+					(uintptr_t)(o), (uintptr_t)(n))
+#define MBQ_CAS_ACQ(p, o, n)	atomic_cmpset_acq_ptr((volatile uintptr_t *)(p), \
+					(uintptr_t)(o), (uintptr_t)(n))
+#define MBQ_ADD(p, v)		atomic_add_int((p), (v))
+#define MBQ_SUB(p, v)		atomic_subtract_int((p), (v))
+#define MBQ_CURCPU()		curcpu
+#define MBQ_NCPUS		(mp_maxid + 1)
 #endif  /* __FreeBSD__ */
 
 #include "netmap_mbq.h"
@@ -161,3 +181,77 @@ void mbq_safe_destroy(struct mbq *q)
 void mbq_destroy(struct mbq *q)
 {
 }
+
+
+int mbq_mp_init(struct mbq_mp *q, unsigned int limit)
+{
+    q->ncpus = MBQ_NCPUS;
+    q->limit = limit;
+    q->cpu = malloc(q->ncpus * sizeof(*q->cpu), M_DEVBUF, M_NOWAIT | M_ZERO);
+    return q->cpu ? 0 : ENOMEM;
+}
+
+
+void mbq_mp_destroy(struct mbq_mp *q)
+{
+    struct mbq tmp;
+
+    if (q->cpu == NULL)
+        return;
+    mbq_init(&tmp);
+    mbq_mp_drain(q, &tmp);
+    mbq_purge(&tmp);
+    free(q->cpu, M_DEVBUF);
+    q->cpu = NULL;
+}
+
+
+/* returns ENOBUFS if the list of this cpu is full, m is not freed */
+int mbq_mp_enqueue(struct mbq_mp *q, struct mbuf *m)
+{
+    struct mbq_mp_cpu *c = &q->cpu[MBQ_CURCPU() % q->ncpus];
+    struct mbuf *h;
+
+    if (c->count >= q->limit)
+        return ENOBUFS;
+    /* count first, so the consumer never takes more than counted */
+    MBQ_ADD(&c->count, 1);
+    do {
+        h = c->head;
+        m->m_nextpkt = h;
+    } while (!MBQ_CAS_REL(&c->head, h, m));
+    return 0;
+}
+
+
+/* append all queued packets to dst, return how many. Single consumer. */
+unsigned int mbq_mp_drain(struct mbq_mp *q, struct mbq *dst)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < q->ncpus; i++) {
+        struct mbq_mp_cpu *c = &q->cpu[i];
+        struct mbuf *h, *m, *rev = NULL;
+        unsigned int k = 0;
+
+        if (c->head == NULL)
+            continue;
+        do {
+            h = c->head;
+        } while (!MBQ_CAS_ACQ(&c->head, h, NULL));
+        /* newest first, reverse */
+        while ((m = h) != NULL) {
+            h = m->m_nextpkt;
+            m->m_nextpkt = rev;
+            rev = m;
+            k++;
+        }
+        while ((m = rev) != NULL) {
+            rev = m->m_nextpkt;
+            __mbq_enqueue(dst, m);
+        }
+        MBQ_SUB(&c->count, k);
+        n += k;
+    }
+    return n;
+}
@@ -86,4 +86,30 @@ static inline unsigned int mbq_len(struct mbq *q)
     return q->count;
 }
 
+/*
+ * A multi-producer, single-consumer queue of mbufs without locks.
+ * Each CPU pushes on its own list (newest first) with a
+ * compare-and-swap, so producers on different CPUs do not share
+ * a cache line, and a producer preempted or migrated in the middle
+ * is still correct. The consumer takes each list whole with another
+ * compare-and-swap and appends it, oldest first, to a plain mbq.
+ * Order is kept among the packets queued by one CPU.
+ * count is only used to bound each list to 'limit' packets.
+ */
+struct mbq_mp_cpu {
+    struct mbuf * volatile head;
+    volatile unsigned int count;
+} __attribute__((__aligned__(64)));
+
+struct mbq_mp {
+    struct mbq_mp_cpu *cpu;
+    unsigned int ncpus;
+    unsigned int limit;		/* per cpu */
+};
+
+int mbq_mp_init(struct mbq_mp *q, unsigned int limit);
+void mbq_mp_destroy(struct mbq_mp *q);
+int mbq_mp_enqueue(struct mbq_mp *q, struct mbuf *m);
+unsigned int mbq_mp_drain(struct mbq_mp *q, struct mbq *dst);
+
 #endif /* __NETMAP_MBQ_H_ */
@@ -59,10 +59,18 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 241723 2012-10-19 09:41:45Z gle
 #define NETMAP_POOL_MAX_NAMSZ	32
 
 
+/*
+ * The large buffers (NETMAP_JBUF_POOL) share the index space of the
+ * buffers: index NETMAP_BUF_POOL.objtotal + i is large buffer i, so
+ * NMB() and friends work unchanged (see netmap_mem_lut_build()).
+ * The pool is empty unless jbuf_num (priv_jbuf_num for VALE ports)
+ * is set, and its buffers only go to rings bound with NR_JBUF.
+ */
 enum {
 	NETMAP_IF_POOL   = 0,
 	NETMAP_RING_POOL,
 	NETMAP_BUF_POOL,
+	NETMAP_JBUF_POOL,
 	NETMAP_POOLS_NR
 };
 
@@ -104,10 +112,28 @@ struct netmap_obj_pool {
 	/* requested values */
 	u_int r_objtotal;
 	u_int r_objsize;
+	int r_huge;		/* hugepages requested */
+
+	int _huge;		/* clusters are hugepages */
 };
 
 #define NMA_LOCK_T		NM_MTX_T
 
+#define NETMAP_BULK		64	/* batch for bulk alloc/free */
+
+/*
+ * Size of the clusters used when netmap_hugepages is set.
+ * It is the size of a superpage (a PMD on linux), so that
+ * both the MMU and the IOMMU can map a cluster with a single entry.
+ */
+#if defined(linux)
+#define NM_HUGEPAGE_SIZE	PMD_SIZE
+#elif defined(NBPDR)
+#define NM_HUGEPAGE_SIZE	NBPDR
+#else
+#define NM_HUGEPAGE_SIZE	(1 << 21)	/* 2 MB */
+#endif
+
 typedef int (*netmap_mem_config_t)(struct netmap_mem_d*);
 typedef int (*netmap_mem_finalize_t)(struct netmap_mem_d*);
 typedef void (*netmap_mem_deref_t)(struct netmap_mem_d*);
@@ -125,12 +151,22 @@ struct netmap_mem_d {
 	/* the three allocators */
 	struct netmap_obj_pool pools[NETMAP_POOLS_NR];
 
+	/* lut of all buffers, small then large, nm_lut_total entries.
+	 * Same as pools[NETMAP_BUF_POOL].lut if there are no large ones.
+	 */
+	struct lut_entry *nm_lut;
+	u_int nm_lut_total;
+
 	netmap_mem_config_t   config;
 	netmap_mem_finalize_t finalize;
 	netmap_mem_deref_t    deref;
 
+	/* requested sizes, for the allocators configured by sysctl */
+	struct netmap_obj_params *params;
+
 	nm_memid_t nm_id;	/* allocator identifier */
 	int nm_grp;	/* iommu groupd id */
+	int nm_node;	/* NUMA node of the memory, -1 if any */
 
 	/* list of all existing allocators, sorted by nm_id */
 	struct netmap_mem_d *prev, *next;
@@ -140,13 +176,13 @@ struct netmap_mem_d {
 struct lut_entry*
 netmap_mem_get_lut(struct netmap_mem_d *nmd)
 {
-	return nmd->pools[NETMAP_BUF_POOL].lut;
+	return nmd->nm_lut;
 }
 
 u_int
 netmap_mem_get_buftotal(struct netmap_mem_d *nmd)
 {
-	return nmd->pools[NETMAP_BUF_POOL].objtotal;
+	return nmd->nm_lut_total;
 }
 
 size_t
@@ -155,6 +191,22 @@ netmap_mem_get_bufsize(struct netmap_mem_d *nmd)
 	return nmd->pools[NETMAP_BUF_POOL]._objsize;
 }
 
+/* number of large buffers, the last ones of the lut */
+u_int
+netmap_mem_get_jbuftotal(struct netmap_mem_d *nmd)
+{
+	return nmd->pools[NETMAP_JBUF_POOL].objtotal;
+}
+
+/* size of the large buffers, 0 if the allocator has none */
+size_t
+netmap_mem_get_jbufsize(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_JBUF_POOL];
+
+	return p->_objtotal ? p->_objsize : 0;
+}
+
 #define NMA_LOCK_INIT(n)	NM_MTX_INIT((n)->nm_mtx)
 #define NMA_LOCK_DESTROY(n)	NM_MTX_DESTROY((n)->nm_mtx)
 #define NMA_LOCK(n)		NM_MTX_LOCK((n)->nm_mtx)
@@ -174,6 +226,34 @@ struct netmap_obj_params netmap_params[NETMAP_POOLS_NR] = {
 		.size = 2048,
 		.num  = NETMAP_BUF_MAX_NUM,
 	},
+	[NETMAP_JBUF_POOL] = {
+		.size = 9216,
+		.num  = 0,
+	},
+};
+
+/*
+ * The allocator shared by the VALE ports when netmap_vale_shared_mem
+ * is set, sized for many small ports. Rings of NM_BRIDGE_RINGSIZE
+ * slots fit in 5 pages.
+ */
+struct netmap_obj_params netmap_vale_params[NETMAP_POOLS_NR] = {
+	[NETMAP_IF_POOL] = {
+		.size = 1024,
+		.num  = 512,
+	},
+	[NETMAP_RING_POOL] = {
+		.size = 5*PAGE_SIZE,
+		.num  = 2048,
+	},
+	[NETMAP_BUF_POOL] = {
+		.size = 2048,
+		.num  = NETMAP_BUF_MAX_NUM,
+	},
+	[NETMAP_JBUF_POOL] = {
+		.size = 9216,
+		.num  = 0,
+	},
 };
 
 struct netmap_obj_params netmap_min_priv_params[NETMAP_POOLS_NR] = {
@@ -189,6 +269,10 @@ struct netmap_obj_params netmap_min_priv_params[NETMAP_POOLS_NR] = {
 		.size = 2048,
 		.num  = 4098,
 	},
+	[NETMAP_JBUF_POOL] = {
+		.size = 9216,
+		.num  = 0,
+	},
 };
 
 
@@ -223,13 +307,22 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
 		},
+		[NETMAP_JBUF_POOL] = {
+			.name	= "netmap_jbuf",
+			.objminsize = 64,
+			.objmaxsize = 32768,	/* fits nr_jbuf_size */
+			.nummin     = 0,
+			.nummax	    = 1000000,
+		},
 	},
 	.config   = netmap_mem_global_config,
 	.finalize = netmap_mem_global_finalize,
 	.deref    = netmap_mem_global_deref,
+	.params   = netmap_params,
 
 	.nm_id = 1,
 	.nm_grp = -1,
+	.nm_node = -1,
 
 	.prev = &nm_mem,
 	.next = &nm_mem,
@@ -238,6 +331,32 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 
 struct netmap_mem_d *netmap_last_mem_d = &nm_mem;
 
+/*
+ * Use hugepage clusters for the pools that can be split exactly
+ * in hugepages (normally, the buffer pool). Only used on the next
+ * (re)configuration of an allocator; the memory falls back to normal
+ * clusters if no hugepages are available.
+ */
+int netmap_hugepages = 0;
+
+/*
+ * If set, a NIC attached to a known NUMA node gets its own copy of
+ * the global allocator, with the memory taken from that node.
+ * The copies use the same parameters as nm_mem and are created when
+ * the first NIC of the node is attached, so changing this only
+ * affects the drivers loaded afterwards.
+ */
+int netmap_numa_mem = 0;
+#define NM_NUMA_MAXNODES	64
+static struct netmap_mem_d *nm_mem_node[NM_NUMA_MAXNODES];
+
+/* the allocator shared by the VALE ports, see netmap_mem_vale_get() */
+static struct netmap_mem_d *nm_mem_vale;
+
+static struct netmap_mem_d *nm_mem_global_new(const char *tag,
+	struct netmap_obj_params *params, int node);
+static void nm_mem_global_delete(struct netmap_mem_d *nmd);
+
 /* blueprint for the private memory allocators */
 static int netmap_mem_private_config(struct netmap_mem_d *nmd);
 static int netmap_mem_private_finalize(struct netmap_mem_d *nmd);
@@ -265,12 +384,20 @@ const struct netmap_mem_d nm_blueprint = {
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
 		},
+		[NETMAP_JBUF_POOL] = {
+			.name	= "%s_jbuf",
+			.objminsize = 64,
+			.objmaxsize = 32768,
+			.nummin     = 0,
+			.nummax	    = 1000000,
+		},
 	},
 	.config   = netmap_mem_private_config,
 	.finalize = netmap_mem_private_finalize,
 	.deref    = netmap_mem_private_deref,
 
 	.flags = NETMAP_MEM_PRIVATE,
+	.nm_node = -1,
 };
 
 /* memory allocator related sysctls */
@@ -295,9 +422,27 @@ const struct netmap_mem_d nm_blueprint = {
 	    "Default number of private netmap " STRINGIFY(name) "s")
 
 SYSCTL_DECL(_dev_netmap);
+SYSCTL_INT(_dev_netmap, OID_AUTO, hugepages,
+    CTLFLAG_RW, &netmap_hugepages, 0, "Use hugepages for netmap memory");
+SYSCTL_INT(_dev_netmap, OID_AUTO, numa_mem,
+    CTLFLAG_RW, &netmap_numa_mem, 0, "Per NUMA node memory for the NICs");
 DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
+DECLARE_SYSCTLS(NETMAP_JBUF_POOL, jbuf);
+
+#define DECLARE_VALE_SYSCTLS(id, name) \
+	SYSCTL_INT(_dev_netmap, OID_AUTO, vale_##name##_size, \
+	    CTLFLAG_RW, &netmap_vale_params[id].size, 0, \
+	    "Size of the shared VALE " STRINGIFY(name) "s"); \
+	SYSCTL_INT(_dev_netmap, OID_AUTO, vale_##name##_num, \
+	    CTLFLAG_RW, &netmap_vale_params[id].num, 0, \
+	    "Number of the shared VALE " STRINGIFY(name) "s")
+
+DECLARE_VALE_SYSCTLS(NETMAP_IF_POOL, if);
+DECLARE_VALE_SYSCTLS(NETMAP_RING_POOL, ring);
+DECLARE_VALE_SYSCTLS(NETMAP_BUF_POOL, buf);
+DECLARE_VALE_SYSCTLS(NETMAP_JBUF_POOL, jbuf);
 
 static int
 nm_mem_assign_id(struct netmap_mem_d *nmd)
@@ -402,9 +547,37 @@ netmap_mem_ofstophys(struct netmap_mem_d* nmd, vm_ooffset_t offset)
 	return 0;	// XXX bad address
 }
 
+/*
+ * Return the physical address of the hugepage cluster starting
+ * at the given offset, or 0 if there is none (the offset is not
+ * aligned, or the pool does not use hugepages).
+ * Used to map hugepages in userspace.
+ */
+vm_paddr_t
+netmap_mem_ofstophys_huge(struct netmap_mem_d* nmd, vm_ooffset_t offset)
+{
+	int i;
+	vm_paddr_t pa = 0;
+	struct netmap_obj_pool *p;
+
+	if (offset % NM_HUGEPAGE_SIZE)
+		return 0;
+	NMA_LOCK(nmd);
+	p = nmd->pools;
+	for (i = 0; i < NETMAP_POOLS_NR; offset -= p[i].memtotal, i++) {
+		if (offset >= p[i].memtotal)
+			continue;
+		if (p[i]._huge && offset % p[i]._clustsize == 0)
+			pa = vtophys(p[i].lut[offset / p[i]._objsize].vaddr);
+		break;
+	}
+	NMA_UNLOCK(nmd);
+	return pa;
+}
+
 int
 netmap_mem_get_info(struct netmap_mem_d* nmd, u_int* size, u_int *memflags,
-	nm_memid_t *id)
+	nm_memid_t *id, u_int *jbufsize)
 {
 	int error = 0;
 	NMA_LOCK(nmd);
@@ -427,6 +600,8 @@ netmap_mem_get_info(struct netmap_mem_d* nmd, u_int* size, u_int *memflags,
 		*memflags = nmd->flags;
 	if (id)
 		*id = nmd->nm_id;
+	if (jbufsize)
+		*jbufsize = netmap_mem_get_jbufsize(nmd);
 out:
 	NMA_UNLOCK(nmd);
 	return error;
@@ -474,6 +649,12 @@ netmap_obj_offset(struct netmap_obj_pool *p, const void *vaddr)
 	(n)->pools[NETMAP_RING_POOL].memtotal +		\
 	netmap_obj_offset(&(n)->pools[NETMAP_BUF_POOL], (v)))
 
+/* offset of the large buffers, they follow the buffers */
+#define netmap_jbuf_base(n)					\
+    ((n)->pools[NETMAP_IF_POOL].memtotal +			\
+	(n)->pools[NETMAP_RING_POOL].memtotal +		\
+	(n)->pools[NETMAP_BUF_POOL].memtotal)
+
 
 ssize_t
 netmap_mem_if_offset(struct netmap_mem_d *nmd, const void *addr)
@@ -517,8 +698,8 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 			continue;
 		}
 		/* locate a slot */
-		for (j = 0, mask = 1; (cur & mask) == 0; j++, mask <<= 1)
-			;
+		j = ffs(cur) - 1;
+		mask = 1U << j;
 
 		p->bitmap[i] &= ~mask; /* mark object as in use */
 		p->objfree--;
@@ -560,6 +741,84 @@ netmap_obj_free(struct netmap_obj_pool *p, uint32_t j)
 	}
 }
 
+/*
+ * Allocate up to n objects, storing their indexes in idx[].
+ * The bitmap is scanned one word at a time, starting from *start
+ * if not NULL, and all the objects needed are taken from a word
+ * before moving to the next one. Returns the number of objects
+ * allocated, less than n only if the pool runs out.
+ * Call with NMA_LOCK held.
+ */
+static u_int
+netmap_obj_malloc_bulk(struct netmap_obj_pool *p, uint32_t *idx, u_int n,
+	uint32_t *start)
+{
+	uint32_t i = start ? *start : 0;	/* index in the bitmap */
+	u_int got = 0;
+
+	if (n > p->objfree)
+		n = p->objfree;
+	while (got < n && i < p->bitmap_slots) {
+		uint32_t cur = p->bitmap[i];
+
+		if (cur == 0) { /* bitmask is fully used */
+			i++;
+			continue;
+		}
+		do {
+			idx[got++] = i * 32 + ffs(cur) - 1;
+			cur &= cur - 1; /* clear the lowest bit */
+		} while (cur != 0 && got < n);
+		p->bitmap[i] = cur; /* mark objects as in use */
+		if (cur == 0)
+			i++;
+	}
+	p->objfree -= got;
+	if (start)
+		*start = i;
+	return got;
+}
+
+
+/*
+ * Free n objects by index. Consecutive indexes in the same bitmap
+ * word (the common case when freeing a ring) are released with a
+ * single update. Returns the number of invalid indexes found,
+ * which are skipped.
+ */
+static u_int
+netmap_obj_free_bulk(struct netmap_obj_pool *p, const uint32_t *idx, u_int n)
+{
+	uint32_t w = 0, mask = 0, m;
+	u_int i, errors = 0;
+
+	for (i = 0; i < n; i++) {
+		uint32_t j = idx[i];
+
+		if (j >= p->objtotal) {
+			D("invalid index %u, max %u", j, p->objtotal);
+			errors++;
+			continue;
+		}
+		if (mask && j / 32 != w) {
+			p->bitmap[w] |= mask;
+			mask = 0;
+		}
+		w = j / 32;
+		m = 1U << (j % 32);
+		if ((p->bitmap[w] | mask) & m) {
+			D("ouch, double free on buffer %d", j);
+			errors++;
+			continue;
+		}
+		mask |= m;
+		p->objfree++;
+	}
+	if (mask)
+		p->bitmap[w] |= mask;
+	return errors;
+}
+
 /*
  * free by address. This is slow but is only used for a few
  * objects (rings, nifp)
@@ -611,69 +870,116 @@ uint32_t
 netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
 {
 	struct netmap_mem_d *nmd = na->nm_mem;
-	uint32_t i, pos = 0; /* opaque, scan position in the bitmap */
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t idx[NETMAP_BULK];
+	uint32_t i = 0, pos = 0; /* opaque, scan position in the bitmap */
+	u_int j, want, got;
 
 	NMA_LOCK(nmd);
 
 	*head = 0;	/* default, 'null' index ie empty list */
-	for (i = 0 ; i < n; i++) {
-		uint32_t cur = *head;	/* save current head */
-		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
-		if (p == NULL) {
+	if (na->na_buf_quota) {
+		u_int left = na->na_buf_quota > na->na_buf_used ?
+			na->na_buf_quota - na->na_buf_used : 0;
+
+		if (n > left) {
+			D("%s: only %u of %u extra buffers within the quota",
+			    na->name, left, n);
+			n = left;
+		}
+	}
+	while (i < n) {
+		want = n - i;
+		if (want > NETMAP_BULK)
+			want = NETMAP_BULK;
+		got = netmap_obj_malloc_bulk(p, idx, want, &pos);
+		for (j = 0; j < got; j++) {
+			uint32_t *buf = p->lut[idx[j]].vaddr;
+
+			RD(5, "allocate buffer %d -> %d", idx[j], *head);
+			*buf = *head; /* link to previous head */
+			*head = idx[j];
+		}
+		i += got;
+		if (got < want) {
 			D("no more buffers after %d of %d", i, n);
-			*head = cur; /* restore */
 			break;
 		}
-		RD(5, "allocate buffer %d -> %d", *head, cur);
-		*p = cur; /* link to previous head */
 	}
+	na->na_buf_used += i;
 
 	NMA_UNLOCK(nmd);
 
 	return i;
 }
 
-static void
+/* free a list from netmap_extra_alloc() */
+void
 netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 {
-        struct lut_entry *lut = na->na_lut;
 	struct netmap_mem_d *nmd = na->nm_mem;
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct lut_entry *lut;
 	uint32_t i, cur, *buf;
 
+	uint32_t idx[NETMAP_BULK];
+	u_int n = 0;
+
 	D("freeing the extra list");
+	NMA_LOCK(nmd);
+	lut = p->lut;
 	for (i = 0; head >=2 && head < p->objtotal; i++) {
 		cur = head;
 		buf = lut[head].vaddr;
 		head = *buf;
 		*buf = 0;
-		if (netmap_obj_free(p, cur))
-			break;
+		idx[n++] = cur;
+		if (n == NETMAP_BULK) {
+			if (netmap_obj_free_bulk(p, idx, n)) {
+				n = 0;	/* do not free them again below */
+				break;
+			}
+			n = 0;
+		}
 	}
+	if (n)
+		netmap_obj_free_bulk(p, idx, n);
 	if (head != 0)
 		D("breaking with head %d", head);
 	D("freed %d buffers", i);
+	na->na_buf_used -= i < na->na_buf_used ? i : na->na_buf_used;
+	NMA_UNLOCK(nmd);
 }
 
 
-/* Return nonzero on error */
+/* Return nonzero on error. jbuf takes large buffers instead */
 static int
-netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n,
+	int jbuf)
 {
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *p =
+		&nmd->pools[jbuf ? NETMAP_JBUF_POOL : NETMAP_BUF_POOL];
+	/* the large buffers are indexed after the small ones */
+	uint32_t base = jbuf ? nmd->pools[NETMAP_BUF_POOL].objtotal : 0;
 	u_int i = 0;	/* slot counter */
 	uint32_t pos = 0;	/* slot in p->bitmap */
-	uint32_t index = 0;	/* buffer index */
-
-	for (i = 0; i < n; i++) {
-		void *vaddr = netmap_buf_malloc(nmd, &pos, &index);
-		if (vaddr == NULL) {
+	uint32_t idx[NETMAP_BULK];
+	u_int j, want, got;
+
+	while (i < n) {
+		want = n - i;
+		if (want > NETMAP_BULK)
+			want = NETMAP_BULK;
+		got = netmap_obj_malloc_bulk(p, idx, want, &pos);
+		for (j = 0; j < got; j++, i++) {
+			slot[i].buf_idx = base + idx[j];
+			slot[i].len = p->_objsize;
+			slot[i].flags = 0;
+		}
+		if (got < want) {
 			D("no more buffers after %d of %d", i, n);
 			goto cleanup;
 		}
-		slot[i].buf_idx = index;
-		slot[i].len = p->_objsize;
-		slot[i].flags = 0;
 	}
 
 	ND("allocated %d buffers, %d available, first at %d", n, p->objfree, pos);
@@ -681,8 +987,10 @@ netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
 
 cleanup:
 	while (i > 0) {
-		i--;
-		netmap_obj_free(p, slot[i].buf_idx);
+		want = i > NETMAP_BULK ? NETMAP_BULK : i;
+		for (j = 0; j < want; j++)
+			idx[j] = slot[--i].buf_idx - base;
+		netmap_obj_free_bulk(p, idx, want);
 	}
 	bzero(slot, n * sizeof(slot[0]));
 	return (ENOMEM);
@@ -702,28 +1010,43 @@ netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n,
 }
 
 
-static void
-netmap_free_buf(struct netmap_mem_d *nmd, uint32_t i)
-{
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-
-	if (i < 2 || i >= p->objtotal) {
-		D("Cannot free buf#%d: should be in [2, %d[", i, p->objtotal);
-		return;
-	}
-	netmap_obj_free(p, i);
-}
-
-
+/*
+ * Each buffer goes back to its own pool, whatever the ring,
+ * as userspace may have moved them around.
+ */
 static void
 netmap_free_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
 {
-	u_int i;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *jp = &nmd->pools[NETMAP_JBUF_POOL], *q, *cur = p;
+	uint32_t nbufs = p->objtotal;
+	uint32_t idx[NETMAP_BULK];
+	u_int i, k = 0;
 
 	for (i = 0; i < n; i++) {
-		if (slot[i].buf_idx > 2)
-			netmap_free_buf(nmd, slot[i].buf_idx);
+		uint32_t j = slot[i].buf_idx;
+
+		if (j <= 2)
+			continue;
+		if (j >= nmd->nm_lut_total) {
+			D("Cannot free buf#%d: should be in [2, %d[", j,
+			    nmd->nm_lut_total);
+			continue;
+		}
+		q = j >= nbufs ? jp : p;
+		if (q != cur && k) {
+			netmap_obj_free_bulk(cur, idx, k);
+			k = 0;
+		}
+		cur = q;
+		idx[k++] = q == jp ? j - nbufs : j;
+		if (k == NETMAP_BULK) {
+			netmap_obj_free_bulk(cur, idx, k);
+			k = 0;
+		}
 	}
+	if (k)
+		netmap_obj_free_bulk(cur, idx, k);
 }
 
 static void
@@ -782,7 +1105,8 @@ netmap_destroy_obj_allocator(struct netmap_obj_pool *p)
 
 /* call with NMA_LOCK held */
 static int
-netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize)
+netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal,
+	u_int objsize, int huge)
 {
 	int i;
 	u_int clustsize;	/* the cluster size, multiple of page size */
@@ -792,6 +1116,8 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	 * detect configuration changes later */
 	p->r_objtotal = objtotal;
 	p->r_objsize = objsize;
+	p->r_huge = huge;
+	p->_huge = 0;
 
 #define MAX_CLUSTSIZE	(1<<22)		// 4 MB
 #define LINE_ROUND	NM_CACHE_ALIGN	// 64
@@ -816,6 +1142,17 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 			objtotal, p->nummin, p->nummax);
 		return EINVAL;
 	}
+	/*
+	 * With hugepages, a cluster is a hugepage, provided that
+	 * the objects fill it exactly (userspace relies on the
+	 * objects being contiguous) and that we need at least one.
+	 */
+	if (huge && NM_HUGEPAGE_SIZE % objsize == 0 &&
+	    (uint64_t)objtotal * objsize >= NM_HUGEPAGE_SIZE) {
+		clustentries = NM_HUGEPAGE_SIZE / objsize;
+		p->_huge = 1;
+		goto done;
+	}
 	/*
 	 * Compute number of objects using a brute-force approach:
 	 * given a max cluster size,
@@ -837,11 +1174,13 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 		D("unsupported allocation for %d bytes", objsize);
 		return EINVAL;
 	}
+done:
 	/* compute clustsize */
 	clustsize = clustentries * objsize;
 	if (netmap_verbose)
-		D("objsize %d clustsize %d objects %d",
-			objsize, clustsize, clustentries);
+		D("objsize %d clustsize %d objects %d%s",
+			objsize, clustsize, clustentries,
+			p->_huge ? " (hugepages)" : "");
 
 	/*
 	 * The number of clusters is n = ceil(objtotal/clustentries)
@@ -859,20 +1198,52 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 }
 
 
+/*
+ * The pools are mapped one after the other. If the buffer pool uses
+ * hugepages, add some netmap_if objects (they are page sized clusters,
+ * normally) so that the buffers start at a hugepage boundary in the
+ * mapping, and userspace can map them with hugepages too.
+ * Nothing is done if the padding cannot be made exact.
+ * call with NMA_LOCK held
+ */
+static void
+netmap_mem_huge_align(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *ifp = &nmd->pools[NETMAP_IF_POOL];
+	u_int ofs, pad;
+
+	if (!nmd->pools[NETMAP_BUF_POOL]._huge || ifp->_huge)
+		return;
+	ofs = ifp->_numclusters * ifp->_clustsize +
+	    nmd->pools[NETMAP_RING_POOL]._numclusters *
+	    nmd->pools[NETMAP_RING_POOL]._clustsize;
+	pad = (NM_HUGEPAGE_SIZE - ofs % NM_HUGEPAGE_SIZE) % NM_HUGEPAGE_SIZE;
+	if (pad % ifp->_clustsize) {
+		D("cannot align the buffers to a hugepage boundary");
+		return;
+	}
+	ifp->_numclusters += pad / ifp->_clustsize;
+	ifp->_objtotal = ifp->_numclusters * ifp->_clustentries;
+}
+
 /* call with NMA_LOCK held */
 static int
-netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
+netmap_finalize_obj_allocator(struct netmap_obj_pool *p, int node)
 {
 	int i; /* must be signed */
+	int huge;
 	size_t n;
 
+	if (p->_objtotal == 0)	/* optional pool, not used */
+		return 0;
+
 	/* optimistically assume we have enough memory */
 	p->numclusters = p->_numclusters;
 	p->objtotal = p->_objtotal;
 
 	n = sizeof(struct lut_entry) * p->objtotal;
 #ifdef linux
-	p->lut = vmalloc(n);
+	p->lut = node < 0 ? vmalloc(n) : vmalloc_node(n, node);
 #else
 	p->lut = malloc(n, M_NETMAP, M_NOWAIT | M_ZERO);
 #endif
@@ -900,8 +1271,25 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		int lim = i + p->_clustentries;
 		char *clust;
 
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
+		clust = contigmalloc_node(n, M_NETMAP, M_NOWAIT | M_ZERO,
+		    (size_t)0, -1UL, p->_huge ? NM_HUGEPAGE_SIZE : PAGE_SIZE, 0,
+		    node);
+		if (clust == NULL && p->_huge) {
+			/*
+			 * Not enough hugepages, release what we got
+			 * and try again with normal clusters.
+			 */
+			D("no hugepages for '%s' after %d clusters, "
+			    "using normal pages", p->name, i / p->_clustentries);
+			huge = p->r_huge;
+			p->objtotal = i;
+			netmap_reset_obj_allocator(p);
+			if (netmap_config_obj_allocator(p, p->r_objtotal,
+					p->r_objsize, 0))
+				return ENOMEM;
+			p->r_huge = huge; /* keep the request, avoid reconfig */
+			return netmap_finalize_obj_allocator(p, node);
+		}
 		if (clust == NULL) {
 			/*
 			 * If we get here, there is a severe memory shortage,
@@ -946,6 +1334,242 @@ clean:
 	return ENOMEM;
 }
 
+/*
+ * Build nmd->nm_lut once the buffer pools are finalized: a copy
+ * of the lut of the buffers followed by the one of the large
+ * buffers, or just the former if there are no large buffers.
+ * The physical addresses (a DMA mapping, on linux) are only
+ * set in nm_lut. Call with NMA_LOCK held.
+ */
+static int
+netmap_mem_lut_build(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *jp = &nmd->pools[NETMAP_JBUF_POOL];
+	size_t n;
+
+	nmd->nm_lut_total = p->objtotal + jp->objtotal;
+	if (jp->objtotal == 0) {
+		nmd->nm_lut = p->lut;
+		return 0;
+	}
+	n = sizeof(struct lut_entry) * nmd->nm_lut_total;
+#ifdef linux
+	nmd->nm_lut = nmd->nm_node < 0 ? vmalloc(n) :
+		vmalloc_node(n, nmd->nm_node);
+#else
+	nmd->nm_lut = malloc(n, M_NETMAP, M_NOWAIT | M_ZERO);
+#endif
+	if (nmd->nm_lut == NULL) {
+		D("Unable to create the buffer lut (%d bytes)", (int)n);
+		nmd->nm_lut_total = 0;
+		return ENOMEM;
+	}
+	memcpy(nmd->nm_lut, p->lut, sizeof(struct lut_entry) * p->objtotal);
+	memcpy(nmd->nm_lut + p->objtotal, jp->lut,
+		sizeof(struct lut_entry) * jp->objtotal);
+	return 0;
+}
+
+static void
+netmap_mem_lut_free(struct netmap_mem_d *nmd)
+{
+	if (nmd->nm_lut && nmd->nm_lut != nmd->pools[NETMAP_BUF_POOL].lut) {
+#ifdef linux
+		vfree(nmd->nm_lut);
+#else
+		free(nmd->nm_lut, M_NETMAP);
+#endif
+	}
+	nmd->nm_lut = NULL;
+	nmd->nm_lut_total = 0;
+}
+
+/*
+ * Append clusters to a finalized pool, up to objtotal objects (a
+ * multiple of the objects per cluster), keeping the existing ones.
+ * The clusters have the geometry of the existing ones, and we stop at
+ * the first one we cannot get. The lut and the bitmap are replaced by
+ * larger copies; the old lut is returned in *oldlut, for the caller
+ * to free.
+ * call with NMA_LOCK held
+ */
+static int
+netmap_grow_obj_allocator(struct netmap_obj_pool *p, u_int objtotal,
+	int node, struct lut_entry **oldlut)
+{
+	struct lut_entry *lut;
+	uint32_t *bitmap;
+	u_int i, n;
+	size_t sz;
+
+	*oldlut = NULL;
+	if (objtotal <= p->objtotal)
+		return 0;
+	if (objtotal > p->nummax || p->objtotal % p->_clustentries) {
+		/* the last cluster may be partly used after a shortage */
+		D("cannot grow '%s' to %d objects", p->name, objtotal);
+		return EINVAL;
+	}
+	sz = sizeof(struct lut_entry) * objtotal;
+#ifdef linux
+	lut = node < 0 ? vmalloc(sz) : vmalloc_node(sz, node);
+#else
+	lut = malloc(sz, M_NETMAP, M_NOWAIT | M_ZERO);
+#endif
+	n = (objtotal + 31) / 32;
+	bitmap = malloc(sizeof(uint32_t) * n, M_NETMAP, M_NOWAIT | M_ZERO);
+	if (lut == NULL || bitmap == NULL) {
+		D("Unable to grow the lookup table of '%s'", p->name);
+		goto fail;
+	}
+	memcpy(lut, p->lut, sizeof(struct lut_entry) * p->objtotal);
+	memcpy(bitmap, p->bitmap, sizeof(uint32_t) * p->bitmap_slots);
+
+	for (i = p->objtotal; i < objtotal;) {
+		u_int lim = i + p->_clustentries;
+		char *clust;
+
+		clust = contigmalloc_node(p->_clustsize, M_NETMAP,
+		    M_NOWAIT | M_ZERO, (size_t)0, -1UL,
+		    p->_huge ? NM_HUGEPAGE_SIZE : PAGE_SIZE, 0, node);
+		if (clust == NULL) {
+			D("Unable to create cluster at %d for '%s' allocator",
+			    i, p->name);
+			break;
+		}
+		for (; i < lim; i++, clust += p->_objsize) {
+			bitmap[ (i>>5) ] |=  ( 1 << (i & 31) );
+			lut[i].vaddr = clust;
+			lut[i].paddr = vtophys(clust);
+		}
+	}
+	if (i == p->objtotal)
+		goto fail;
+
+	D("'%s' grown from %d to %d objects", p->name, p->objtotal, i);
+	p->objfree += i - p->objtotal;
+	p->objtotal = p->_objtotal = i;
+	p->numclusters = p->_numclusters = i / p->_clustentries;
+	p->memtotal = p->numclusters * p->_clustsize;
+	free(p->bitmap, M_NETMAP);
+	p->bitmap = bitmap;
+	p->bitmap_slots = n;
+	*oldlut = p->lut;
+	p->lut = lut;
+	return 0;
+
+fail:
+	if (bitmap)
+		free(bitmap, M_NETMAP);
+	if (lut) {
+#ifdef linux
+		vfree(lut);
+#else
+		free(lut, M_NETMAP);
+#endif
+	}
+	return ENOMEM;
+}
+
+/*
+ * The parameters changed and the allocator is finalized. The last pool
+ * of the region can grow at its end: the buffers, or the large buffers
+ * if there are any (their indexes follow those of the buffers). If that
+ * is the only change, we append to it and keep the clusters we have
+ * (e.g. hugepages, which may not come back after a reset).
+ * Not while the allocator is in use (EBUSY): the adapters in netmap
+ * mode cached the lut and the number of buffers, and the processes
+ * mapped the smaller region, so the new buffers would be invalid for
+ * them, and zero-copy paths between ports would hand them over.
+ * EINVAL means that other parameters changed, and the allocator must
+ * be reset.
+ * call with NMA_LOCK held
+ */
+static int
+netmap_mem_grow(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p;
+	struct lut_entry *oldlut, *nm_lut = NULL;
+	u_int objtotal, oldtotal, memtotal;
+	int i, t;
+
+	if (nmd->refcount > 0)
+		return EBUSY;
+	if (!(nmd->flags & NETMAP_MEM_FINALIZED))
+		return EINVAL;
+	t = nmd->pools[NETMAP_JBUF_POOL].objtotal ?
+		NETMAP_JBUF_POOL : NETMAP_BUF_POOL;
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		p = &nmd->pools[i];
+		if (p->r_objsize == nmd->params[i].size &&
+		    p->r_huge == netmap_hugepages &&
+		    (p->r_objtotal == nmd->params[i].num ||
+		     (i == t && p->r_objtotal < nmd->params[i].num)))
+			continue;
+		return EINVAL;
+	}
+	p = &nmd->pools[t];
+	objtotal = (nmd->params[t].num + p->_clustentries - 1) /
+		p->_clustentries * p->_clustentries;
+
+	if (t == NETMAP_JBUF_POOL) {
+		/* nm_lut is a copy, the new one must cover all of them */
+		size_t n = sizeof(struct lut_entry) *
+			(nmd->pools[NETMAP_BUF_POOL].objtotal + objtotal);
+#ifdef linux
+		nm_lut = nmd->nm_node < 0 ? vmalloc(n) :
+			vmalloc_node(n, nmd->nm_node);
+#else
+		nm_lut = malloc(n, M_NETMAP, M_NOWAIT | M_ZERO);
+#endif
+		if (nm_lut == NULL)
+			return ENOMEM;
+	}
+	oldtotal = p->objtotal;
+	memtotal = p->memtotal;
+	if (netmap_grow_obj_allocator(p, objtotal, nmd->nm_node, &oldlut))
+		goto fail;
+	p->r_objtotal = nmd->params[t].num;
+	if (oldlut == NULL)	/* the clusters already had room */
+		goto fail;
+	nmd->nm_totalsize += p->memtotal - memtotal;
+
+	if (t == NETMAP_BUF_POOL) {
+		/* no large buffers, nm_lut was the lut of the pool */
+		nmd->nm_lut = p->lut;
+	} else {
+		memcpy(nm_lut, nmd->nm_lut,
+			sizeof(struct lut_entry) * nmd->nm_lut_total);
+		memcpy(nm_lut + nmd->nm_lut_total, p->lut + oldtotal,
+			sizeof(struct lut_entry) * (p->objtotal - oldtotal));
+#ifdef linux
+		vfree(nmd->nm_lut);
+#else
+		free(nmd->nm_lut, M_NETMAP);
+#endif
+		nmd->nm_lut = nm_lut;
+	}
+#ifdef linux
+	vfree(oldlut);
+#else
+	free(oldlut, M_NETMAP);
+#endif
+	nmd->nm_lut_total = nmd->pools[NETMAP_BUF_POOL].objtotal +
+		nmd->pools[NETMAP_JBUF_POOL].objtotal;
+	return 0;
+
+fail:
+	if (nm_lut) {
+#ifdef linux
+		vfree(nm_lut);
+#else
+		free(nm_lut, M_NETMAP);
+#endif
+	}
+	return p->r_objtotal == nmd->params[t].num ? 0 : ENOMEM;
+}
+
 /* call with lock held */
 static int
 netmap_memory_config_changed(struct netmap_mem_d *nmd)
@@ -953,8 +1577,9 @@ netmap_memory_config_changed(struct netmap_mem_d *nmd)
 	int i;
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-		if (nmd->pools[i].r_objsize != netmap_params[i].size ||
-		    nmd->pools[i].r_objtotal != netmap_params[i].num)
+		if (nmd->pools[i].r_objsize != nmd->params[i].size ||
+		    nmd->pools[i].r_objtotal != nmd->params[i].num ||
+		    nmd->pools[i].r_huge != netmap_hugepages)
 		    return 1;
 	}
 	return 0;
@@ -967,16 +1592,21 @@ netmap_mem_reset_all(struct netmap_mem_d *nmd)
 
 	if (netmap_verbose)
 		D("resetting %p", nmd);
+	netmap_mem_lut_free(nmd);
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		netmap_reset_obj_allocator(&nmd->pools[i]);
 	}
-	nmd->flags  &= ~NETMAP_MEM_FINALIZED;
+	nmd->flags  &= ~(NETMAP_MEM_FINALIZED | NETMAP_MEM_HUGEPAGES);
 }
 
+/*
+ * The large buffers are not mapped, NICs do not use them.
+ */
 static int
-netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
+netmap_mem_unmap(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
-	int i, lim = p->_objtotal;
+	struct lut_entry *lut = nmd->nm_lut;
+	int i, lim = nmd->pools[NETMAP_BUF_POOL].objtotal;
 
 	if (na->pdev == NULL)
 		return 0;
@@ -984,10 +1614,11 @@ netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
 #ifdef __FreeBSD__
 	(void)i;
 	(void)lim;
+	(void)lut;
 	D("unsupported on FreeBSD");
 #else /* linux */
 	for (i = 2; i < lim; i++) {
-		netmap_unload_map(na, (bus_dma_tag_t) na->pdev, &p->lut[i].paddr);
+		netmap_unload_map(na, (bus_dma_tag_t) na->pdev, &lut[i].paddr);
 	}
 #endif /* linux */
 
@@ -995,19 +1626,20 @@ netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
 }
 
 static int
-netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
+netmap_mem_map(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
 #ifdef __FreeBSD__
 	D("unsupported on FreeBSD");
 #else /* linux */
-	int i, lim = p->_objtotal;
+	struct lut_entry *lut = nmd->nm_lut;
+	int i, lim = nmd->pools[NETMAP_BUF_POOL].objtotal;
 
 	if (na->pdev == NULL)
 		return 0;
 
 	for (i = 2; i < lim; i++) {
-		netmap_load_map(na, (bus_dma_tag_t) na->pdev, &p->lut[i].paddr,
-				p->lut[i].vaddr);
+		netmap_load_map(na, (bus_dma_tag_t) na->pdev, &lut[i].paddr,
+				lut[i].vaddr);
 	}
 #endif /* linux */
 
@@ -1023,7 +1655,8 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	nmd->lasterr = 0;
 	nmd->nm_totalsize = 0;
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
+		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i],
+				nmd->nm_node);
 		if (nmd->lasterr)
 			goto error;
 		nmd->nm_totalsize += nmd->pools[i].memtotal;
@@ -1031,13 +1664,19 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	/* buffers 0 and 1 are reserved */
 	nmd->pools[NETMAP_BUF_POOL].objfree -= 2;
 	nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3;
+	nmd->lasterr = netmap_mem_lut_build(nmd);
+	if (nmd->lasterr)
+		goto error;
 	nmd->flags |= NETMAP_MEM_FINALIZED;
+	if (nmd->pools[NETMAP_BUF_POOL]._huge)
+		nmd->flags |= NETMAP_MEM_HUGEPAGES;
 
 	if (netmap_verbose)
-		D("interfaces %d KB, rings %d KB, buffers %d MB",
+		D("interfaces %d KB, rings %d KB, buffers %d MB, large %d MB",
 		    nmd->pools[NETMAP_IF_POOL].memtotal >> 10,
 		    nmd->pools[NETMAP_RING_POOL].memtotal >> 10,
-		    nmd->pools[NETMAP_BUF_POOL].memtotal >> 20);
+		    nmd->pools[NETMAP_BUF_POOL].memtotal >> 20,
+		    nmd->pools[NETMAP_JBUF_POOL].memtotal >> 20);
 
 	if (netmap_verbose)
 		D("Free buffers: %d", nmd->pools[NETMAP_BUF_POOL].objfree);
@@ -1133,7 +1772,8 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 	}
 
 	/* possibly increase them to fit user request */
-	v = sizeof(struct netmap_if) + sizeof(ssize_t) * (txr + rxr);
+	v = sizeof(struct netmap_if) + sizeof(ssize_t) * (txr + rxr) +
+		(rxr + 31) / 32 * sizeof(uint32_t);	/* NETMAP_IF_RX_PENDING */
 	if (p[NETMAP_IF_POOL].size < v)
 		p[NETMAP_IF_POOL].size = v;
 	v = 2 + 4 * npipes;
@@ -1158,25 +1798,34 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 		/* the +2 is for the tx and rx fake buffers (indices 0 and 1) */
 	if (p[NETMAP_BUF_POOL].num < v)
 		p[NETMAP_BUF_POOL].num = v;
+	/* if enabled, enough large buffers for all the rings
+	 * (pipes cannot have them)
+	 */
+	v = rxr * rxd + txr * txd;
+	if (p[NETMAP_JBUF_POOL].num > 0 && p[NETMAP_JBUF_POOL].num < v)
+		p[NETMAP_JBUF_POOL].num = v;
 
 	if (netmap_verbose)
-		D("req if %d*%d ring %d*%d buf %d*%d",
+		D("req if %d*%d ring %d*%d buf %d*%d jbuf %d*%d",
 			p[NETMAP_IF_POOL].num,
 			p[NETMAP_IF_POOL].size,
 			p[NETMAP_RING_POOL].num,
 			p[NETMAP_RING_POOL].size,
 			p[NETMAP_BUF_POOL].num,
-			p[NETMAP_BUF_POOL].size);
+			p[NETMAP_BUF_POOL].size,
+			p[NETMAP_JBUF_POOL].num,
+			p[NETMAP_JBUF_POOL].size);
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		snprintf(d->pools[i].name, NETMAP_POOL_MAX_NAMSZ,
 				nm_blueprint.pools[i].name,
 				name);
 		err = netmap_config_obj_allocator(&d->pools[i],
-				p[i].num, p[i].size);
+				p[i].num, p[i].size, netmap_hugepages);
 		if (err)
 			goto error;
 	}
+	netmap_mem_huge_align(d);
 
 	d->flags &= ~NETMAP_MEM_FINALIZED;
 
@@ -1197,29 +1846,36 @@ netmap_mem_global_config(struct netmap_mem_d *nmd)
 {
 	int i;
 
-	if (nmd->refcount)
-		/* already in use, we cannot change the configuration */
+	if (!netmap_memory_config_changed(nmd))
 		goto out;
 
-	if (!netmap_memory_config_changed(nmd))
+	/* a larger last pool is appended to, EBUSY while in use */
+	if (netmap_mem_grow(nmd) == 0)
+		goto out;
+	if (nmd->refcount) {
+		RD(60, "memory in use, new parameters deferred");
 		goto out;
+	}
 
 	D("reconfiguring");
 
 	if (nmd->flags & NETMAP_MEM_FINALIZED) {
 		/* reset previous allocation */
+		netmap_mem_lut_free(nmd);
 		for (i = 0; i < NETMAP_POOLS_NR; i++) {
 			netmap_reset_obj_allocator(&nmd->pools[i]);
 		}
-		nmd->flags &= ~NETMAP_MEM_FINALIZED;
+		nmd->flags &= ~(NETMAP_MEM_FINALIZED | NETMAP_MEM_HUGEPAGES);
 	}
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		nmd->lasterr = netmap_config_obj_allocator(&nmd->pools[i],
-				netmap_params[i].num, netmap_params[i].size);
+				nmd->params[i].num, nmd->params[i].size,
+				netmap_hugepages);
 		if (nmd->lasterr)
 			goto out;
 	}
+	netmap_mem_huge_align(nmd);
 
 out:
 
@@ -1272,14 +1928,215 @@ netmap_mem_init(void)
 void
 netmap_mem_fini(void)
 {
-	int i;
+	int i, j;
 
+	for (j = 0; j < NM_NUMA_MAXNODES; j++) {
+		if (nm_mem_node[j] == NULL)
+			continue;
+		nm_mem_global_delete(nm_mem_node[j]);
+		nm_mem_node[j] = NULL;
+	}
+	if (nm_mem_vale != NULL) {
+		nm_mem_global_delete(nm_mem_vale);
+		nm_mem_vale = NULL;
+	}
+	netmap_mem_lut_free(&nm_mem);
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 	    netmap_destroy_obj_allocator(&nm_mem.pools[i]);
 	}
 	NMA_LOCK_DESTROY(&nm_mem);
 }
 
+/*
+ * Return the global allocator to be used by a NIC: nm_mem, or the
+ * copy local to the NUMA node of the device if netmap_numa_mem is set.
+ * The per-node copies are never released before netmap_mem_fini().
+ */
+/*
+ * A new allocator that works as nm_mem (same limits, configured with
+ * params when first used) for the NUMA node, tag is appended to the
+ * names of the pools.
+ */
+static struct netmap_mem_d *
+nm_mem_global_new(const char *tag, struct netmap_obj_params *params,
+	int node)
+{
+	struct netmap_mem_d *nmd;
+	int i;
+
+	nmd = malloc(sizeof(*nmd), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (nmd == NULL)
+		return NULL;
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		struct netmap_obj_pool *p = &nmd->pools[i];
+
+		snprintf(p->name, NETMAP_POOL_MAX_NAMSZ, "%s%s",
+		    nm_mem.pools[i].name, tag);
+		p->objminsize = nm_mem.pools[i].objminsize;
+		p->objmaxsize = nm_mem.pools[i].objmaxsize;
+		p->nummin = nm_mem.pools[i].nummin;
+		p->nummax = nm_mem.pools[i].nummax;
+	}
+	nmd->config = netmap_mem_global_config;
+	nmd->finalize = netmap_mem_global_finalize;
+	nmd->deref = netmap_mem_global_deref;
+	nmd->params = params;
+	nmd->nm_grp = -1;
+	nmd->nm_node = node;
+	if (nm_mem_assign_id(nmd)) {
+		free(nmd, M_DEVBUF);
+		return NULL;
+	}
+	NMA_LOCK_INIT(nmd);
+	return nmd;
+}
+
+/* free an allocator from nm_mem_global_new() */
+static void
+nm_mem_global_delete(struct netmap_mem_d *nmd)
+{
+	int i;
+
+	netmap_mem_lut_free(nmd);
+	for (i = 0; i < NETMAP_POOLS_NR; i++)
+		netmap_destroy_obj_allocator(&nmd->pools[i]);
+	nm_mem_release_id(nmd);
+	NMA_LOCK_DESTROY(nmd);
+	free(nmd, M_DEVBUF);
+}
+
+struct netmap_mem_d *
+netmap_mem_global_get(struct netmap_adapter *na)
+{
+	struct netmap_mem_d *nmd, *old;
+	char tag[8];
+	int node;
+
+	node = na->pdev ? nm_numa_node(na->pdev) : -1;
+	if (!netmap_numa_mem || node < 0 || node >= NM_NUMA_MAXNODES)
+		return &nm_mem;
+
+	NMA_LOCK(&nm_mem);
+	nmd = nm_mem_node[node];
+	NMA_UNLOCK(&nm_mem);
+	if (nmd != NULL)
+		return nmd;
+
+	snprintf(tag, sizeof(tag), "@%d", node);
+	nmd = nm_mem_global_new(tag, netmap_params, node);
+	if (nmd == NULL) {
+		D("no memory for the node %d allocator, using the global one",
+		    node);
+		return &nm_mem;
+	}
+
+	/* another NIC of the same node may have raced with us */
+	NMA_LOCK(&nm_mem);
+	old = nm_mem_node[node];
+	if (old == NULL)
+		nm_mem_node[node] = nmd;
+	NMA_UNLOCK(&nm_mem);
+	if (old != NULL) {
+		nm_mem_global_delete(nmd);
+		return old;
+	}
+	if (netmap_verbose)
+		D("new allocator %d for NUMA node %d", nmd->nm_id, node);
+	return nmd;
+}
+
+/*
+ * Return the allocator shared by the VALE ports (netmap_vale_shared_mem),
+ * created on first use with the netmap_vale_params, or NULL.
+ * As the global one, it is configured and filled when the first port
+ * is registered, and then kept (and reconfigured only if the parameters
+ * change while no port is registered), so registering a port does not
+ * allocate memory. The ports get NETMAP_MEM_PRIVATE, as they do not
+ * share the memory with the NICs.
+ */
+struct netmap_mem_d *
+netmap_mem_vale_get(void)
+{
+	struct netmap_mem_d *nmd, *old;
+
+	NMA_LOCK(&nm_mem);
+	nmd = nm_mem_vale;
+	NMA_UNLOCK(&nm_mem);
+	if (nmd != NULL)
+		return nmd;
+
+	nmd = nm_mem_global_new("@vale", netmap_vale_params, -1);
+	if (nmd == NULL)
+		return NULL;
+	nmd->flags |= NETMAP_MEM_PRIVATE;
+	/* many small ports */
+	nmd->pools[NETMAP_IF_POOL].nummax = 100000;
+	nmd->pools[NETMAP_RING_POOL].nummax = 100000;
+
+	NMA_LOCK(&nm_mem);
+	old = nm_mem_vale;
+	if (old == NULL)
+		nm_mem_vale = nmd;
+	NMA_UNLOCK(&nm_mem);
+	if (old != NULL) {
+		nm_mem_global_delete(nmd);
+		return old;
+	}
+	if (netmap_verbose)
+		D("new allocator %d for the VALE ports", nmd->nm_id);
+	return nmd;
+}
+
+int
+netmap_mem_get_node(struct netmap_mem_d *nmd)
+{
+	return nmd->nm_node;
+}
+
+/*
+ * Slots in the largest ring that fits in a ring object of nmd, as
+ * configured or, if not in use yet, as it will be configured.
+ */
+u_int
+netmap_mem_get_maxslots(struct netmap_mem_d *nmd)
+{
+	u_int size;
+
+	NMA_LOCK(nmd);
+	size = nmd->pools[NETMAP_RING_POOL]._objsize;
+	if (!(nmd->flags & NETMAP_MEM_FINALIZED) && nmd->params)
+		size = nmd->params[NETMAP_RING_POOL].size;
+	NMA_UNLOCK(nmd);
+	return size > sizeof(struct netmap_ring) ?
+		(size - sizeof(struct netmap_ring)) / sizeof(struct netmap_slot) : 0;
+}
+
+/* the ring has its own buffers (not one of the fake host rings) */
+static inline int
+netmap_ring_has_bufs(struct netmap_adapter *na, struct netmap_kring *kring)
+{
+	return (na->na_flags & NAF_HOST_RINGS) ||
+		(kring != na->tx_rings + na->num_tx_rings &&
+		 kring != na->rx_rings + na->num_rx_rings);
+}
+
+/*
+ * Account for the n buffers of a new ring of na, within the quota
+ * of the port if it has one (VALE ports on the shared allocator).
+ * Call with NMA_LOCK held.
+ */
+static int
+netmap_mem_quota_get(struct netmap_adapter *na, u_int n)
+{
+	if (na->na_buf_quota && na->na_buf_used + n > na->na_buf_quota) {
+		D("%s: %u buffers would exceed the quota of %u", na->name,
+		    na->na_buf_used + n, na->na_buf_quota);
+		return ENOMEM;
+	}
+	na->na_buf_used += n;
+	return 0;
+}
+
 static void
 netmap_free_rings(struct netmap_adapter *na)
 {
@@ -1291,20 +2148,53 @@ netmap_free_rings(struct netmap_adapter *na)
 		ring = kring->ring;
 		if (ring == NULL)
 			continue;
+		if (netmap_ring_has_bufs(na, kring))
+			na->na_buf_used -= kring->nkr_num_slots;
 		netmap_free_bufs(na->nm_mem, ring->slot, kring->nkr_num_slots);
 		netmap_ring_free(na->nm_mem, ring);
 		kring->ring = NULL;
+		kring->nkr_ts = NULL;
+		kring->nkr_ts_pend = 0;
 	}
 	for (/* cont'd from above */; kring != na->tailroom; kring++) {
 		ring = kring->ring;
 		if (ring == NULL)
 			continue;
+		if (netmap_ring_has_bufs(na, kring))
+			na->na_buf_used -= kring->nkr_num_slots;
 		netmap_free_bufs(na->nm_mem, ring->slot, kring->nkr_num_slots);
 		netmap_ring_free(na->nm_mem, ring);
 		kring->ring = NULL;
+		kring->nkr_ts = NULL;
+		kring->nkr_ts_pend = 0;
 	}
 }
 
+/*
+ * Set buf_ofs and nr_buf_size of the ring of kring, so that
+ * NETMAP_BUF(ring, i) works in userspace for the buffers of the
+ * ring: for large buffers, buf_ofs points to where buffer 0 would
+ * be if all the buffers were large (possibly before the region).
+ * Call with NMA_LOCK held.
+ */
+static void
+netmap_mem_ring_bufs(struct netmap_mem_d *nmd, struct netmap_kring *kring)
+{
+	struct netmap_ring *ring = kring->ring;
+	int64_t ofs = nmd->pools[NETMAP_IF_POOL].memtotal +
+		nmd->pools[NETMAP_RING_POOL].memtotal;
+	uint32_t size = netmap_mem_bufsize(nmd);
+
+	if (kring->nr_kflags & NKR_JBUF) {
+		size = nmd->pools[NETMAP_JBUF_POOL]._objsize;
+		ofs = netmap_jbuf_base(nmd) -
+			(int64_t)nmd->pools[NETMAP_BUF_POOL].objtotal * size;
+	}
+	*(int64_t *)(uintptr_t)&ring->buf_ofs =
+		ofs - netmap_ring_offset(nmd, ring);
+	*(uint32_t *)(uintptr_t)&ring->nr_buf_size = size;
+}
+
 /* call with NMA_LOCK held *
  *
  * Allocate netmap rings and buffers for this card
@@ -1331,6 +2221,8 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 		ndesc = kring->nkr_num_slots;
 		len = sizeof(struct netmap_ring) +
 			  ndesc * sizeof(struct netmap_slot);
+		if (na->na_flags & NAF_HW_TS)
+			len += ndesc * sizeof(uint64_t);
 		ring = netmap_ring_malloc(na->nm_mem, len);
 		if (ring == NULL) {
 			D("Cannot allocate tx_ring");
@@ -1339,25 +2231,26 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 		ND("txring at %p", ring);
 		kring->ring = ring;
 		*(uint32_t *)(uintptr_t)&ring->num_slots = ndesc;
-		*(int64_t *)(uintptr_t)&ring->buf_ofs =
-		    (na->nm_mem->pools[NETMAP_IF_POOL].memtotal +
-			na->nm_mem->pools[NETMAP_RING_POOL].memtotal) -
-			netmap_ring_offset(na->nm_mem, ring);
+		if (na->na_flags & NAF_HW_TS) /* no timestamps yet */
+			bzero(nm_ring_ts(ring), ndesc * sizeof(uint64_t));
+		netmap_mem_ring_bufs(na->nm_mem, kring);
 
 		/* copy values from kring */
 		ring->head = kring->rhead;
 		ring->cur = kring->rcur;
 		ring->tail = kring->rtail;
-		*(uint16_t *)(uintptr_t)&ring->nr_buf_size =
-			netmap_mem_bufsize(na->nm_mem);
 		ND("%s h %d c %d t %d", kring->name,
 			ring->head, ring->cur, ring->tail);
 		ND("initializing slots for txring");
 		if (i != na->num_tx_rings || (na->na_flags & NAF_HOST_RINGS)) {
 			/* this is a real ring */
-			if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc)) {
+			if (netmap_mem_quota_get(na, ndesc))
+				goto nobufs;
+			if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc,
+					kring->nr_kflags & NKR_JBUF)) {
 				D("Cannot allocate buffers for tx_ring");
-				goto cleanup;
+				na->na_buf_used -= ndesc;
+				goto nobufs;
 			}
 		} else {
 			/* this is a fake tx ring, set all indices to 0 */
@@ -1374,6 +2267,8 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 		ndesc = kring->nkr_num_slots;
 		len = sizeof(struct netmap_ring) +
 			  ndesc * sizeof(struct netmap_slot);
+		if (na->na_flags & NAF_HW_TS)
+			len += ndesc * sizeof(uint64_t);
 		ring = netmap_ring_malloc(na->nm_mem, len);
 		if (ring == NULL) {
 			D("Cannot allocate rx_ring");
@@ -1382,25 +2277,26 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 		ND("rxring at %p", ring);
 		kring->ring = ring;
 		*(uint32_t *)(uintptr_t)&ring->num_slots = ndesc;
-		*(int64_t *)(uintptr_t)&ring->buf_ofs =
-		    (na->nm_mem->pools[NETMAP_IF_POOL].memtotal +
-		        na->nm_mem->pools[NETMAP_RING_POOL].memtotal) -
-			netmap_ring_offset(na->nm_mem, ring);
+		if (na->na_flags & NAF_HW_TS) /* no timestamps yet */
+			bzero(nm_ring_ts(ring), ndesc * sizeof(uint64_t));
+		netmap_mem_ring_bufs(na->nm_mem, kring);
 
 		/* copy values from kring */
 		ring->head = kring->rhead;
 		ring->cur = kring->rcur;
 		ring->tail = kring->rtail;
-		*(int *)(uintptr_t)&ring->nr_buf_size =
-			netmap_mem_bufsize(na->nm_mem);
 		ND("%s h %d c %d t %d", kring->name,
 			ring->head, ring->cur, ring->tail);
 		ND("initializing slots for rxring %p", ring);
 		if (i != na->num_rx_rings || (na->na_flags & NAF_HOST_RINGS)) {
 			/* this is a real ring */
-			if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc)) {
+			if (netmap_mem_quota_get(na, ndesc))
+				goto nobufs;
+			if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc,
+					kring->nr_kflags & NKR_JBUF)) {
 				D("Cannot allocate buffers for rx_ring");
-				goto cleanup;
+				na->na_buf_used -= ndesc;
+				goto nobufs;
 			}
 		} else {
 			/* this is a fake rx ring, set all indices to 1 */
@@ -1412,6 +2308,10 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 
 	return 0;
 
+nobufs:
+	/* the ring has no buffers, do not let netmap_free_rings() see it */
+	netmap_ring_free(na->nm_mem, kring->ring);
+	kring->ring = NULL;
 cleanup:
 	netmap_free_rings(na);
 
@@ -1452,12 +2352,14 @@ netmap_mem_if_new(struct netmap_adapter *na)
 	nrx = na->num_rx_rings + 1;
 	/*
 	 * the descriptor is followed inline by an array of offsets
-	 * to the tx and rx rings in the shared memory region.
+	 * to the tx and rx rings in the shared memory region,
+	 * and by the bitmap of the pending rx rings.
 	 */
 
 	NMA_LOCK(na->nm_mem);
 
-	len = sizeof(struct netmap_if) + (nrx + ntx) * sizeof(ssize_t);
+	len = sizeof(struct netmap_if) + (nrx + ntx) * sizeof(ssize_t) +
+		(nrx + 31) / 32 * sizeof(uint32_t);
 	nifp = netmap_if_malloc(na->nm_mem, len);
 	if (nifp == NULL) {
 		NMA_UNLOCK(na->nm_mem);
@@ -1483,6 +2385,9 @@ netmap_mem_if_new(struct netmap_adapter *na)
 		*(ssize_t *)(uintptr_t)&nifp->ring_ofs[i+ntx] =
 			netmap_ring_offset(na->nm_mem, na->rx_rings[i].ring) - base;
 	}
+	/* until the first sync, all rx rings are worth a look */
+	memset(NETMAP_IF_RX_PENDING(nifp), 0xff,
+		(nrx + 31) / 32 * sizeof(uint32_t));
 
 	NMA_UNLOCK(na->nm_mem);
 
@@ -1495,9 +2400,9 @@ netmap_mem_if_delete(struct netmap_adapter *na, struct netmap_if *nifp)
 	if (nifp == NULL)
 		/* nothing to do */
 		return;
-	NMA_LOCK(na->nm_mem);
 	if (nifp->ni_bufs_head)
 		netmap_extra_free(na, nifp->ni_bufs_head);
+	NMA_LOCK(na->nm_mem);
 	netmap_if_free(na->nm_mem, nifp);
 
 	NMA_UNLOCK(na->nm_mem);
@@ -1527,7 +2432,7 @@ netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 	}
 
 	if (!nmd->lasterr && na->pdev)
-		netmap_mem_map(&nmd->pools[NETMAP_BUF_POOL], na);
+		netmap_mem_map(nmd, na);
 
 	return nmd->lasterr;
 }
@@ -1536,7 +2441,7 @@ void
 netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
 	NMA_LOCK(nmd);
-	netmap_mem_unmap(&nmd->pools[NETMAP_BUF_POOL], na);
+	netmap_mem_unmap(nmd, na);
 	NMA_UNLOCK(nmd);
 	return nmd->deref(nmd);
 }
@@ -92,6 +92,13 @@
  *	Must contain a full frame (eg 1518, or more for vlans, jumbo
  *	frames etc.) plus be nicely aligned, plus some NICs restrict
  *	the size to multiple of 1K or so. Default to 2K
+ *
+ * nm_jbuf_pool (optional, empty by default)
+ *	Large buffers, e.g. for 9000 byte frames, mapped after nm_buf.
+ *	Their indexes follow those of nm_buf, and rings registered
+ *	with NR_JBUF get them instead of the normal buffers. Only
+ *	VALE ports support them for now, as NIC drivers program their
+ *	DMA descriptors with the size of the normal buffers.
  */
 #ifndef _NET_NETMAP_MEM2_H_
 #define _NET_NETMAP_MEM2_H_
@@ -102,7 +109,8 @@
  *
  * - global: used by hardware NICS;
  *
- * - private: used by VALE ports.
+ * - private: used by VALE ports, unless they share the one returned by
+ *   netmap_mem_vale_get() (vale_shared_mem), which works as a global one.
  *
  * In both cases, the netmap_mem_d structure has the same lifetime as the
  * netmap_adapter of the corresponding NIC or port. It is the responsibility of
@@ -116,11 +124,20 @@
  */
 
 extern struct netmap_mem_d nm_mem;
+extern int netmap_hugepages;
+extern int netmap_numa_mem;
 
 struct lut_entry* netmap_mem_get_lut(struct netmap_mem_d *);
 u_int      netmap_mem_get_buftotal(struct netmap_mem_d *);
 size_t     netmap_mem_get_bufsize(struct netmap_mem_d *);
+u_int      netmap_mem_get_jbuftotal(struct netmap_mem_d *);
+size_t     netmap_mem_get_jbufsize(struct netmap_mem_d *);
+int        netmap_mem_get_node(struct netmap_mem_d *);
+u_int      netmap_mem_get_maxslots(struct netmap_mem_d *);
+struct netmap_mem_d* netmap_mem_global_get(struct netmap_adapter *);
+struct netmap_mem_d* netmap_mem_vale_get(void);
 vm_paddr_t netmap_mem_ofstophys(struct netmap_mem_d *, vm_ooffset_t);
+vm_paddr_t netmap_mem_ofstophys_huge(struct netmap_mem_d *, vm_ooffset_t);
 int	   netmap_mem_finalize(struct netmap_mem_d *, struct netmap_adapter *);
 int 	   netmap_mem_init(void);
 void 	   netmap_mem_fini(void);
@@ -129,7 +146,8 @@ void 	   netmap_mem_if_delete(struct netmap_adapter *, struct netmap_if *);
 int	   netmap_mem_rings_create(struct netmap_adapter *);
 void	   netmap_mem_rings_delete(struct netmap_adapter *);
 void 	   netmap_mem_deref(struct netmap_mem_d *, struct netmap_adapter *);
-int	   netmap_mem_get_info(struct netmap_mem_d *, u_int *size, u_int *memflags, uint16_t *id);
+int	   netmap_mem_get_info(struct netmap_mem_d *, u_int *size, u_int *memflags, uint16_t *id,
+	u_int *jbufsize);
 ssize_t    netmap_mem_if_offset(struct netmap_mem_d *, const void *vaddr);
 struct netmap_mem_d* netmap_mem_private_new(const char *name,
 	u_int txr, u_int txd, u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes,
@@ -138,8 +156,10 @@ void	   netmap_mem_private_delete(struct netmap_mem_d *);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
+#define NETMAP_MEM_HUGEPAGES	0x8	/* buffers are in hugepage clusters */
 
 uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
+void	 netmap_extra_free(struct netmap_adapter *, uint32_t head);
 
 
 #endif
@@ -52,8 +52,18 @@
  * If the monitor is not able to cope with the stream of frames, excess traffic
  * will be dropped.
  *
- * Each ring can be monitored by at most one monitor. This may change in the
- * future, if we implement monitor chaining.
+ * By default the monitor swaps buffers with the monitored rings, so the
+ * monitored application loses the frames (it finds the old monitor
+ * buffers in the released slots). Each ring can have at most one such
+ * zero-copy monitor.
+ *
+ * With NR_MONITOR_COPY the monitor copies the first 'snaplen' bytes
+ * (nr_arg3, 0 for the whole frame) into its own buffers and leaves the
+ * monitored rings alone, so any number of copy monitors can look at a
+ * ring, also together with a zero-copy one, which comes last.
+ * A copy monitor can also ask for fewer rx rings (nr_rx_rings) than the
+ * parent has: parent ring i, tx or rx, goes to monitor ring i % nr_rx_rings,
+ * so e.g. a single ring collects all the traffic of the port.
  *
  */
 
@@ -105,61 +115,61 @@
 
 #define NM_MONITOR_MAXSLOTS 4096
 
-/* monitor works by replacing the nm_sync callbacks in the monitored rings.
- * The actions to be performed are the same on both tx and rx rings, so we
- * have collected them here
+/* compute the free slots on the monitor ring mkring, and advance
+ * *beg to skip (and count as drops) the oldest of rel_slots released
+ * slots that do not fit.
+ * Return the number of slots to pass to the monitor.
+ * Called with mkring->q_lock held.
  */
-static int
-netmap_monitor_parent_sync(struct netmap_kring *kring, int flags, u_int* ringptr)
+static u_int
+netmap_monitor_room(struct netmap_kring *kring, struct netmap_kring *mkring,
+	u_int *beg, u_int rel_slots)
+{
+	u_int lim = kring->nkr_num_slots - 1, free_slots;
+	int busy;
+
+	busy = mkring->nr_hwtail - mkring->nr_hwcur;
+	if (busy < 0)
+		busy += mkring->nkr_num_slots;
+	free_slots = mkring->nkr_num_slots - 1 - busy;
+
+	if (free_slots < rel_slots) {
+		netmap_kstat_drop(mkring, NM_STAT_DROP_MONITOR,
+		    rel_slots - free_slots);
+		*beg += (rel_slots - free_slots);
+		if (*beg > lim)
+			*beg -= lim + 1;
+		rel_slots = free_slots;
+	}
+	return rel_slots;
+}
+
+/* zero-copy monitor: swap the released slots with the free
+ * slots of the monitor ring
+ */
+static void
+netmap_monitor_swap(struct netmap_monitor_adapter *mna,
+	struct netmap_kring *kring, u_int beg, u_int rel_slots)
 {
-	struct netmap_monitor_adapter *mna = kring->monitor;
 	struct netmap_kring *mkring = &mna->up.rx_rings[kring->ring_id];
 	struct netmap_ring *ring = kring->ring, *mring = mkring->ring;
-	int error;
-	int rel_slots, free_slots, busy;
-	u_int beg, end, i;
+	uint64_t *ts = kring->nkr_ts, *mts = mkring->nkr_ts;
+	u_int i;
 	u_int lim = kring->nkr_num_slots - 1,
 	      mlim = mkring->nkr_num_slots - 1;
 
-	/* get the relased slots (rel_slots) */
-	beg = *ringptr;
-	error = kring->save_sync(kring, flags);
-	if (error)
-		return error;
-	end = *ringptr;
-	rel_slots = end - beg;
-	if (rel_slots < 0)
-		rel_slots += kring->nkr_num_slots;
-
-	if (!rel_slots) {
-		return 0;
-	}
-
 	/* we need to lock the monitor receive ring, since it
 	 * is the target of bot tx and rx traffic from the monitored
 	 * adapter
 	 */
 	mtx_lock(&mkring->q_lock);
-	/* get the free slots available on the monitor ring */
-	i = mkring->nr_hwtail;
-	busy = i - mkring->nr_hwcur;
-	if (busy < 0)
-		busy += mkring->nkr_num_slots;
-	free_slots = mlim - busy;
-
-	if (!free_slots) {
+	rel_slots = netmap_monitor_room(kring, mkring, &beg, rel_slots);
+	if (!rel_slots) {
 		mtx_unlock(&mkring->q_lock);
-		return 0;
-	}
-
-	/* swap min(free_slots, rel_slots) slots */
-	if (free_slots < rel_slots) {
-		beg += (rel_slots - free_slots);
-		if (beg > lim)
-			beg = 0;
-		rel_slots = free_slots;
+		return;
 	}
 
+	i = mkring->nr_hwtail;
 	for ( ; rel_slots; rel_slots--) {
 		struct netmap_slot *s = &ring->slot[beg];
 		struct netmap_slot *ms = &mring->slot[i];
@@ -175,6 +185,8 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, int flags, u_int* ringptr
 
 		s->flags |= NS_BUF_CHANGED;
 
+		if (mts)
+			mts[i] = ts ? ts[beg] : 0;
 		beg = nm_next(beg, lim);
 		i = nm_next(i, mlim);
 
@@ -185,6 +197,87 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, int flags, u_int* ringptr
 	mtx_unlock(&mkring->q_lock);
 	/* notify the new frames to the monitor */
 	mna->up.nm_notify(&mna->up, mkring->ring_id, NR_RX, 0);
+}
+
+/* copy monitor: copy up to snaplen bytes of the released slots
+ * into the free slots of the monitor ring
+ */
+static void
+netmap_monitor_copy(struct netmap_monitor_adapter *mna,
+	struct netmap_kring *kring, u_int beg, u_int rel_slots)
+{
+	struct netmap_kring *mkring =
+		&mna->up.rx_rings[kring->ring_id % mna->up.num_rx_rings];
+	struct netmap_ring *ring = kring->ring, *mring = mkring->ring;
+	uint64_t *ts = kring->nkr_ts, *mts = mkring->nkr_ts;
+	u_int i, snaplen = mna->snaplen;
+	u_int lim = kring->nkr_num_slots - 1,
+	      mlim = mkring->nkr_num_slots - 1;
+
+	/* the monitor ring may be fed by several parent rings */
+	mtx_lock(&mkring->q_lock);
+	rel_slots = netmap_monitor_room(kring, mkring, &beg, rel_slots);
+	if (!rel_slots) {
+		mtx_unlock(&mkring->q_lock);
+		return;
+	}
+
+	i = mkring->nr_hwtail;
+	for ( ; rel_slots; rel_slots--) {
+		struct netmap_slot *s = &ring->slot[beg];
+		struct netmap_slot *ms = &mring->slot[i];
+		u_int copy = s->len;
+
+		if (copy > snaplen)
+			copy = snaplen;
+		memcpy(NMB(&mna->up, ms), NMB(kring->na, s), copy);
+		ms->len = copy;
+		if (mts)
+			mts[i] = ts ? ts[beg] : 0;
+
+		beg = nm_next(beg, lim);
+		i = nm_next(i, mlim);
+	}
+	mb();
+	mkring->nr_hwtail = i;
+
+	mtx_unlock(&mkring->q_lock);
+	mna->up.nm_notify(&mna->up, mkring->ring_id, NR_RX, 0);
+}
+
+/* monitor works by replacing the nm_sync callbacks in the monitored rings.
+ * The actions to be performed are the same on both tx and rx rings, so we
+ * have collected them here
+ */
+static int
+netmap_monitor_parent_sync(struct netmap_kring *kring, int flags, u_int* ringptr)
+{
+	struct netmap_monitor_adapter *mna = kring->monitor;
+	int error;
+	int rel_slots;
+	u_int beg, end, i;
+
+	/* get the relased slots (rel_slots) */
+	beg = *ringptr;
+	error = kring->save_sync(kring, flags);
+	if (error)
+		return error;
+	end = *ringptr;
+	rel_slots = end - beg;
+	if (rel_slots < 0)
+		rel_slots += kring->nkr_num_slots;
+
+	if (!rel_slots) {
+		return 0;
+	}
+
+	/* copy monitors go first, the swap changes the buffers */
+	for (i = 0; i < kring->n_monitors; i++) {
+		netmap_monitor_copy(kring->monitors[i], kring, beg, rel_slots);
+	}
+	if (mna && nm_netmap_on(&mna->up)) {
+		netmap_monitor_swap(mna, kring, beg, rel_slots);
+	}
 	return 0;
 }
 
@@ -241,16 +334,106 @@ netmap_monitor_krings_create(struct netmap_adapter *na)
 }
 
 
+/* stop or restart parent ring i, tx or rx */
+static void
+netmap_monitor_set_ring(struct netmap_adapter *pna, u_int i, int tx,
+	int stopped)
+{
+	if (tx)
+		netmap_set_txring(pna, i, stopped);
+	else
+		netmap_set_rxring(pna, i, stopped);
+}
+
+/* start monitoring the parent kring: copy monitors join the list
+ * in the kring (zero-copy ones are in kring->monitor already), and
+ * the first monitor replaces the nm_sync callback.
+ */
+static int
+netmap_monitor_add(struct netmap_monitor_adapter *mna,
+	struct netmap_kring *kring, int tx)
+{
+	struct netmap_adapter *pna = kring->na;
+	int error = 0;
+
+	netmap_monitor_set_ring(pna, kring->ring_id, tx, 1 /* stopped */);
+	if ((mna->flags & NR_HWTS) && (pna->na_flags & NAF_HW_TS) &&
+	    kring->nkr_ts == NULL &&
+	    kring->ring_id < (tx ? pna->num_tx_rings : pna->num_rx_rings)) {
+		/* as in netmap_do_regif(), until the rings are deleted */
+		kring->nkr_ts = nm_ring_ts(kring->ring);
+	}
+	if (mna->flags & NR_MONITOR_COPY) {
+		if (kring->n_monitors == kring->max_monitors) {
+			u_int n = kring->max_monitors ?
+				2 * kring->max_monitors : 2;
+			struct netmap_monitor_adapter **m;
+
+			m = malloc(n * sizeof(*m), M_DEVBUF, M_NOWAIT | M_ZERO);
+			if (m == NULL) {
+				error = ENOMEM;
+				goto out;
+			}
+			if (kring->monitors) {
+				memcpy(m, kring->monitors,
+					kring->n_monitors * sizeof(*m));
+				free(kring->monitors, M_DEVBUF);
+			}
+			kring->monitors = m;
+			kring->max_monitors = n;
+		}
+		kring->monitors[kring->n_monitors++] = mna;
+	}
+	if (kring->save_sync == NULL) {
+		kring->save_sync = kring->nm_sync;
+		kring->nm_sync = tx ? netmap_monitor_parent_txsync :
+			netmap_monitor_parent_rxsync;
+	}
+out:
+	netmap_monitor_set_ring(pna, kring->ring_id, tx, 0 /* enabled */);
+	return error;
+}
+
+/* stop monitoring the parent kring, and restore the original nm_sync
+ * callback if there are no other (registered) monitors.
+ * We need to stop traffic while we are doing this, since the monitored
+ * adapter may have already started executing a netmap_monitor_parent_sync
+ * and may not like the kring->save_sync pointer to become NULL.
+ */
+static void
+netmap_monitor_del(struct netmap_monitor_adapter *mna,
+	struct netmap_kring *kring, int tx)
+{
+	struct netmap_adapter *pna = kring->na;
+	struct netmap_monitor_adapter *zmon = kring->monitor;
+	u_int i;
+
+	netmap_monitor_set_ring(pna, kring->ring_id, tx, 1 /* stopped */);
+	if (mna->flags & NR_MONITOR_COPY) {
+		for (i = 0; i < kring->n_monitors; i++) {
+			if (kring->monitors[i] == mna) {
+				kring->monitors[i] =
+					kring->monitors[--kring->n_monitors];
+				break;
+			}
+		}
+	}
+	if (kring->save_sync && kring->n_monitors == 0 &&
+	    (zmon == NULL || zmon == mna || !nm_netmap_on(&zmon->up))) {
+		kring->nm_sync = kring->save_sync;
+		kring->save_sync = NULL;
+	}
+	netmap_monitor_set_ring(pna, kring->ring_id, tx, 0 /* enabled */);
+}
+
 /* nm_register callback for monitors.
  *
  * On registration, replace the nm_sync callbacks in the monitored
  * rings with our own, saving the previous ones in the monitored
  * rings themselves, where they are used by netmap_monitor_parent_sync.
  *
- * On de-registration, restore the original callbacks. We need to
- * stop traffic while we are doing this, since the monitored adapter may
- * have already started executing a netmap_monitor_parent_sync
- * and may not like the kring->save_sync pointer to become NULL.
+ * On de-registration, restore the original callbacks, unless the
+ * rings have other monitors.
  */
 static int
 netmap_monitor_reg(struct netmap_adapter *na, int onoff)
@@ -259,8 +442,7 @@ netmap_monitor_reg(struct netmap_adapter *na, int onoff)
 		(struct netmap_monitor_adapter *)na;
 	struct netmap_priv_d *priv = &mna->priv;
 	struct netmap_adapter *pna = priv->np_na;
-	struct netmap_kring *kring;
-	int i;
+	int i, error = 0;
 
 	ND("%p: onoff %d", na, onoff);
 	if (onoff) {
@@ -269,17 +451,25 @@ netmap_monitor_reg(struct netmap_adapter *na, int onoff)
 			return ENXIO;
 		}
 		if (mna->flags & NR_MONITOR_TX) {
-			for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
-				kring = &pna->tx_rings[i];
-				kring->save_sync = kring->nm_sync;
-				kring->nm_sync = netmap_monitor_parent_txsync;
+			for (i = priv->np_txqfirst; !error && i < priv->np_txqlast; i++)
+				error = netmap_monitor_add(mna, &pna->tx_rings[i], 1);
+			if (error) {
+				for (i -= 2; i >= (int)priv->np_txqfirst; i--)
+					netmap_monitor_del(mna, &pna->tx_rings[i], 1);
+				return error;
 			}
 		}
 		if (mna->flags & NR_MONITOR_RX) {
-			for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
-				kring = &pna->rx_rings[i];
-				kring->save_sync = kring->nm_sync;
-				kring->nm_sync = netmap_monitor_parent_rxsync;
+			for (i = priv->np_rxqfirst; !error && i < priv->np_rxqlast; i++)
+				error = netmap_monitor_add(mna, &pna->rx_rings[i], 0);
+			if (error) {
+				for (i -= 2; i >= (int)priv->np_rxqfirst; i--)
+					netmap_monitor_del(mna, &pna->rx_rings[i], 0);
+				if (mna->flags & NR_MONITOR_TX) {
+					for (i = priv->np_txqfirst; i < priv->np_txqlast; i++)
+						netmap_monitor_del(mna, &pna->tx_rings[i], 1);
+				}
+				return error;
 			}
 		}
 		na->na_flags |= NAF_NETMAP_ON;
@@ -290,22 +480,12 @@ netmap_monitor_reg(struct netmap_adapter *na, int onoff)
 		}
 		na->na_flags &= ~NAF_NETMAP_ON;
 		if (mna->flags & NR_MONITOR_TX) {
-			for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
-				netmap_set_txring(pna, i, 1 /* stopped */);
-				kring = &pna->tx_rings[i];
-				kring->nm_sync = kring->save_sync;
-				kring->save_sync = NULL;
-				netmap_set_txring(pna, i, 0 /* enabled */);
-			}
+			for (i = priv->np_txqfirst; i < priv->np_txqlast; i++)
+				netmap_monitor_del(mna, &pna->tx_rings[i], 1);
 		}
 		if (mna->flags & NR_MONITOR_RX) {
-			for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
-				netmap_set_rxring(pna, i, 1 /* stopped */);
-				kring = &pna->rx_rings[i];
-				kring->nm_sync = kring->save_sync;
-				kring->save_sync = NULL;
-				netmap_set_rxring(pna, i, 0 /* enabled */);
-			}
+			for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++)
+				netmap_monitor_del(mna, &pna->rx_rings[i], 0);
 		}
 	}
 	return 0;
@@ -333,12 +513,14 @@ netmap_monitor_dtor(struct netmap_adapter *na)
 		/* parent still in netmap mode, mark its krings as free */
 		if (mna->flags & NR_MONITOR_TX) {
 			for (i = priv->np_txqfirst; i < priv->np_txqlast; i++) {
-				pna->tx_rings[i].monitor = NULL;
+				if (pna->tx_rings[i].monitor == mna)
+					pna->tx_rings[i].monitor = NULL;
 			}
 		}
 		if (mna->flags & NR_MONITOR_RX) {
 			for (i = priv->np_rxqfirst; i < priv->np_rxqlast; i++) {
-				pna->rx_rings[i].monitor = NULL;
+				if (pna->rx_rings[i].monitor == mna)
+					pna->rx_rings[i].monitor = NULL;
 			}
 		}
 	}
@@ -375,7 +557,8 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	 * except other monitors.
 	 */
 	memcpy(&pnmr, nmr, sizeof(pnmr));
-	pnmr.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX);
+	pnmr.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX | NR_MONITOR_COPY);
+	pnmr.nr_arg3 = 0;
 	error = netmap_get_na(&pnmr, &pna, create);
 	if (error) {
 		D("parent lookup failed: %d", error);
@@ -400,7 +583,9 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		D("ringid error");
 		goto put_out;
 	}
-	if (nmr->nr_flags & NR_MONITOR_TX) {
+	if (nmr->nr_flags & NR_MONITOR_COPY) {
+		/* copy monitors don't need exclusive access */
+	} else if (nmr->nr_flags & NR_MONITOR_TX) {
 		for (i = mna->priv.np_txqfirst; i < mna->priv.np_txqlast; i++) {
 			struct netmap_kring *kring = &pna->tx_rings[i];
 			if (kring->monitor) {
@@ -408,10 +593,16 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 				D("ring busy");
 				goto release_out;
 			}
+			if (kring->nr_kflags & NKR_JBUF) {
+				/* the swap would mix the buffer sizes */
+				error = EOPNOTSUPP;
+				D("%s has large buffers", kring->name);
+				goto release_out;
+			}
 			kring->monitor = mna;
 		}
 	}
-	if (nmr->nr_flags & NR_MONITOR_RX) {
+	if ((nmr->nr_flags & (NR_MONITOR_RX | NR_MONITOR_COPY)) == NR_MONITOR_RX) {
 		for (i = mna->priv.np_rxqfirst; i < mna->priv.np_rxqlast; i++) {
 			struct netmap_kring *kring = &pna->rx_rings[i];
 			if (kring->monitor) {
@@ -419,14 +610,23 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 				D("ring busy");
 				goto release_out;
 			}
+			if (kring->nr_kflags & NKR_JBUF) {
+				/* the swap would mix the buffer sizes */
+				error = EOPNOTSUPP;
+				D("%s has large buffers", kring->name);
+				goto release_out;
+			}
 			kring->monitor = mna;
 		}
 	}
 
-	snprintf(mna->up.name, sizeof(mna->up.name), "mon:%s", pna->name);
+	snprintf(mna->up.name, sizeof(mna->up.name), "%s:%s",
+		nmr->nr_flags & NR_MONITOR_COPY ? "cmon" : "mon", pna->name);
 
-	/* the monitor supports the host rings iff the parent does */
-	mna->up.na_flags = (pna->na_flags & NAF_HOST_RINGS);
+	/* the monitor supports the host rings iff the parent does,
+	 * and gets the timestamps of the parent, if any
+	 */
+	mna->up.na_flags = (pna->na_flags & (NAF_HOST_RINGS | NAF_HW_TS));
 	mna->up.nm_txsync = netmap_monitor_txsync;
 	mna->up.nm_rxsync = netmap_monitor_rxsync;
 	mna->up.nm_register = netmap_monitor_reg;
@@ -437,6 +637,8 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	mna->up.na_lut = pna->na_lut;
 	mna->up.na_lut_objtotal = pna->na_lut_objtotal;
 	mna->up.na_lut_objsize = pna->na_lut_objsize;
+	mna->up.na_lut_jtotal = pna->na_lut_jtotal;
+	mna->up.na_lut_jsize = pna->na_lut_jsize;
 
 	mna->up.num_tx_rings = 1; // XXX we don't need it, but field can't be zero
 	/* we set the number of our rx_rings to be max(num_rx_rings, num_rx_rings)
@@ -445,6 +647,17 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	mna->up.num_rx_rings = pna->num_rx_rings;
 	if (pna->num_tx_rings > pna->num_rx_rings)
 		mna->up.num_rx_rings = pna->num_tx_rings;
+	if (nmr->nr_flags & NR_MONITOR_COPY) {
+		/* a copy monitor can collect several rings in one */
+		if (nmr->nr_rx_rings > 0 &&
+		    nmr->nr_rx_rings < mna->up.num_rx_rings)
+			mna->up.num_rx_rings = nmr->nr_rx_rings;
+		/* nr_arg3 is the snaplen, not extra buffers */
+		mna->snaplen = nmr->nr_arg3;
+		if (mna->snaplen == 0 || mna->snaplen > NETMAP_BUF_SIZE(pna))
+			mna->snaplen = NETMAP_BUF_SIZE(pna);
+		nmr->nr_arg3 = 0;
+	}
 	/* by default, the number of slots is the same as in
 	 * the parent rings, but the user may ask for a different
 	 * number
@@ -461,8 +674,11 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		goto release_out;
 	}
 
-	/* remember the traffic directions we have to monitor */
-	mna->flags = (nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX));
+	/* remember the traffic directions we have to monitor,
+	 * and whether the parent rings must fill the timestamps
+	 */
+	mna->flags = (nmr->nr_flags &
+		(NR_MONITOR_TX | NR_MONITOR_RX | NR_MONITOR_COPY | NR_HWTS));
 
 	*na = &mna->up;
 	netmap_adapter_get(*na);
@@ -60,20 +60,43 @@
 
 
 
+/* Raw checksum of the parts of the TCP/UDP pseudo-header that are
+ * the same in all the segments of a GSO packet (addresses and protocol).
+ * 'iph' points to the IPv4 or IPv6 header.
+ */
+static rawsum_t gso_pseudo_sum(uint8_t *iph, u_int iphlen, u_int tcp)
+{
+	uint8_t proto[2] = { 0, tcp ? 6 : 17 };
+	rawsum_t sum;
+
+	if (iphlen == 20)
+		sum = nm_csum_raw(iph + 12, 8, 0);	/* saddr, daddr */
+	else
+		sum = nm_csum_raw(iph + 8, 32, 0);	/* saddr, daddr */
+	return nm_csum_raw(proto, sizeof(proto), sum);
+}
+
 /* This routine is called by bdg_mismatch_datapath() when it finishes
  * accumulating bytes for a segment, in order to fix some fields in the
  * segment headers (which still contain the same content as the header
  * of the original GSO packet). 'buf' points to the beginning (e.g.
  * the ethernet header) of the segment, and 'len' is its length.
+ * The TCP/UDP checksum is built from 'pseudo_sum' (see gso_pseudo_sum())
+ * and 'payload_sum', the raw sum of the payload computed while copying
+ * it, so only the headers are read again here.
  */
 static void gso_fix_segment(uint8_t *buf, size_t len, u_int idx,
 			    u_int segmented_bytes, u_int last_segment,
-			    u_int tcp, u_int iphlen)
+			    u_int tcp, u_int iphlen,
+			    rawsum_t pseudo_sum, rawsum_t payload_sum)
 {
 	struct nm_iphdr *iph = (struct nm_iphdr *)(buf + 14);
 	struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(buf + 14);
 	uint16_t *check = NULL;
 	uint8_t *check_data = NULL;
+	u_int l4len = len - 14 - iphlen, l4hlen;
+	uint8_t plen[2] = { l4len >> 8, l4len & 0xff };
+	rawsum_t sum;
 
 	if (iphlen == 20) {
 		/* Set the IPv4 "Total Length" field. */
@@ -108,6 +131,7 @@ static void gso_fix_segment(uint8_t *buf, size_t len, u_int idx,
 
 		check = &tcph->check;
 		check_data = (uint8_t *)tcph;
+		l4hlen = 4*(tcph->doff >> 4);
 	} else { /* UDP */
 		struct nm_udphdr *udph = (struct nm_udphdr *)(buf + 14 + iphlen);
 
@@ -116,20 +140,38 @@ static void gso_fix_segment(uint8_t *buf, size_t len, u_int idx,
 
 		check = &udph->check;
 		check_data = (uint8_t *)udph;
+		l4hlen = sizeof(*udph);
 	}
 
-	/* Compute and insert TCP/UDP checksum. */
+	/* Compute and insert TCP/UDP checksum: pseudo-header (the
+	 * length is the only part that changes), header, payload.
+	 */
 	*check = 0;
-	if (iphlen == 20)
-		nm_csum_tcpudp_ipv4(iph, check_data, len-14-iphlen, check);
-	else
-		nm_csum_tcpudp_ipv6(ip6h, check_data, len-14-iphlen, check);
+	sum = nm_csum_raw(plen, sizeof(plen), pseudo_sum);
+	sum = nm_csum_raw(check_data, l4hlen, sum);
+	sum = nm_csum_add(sum, payload_sum, l4hlen);
+	*check = nm_csum_fold(sum);
+	if (!tcp && *check == 0)
+		*check = 0xffff;	/* 0 means no UDP checksum */
 
 	ND("TCP/UDP csum %x", be16toh(*check));
 }
 
 
 /* The VALE mismatch datapath implementation. */
+/* Copy len bytes of a source fragment. NS_INDIRECT fragments are
+ * in userspace, so only copyin() touches them; the headers (the
+ * first fragment) must be in a netmap buffer.
+ */
+static inline int
+nm_frag_copy(struct nm_bdg_fwd *ft_p, uint8_t *dst, uint8_t *src, size_t len)
+{
+	if (ft_p->ft_flags & NS_INDIRECT)
+		return copyin(src, dst, len);
+	memcpy(dst, src, len);
+	return 0;
+}
+
 void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			   struct netmap_vp_adapter *dst_na,
 			   struct nm_bdg_fwd *ft_p, struct netmap_ring *ring,
@@ -151,7 +193,7 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	/* If the source port uses the offloadings, while destination doesn't,
 	 * we grab the source virtio-net header and do the offloadings here.
 	 */
-	if (na->virt_hdr_len && !dst_na->virt_hdr_len) {
+	if (na->virt_hdr_len && !dst_na->rx_hdr_len) {
 		vh = (struct nm_vnet_hdr *)ft_p->ft_buf;
 	}
 
@@ -184,14 +226,14 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	 *  12 |   0 | doesn't exist
 	 *  12 |  10 | copied from the first 10 bytes of source header
 	 */
-	bzero(dst, dst_na->virt_hdr_len);
-	if (na->virt_hdr_len && dst_na->virt_hdr_len)
+	bzero(dst, dst_na->rx_hdr_len);
+	if (na->virt_hdr_len && dst_na->rx_hdr_len)
 		memcpy(dst, src, sizeof(struct nm_vnet_hdr));
 	/* Skip the virtio-net headers. */
 	src += na->virt_hdr_len;
 	src_len -= na->virt_hdr_len;
-	dst += dst_na->virt_hdr_len;
-	dst_len = dst_na->virt_hdr_len + src_len;
+	dst += dst_na->rx_hdr_len;
+	dst_len = dst_na->rx_hdr_len + src_len;
 
 	/* Here it could be dst_len == 0 (which implies src_len == 0),
 	 * so we avoid passing a zero length fragment.
@@ -213,6 +255,10 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		u_int gso_idx = 0;
 		/* Payload data bytes segmented so far (e.g. TCP data bytes). */
 		u_int segmented_bytes = 0;
+		/* Raw checksums of the pseudo-header (constant part) and of
+		 * the payload of the current segment.
+		 */
+		rawsum_t pseudo_sum = 0, payload_sum = 0;
 		/* Length of the IP header (20 if IPv4, 40 if IPv6). */
 		u_int iphlen = 0;
 		/* Is this a TCP or an UDP GSO packet? */
@@ -249,6 +295,7 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 					gso_hdr_len = 14 + iphlen + 4*(tcph->doff >> 4);
 				} else
 					gso_hdr_len = 14 + iphlen + 8; /* UDP */
+				pseudo_sum = gso_pseudo_sum(gso_hdr + 14, iphlen, tcp);
 
 				ND(3, "gso_hdr_len %u gso_mtu %d", gso_hdr_len,
 								dst_na->mfs);
@@ -276,7 +323,12 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			copy = src_len;
 			if (gso_bytes + copy > dst_na->mfs)
 				copy = dst_na->mfs - gso_bytes;
-			memcpy(dst + gso_bytes, src, copy);
+			if (nm_frag_copy(ft_p, dst + gso_bytes, src, copy))
+				bzero(dst + gso_bytes, copy);
+			/* sum the payload while it is in the cache */
+			payload_sum = nm_csum_add(payload_sum,
+				nm_csum_raw(dst + gso_bytes, copy, 0),
+				gso_bytes - gso_hdr_len);
 			gso_bytes += copy;
 			src += copy;
 			src_len -= copy;
@@ -291,7 +343,8 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				gso_fix_segment(dst, gso_bytes, gso_idx,
 						segmented_bytes,
 						src_len == 0 && ft_p + 1 == ft_end,
-						tcp, iphlen);
+						tcp, iphlen, pseudo_sum, payload_sum);
+				payload_sum = 0;
 
 				ND("frame %u completed with %d bytes", gso_idx, (int)gso_bytes);
 				slot->len = gso_bytes;
@@ -325,6 +378,8 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		uint16_t *check = NULL;
 		/* Accumulator for an unfolded checksum. */
 		rawsum_t csum = 0;
+		/* Bytes in csum so far. */
+		size_t csum_bytes = 0;
 
 		/* Process a non-GSO packet. */
 
@@ -338,25 +393,29 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		}
 
 		while (ft_p != ft_end) {
-			/* Init/update the packet checksum if needed. */
-			if (vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-				if (!dst_slots)
-					csum = nm_csum_raw(src + vh->csum_start,
-								src_len - vh->csum_start, 0);
-				else
-					csum = nm_csum_raw(src, src_len, csum);
+			/* Round to a multiple of 64, but copyin() exactly */
+			if (nm_frag_copy(ft_p, dst, src,
+			    (ft_p->ft_flags & NS_INDIRECT) ? src_len :
+			    ((src_len + 63) & ~63))) {
+				/* Invalid user pointer, pretend len is 0. */
+				dst_len = 0;
 			}
 
-			/* Round to a multiple of 64 */
-			src_len = (src_len + 63) & ~63;
-
-			if (ft_p->ft_flags & NS_INDIRECT) {
-				if (copyin(src, dst, src_len)) {
-					/* Invalid user pointer, pretend len is 0. */
-					dst_len = 0;
+			/* Init/update the packet checksum if needed,
+			 * on the copy (the source may be in userspace).
+			 */
+			if (vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+				if (!dst_slots) {
+					csum = nm_csum_raw(dst + vh->csum_start,
+								src_len - vh->csum_start, 0);
+					csum_bytes = src_len - vh->csum_start;
+				} else {
+					/* fragments can have odd lengths */
+					csum = nm_csum_add(csum,
+						nm_csum_raw(dst, src_len, 0),
+						csum_bytes);
+					csum_bytes += src_len;
 				}
-			} else {
-				memcpy(dst, src, (int)src_len);
 			}
 			slot->len = dst_len;
 
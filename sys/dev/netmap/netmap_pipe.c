@@ -71,6 +71,7 @@
 #ifdef WITH_PIPES
 
 #define NM_PIPE_MAXSLOTS	4096
+#define NM_PIPE_MAXRINGS	32	/* max slave rings in a pipe group */
 
 int netmap_default_pipes = 0; /* default number of pipes for each nic */
 SYSCTL_DECL(_dev_netmap);
@@ -243,6 +244,96 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 	return 0;
 }
 
+/*
+ * txsync for the master of a pipe group. Each slot is swapped into
+ * the slave rx ring selected by the flow hash of the packet, so
+ * there is no copy here either. Fragments of a packet (NS_MOREFRAG)
+ * go to the same ring, and are only moved when the whole chain is
+ * available and fits. A full ring stops the transmission, to
+ * preserve the ordering; the slave will notify us when it releases
+ * some slots.
+ */
+static int
+netmap_pipe_group_txsync(struct netmap_kring *txkring, int flags)
+{
+	struct netmap_kring *rxbase = txkring->pipe, *rxkring;
+	struct netmap_adapter *na = txkring->na;
+	u_int n = rxbase->na->num_rx_rings;
+	u_int tail[NM_PIPE_MAXRINGS], space[NM_PIPE_MAXRINGS];
+	u_int changed = 0; /* bitmap of the rings to notify */
+	u_int lim_tx = txkring->nkr_num_slots - 1,
+		lim_rx = rxbase->nkr_num_slots - 1;
+	u_int head = txkring->rhead, k = txkring->nr_hwcur, r, c;
+	int busy;
+
+	for (r = 0; r < n; r++) {
+		rxkring = rxbase + r;
+		tail[r] = rxkring->nr_hwtail;
+		busy = tail[r] - rxkring->nr_hwcur;
+		if (busy < 0)
+			busy += rxkring->nkr_num_slots;
+		space[r] = lim_rx - busy;
+	}
+
+	while (k != head) {
+		struct netmap_slot *ts = &txkring->ring->slot[k];
+		u_int j, frags = 1;
+
+		/* count the fragments of this packet */
+		for (j = k; txkring->ring->slot[j].flags & NS_MOREFRAG;
+				frags++) {
+			j = nm_next(j, lim_tx);
+			if (j == head)
+				break;
+		}
+		if (j == head)
+			break;	/* incomplete chain, wait for the rest */
+		r = nm_flow_hash(NMB(na, ts), ts->len) % n;
+		if (space[r] < frags)
+			break;
+		space[r] -= frags;
+		changed |= 1U << r;
+		for (c = 0; c < frags; c++) {
+			struct netmap_slot *rs =
+				&rxbase[r].save_ring->slot[tail[r]];
+			struct netmap_slot tmp;
+
+			ts = &txkring->ring->slot[k];
+			/* swap the slots */
+			tmp = *rs;
+			*rs = *ts;
+			*ts = tmp;
+
+			tail[r] = nm_next(tail[r], lim_rx);
+			k = nm_next(k, lim_tx);
+		}
+	}
+
+	if (changed == 0) {
+		/* either the rings are full, or nothing to send */
+		nm_txsync_finalize(txkring);
+		return 0;
+	}
+
+	mb(); /* make sure the slots are updated before publishing them */
+	for (r = 0; r < n; r++) {
+		if (changed & (1U << r))
+			rxbase[r].nr_hwtail = tail[r];
+	}
+	txkring->nr_hwcur = k;
+	txkring->nr_hwtail = nm_prev(k, lim_tx);
+
+	nm_txsync_finalize(txkring);
+
+	mb(); /* make sure the nr_hwtails are updated before notifying */
+	for (r = 0; r < n; r++) {
+		if (changed & (1U << r))
+			rxbase->na->nm_notify(rxbase->na, r, NR_RX, 0);
+	}
+
+	return 0;
+}
+
 static int
 netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
 {
@@ -293,6 +384,24 @@ netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
  */
 
 
+/* Link the krings of na to the ones of the other end ona.
+ * tx ring i feeds rx ring i of the other end; the single tx ring
+ * of a group master points to the first of the slave rx rings.
+ * rx ring i gets its slots from tx ring i, or from the only tx
+ * ring of the group master.
+ */
+static void
+netmap_pipe_link(struct netmap_adapter *na, struct netmap_adapter *ona)
+{
+	u_int i;
+
+	for (i = 0; i < na->num_tx_rings; i++)
+		na->tx_rings[i].pipe = ona->rx_rings + i;
+	for (i = 0; i < na->num_rx_rings; i++)
+		na->rx_rings[i].pipe = ona->tx_rings +
+			(i < ona->num_tx_rings ? i : 0);
+}
+
 /* netmap_pipe_krings_delete.
  *
  * There are two cases:
@@ -358,12 +467,8 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 			ona->rx_rings[i].save_ring = ona->rx_rings[i].ring;
 
 		/* cross link the krings */
-		for (i = 0; i < na->num_tx_rings; i++) {
-			na->tx_rings[i].pipe = pna->peer->up.rx_rings + i;
-			na->rx_rings[i].pipe = pna->peer->up.tx_rings + i;
-			pna->peer->up.tx_rings[i].pipe = na->rx_rings + i;
-			pna->peer->up.rx_rings[i].pipe = na->tx_rings + i;
-		}
+		netmap_pipe_link(na, ona);
+		netmap_pipe_link(ona, na);
 	} else {
 		int i;
 		/* case 2) above */
@@ -528,7 +633,7 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	struct nmreq pnmr;
 	struct netmap_adapter *pna; /* parent adapter */
 	struct netmap_pipe_adapter *mna, *sna, *req;
-	u_int pipe_id;
+	u_int pipe_id, nrings;
 	int role = nmr->nr_flags & NR_REG_MASK;
 	int error;
 
@@ -596,7 +701,12 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	mna->role = NR_REG_PIPE_MASTER;
 	mna->parent = pna;
 
-	mna->up.nm_txsync = netmap_pipe_txsync;
+	/* more than one slave ring makes this a pipe group */
+	nrings = nmr->nr_rx_rings;
+	nm_bound_var(&nrings, 1, 1, NM_PIPE_MAXRINGS, NULL);
+
+	mna->up.nm_txsync = (nrings > 1 ? netmap_pipe_group_txsync :
+		netmap_pipe_txsync);
 	mna->up.nm_rxsync = netmap_pipe_rxsync;
 	mna->up.nm_register = netmap_pipe_reg;
 	mna->up.nm_dtor = netmap_pipe_dtor;
@@ -606,9 +716,11 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	mna->up.na_lut = pna->na_lut;
 	mna->up.na_lut_objtotal = pna->na_lut_objtotal;
 	mna->up.na_lut_objsize = pna->na_lut_objsize;
+	mna->up.na_lut_jtotal = pna->na_lut_jtotal;
+	mna->up.na_lut_jsize = pna->na_lut_jsize;
 
 	mna->up.num_tx_rings = 1;
-	mna->up.num_rx_rings = 1;
+	mna->up.num_rx_rings = nrings;
 	mna->up.num_tx_desc = nmr->nr_tx_slots;
 	nm_bound_var(&mna->up.num_tx_desc, pna->num_tx_desc,
 			1, NM_PIPE_MAXSLOTS, NULL);
@@ -633,6 +745,8 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	*sna = *mna;
 	snprintf(sna->up.name, sizeof(sna->up.name), "%s}%d", pna->name, pipe_id);
 	sna->role = NR_REG_PIPE_SLAVE;
+	sna->up.nm_txsync = netmap_pipe_txsync;
+	sna->up.num_tx_rings = nrings;
 	error = netmap_attach_common(&sna->up);
 	if (error)
 		goto free_sna;
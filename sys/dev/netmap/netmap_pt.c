@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2014 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Host side of the passthrough rings (NETMAP_PT_HOST_CREATE).
+ *
+ * A hypervisor binds a port, maps its memory region into a guest as
+ * a PCI BAR, and hands the rings over to the guest one by one. The
+ * guest application then works on the rings of the host port: it
+ * moves head/cur and kicks us (an eventfd), and a kernel thread per
+ * ring does here what NIOCTXSYNC/NIOCRXSYNC would do on the host
+ * kring, as in the busy poll mode. Nothing is copied or translated,
+ * the slots carry the buffer indexes of the host region, which the
+ * guest sees at the same offsets.
+ *
+ * Each ring has a struct ptn_csb in a netmap buffer (so it is in the
+ * BAR too) with the two flags that suppress kicks and interrupts:
+ * the thread sets host_need_kick before sleeping, and the guest sets
+ * guest_need_kick before waiting for an interrupt. Both look at the
+ * ring again after setting their flag (with a barrier in between),
+ * so an update made just before the flag was seen is not lost.
+ * Interrupts to the guest go through a second eventfd.
+ *
+ * The threads are woken up by the kicks and by the notifications of
+ * the kring (see netmap_notify_wakeup()), e.g. new frames from the
+ * VALE switch or tx completions of a NIC.
+ *
+ * Only Linux for now, as the kicks and interrupts rely on eventfds
+ * (KVM ioeventfd/irqfd on the hypervisor side).
+ */
+
+#if defined(linux)
+
+#include "bsd_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+#include <dev/netmap/netmap_mem2.h>
+
+#ifdef WITH_PTNETMAP
+
+struct ptn_kring {
+	struct ptn_kring	*pk_next;	/* in priv->np_pt */
+	struct netmap_kring	*pk_kring;
+	enum txrx		pk_tx;
+	u_int			pk_ring;
+	uint32_t		pk_csb_idx;	/* netmap buffer of pk_csb */
+	struct ptn_csb		*pk_csb;
+	struct nm_eventfd	*pk_kick;	/* signalled by the guest */
+	struct nm_eventfd	*pk_irq;	/* to interrupt the guest */
+	struct nm_kthread	*pk_thread;
+};
+
+/* the guest kicked us */
+static void
+ptn_kick(void *arg)
+{
+	struct ptn_kring *pk = arg;
+
+	nm_kthread_wakeup(pk->pk_thread);
+}
+
+/*
+ * Called from the notifications (also from interrupts and from the
+ * held-back notify timer), which do not own the kring: the lock
+ * keeps pk alive until ptn_kring_delete() cleared the pointer.
+ */
+void
+netmap_pt_notify(struct netmap_kring *kring)
+{
+	struct ptn_kring *pk;
+
+	mtx_lock(&kring->nkr_pt_lock);
+	pk = kring->nkr_pt;
+	if (pk != NULL)
+		nm_kthread_wakeup(pk->pk_thread);
+	mtx_unlock(&kring->nkr_pt_lock);
+}
+
+/* is there something for the thread to do on the kring ? */
+static int
+ptn_pending(struct ptn_kring *pk)
+{
+	struct netmap_kring *kring = pk->pk_kring;
+
+	if (kring->ring->head != kring->nr_hwcur)
+		return 1;	/* new frames to send, or slots released */
+	/* frames already delivered to the kring (e.g. by a VALE switch) */
+	return pk->pk_tx == NR_RX && kring->nr_hwtail != kring->rtail;
+}
+
+/*
+ * The loop of the thread of a ring. As netmap_busy_poll(), but on a
+ * single kring, sleeping when there is nothing to do, and interrupting
+ * the guest when tail moves and it asked for it.
+ */
+static void
+ptn_worker(void *arg)
+{
+	struct ptn_kring *pk = arg;
+	struct netmap_kring *kring = pk->pk_kring;
+	struct netmap_adapter *na = kring->na;
+	struct ptn_csb *csb = pk->pk_csb;
+	u_int tail;
+
+	mb();
+	if (!ptn_pending(pk)) {
+		csb->host_need_kick = 1;
+		mb(); /* the flag before looking again at head */
+		if (!ptn_pending(pk))
+			nm_kthread_wait(pk->pk_thread);
+		csb->host_need_kick = 0;
+		mb();
+	}
+
+	if (!nm_netmap_on(na))
+		return;
+	/* XXX if the kring is stopped we spin until it restarts */
+	if (nm_kr_tryget(kring))
+		return;
+	tail = kring->rtail;
+	if (pk->pk_tx == NR_TX) {
+		if (nm_txsync_prologue(kring) >= kring->nkr_num_slots)
+			netmap_ring_reinit(kring);
+		else
+			kring->nm_sync(kring, NAF_FORCE_RECLAIM);
+	} else {
+		if (kring->nm_sync(kring, 0) == 0 &&
+		    kring->nr_hwtail != tail &&
+		    (netmap_no_timestamp == 0 ||
+		     kring->ring->flags & NR_TIMESTAMP)) {
+			microtime(&kring->ring->ts);
+		}
+	}
+	nm_kr_put(kring);
+
+	mb(); /* tail before guest_need_kick */
+	if (kring->rtail != tail && csb->guest_need_kick) {
+		csb->guest_need_kick = 0;
+		nm_eventfd_signal(pk->pk_irq);
+		NM_KSTAT_ADD(kring, NM_STAT_NOTIFY, 1);
+	}
+}
+
+/* stop the thread and free everything, call with NMG_LOCK held */
+static void
+ptn_kring_delete(struct netmap_adapter *na, struct ptn_kring *pk)
+{
+	struct netmap_kring *kring = pk->pk_kring;
+	int stopped = 0;
+
+	if (kring->nkr_pt == pk) {
+		/* no more wakeups from the notifications: once the
+		 * pointer is cleared under nkr_pt_lock nobody can still
+		 * be using pk in netmap_pt_notify(). Then stop the kring,
+		 * the thread must not be inside a sync when it goes away
+		 */
+		mtx_lock(&kring->nkr_pt_lock);
+		kring->nkr_pt = NULL;
+		mtx_unlock(&kring->nkr_pt_lock);
+		if (pk->pk_tx == NR_TX)
+			netmap_set_txring(na, pk->pk_ring, 1);
+		else
+			netmap_set_rxring(na, pk->pk_ring, 1);
+		stopped = 1;
+	}
+	if (pk->pk_thread)
+		nm_kthread_stop(pk->pk_thread);
+	if (pk->pk_kick)
+		nm_eventfd_put(pk->pk_kick);
+	if (pk->pk_irq)
+		nm_eventfd_put(pk->pk_irq);
+	if (stopped && pk->pk_tx == NR_TX)
+		netmap_set_txring(na, pk->pk_ring, 0);
+	else if (stopped)
+		netmap_set_rxring(na, pk->pk_ring, 0);
+	if (pk->pk_csb) {
+		/* the first word links the list of extra buffers */
+		bzero(pk->pk_csb, sizeof(*pk->pk_csb));
+		netmap_extra_free(na, pk->pk_csb_idx);
+	}
+	D("%s: %s ring %d back from the guest", na->name,
+		pk->pk_tx == NR_TX ? "tx" : "rx", pk->pk_ring);
+	free(pk, M_DEVBUF);
+}
+
+static int
+ptn_kring_create(struct netmap_priv_d *priv, struct nmreq *nmr)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct ptn_kring *pk;
+	struct netmap_kring *kring;
+	enum txrx t = nmr->nr_arg2 ? NR_RX : NR_TX;
+	u_int ring = nmr->nr_arg1;
+	char name[32];
+	int error;
+
+	if (priv->np_flags & NR_BUSY_POLL)
+		return EBUSY;	/* already a thread on the rings */
+	if (t == NR_TX ? ring < priv->np_txqfirst || ring >= priv->np_txqlast :
+			 ring < priv->np_rxqfirst || ring >= priv->np_rxqlast)
+		return EINVAL;	/* not bound to priv */
+	kring = (t == NR_TX ? na->tx_rings : na->rx_rings) + ring;
+	if (kring->nkr_pt != NULL)
+		return EBUSY;
+
+	pk = malloc(sizeof(*pk), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (pk == NULL)
+		return ENOMEM;
+	pk->pk_kring = kring;
+	pk->pk_tx = t;
+	pk->pk_ring = ring;
+	error = ENOMEM;
+	if (netmap_extra_alloc(na, &pk->pk_csb_idx, 1) != 1)
+		goto fail;
+	pk->pk_csb = na->na_lut[pk->pk_csb_idx].vaddr;
+	bzero(pk->pk_csb, sizeof(*pk->pk_csb));
+
+	/* the thread before the kicks, they wake it up */
+	snprintf(name, sizeof(name), "nm_pt:%s:%s%d", na->name,
+		t == NR_TX ? "tx" : "rx", ring);
+	pk->pk_thread = nm_kthread_start(ptn_worker, pk, name);
+	if (pk->pk_thread == NULL)
+		goto fail;
+	if (nmr->nr_arg3 > 0)
+		nm_kthread_set_affinity(pk->pk_thread, nmr->nr_arg3 - 1);
+	pk->pk_irq = nm_eventfd_get(nmr->nr_memsize, NULL, NULL, &error);
+	if (pk->pk_irq == NULL)
+		goto fail;
+	pk->pk_kick = nm_eventfd_get(nmr->nr_offset, ptn_kick, pk, &error);
+	if (pk->pk_kick == NULL)
+		goto fail;
+
+	mtx_lock(&kring->nkr_pt_lock);
+	kring->nkr_pt = pk;
+	mtx_unlock(&kring->nkr_pt_lock);
+	pk->pk_next = priv->np_pt;
+	priv->np_pt = pk;
+	nm_kthread_wakeup(pk->pk_thread); /* look at the ring once */
+	nmr->nr_arg3 = pk->pk_csb_idx;
+	D("%s: %s ring %d to the guest, csb in buffer %d", na->name,
+		t == NR_TX ? "tx" : "rx", ring, pk->pk_csb_idx);
+	return 0;
+
+fail:
+	D("%s: cannot pass %s ring %d to the guest: %d", na->name,
+		t == NR_TX ? "tx" : "rx", ring, error);
+	ptn_kring_delete(na, pk);
+	return error;
+}
+
+/* give back all the rings of priv, call with NMG_LOCK held */
+void
+netmap_pt_host_delete(struct netmap_priv_d *priv)
+{
+	struct ptn_kring *pk;
+
+	NMG_LOCK_ASSERT();
+	while ((pk = priv->np_pt) != NULL) {
+		priv->np_pt = pk->pk_next;
+		ptn_kring_delete(priv->np_na, pk);
+	}
+}
+
+/* NETMAP_PT_HOST_CREATE/DELETE, call with NMG_LOCK held */
+int
+netmap_pt_host_ctl(struct netmap_priv_d *priv, struct nmreq *nmr)
+{
+	NMG_LOCK_ASSERT();
+	if (priv->np_nifp == NULL || priv->np_na == NULL)
+		return ENXIO;	/* not bound */
+	if (nmr->nr_cmd == NETMAP_PT_HOST_DELETE) {
+		netmap_pt_host_delete(priv);
+		return 0;
+	}
+	return ptn_kring_create(priv, nmr);
+}
+
+#endif /* WITH_PTNETMAP */
@@ -78,6 +78,7 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #include <machine/bus.h>	/* bus_dmamap_* */
 #include <sys/endian.h>
 #include <sys/refcount.h>
+#include <sys/rmlock.h>
 
 
 #define BDG_RWLOCK_T		struct rwlock // struct rwlock
@@ -87,10 +88,24 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #define BDG_WLOCK(b)		rw_wlock(&(b)->bdg_lock)
 #define BDG_WUNLOCK(b)		rw_wunlock(&(b)->bdg_lock)
 #define BDG_RLOCK(b)		rw_rlock(&(b)->bdg_lock)
-#define BDG_RTRYLOCK(b)		rw_try_rlock(&(b)->bdg_lock)
 #define BDG_RUNLOCK(b)		rw_runlock(&(b)->bdg_lock)
 #define BDG_RWDESTROY(b)	rw_destroy(&(b)->bdg_lock)
 
+/* read-mostly lock, readers only touch per-CPU data */
+#define BDG_RCU_T		struct rmlock
+#define BDG_RCU_TRACKER_T	struct rm_priotracker
+#define BDG_RCU_INIT(b)		\
+	(rm_init_flags(&(b)->bdg_rcu, "bdg rcu", RM_NOWITNESS), 0)
+#define BDG_RCU_DESTROY(b)	rm_destroy(&(b)->bdg_rcu)
+#define BDG_RCU_ENTER(b, t)	rm_rlock(&(b)->bdg_rcu, &(t))
+#define BDG_RCU_EXIT(b, t)	rm_runlock(&(b)->bdg_rcu, &(t))
+#define BDG_RCU_SYNC(b)		do {				\
+	rm_wlock(&(b)->bdg_rcu);					\
+	rm_wunlock(&(b)->bdg_rcu);					\
+} while (0)
+#define BDG_SET_VAR(lval, p)	do { wmb(); (lval) = (p); } while (0)
+#define BDG_GET_VAR(lval)	(*(volatile __typeof(lval) *)&(lval))
+
 
 #elif defined(linux)
 
@@ -137,7 +152,9 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #define NM_BDG_MAXRINGS		16	/* XXX unclear how many. */
 #define NM_BDG_MAXSLOTS		4096	/* XXX same as above */
 #define NM_BRIDGE_RINGSIZE	1024	/* in the device */
-#define NM_BDG_HASH		1024	/* forwarding table entries */
+#define NM_BDG_HASH		4096	/* default forwarding table entries */
+#define NM_BDG_HASH_WAYS	4	/* entries per bucket (a cache line) */
+#define NM_BDG_HASH_MAX		65536	/* max forwarding table entries */
 #define NM_BDG_BATCH		1024	/* entries in the forwarding buffer */
 #define NM_MULTISEG		64	/* max size of a chain of bufs */
 /* actual size of the tables */
@@ -156,6 +173,75 @@ int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0 , "");
 
+/*
+ * With bridge_batch_min > 0 the batch of each sender adapts, between
+ * bridge_batch_min and bridge_batch, to the slots it finds pending
+ * (see nm_bdg_batch_adapt()): a busy port flushes fewer, larger
+ * batches, a lightly loaded one flushes early. bridge_batch_us
+ * bounds the time the first packet of a batch waits until the end
+ * of the flush; a batch that takes longer halves the next one.
+ */
+int bridge_batch_min = 0;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch_min, CTLFLAG_RW, &bridge_batch_min, 0 , "");
+int bridge_batch_us = 50;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch_us, CTLFLAG_RW, &bridge_batch_us, 0 , "");
+
+/*
+ * bridge_zerocopy enables buffer swapping (instead of copying)
+ * between ports that share the same memory allocator.
+ * Only unicast traffic is swapped, broadcast is always copied
+ * as the source buffer must be delivered to multiple ports.
+ */
+int bridge_zerocopy = 0;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_zerocopy, CTLFLAG_RW, &bridge_zerocopy, 0 , "");
+
+/*
+ * bridge_hash_size is the number of entries in the forwarding table
+ * of newly created bridges (see also NETMAP_BDG_HASHSIZE).
+ * Entries not refreshed for bridge_ageing seconds are ignored
+ * by the learning bridge (0 means never expire).
+ */
+int bridge_hash_size = NM_BDG_HASH;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_hash_size, CTLFLAG_RW, &bridge_hash_size, 0 , "");
+int bridge_ageing = 300;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_ageing, CTLFLAG_RW, &bridge_ageing, 0 , "");
+
+/*
+ * bridge_bcast_rings controls the delivery of broadcast and multicast
+ * traffic to ports with multiple rx rings: 0 only uses ring 0,
+ * 1 replicates the traffic to all rings.
+ */
+int bridge_bcast_rings = 0;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_bcast_rings, CTLFLAG_RW, &bridge_bcast_rings, 0 , "");
+
+/*
+ * If bridge_kthreads is set, NICs attached to a switch afterwards
+ * forward their rx rings from one kernel thread per ring instead of
+ * the interrupt handler. Each pass moves at most bridge_kthread_budget
+ * slots (0 means unlimited) before yielding the CPU.
+ * Ring i is bound to CPU bridge_kthread_cpu + i, modulo the number
+ * of CPUs; -1 leaves the threads to the scheduler.
+ */
+int bridge_kthreads = 0;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_kthreads, CTLFLAG_RW, &bridge_kthreads, 0 , "");
+int bridge_kthread_budget = 256;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_kthread_budget, CTLFLAG_RW, &bridge_kthread_budget, 0 , "");
+int bridge_kthread_cpu = -1;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_kthread_cpu, CTLFLAG_RW, &bridge_kthread_cpu, 0 , "");
+
+/*
+ * If vale_shared_mem is set, ports created afterwards take their memory
+ * from one allocator shared by all of them (see netmap_mem_vale_get(),
+ * sized by the vale_* sysctls of the allocator) instead of a private
+ * one each. Each port can then hold at most vale_port_bufs buffers
+ * in its rings and extra buffers (0 means no limit), and its rings
+ * are shortened to fit in the ring objects of the allocator.
+ */
+int vale_shared_mem = 0;
+SYSCTL_INT(_dev_netmap, OID_AUTO, vale_shared_mem, CTLFLAG_RW, &vale_shared_mem, 0 , "");
+int vale_port_bufs = 0;
+SYSCTL_INT(_dev_netmap, OID_AUTO, vale_port_bufs, CTLFLAG_RW, &vale_port_bufs, 0 , "");
+
 
 static int netmap_vp_create(struct nmreq *, struct ifnet *, struct netmap_vp_adapter **);
 static int netmap_vp_reg(struct netmap_adapter *na, int onoff);
@@ -172,10 +258,42 @@ struct nm_bdg_q {
 	uint32_t bq_len;	/* number of buffers */
 };
 
-/* XXX revise this */
+/*
+ * Entry of the forwarding table. The table is set associative,
+ * each bucket has NM_BDG_HASH_WAYS entries in one cache line.
+ * The epoch is the time (in seconds) of the last refresh, used for
+ * ageing with a wrap-safe difference. An entry with epoch 0 is unused.
+ */
 struct nm_hash_ent {
-	uint64_t	mac;	/* the top 2 bytes are the epoch */
-	uint64_t	ports;
+	uint64_t	mac;
+	uint32_t	ports;
+	uint32_t	epoch;
+};
+
+#define NM_HT_USED(e)	((e)->epoch != 0)
+
+/*
+ * Compact list of the destinations for broadcast traffic, rebuilt
+ * by nm_bdg_update_dsts() on attach and detach. Each bridge has two
+ * of them, one is used by the forwarding path while the other one
+ * is being rebuilt.
+ */
+struct nm_bdg_dst {
+	uint16_t	bd_qbase;	/* port * NM_BDG_MAXRINGS */
+	uint16_t	bd_nrings;	/* usable rx rings */
+};
+
+struct nm_bdg_dstlist {
+	u_int		bd_n;		/* valid entries in bd_dst */
+	struct nm_bdg_dst bd_dst[NM_BDG_MAXPORTS];
+};
+
+/* The table and its size are replaced together, so that
+ * the forwarding path always sees a consistent pair.
+ */
+struct nm_hash_table {
+	u_int		ht_mask;	/* number of buckets - 1 */
+	struct nm_hash_ent ht_ent[0] __attribute__((__aligned__(64)));
 };
 
 /*
@@ -188,12 +306,20 @@ struct nm_hash_ent {
  * The bridge is non blocking on the transmit ports: excess
  * packets are dropped if there is no room on the output port.
  *
- * bdg_lock protects accesses to the bdg_ports array.
+ * bdg_lock serializes the modifications to the bdg_ports array,
+ * the lookup functions and the forwarding table.
  * This is a rw lock (or equivalent).
+ * The forwarding path does not take bdg_lock: it runs in a
+ * read-side section of bdg_rcu (SRCU on linux, a read-mostly
+ * lock on FreeBSD) which does not write to shared memory.
+ * Writers publish their changes under bdg_lock and then wait
+ * for the readers with BDG_RCU_SYNC() before disposing of
+ * anything the forwarding path may still be using.
  */
 struct nm_bridge {
 	/* XXX what is the proper alignment/layout ? */
 	BDG_RWLOCK_T	bdg_lock;	/* protects bdg_ports */
+	BDG_RCU_T	bdg_rcu;	/* protects the forwarding path */
 	int		bdg_namelen;
 	uint32_t	bdg_active_ports; /* 0 means free */
 	char		bdg_basename[IFNAMSIZ];
@@ -205,6 +331,10 @@ struct nm_bridge {
 
 	struct netmap_vp_adapter *bdg_ports[NM_BDG_MAXPORTS];
 
+	/* broadcast destinations, bdg_cur_dsts points into bdg_dsts[] */
+	struct nm_bdg_dstlist *bdg_cur_dsts;
+	struct nm_bdg_dstlist bdg_dsts[2];
+
 
 	/*
 	 * The function to decide the destination port.
@@ -217,11 +347,11 @@ struct nm_bridge {
 	 */
 	struct netmap_bdg_ops bdg_ops;
 
-	/* the forwarding table, MAC+ports.
-	 * XXX should be changed to an argument to be passed to
-	 * the lookup function, and allocated on attach
+	/* the forwarding table, MAC+ports, allocated when the
+	 * bridge is created. There are ht_mask + 1 buckets of
+	 * NM_BDG_HASH_WAYS entries each.
 	 */
-	struct nm_hash_ent ht[NM_BDG_HASH];
+	struct nm_hash_table *ht;
 
 #ifdef CONFIG_NET_NS
 	struct net *ns;
@@ -278,6 +408,77 @@ pkt_copy(void *_src, void *_dst, int l)
 }
 
 
+/*
+ * (Re)allocate the forwarding table of bridge b with room for at
+ * least 'entries' entries, using a power of 2 number of buckets.
+ * The new table is empty. The old one, if any, is replaced
+ * under BDG_WLOCK() and freed when no reader can see it anymore.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static int
+nm_bdg_ht_alloc(struct nm_bridge *b, u_int entries)
+{
+	struct nm_hash_table *ht, *old;
+	u_int nbuckets = 1;
+
+	NMG_LOCK_ASSERT();
+	if (entries > NM_BDG_HASH_MAX)
+		entries = NM_BDG_HASH_MAX;
+	while (nbuckets * NM_BDG_HASH_WAYS < entries)
+		nbuckets <<= 1;
+	ht = malloc(sizeof(*ht) + sizeof(struct nm_hash_ent) *
+		NM_BDG_HASH_WAYS * nbuckets, M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (ht == NULL) {
+		D("cannot allocate %u buckets for %s", nbuckets,
+			b->bdg_basename);
+		return ENOMEM;
+	}
+	ht->ht_mask = nbuckets - 1;
+	BDG_WLOCK(b);
+	old = b->ht;
+	BDG_SET_VAR(b->ht, ht);
+	BDG_WUNLOCK(b);
+	if (old) {
+		BDG_RCU_SYNC(b);
+		free(old, M_DEVBUF);
+	}
+	return 0;
+}
+
+
+/*
+ * Rebuild the list of broadcast destinations of bridge b after
+ * a change in bdg_ports. The spare list is filled and published.
+ * The caller must BDG_RCU_SYNC() after releasing the lock, so that
+ * the old list is not in use on the next update.
+ * MUST BE CALLED WITH BDG_WLOCK()
+ */
+static void
+nm_bdg_update_dsts(struct nm_bridge *b)
+{
+	struct nm_bdg_dstlist *l = b->bdg_cur_dsts == &b->bdg_dsts[0] ?
+		&b->bdg_dsts[1] : &b->bdg_dsts[0];
+	u_int i, n = 0;
+
+	for (i = 0; i < b->bdg_active_ports; i++) {
+		u_int port = b->bdg_port_index[i];
+		struct netmap_vp_adapter *vpna = b->bdg_ports[port];
+		u_int nrings;
+
+		if (vpna == NULL)
+			continue;
+		nrings = vpna->up.num_rx_rings;
+		if (nrings > NM_BDG_MAXRINGS)
+			nrings = NM_BDG_MAXRINGS;
+		l->bd_dst[n].bd_qbase = port * NM_BDG_MAXRINGS;
+		l->bd_dst[n].bd_nrings = nrings;
+		n++;
+	}
+	l->bd_n = n;
+	BDG_SET_VAR(b->bdg_cur_dsts, l);
+}
+
+
 /*
  * locate a bridge among the existing ones.
  * MUST BE CALLED WITH NMG_LOCK()
@@ -330,16 +531,24 @@ nm_find_bridge(const char *name, int create)
 	if (i == num_bridges && b) { /* name not found, can create entry */
 		/* initialize the bridge */
 		strncpy(b->bdg_basename, name, namelen);
+		/* allocate and reset the MAC address table */
+		if (nm_bdg_ht_alloc(b, bridge_hash_size)) {
+			/* leave the slot free */
+			b->bdg_basename[0] = '\0';
+			b->bdg_namelen = 0;
+			return NULL;
+		}
 		ND("create new bridge %s with ports %d", b->bdg_basename,
 			b->bdg_active_ports);
 		b->bdg_namelen = namelen;
 		b->bdg_active_ports = 0;
 		for (i = 0; i < NM_BDG_MAXPORTS; i++)
 			b->bdg_port_index[i] = i;
+		b->bdg_dsts[0].bd_n = 0;
+		b->bdg_cur_dsts = &b->bdg_dsts[0];
 		/* set the default function */
 		b->bdg_ops.lookup = netmap_bdg_learning;
-		/* reset the MAC address table */
-		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		b->bdg_ops.lookup_batch = netmap_bdg_learning_batch;
 		NM_BNS_GET(b);
 	}
 	return b;
@@ -382,6 +591,8 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
 	l += sizeof(struct nm_bdg_q) * num_dstq;
 	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
+	/* port and ring of each packet, for lookup_batch */
+	l += (sizeof(uint16_t) + sizeof(uint8_t)) * NM_BDG_BATCH_MAX;
 
 	nrings = netmap_real_tx_rings(na);
 	kring = na->tx_rings;
@@ -461,13 +672,18 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 		b->bdg_ports[s_sw] = NULL;
 	}
 	memcpy(b->bdg_port_index, tmp, sizeof(tmp));
-	b->bdg_active_ports = lim;
+	BDG_SET_VAR(b->bdg_active_ports, lim);
+	nm_bdg_update_dsts(b);
 	BDG_WUNLOCK(b);
+	/* wait for the forwarding path to release the old ports */
+	BDG_RCU_SYNC(b);
 
 	ND("now %d active ports", lim);
 	if (lim == 0) {
 		ND("marking bridge %s as free", b->bdg_basename);
 		bzero(&b->bdg_ops, sizeof(b->bdg_ops));
+		free(b->ht, M_DEVBUF);
+		b->ht = NULL;
 		NM_BNS_PUT(b);
 	}
 }
@@ -712,20 +928,24 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	BDG_WLOCK(b);
 	vpna->bdg_port = cand;
 	ND("NIC  %p to bridge port %d", vpna, cand);
-	/* bind the port to the bridge (virtual ports are not active) */
-	b->bdg_ports[cand] = vpna;
+	/* bind the port to the bridge (virtual ports are not active).
+	 * The port must be initialized before readers can see it.
+	 */
 	vpna->na_bdg = b;
-	b->bdg_active_ports++;
+	BDG_SET_VAR(b->bdg_ports[cand], vpna);
+	BDG_SET_VAR(b->bdg_active_ports, b->bdg_active_ports + 1);
 	if (hostna != NULL) {
 		/* also bind the host stack to the bridge */
-		b->bdg_ports[cand2] = hostna;
 		hostna->bdg_port = cand2;
 		hostna->na_bdg = b;
-		b->bdg_active_ports++;
+		BDG_SET_VAR(b->bdg_ports[cand2], hostna);
+		BDG_SET_VAR(b->bdg_active_ports, b->bdg_active_ports + 1);
 		ND("host %p to bridge port %d", hostna, cand2);
 	}
+	nm_bdg_update_dsts(b);
 	ND("if %s refs %d", ifname, vpna->up.na_refcount);
 	BDG_WUNLOCK(b);
+	BDG_RCU_SYNC(b);	/* the old dst list is now free */
 	*na = &vpna->up;
 	netmap_adapter_get(*na);
 	return 0;
@@ -931,7 +1151,29 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		if (!b) {
 			error = EINVAL;
 		} else {
+			BDG_WLOCK(b);
 			b->bdg_ops = *bdg_ops;
+			BDG_WUNLOCK(b);
+			/* make sure nobody uses the old callbacks */
+			BDG_RCU_SYNC(b);
+		}
+		NMG_UNLOCK();
+		break;
+
+	case NETMAP_BDG_HASHSIZE:
+		/* resize the forwarding table of an existing bridge.
+		 * nr_arg3 is the requested number of entries, 0 only
+		 * reports the current size. The actual size is returned
+		 * in nr_arg3. Resizing flushes the table.
+		 */
+		NMG_LOCK();
+		b = nm_find_bridge(name, 0 /* don't create */);
+		if (!b) {
+			error = ENOENT;
+		} else {
+			if (nmr->nr_arg3)
+				error = nm_bdg_ht_alloc(b, nmr->nr_arg3);
+			nmr->nr_arg3 = (b->ht->ht_mask + 1) * NM_BDG_HASH_WAYS;
 		}
 		NMG_UNLOCK();
 		break;
@@ -950,6 +1192,11 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		if (na && !error) {
 			vpna = (struct netmap_vp_adapter *)na;
 			vpna->virt_hdr_len = nmr->nr_arg1;
+			/* on a bwrap, what the NIC accepts is set
+			 * on the NIC itself, before attaching it
+			 */
+			if (na->nm_register != netmap_bwrap_register)
+				vpna->rx_hdr_len = vpna->virt_hdr_len;
 			if (vpna->virt_hdr_len)
 				vpna->mfs = NETMAP_BUF_SIZE(na);
 			D("Using vnet_hdr_len %d for %p", vpna->virt_hdr_len, vpna);
@@ -1040,6 +1287,52 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n,
 	struct netmap_vp_adapter *na, u_int ring_nr);
 
 
+/*
+ * The adaptive batch of kring (bridge_batch_min > 0) for the slots
+ * from j to end: doubled while they are at least twice as many,
+ * halved when they are less than half of it.
+ */
+static inline u_int
+nm_bdg_batch_adapt(struct netmap_kring *kring, u_int j, u_int end)
+{
+	int batch = kring->nkr_bdg_batch, min = bridge_batch_min;
+	int pending = (int)end - (int)j;
+
+	if (pending < 0)
+		pending += kring->nkr_num_slots;
+	if (min > bridge_batch)
+		min = bridge_batch;
+	if (batch < min)
+		batch = min;
+	else if (batch > bridge_batch)
+		batch = bridge_batch;
+	if (pending >= 2 * batch)
+		batch = 2 * batch < bridge_batch ? 2 * batch : bridge_batch;
+	else if (pending < batch / 2)
+		batch = batch / 2 > min ? batch / 2 : min;
+	kring->nkr_bdg_batch = batch;
+	return batch;
+}
+
+/*
+ * A batch that started at t0 has been flushed, halve the next ones
+ * if it took more than bridge_batch_us. Return the new batch.
+ */
+static inline int
+nm_bdg_batch_late(struct netmap_kring *kring, int batch,
+	const struct timeval *t0)
+{
+	struct timeval t;
+
+	microtime(&t);
+	if ((t.tv_sec - t0->tv_sec) * 1000000L + (t.tv_usec - t0->tv_usec) >
+	    bridge_batch_us && batch / 2 >= bridge_batch_min) {
+		batch /= 2;
+		kring->nkr_bdg_batch = batch;
+	}
+	return batch;
+}
+
 /*
  * main dispatch routine for the bridge.
  * Grab packets from a kring, move them into the ft structure
@@ -1059,29 +1352,36 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 	u_int ft_i = 0;	/* start from 0 */
 	u_int frags = 1; /* how many frags ? */
 	struct nm_bridge *b = na->na_bdg;
-
-	/* To protect against modifications to the bridge we acquire a
-	 * shared lock, waiting if we can sleep (if the source port is
-	 * attached to a user process) or with a trylock otherwise (NICs).
+	BDG_RCU_TRACKER_T tracker;
+	int batch = bridge_batch;
+	int timed = 0;	/* t0 is the start of the current batch */
+	struct timeval t0 = { 0, 0 };
+
+	/* To protect against modifications to the bridge we enter
+	 * a read-side section. This never blocks, and does not
+	 * write shared cache lines, so it is also fine for NICs.
 	 */
-	ND("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
-	if (na->up.na_flags & NAF_BDG_MAYSLEEP)
-		BDG_RLOCK(b);
-	else if (!BDG_RTRYLOCK(b))
-		return 0;
-	ND(5, "rlock acquired for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+	BDG_RCU_ENTER(b, tracker);
 	ft = kring->nkr_ft;
+	if (bridge_batch_min > 0) {
+		batch = nm_bdg_batch_adapt(kring, j, end);
+		timed = bridge_batch_us > 0;
+	}
 
 	for (; likely(j != end); j = nm_next(j, lim)) {
 		struct netmap_slot *slot = &ring->slot[j];
 		char *buf;
 
+		if (unlikely(timed) && ft_i == 0)
+			microtime(&t0);
+
 		ft[ft_i].ft_len = slot->len;
 		ft[ft_i].ft_flags = slot->flags;
 
 		ND("flags is 0x%x", slot->flags);
 		/* this slot goes into a list so initialize the link field */
 		ft[ft_i].ft_next = NM_FT_NULL;
+		ft[ft_i].ft_slot = slot;
 		buf = ft[ft_i].ft_buf = (slot->flags & NS_INDIRECT) ?
 			(void *)(uintptr_t)slot->ptr : NMB(&na->up, slot);
 		if (unlikely(buf == NULL)) {
@@ -1102,8 +1402,11 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 			RD(5, "%d frags at %d", frags, ft_i - frags);
 		ft[ft_i - frags].ft_frags = frags;
 		frags = 1;
-		if (unlikely((int)ft_i >= bridge_batch))
+		if (unlikely((int)ft_i >= batch)) {
 			ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
+			if (unlikely(timed))
+				batch = nm_bdg_batch_late(kring, batch, &t0);
+		}
 	}
 	if (frags > 1) {
 		D("truncate incomplete fragment at %d (%d frags)", ft_i, frags);
@@ -1111,9 +1414,12 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i - 1].ft_frags &= ~NS_MOREFRAG;
 		ft[ft_i - frags].ft_frags = frags - 1;
 	}
-	if (ft_i)
+	if (ft_i) {
 		ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
-	BDG_RUNLOCK(b);
+		if (unlikely(timed))
+			nm_bdg_batch_late(kring, batch, &t0);
+	}
+	BDG_RCU_EXIT(b, tracker);
 	return j;
 }
 
@@ -1153,8 +1459,7 @@ nm_bridge_rthash(const uint8_t *addr)
         a += addr[0];
 
         mix(a, b, c);
-#define BRIDGE_RTHASH_MASK	(NM_BDG_HASH-1)
-        return (c & BRIDGE_RTHASH_MASK);
+        return c;
 }
 
 #undef mix
@@ -1180,8 +1485,12 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 	} else {
 		na->na_flags &= ~NAF_NETMAP_ON;
 	}
-	if (vpna->na_bdg)
+	if (vpna->na_bdg) {
 		BDG_WUNLOCK(vpna->na_bdg);
+		/* senders may still be writing into our rings */
+		if (!onoff)
+			BDG_RCU_SYNC(vpna->na_bdg);
+	}
 	return 0;
 }
 
@@ -1190,7 +1499,8 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
  * Lookup function for a learning bridge.
  * Update the hash table with the source address,
  * and then returns the destination port index, and the
- * ring in *dst_ring (at the moment, always use ring 0)
+ * ring in *dst_ring. Unicast traffic to ports with multiple
+ * rx rings is spread using a flow hash, broadcast goes to ring 0.
  */
 u_int
 netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
@@ -1198,10 +1508,12 @@ netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 {
 	uint8_t *buf = ft->ft_buf;
 	u_int buf_len = ft->ft_len;
-	struct nm_hash_ent *ht = na->na_bdg->ht;
-	uint32_t sh, dh;
-	u_int dst, mysrc = na->bdg_port;
+	struct nm_bridge *b = na->na_bdg;
+	struct nm_hash_table *t = BDG_GET_VAR(b->ht);
+	struct nm_hash_ent *ht, *e;
+	u_int dst, mysrc = na->bdg_port, k;
 	uint64_t smac, dmac;
+	uint32_t now = (uint32_t)time_second, age;
 
 	/* safety check, unfortunately we have many cases */
 	if (buf_len >= 14 + na->virt_hdr_len) {
@@ -1227,27 +1539,167 @@ netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 	 */
 	if ((buf[6] & 1) == 0) { /* valid src */
 		uint8_t *s = buf+6;
-		sh = nm_bridge_rthash(s); // XXX hash of source
-		/* update source port forwarding entry */
-		ht[sh].mac = smac;	/* XXX expire ? */
-		ht[sh].ports = mysrc;
+		struct nm_hash_ent *victim = NULL;
+		uint32_t oldest = 0;
+
+		ht = t->ht_ent + (nm_bridge_rthash(s) & t->ht_mask) *
+			NM_BDG_HASH_WAYS;
+		/* update the entry for this address if there is one,
+		 * otherwise replace a free or the oldest entry
+		 */
+		for (k = 0; k < NM_BDG_HASH_WAYS; k++) {
+			e = ht + k;
+			if (e->mac == smac && NM_HT_USED(e)) {
+				victim = e;
+				break;
+			}
+			age = NM_HT_USED(e) ? now - e->epoch : 0xffffffff;
+			if (victim == NULL || age > oldest) {
+				victim = e;
+				oldest = age;
+			}
+		}
+		/* avoid dirtying the cache line if nothing changed */
+		if (victim->mac != smac || victim->epoch != now ||
+		    victim->ports != mysrc) {
+			victim->mac = smac;
+			victim->ports = mysrc;
+			victim->epoch = now;
+		}
 		if (netmap_verbose)
 		    D("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
 			s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
 	}
 	dst = NM_BDG_BROADCAST;
+	*dst_ring = 0;
 	if ((buf[0] & 1) == 0) { /* unicast */
-		dh = nm_bridge_rthash(buf); // XXX hash of dst
-		if (ht[dh].mac == dmac) {	/* found dst */
-			dst = ht[dh].ports;
+		ht = t->ht_ent + (nm_bridge_rthash(buf) & t->ht_mask) *
+			NM_BDG_HASH_WAYS;
+		for (k = 0; k < NM_BDG_HASH_WAYS; k++) {
+			e = ht + k;
+			if (e->mac != dmac || !NM_HT_USED(e))
+				continue;
+			age = now - e->epoch;
+			if (bridge_ageing == 0 || age < (uint32_t)bridge_ageing)
+				dst = e->ports;	/* found dst */
+			break;
 		}
 		/* XXX otherwise return NM_BDG_UNKNOWN ? */
 	}
-	*dst_ring = 0;
+	if (dst < NM_BDG_MAXPORTS) {
+		struct netmap_vp_adapter *dst_na = BDG_GET_VAR(b->bdg_ports[dst]);
+		u_int nrings = dst_na ? dst_na->up.num_rx_rings : 1;
+
+		/* nm_bdg_flush() has room for NM_BDG_MAXRINGS queues */
+		if (nrings > NM_BDG_MAXRINGS)
+			nrings = NM_BDG_MAXRINGS;
+		if (nrings > 1)
+			*dst_ring = nm_flow_hash(buf, buf_len) % nrings;
+	}
 	return dst;
 }
 
 
+/* the ethernet header of ft, after the virtio-net header, or NULL */
+static inline uint8_t *
+nm_bdg_l2hdr(struct nm_bdg_fwd *ft, const struct netmap_vp_adapter *na)
+{
+	if (ft->ft_len >= 14 + na->virt_hdr_len)
+		return ft->ft_buf + na->virt_hdr_len;
+	if (ft->ft_len == na->virt_hdr_len && ft->ft_flags & NS_MOREFRAG)
+		return ft[1].ft_buf;
+	return NULL;
+}
+
+#define NM_BDG_LOOKUP_AHEAD	4	/* packets between the stages */
+
+/* prefetch the header of packet j, return the next packet */
+static inline u_int
+nm_bdg_prefetch_hdr(struct nm_bdg_fwd *ft, u_int j,
+		const struct netmap_vp_adapter *na)
+{
+	uint8_t *buf = nm_bdg_l2hdr(&ft[j], na);
+
+	if (buf)
+		__builtin_prefetch(buf);
+	return j + ft[j].ft_frags;
+}
+
+/*
+ * prefetch the buckets that netmap_bdg_learning() will touch for
+ * packet j: the source one (written) and the destination one.
+ * Multicast addresses are neither learned nor looked up.
+ */
+static inline u_int
+nm_bdg_prefetch_bucket(struct nm_bdg_fwd *ft, u_int j,
+		const struct netmap_vp_adapter *na)
+{
+	struct nm_hash_table *t = BDG_GET_VAR(na->na_bdg->ht);
+	uint8_t *buf = nm_bdg_l2hdr(&ft[j], na);
+
+	if (buf) {
+		if ((buf[6] & 1) == 0)
+			__builtin_prefetch(t->ht_ent + (nm_bridge_rthash(buf + 6)
+			    & t->ht_mask) * NM_BDG_HASH_WAYS, 1);
+		if ((buf[0] & 1) == 0)
+			__builtin_prefetch(t->ht_ent + (nm_bridge_rthash(buf)
+			    & t->ht_mask) * NM_BDG_HASH_WAYS);
+	}
+	return j + ft[j].ft_frags;
+}
+
+/*
+ * Batch version of netmap_bdg_learning(). The lookup of each packet
+ * is the same, but it is pipelined: headers are prefetched
+ * 2 * NM_BDG_LOOKUP_AHEAD packets ahead, and NM_BDG_LOOKUP_AHEAD
+ * packets ahead we hash the (hopefully cached) addresses and prefetch
+ * the source and destination buckets of the forwarding table.
+ */
+void
+netmap_bdg_learning_batch(struct nm_bdg_fwd *ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		const struct netmap_vp_adapter *na)
+{
+	u_int i, h, b, k;
+
+	/* start the pipeline: h is 2 * AHEAD packets in, b is AHEAD */
+	for (h = 0, k = 0; h < n && k < 2 * NM_BDG_LOOKUP_AHEAD; k++)
+		h = nm_bdg_prefetch_hdr(ft, h, na);
+	for (b = 0, k = 0; b < n && k < NM_BDG_LOOKUP_AHEAD; k++)
+		b = nm_bdg_prefetch_bucket(ft, b, na);
+	for (i = 0; i < n; i += ft[i].ft_frags) {
+		if (h < n)
+			h = nm_bdg_prefetch_hdr(ft, h, na);
+		if (b < n)
+			b = nm_bdg_prefetch_bucket(ft, b, na);
+		/* nm_bdg_flush() drops these without a lookup */
+		if (unlikely(na->virt_hdr_len > ft[i].ft_len)) {
+			dst_port[i] = NM_BDG_NOPORT;
+			continue;
+		}
+		dst_port[i] = netmap_bdg_learning(&ft[i], &dst_ring[i], na);
+	}
+}
+
+
+#define NM_BDG_COPY_AHEAD	4	/* packets prefetched in the copy */
+
+/*
+ * prefetch for the copy the first line of packet k of the ft, and
+ * the buffer of slot j of the destination ring (wrapped), which will
+ * likely receive it. Return the next packet for the same destination.
+ */
+static inline u_int
+nm_bdg_prefetch_copy(struct nm_bdg_fwd *ft, u_int k, struct netmap_ring *ring,
+		u_int j, u_int lim, struct netmap_vp_adapter *dst_na)
+{
+	if (j > lim)
+		j -= lim + 1;
+	__builtin_prefetch(ft[k].ft_buf);
+	__builtin_prefetch(NMB(&dst_na->up, &ring->slot[j]), 1);
+	return ft[k].ft_next;
+}
+
 /*
  * Available space in the ring. Only used in VALE code
  * and only with is_rx = 1
@@ -1329,18 +1781,32 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		u_int ring_nr)
 {
 	struct nm_bdg_q *dst_ents, *brddst;
-	uint16_t num_dsts = 0, *dsts;
+	uint16_t num_dsts = 0, *dsts, *ports;
+	uint8_t *rings;
 	struct nm_bridge *b = na->na_bdg;
+	bdg_lookup_batch_fn_t lookup_batch;
 	u_int i, j, me = na->bdg_port;
+	int allrings = bridge_bcast_rings;
+	u_int lookup_drops = 0;
 
 	/*
 	 * The work area (pointed by ft) is followed by an array of
 	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
 	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
+	 * Then we have an array of destination indexes, and the
+	 * port and ring of each packet as found by lookup_batch.
 	 */
 	dst_ents = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX);
 	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
+	ports = dsts + NM_BDG_BATCH_MAX;
+	rings = (uint8_t *)(ports + NM_BDG_BATCH_MAX);
+
+	lookup_batch = b->bdg_ops.lookup_batch;
+	if (lookup_batch) {
+		for (i = 0; likely(i < n); i += ft[i].ft_frags)
+			rings[i] = ring_nr; /* default, same ring as origin */
+		lookup_batch(ft, n, ports, rings, na);
+	}
 
 	/* first pass: find a destination for each packet in the batch */
 	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
@@ -1353,18 +1819,28 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		   fragment nor at the very beginning of the second. */
 		if (unlikely(na->virt_hdr_len > ft[i].ft_len))
 			continue;
-		dst_port = b->bdg_ops.lookup(&ft[i], &dst_ring, na);
+		if (lookup_batch) {
+			dst_port = ports[i];
+			dst_ring = rings[i];
+		} else {
+			dst_port = b->bdg_ops.lookup(&ft[i], &dst_ring, na);
+		}
 		if (netmap_verbose > 255)
 			RD(5, "slot %d port %d -> %d", i, me, dst_port);
-		if (dst_port == NM_BDG_NOPORT)
-			continue; /* this packet is identified to be dropped */
-		else if (unlikely(dst_port > NM_BDG_MAXPORTS))
+		if (dst_port == NM_BDG_NOPORT) {
+			/* this packet is identified to be dropped */
+			lookup_drops++;
 			continue;
-		else if (dst_port == NM_BDG_BROADCAST)
+		} else if (unlikely(dst_port > NM_BDG_MAXPORTS)) {
+			lookup_drops++;
+			continue;
+		} else if (dst_port == NM_BDG_BROADCAST)
 			dst_ring = 0; /* broadcasts always go to ring 0 */
 		else if (unlikely(dst_port == me ||
-		    !b->bdg_ports[dst_port]))
+		    !b->bdg_ports[dst_port])) {
+			lookup_drops++;
 			continue;
+		}
 
 		/* get a position in the scratch pad */
 		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
@@ -1382,24 +1858,33 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		}
 		d->bq_len += ft[i].ft_frags;
 	}
+	if (unlikely(lookup_drops))
+		netmap_kstat_drop(&na->up.tx_rings[ring_nr],
+		    NM_STAT_DROP_LOOKUP, lookup_drops);
 
 	/*
-	 * Broadcast traffic goes to ring 0 on all destinations.
-	 * So we need to add these rings to the list of ports to scan.
-	 * XXX at the moment we scan all NM_BDG_MAXPORTS ports, which is
-	 * expensive. We should keep a compact list of active destinations
-	 * so we could shorten this loop.
+	 * Broadcast traffic goes to ring 0 (or all rings, if
+	 * bridge_bcast_rings is set) on all destinations.
+	 * So we need to add these rings to the list of ports to scan,
+	 * using the compact list of destinations kept in the bridge.
 	 */
 	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
 	if (brddst->bq_head != NM_FT_NULL) {
-		for (j = 0; likely(j < b->bdg_active_ports); j++) {
-			uint16_t d_i;
-			i = b->bdg_port_index[j];
-			if (unlikely(i == me))
+		struct nm_bdg_dstlist *l = BDG_GET_VAR(b->bdg_cur_dsts);
+		u_int myq = me * NM_BDG_MAXRINGS;
+
+		for (j = 0; likely(j < l->bd_n); j++) {
+			struct nm_bdg_dst *bd = &l->bd_dst[j];
+			u_int r, nr = allrings ? bd->bd_nrings : 1;
+
+			if (unlikely(bd->bd_qbase == myq))
 				continue;
-			d_i = i * NM_BDG_MAXRINGS;
-			if (dst_ents[d_i].bq_head == NM_FT_NULL)
-				dsts[num_dsts++] = d_i;
+			for (r = 0; r < nr; r++) {
+				uint16_t d_i = bd->bd_qbase + r;
+
+				if (dst_ents[d_i].bq_head == NM_FT_NULL)
+					dsts[num_dsts++] = d_i;
+			}
 		}
 	}
 
@@ -1409,13 +1894,15 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		struct netmap_vp_adapter *dst_na;
 		struct netmap_kring *kring;
 		struct netmap_ring *ring;
-		u_int dst_nr, lim, j, d_i, next, brd_next;
-		u_int needed, howmany;
+		u_int dst_nr, lim, j, k, d_i, next, brd_next, pf;
+		u_int needed, howmany, brd_len;
 		int retry = netmap_txsync_retry;
 		struct nm_bdg_q *d;
 		uint32_t my_start = 0, lease_idx = 0;
 		int nrings;
 		int virt_hdr_mismatch = 0;
+		int zcopy;
+		u_int lost = 0;	/* packets that did not fit */
 
 		d_i = dsts[i];
 		ND("second pass %d port %d", i, d_i);
@@ -1439,8 +1926,18 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			goto cleanup;
 		}
 
-		/* there is at least one either unicast or broadcast packet */
-		brd_next = brddst->bq_head;
+		/* there is at least one either unicast or broadcast packet.
+		 * Broadcast only goes to the rings selected in pass 1.
+		 */
+		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
+		nrings = dst_na->up.num_rx_rings;
+		if (dst_nr == 0 || (allrings && (int)dst_nr < nrings)) {
+			brd_next = brddst->bq_head;
+			brd_len = brddst->bq_len;
+		} else {
+			brd_next = NM_FT_NULL;
+			brd_len = 0;
+		}
 		next = d->bq_head;
 		/* we need to reserve this many slots. If fewer are
 		 * available, some packets will be dropped.
@@ -1449,16 +1946,16 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		 * we have claimed, so we will need to handle the leftover
 		 * ones when we regain the lock.
 		 */
-		needed = d->bq_len + brddst->bq_len;
+		needed = d->bq_len + brd_len;
 
-		if (unlikely(dst_na->virt_hdr_len != na->virt_hdr_len)) {
-			RD(3, "virt_hdr_mismatch, src %d dst %d", na->virt_hdr_len, dst_na->virt_hdr_len);
+		if (unlikely(dst_na->rx_hdr_len != na->virt_hdr_len)) {
+			RD(3, "virt_hdr_mismatch, src %d dst %d", na->virt_hdr_len, dst_na->rx_hdr_len);
 			/* There is a virtio-net header/offloadings mismatch between
 			 * source and destination. The slower mismatch datapath will
 			 * be used to cope with all the mismatches.
 			 */
 			virt_hdr_mismatch = 1;
-			if (dst_na->mfs < na->mfs) {
+			if (!dst_na->rx_hdr_len && dst_na->mfs < na->mfs) {
 				/* We may need to do segmentation offloadings, and so
 				 * we may need a number of destination slots greater
 				 * than the number of input slots ('needed').
@@ -1475,10 +1972,14 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			}
 		}
 
+		/* buffers can be swapped only if both ports see the
+		 * same memory region
+		 */
+		zcopy = bridge_zerocopy && !virt_hdr_mismatch &&
+			dst_na->up.nm_mem == na->up.nm_mem;
+
 		ND(5, "pass 2 dst %d is %x %s",
 			i, d_i, is_vp ? "virtual" : "nic/host");
-		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
-		nrings = dst_na->up.num_rx_rings;
 		if (dst_nr >= nrings)
 			dst_nr = dst_nr % nrings;
 		kring = &dst_na->up.rx_rings[dst_nr];
@@ -1515,11 +2016,20 @@ retry:
 		if (retry && needed <= howmany)
 			retry = 0;
 
+		/* start prefetching the unicast packets we copy, pf
+		 * runs NM_BDG_COPY_AHEAD packets ahead of next
+		 */
+		pf = zcopy ? NM_FT_NULL : next;
+		for (k = 0; pf != NM_FT_NULL && k < NM_BDG_COPY_AHEAD; k++)
+			pf = nm_bdg_prefetch_copy(ft, pf, ring, j + k, lim,
+				dst_na);
+
 		/* copy to the destination queue */
 		while (howmany > 0) {
 			struct netmap_slot *slot;
 			struct nm_bdg_fwd *ft_p, *ft_end;
 			u_int cnt;
+			int swap = zcopy;
 
 			/* find the queue from which we pick next packet.
 			 * NM_FT_NULL is always higher than valid indexes
@@ -1530,13 +2040,19 @@ retry:
 			if (next < brd_next) {
 				ft_p = ft + next;
 				next = ft_p->ft_next;
+				if (pf != NM_FT_NULL)
+					pf = nm_bdg_prefetch_copy(ft, pf, ring,
+						j + NM_BDG_COPY_AHEAD, lim, dst_na);
 			} else { /* insert broadcast */
 				ft_p = ft + brd_next;
 				brd_next = ft_p->ft_next;
+				swap = 0; /* other ports need this buffer */
 			}
 			cnt = ft_p->ft_frags; // cnt > 0
-			if (unlikely(cnt > howmany))
+			if (unlikely(cnt > howmany)) {
+			    lost++; /* already off the queue */
 			    break; /* no more space */
+			}
 			if (netmap_verbose && cnt > 1)
 				RD(5, "rx %d frags to %d", cnt, j);
 			ft_end = ft_p + cnt;
@@ -1547,9 +2063,16 @@ retry:
 				do {
 					char *dst, *src = ft_p->ft_buf;
 					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
+					u_int src_size, dst_size;
+					uint16_t bufchg = 0;
 
 					slot = &ring->slot[j];
 					dst = NMB(&dst_na->up, slot);
+					/* either side may have large buffers */
+					dst_size = NMB_SIZE(&dst_na->up, slot);
+					src_size = (ft_p->ft_flags & NS_INDIRECT) ?
+					    NETMAP_BUF_SIZE(&na->up) :
+					    NMB_SIZE(&na->up, ft_p->ft_slot);
 
 					ND("send [%d] %d(%d) bytes at %s:%d",
 							i, (int)copy_len, (int)dst_len,
@@ -1557,27 +2080,44 @@ retry:
 					/* round to a multiple of 64 */
 					copy_len = (copy_len + 63) & ~63;
 
-					if (unlikely(copy_len > NETMAP_BUF_SIZE(&dst_na->up) ||
-						     copy_len > NETMAP_BUF_SIZE(&na->up))) {
+					if (unlikely(copy_len > dst_size ||
+						     copy_len > src_size)) {
 						RD(5, "invalid len %d, down to 64", (int)copy_len);
 						copy_len = dst_len = 64; // XXX
 					}
 					if (ft_p->ft_flags & NS_INDIRECT) {
-						if (copyin(src, dst, copy_len)) {
+						/* exact length, the rounding
+						 * could cross into an unmapped
+						 * page
+						 */
+						if (copyin(src, dst, dst_len)) {
 							// invalid user pointer, pretend len is 0
 							dst_len = 0;
 						}
+					} else if (swap && src_size == dst_size) {
+						/* same memory region, exchange the
+						 * buffers as netmap pipes do.
+						 * Buffers of different sizes
+						 * would move between rings.
+						 */
+						struct netmap_slot *src_slot = ft_p->ft_slot;
+						uint32_t tmp = slot->buf_idx;
+
+						slot->buf_idx = src_slot->buf_idx;
+						src_slot->buf_idx = tmp;
+						src_slot->flags |= NS_BUF_CHANGED;
+						bufchg = NS_BUF_CHANGED;
 					} else {
 						//memcpy(dst, src, copy_len);
 						pkt_copy(src, dst, (int)copy_len);
 					}
 					slot->len = dst_len;
-					slot->flags = (cnt << 8)| NS_MOREFRAG;
+					slot->flags = (cnt << 8)| NS_MOREFRAG | bufchg;
 					j = nm_next(j, lim);
 					needed--;
 					ft_p++;
 				} while (ft_p != ft_end);
-				slot->flags = (cnt << 8); /* clear flag on last entry */
+				slot->flags &= ~NS_MOREFRAG; /* clear flag on last entry */
 			}
 			/* are we done ? */
 			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
@@ -1639,6 +2179,7 @@ retry:
 					/* XXX this is going to call nm_notify again.
 					 * Only useful for bwrap in virtual machines
 					 */
+					netmap_kstat_drop(kring, NM_STAT_RETRY, 1);
 					goto retry;
 				}
 			}
@@ -1646,6 +2187,13 @@ retry:
 		    if (still_locked)
 			mtx_unlock(&kring->q_lock);
 		}
+		/* what is left in the queues is dropped */
+		for (; next != NM_FT_NULL; next = ft[next].ft_next)
+			lost++;
+		for (; brd_next != NM_FT_NULL; brd_next = ft[brd_next].ft_next)
+			lost++;
+		if (unlikely(lost))
+			netmap_kstat_drop(kring, NM_STAT_DROP_NOSPACE, lost);
 cleanup:
 		d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
 		d->bq_len = 0;
@@ -1816,26 +2364,42 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 	nm_bound_var(&nmr->nr_arg3, 0, 0,
 			128*NM_BDG_MAXSLOTS, NULL);
 	na->num_rx_desc = nmr->nr_rx_slots;
-	vpna->virt_hdr_len = 0;
+	vpna->virt_hdr_len = vpna->rx_hdr_len = 0;
 	vpna->mfs = 1514;
 	/*if (vpna->mfs > netmap_buf_size)  TODO netmap_buf_size is zero??
 		vpna->mfs = netmap_buf_size; */
         if (netmap_verbose)
 		D("max frame size %u", vpna->mfs);
 
-	na->na_flags |= NAF_BDG_MAYSLEEP | NAF_MEM_OWNER;
+	na->na_flags |= NAF_BDG_MAYSLEEP | NAF_JBUF | NAF_TX_INDIRECT;
 	na->nm_txsync = netmap_vp_txsync;
 	na->nm_rxsync = netmap_vp_rxsync;
 	na->nm_register = netmap_vp_reg;
 	na->nm_krings_create = netmap_vp_krings_create;
 	na->nm_krings_delete = netmap_vp_krings_delete;
 	na->nm_dtor = netmap_vp_dtor;
-	na->nm_mem = netmap_mem_private_new(na->name,
-			na->num_tx_rings, na->num_tx_desc,
-			na->num_rx_rings, na->num_rx_desc,
-			nmr->nr_arg3, npipes, &error);
-	if (na->nm_mem == NULL)
-		goto err;
+	if (vale_shared_mem)
+		na->nm_mem = netmap_mem_vale_get();
+	if (na->nm_mem != NULL) {
+		u_int maxslots = netmap_mem_get_maxslots(na->nm_mem);
+
+		if (na->num_tx_desc > maxslots)
+			na->num_tx_desc = nmr->nr_tx_slots = maxslots;
+		if (na->num_rx_desc > maxslots)
+			na->num_rx_desc = nmr->nr_rx_slots = maxslots;
+		if (vale_port_bufs > 0)
+			na->na_buf_quota = vale_port_bufs;
+	} else {
+		if (vale_shared_mem)
+			D("%s: no shared memory, using a private one", na->name);
+		na->na_flags |= NAF_MEM_OWNER;
+		na->nm_mem = netmap_mem_private_new(na->name,
+				na->num_tx_rings, na->num_tx_desc,
+				na->num_rx_rings, na->num_rx_desc,
+				nmr->nr_arg3, npipes, &error);
+		if (na->nm_mem == NULL)
+			goto err;
+	}
 	na->nm_bdg_attach = netmap_vp_bdg_attach;
 	/* other nmd fields are set in the common routine */
 	error = netmap_attach_common(na);
@@ -1845,7 +2409,7 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 	return 0;
 
 err:
-	if (na->nm_mem != NULL)
+	if (na->na_flags & NAF_MEM_OWNER)
 		netmap_mem_private_delete(na->nm_mem);
 	free(vpna, M_DEVBUF);
 	return error;
@@ -1908,10 +2472,24 @@ netmap_bwrap_dtor(struct netmap_adapter *na)
 }
 
 
+/* the rx ring of a bwrap served by a kernel thread */
+struct netmap_bwrap_worker {
+	struct netmap_bwrap_adapter *bna;
+	u_int ring_nr;
+	int more;		/* the last pass hit the budget */
+	int stopped;		/* the ring was already stopped */
+	struct nm_kthread *kt;
+};
+
+static int netmap_bwrap_rx(struct netmap_adapter *, u_int, int,
+	u_int, int *);
+static void netmap_bwrap_workers_stop(struct netmap_bwrap_adapter *);
+
 /*
  * Intr callback for NICs connected to a bridge.
  * Simply ignore tx interrupts (maybe we could try to recover space ?)
- * and pass received packets from nic to the bridge.
+ * and pass received packets from nic to the bridge, or wake up
+ * the worker of the ring that will do it.
  *
  * XXX TODO check locking: this is called from the interrupt
  * handler so we should make sure that the interface is not
@@ -1930,12 +2508,6 @@ static int
 netmap_bwrap_intr_notify(struct netmap_adapter *na, u_int ring_nr, enum txrx tx, int flags)
 {
 	struct netmap_bwrap_adapter *bna = na->na_private;
-	struct netmap_vp_adapter *hostna = &bna->host;
-	struct netmap_kring *kring, *bkring;
-	struct netmap_ring *ring;
-	int is_host_ring = ring_nr == na->num_rx_rings;
-	struct netmap_vp_adapter *vpna = &bna->up;
-	int error = 0;
 
 	if (netmap_verbose)
 	    D("%s %s%d 0x%x", na->name,
@@ -1948,6 +2520,46 @@ netmap_bwrap_intr_notify(struct netmap_adapter *na, u_int ring_nr, enum txrx tx,
 	if (tx == NR_TX)
 		return 0;
 
+	if (ring_nr < bna->nworkers) {
+		struct netmap_kring *kring = &na->rx_rings[ring_nr];
+		int woken = 0;
+
+		/* check again under the lock that
+		 * netmap_bwrap_workers_stop() runs through
+		 */
+		mtx_lock(&kring->q_lock);
+		if (ring_nr < bna->nworkers) {
+			nm_kthread_wakeup(bna->workers[ring_nr].kt);
+			woken = 1;
+		}
+		mtx_unlock(&kring->q_lock);
+		if (woken)
+			return 0;
+	}
+	return netmap_bwrap_rx(na, ring_nr, flags, 0, NULL);
+}
+
+
+/*
+ * Move the packets received on hwna rx ring ring_nr to the switch,
+ * at most budget slots if budget > 0 (rounded up to a whole packet),
+ * in which case *more tells if some were left in the ring.
+ */
+static int
+netmap_bwrap_rx(struct netmap_adapter *na, u_int ring_nr, int flags,
+	u_int budget, int *more)
+{
+	struct netmap_bwrap_adapter *bna = na->na_private;
+	struct netmap_vp_adapter *hostna = &bna->host;
+	struct netmap_kring *kring, *bkring;
+	struct netmap_ring *ring;
+	int is_host_ring = ring_nr == na->num_rx_rings;
+	struct netmap_vp_adapter *vpna = &bna->up;
+	int error = 0;
+	u_int head;
+
+	if (more)
+		*more = 0;
 	kring = &na->rx_rings[ring_nr];
 	ring = kring->ring;
 
@@ -1956,7 +2568,7 @@ netmap_bwrap_intr_notify(struct netmap_adapter *na, u_int ring_nr, enum txrx tx,
 		return 0;
 
 	if (is_host_ring && hostna->na_bdg == NULL) {
-		error = bna->save_notify(na, ring_nr, tx, flags);
+		error = bna->save_notify(na, ring_nr, NR_RX, flags);
 		goto put_out;
 	}
 
@@ -1994,9 +2606,24 @@ netmap_bwrap_intr_notify(struct netmap_adapter *na, u_int ring_nr, enum txrx tx,
 
 	/* new packets are ring->cur to ring->tail, and the bkring
 	 * had hwcur == ring->cur. So advance ring->cur to ring->tail
-	 * to push all packets out.
+	 * to push all packets out, or as many as the budget allows.
+	 * The rest stays in the ring for the next pass.
 	 */
-	ring->head = ring->cur = ring->tail;
+	head = ring->tail;
+	if (budget > 0 && nm_kr_rxspace(kring) > budget) {
+		u_int lim = kring->nkr_num_slots - 1;
+
+		head = ring->cur + budget;
+		if (head > lim)
+			head -= lim + 1;
+		/* do not split a packet */
+		while (head != ring->tail &&
+		    ring->slot[nm_prev(head, lim)].flags & NS_MOREFRAG)
+			head = nm_next(head, lim);
+		if (head != ring->tail)
+			*more = 1;
+	}
+	ring->head = ring->cur = head;
 
 	/* also set tail to what the bwrap expects */
 	bkring = &vpna->up.tx_rings[ring_nr];
@@ -2006,8 +2633,8 @@ netmap_bwrap_intr_notify(struct netmap_adapter *na, u_int ring_nr, enum txrx tx,
 	nm_txsync_prologue(bkring); // XXX error checking ?
 	netmap_vp_txsync(bkring, flags);
 
-	/* mark all buffers as released on this ring */
-	ring->head = ring->cur = kring->nr_hwtail;
+	/* mark the buffers we forwarded as released on this ring */
+	ring->head = ring->cur = head;
 	ring->tail = kring->rtail;
 	/* another call to actually release the buffers */
 	if (!is_host_ring) {
@@ -2026,6 +2653,105 @@ put_out:
 }
 
 
+/*
+ * Body of the kernel thread of a bwrap rx ring: sleep until the
+ * interrupt comes, then forward the packets in passes of at most
+ * bridge_kthread_budget slots, going back to sleep when the ring
+ * is empty. nm_kthread_main() yields the CPU between passes.
+ */
+static void
+netmap_bwrap_worker(void *arg)
+{
+	struct netmap_bwrap_worker *w = arg;
+	struct netmap_adapter *hwna = w->bna->hwna;
+
+	if (!w->more)
+		nm_kthread_wait(w->kt);
+	if (!nm_netmap_on(hwna)) {
+		w->more = 0;
+		return;
+	}
+	netmap_bwrap_rx(hwna, w->ring_nr, 0, bridge_kthread_budget,
+		&w->more);
+}
+
+
+/* start the rx workers of a bwrap, on failure the rings stay inline */
+static void
+netmap_bwrap_workers_start(struct netmap_bwrap_adapter *bna)
+{
+	struct netmap_adapter *hwna = bna->hwna;
+	struct netmap_bwrap_worker *w;
+	u_int i, n = hwna->num_rx_rings;
+	char name[32];
+
+	bna->workers = malloc(sizeof(*w) * n, M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (bna->workers == NULL) {
+		D("%s: no memory for the rx workers", hwna->name);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		struct nm_kthread *kt;
+
+		w = &bna->workers[i];
+		w->bna = bna;
+		w->ring_nr = i;
+		snprintf(name, sizeof(name), "nm_bdg:%s-%u", hwna->name, i);
+		kt = nm_kthread_start(netmap_bwrap_worker, w, name);
+		if (kt == NULL)
+			break;
+		if (bridge_kthread_cpu >= 0 &&
+		    nm_kthread_set_affinity(kt, bridge_kthread_cpu + i))
+			D("%s: cannot bind to cpu %d", name,
+			    bridge_kthread_cpu + i);
+		w->kt = kt;
+	}
+	if (i < n) {
+		D("%s: cannot start the rx workers", hwna->name);
+		bna->nworkers = i;
+		netmap_bwrap_workers_stop(bna);
+		return;
+	}
+	mb();	/* workers set up before the interrupt can see them */
+	bna->nworkers = n;
+}
+
+
+/*
+ * Stop the rx workers. Stopping the hwna rx rings waits for the
+ * interrupts that may still be waking up a worker (they run under
+ * the q_lock) and for the passes in progress; later interrupts see
+ * nworkers == 0. The rings are then enabled again, unless they were
+ * already stopped.
+ */
+static void
+netmap_bwrap_workers_stop(struct netmap_bwrap_adapter *bna)
+{
+	struct netmap_adapter *hwna = bna->hwna;
+	struct netmap_bwrap_worker *w;
+	u_int i, n = bna->nworkers;
+
+	if (bna->workers == NULL)
+		return;
+	bna->nworkers = 0;
+	mb();
+	for (i = 0; i < n; i++) {
+		w = &bna->workers[i];
+		w->stopped = hwna->rx_rings[i].nkr_stopped;
+		netmap_set_rxring(hwna, i, 1);
+	}
+	for (i = 0; i < n; i++)
+		nm_kthread_stop(bna->workers[i].kt);
+	for (i = 0; i < n; i++) {
+		w = &bna->workers[i];
+		if (!w->stopped)
+			netmap_set_rxring(hwna, i, 0);
+	}
+	free(bna->workers, M_DEVBUF);
+	bna->workers = NULL;
+}
+
+
 /* nm_register callback for bwrap */
 static int
 netmap_bwrap_register(struct netmap_adapter *na, int onoff)
@@ -2049,6 +2775,8 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 		hwna->na_lut = na->na_lut;
 		hwna->na_lut_objtotal = na->na_lut_objtotal;
 		hwna->na_lut_objsize = na->na_lut_objsize;
+		hwna->na_lut_jtotal = na->na_lut_jtotal;
+		hwna->na_lut_jsize = na->na_lut_jsize;
 
 		if (hostna->na_bdg) {
 			/* if the host rings have been attached to switch,
@@ -2058,6 +2786,8 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 			hostna->up.na_lut = na->na_lut;
 			hostna->up.na_lut_objtotal = na->na_lut_objtotal;
 			hostna->up.na_lut_objsize = na->na_lut_objsize;
+			hostna->up.na_lut_jtotal = na->na_lut_jtotal;
+			hostna->up.na_lut_jsize = na->na_lut_jsize;
 		}
 
 		/* cross-link the netmap rings
@@ -2076,6 +2806,14 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 		}
 	}
 
+	/* no more interrupts through the bwrap before the hwna
+	 * goes down, then wait for those still using the workers
+	 */
+	if (!onoff) {
+		hwna->nm_notify = bna->save_notify;
+		netmap_bwrap_workers_stop(bna);
+	}
+
 	/* forward the request to the hwna */
 	error = hwna->nm_register(hwna, onoff);
 	if (error)
@@ -2087,6 +2825,8 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 		netmap_vp_reg(&hostna->up, onoff);
 
 	if (onoff) {
+		if (bridge_kthreads)
+			netmap_bwrap_workers_start(bna);
 		/* intercept the hwna nm_nofify callback */
 		bna->save_notify = hwna->nm_notify;
 		hwna->nm_notify = netmap_bwrap_intr_notify;
@@ -2095,6 +2835,8 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 		hwna->na_lut = NULL;
 		hwna->na_lut_objtotal = 0;
 		hwna->na_lut_objsize = 0;
+		hwna->na_lut_jtotal = 0;
+		hwna->na_lut_jsize = 0;
 	}
 
 	return 0;
@@ -2364,6 +3106,13 @@ netmap_bwrap_attach(const char *nr_name, struct netmap_adapter *hwna)
 	if (na->nm_mem == NULL)
 		goto err_put;
 	bna->up.retry = 1; /* XXX maybe this should depend on the hwna */
+	bna->up.mfs = 1514;
+	/* frames from the switch go to the NIC tx rings. If the NIC
+	 * does the offloadings they keep their virtio-net header (and
+	 * TSO frames are not segmented), otherwise they lose it.
+	 * Frames from the NIC never have one.
+	 */
+	bna->up.rx_hdr_len = hwna->tx_hdr_len;
 
 	bna->hwna = hwna;
 	netmap_adapter_get(hwna);
@@ -2436,8 +3185,18 @@ netmap_init_bridges2(u_int n)
 		M_NOWAIT | M_ZERO);
 	if (b == NULL)
 		return NULL;
-	for (i = 0; i < n; i++)
+	for (i = 0; i < n; i++) {
+		if (BDG_RCU_INIT(&b[i])) {
+			D("cannot initialize bridge %d", i);
+			while (--i >= 0) {
+				BDG_RCU_DESTROY(&b[i]);
+				BDG_RWDESTROY(&b[i]);
+			}
+			free(b, M_DEVBUF);
+			return NULL;
+		}
 		BDG_RWINIT(&b[i]);
+	}
 	return b;
 }
 
@@ -2449,8 +3208,12 @@ netmap_uninit_bridges2(struct nm_bridge *b, u_int n)
 	if (b == NULL)
 		return;
 
-	for (i = 0; i < n; i++)
+	for (i = 0; i < n; i++) {
+		if (b[i].ht)
+			free(b[i].ht, M_DEVBUF);
+		BDG_RCU_DESTROY(&b[i]);
 		BDG_RWDESTROY(&b[i]);
+	}
 	free(b, M_DEVBUF);
 }
 
@@ -137,6 +137,15 @@
  *	netmap:foo-k			the k-th NIC ring pair
  *	netmap:foo{k			PIPE ring pair k, master side
  *	netmap:foo}k			PIPE ring pair k, slave side
+ *	netmap:foo}k-r			ring r of the slave side of PIPE k
+ *
+ * + A pipe created with nr_rx_rings = N > 1 is a pipe group:
+ *   the master has one tx ring and N rx rings, the slave has N ring
+ *   pairs. Slots sent on the master tx ring are steered (swapping
+ *   buffers, as in regular pipes) to the slave rx rings according
+ *   to a symmetric flow hash, so both directions of a connection
+ *   reach the same ring. Slave tx ring i feeds master rx ring i.
+ *   Workers bind a single slave ring with NR_PIPE_RING(i).
  */
 
 /*
@@ -276,6 +285,16 @@ struct netmap_ring {
 
 	/* the slots follow. This struct has variable size */
 	struct netmap_slot slot[0];	/* array of slots. */
+	/*
+	 * On ports bound with NR_HWTS, an array of num_slots
+	 * uint64_t follows the slots (see NETMAP_RING_TS() in
+	 * netmap_user.h). Entry i is the hardware timestamp, in
+	 * nanoseconds of the NIC clock, of the frame in slot i:
+	 * on rx rings, the time of reception, valid for the slots
+	 * in [head .. tail-1]; on tx rings, the time of transmission
+	 * of frames sent with NS_REPORT, filled in by a later
+	 * txsync. 0 means no timestamp.
+	 */
 };
 
 
@@ -311,6 +330,7 @@ struct netmap_if {
 	const uint32_t	ni_version;	/* API version, currently unused */
 	const uint32_t	ni_flags;	/* properties */
 #define	NI_PRIV_MEM	0x1		/* private memory region */
+#define	NI_RX_PENDING	0x2		/* NETMAP_IF_RX_PENDING() is valid */
 
 	/*
 	 * The number of packet rings available in netmap mode.
@@ -332,10 +352,20 @@ struct netmap_if {
 	 *
 	 * The area is filled up by the kernel on NIOCREGIF,
 	 * and then only read by userspace code.
+	 *
+	 * It is followed by a bitmap of the rx rings (NIC and host),
+	 * NETMAP_IF_RX_PENDING(nifp). On each poll() for POLLIN and each
+	 * NIOCRXSYNC, the kernel clears the bits of the rings that were
+	 * empty and had no new slots, so that they can be skipped until
+	 * the next sync. Only valid if ni_flags has NI_RX_PENDING
+	 * (not with NR_BUSY_POLL).
 	 */
 	const ssize_t	ring_ofs[0];
 };
 
+#define NETMAP_IF_RX_PENDING(nifp)	((uint32_t *)(uintptr_t)	\
+	&(nifp)->ring_ofs[(nifp)->ni_tx_rings + (nifp)->ni_rx_rings + 2])
+
 
 #ifndef NIOCREGIF
 /*
@@ -354,6 +384,10 @@ struct netmap_if {
  * NIOCREGIF takes an interface name within a struct nmre,
  *	and activates netmap mode on the interface (if possible).
  *
+ * NIOCGSTATS takes a struct nm_stats_req (see below) and returns
+ *	the counters of one ring of the port bound to the file
+ *	descriptor.
+ *
  * The argument to NIOCGINFO/NIOCREGIF overlays struct ifreq so we
  * can pass it down to other NIC-related ioctls.
  *
@@ -424,6 +458,40 @@ struct netmap_if {
  *		If two ports the same region zero-copy is possible.
  *
  * nr_arg3 (in/out)	number of extra buffers to be allocated.
+ *		With NR_MONITOR_COPY, the bytes copied from each frame
+ *		(0: all of it); no extra buffers are allocated.
+ *
+ * nr_flags (in)	the NR_REG_* binding mode, plus optional flags:
+ *	NR_BUSY_POLL	a kernel thread continuously runs txsync and
+ *		rxsync on the bound rings until the port is unbound.
+ *		The application only updates head/cur and reads tail
+ *		from the shared rings, and must not issue NIOC*SYNC or
+ *		poll() on the file descriptor. The thread keeps a CPU
+ *		busy, and can be pinned with the usual system tools.
+ *	NR_MONITOR_TX, NR_MONITOR_RX	monitor the tx/rx rings of the
+ *		port selected by the other fields (see netmap_monitor.c).
+ *		Frames are moved to the monitor by swapping buffers.
+ *	NR_MONITOR_COPY	with the above, copy the frames and leave the
+ *		monitored rings alone. Several copy monitors can share a
+ *		ring, and nr_rx_rings (if smaller) folds the monitored
+ *		rings onto fewer monitor rings.
+ *	NR_HWTS	the driver stores hardware timestamps in the array
+ *		that follows the slots of each bound ring (see struct
+ *		netmap_ring). Fails with EOPNOTSUPP if the port cannot
+ *		do it.
+ *	NR_JBUF	the bound rings get the large buffers of the memory
+ *		region (nr_jbuf_size bytes each) instead of the normal
+ *		ones. Only applies when the rings are created, i.e. on
+ *		the first registration of the port, and host rings keep
+ *		normal buffers. Fails with EOPNOTSUPP if the region has
+ *		no large buffers or the port cannot use them (for now,
+ *		only VALE ports can), and with EBUSY if the port is
+ *		already registered and a hw ring to bind has normal
+ *		buffers.
+ *
+ * nr_node (out)	NUMA node the port (and, if set, its memory) is
+ *		attached to, -1 if unknown. Returned by NIOCGINFO and
+ *		NIOCREGIF, meant for pinning the threads that use the port.
  *
  *
  *
@@ -443,7 +511,13 @@ struct netmap_if {
  *
  *	NETMAP_BDG_VNET_HDR
  *		Set the virtio-net header length used by the client
- *		of a VALE switch port.
+ *		of a VALE switch port. nr_arg1 is 0, 10 or 12.
+ *		With the name of a NIC that supports it (e.g. ixgbe),
+ *		frames in its tx rings start with such a header, which
+ *		the NIC uses for checksum and TSO offloading. Only while
+ *		the NIC is not in use; a VALE attach done later then
+ *		passes TSO frames from the ports to the NIC unsegmented.
+ *		Used by vale-ctl -o ...
  *
  *	NETMAP_BDG_NEWIF
  *		create a persistent VALE port with name nr_name.
@@ -452,6 +526,59 @@ struct netmap_if {
  *	NETMAP_BDG_DELIF
  *		delete a persistent VALE port. Used by vale-ctl -d ...
  *
+ *	NETMAP_BDG_HASHSIZE	and nr_name = vale*:
+ *		resize (and flush) the forwarding table of the switch
+ *		to nr_arg3 entries. nr_arg3 = 0 only reads the size.
+ *		The actual size is returned in nr_arg3.
+ *		Used by vale-ctl -H ...
+ *
+ *	NETMAP_RING_NOTIFY	on a file descriptor bound with NIOCREGIF
+ *		coalesces the wakeups on the bound rings: poll()/select()
+ *		are woken up when nr_arg1 slots are ready (received
+ *		packets or free tx slots), or at most nr_arg3 microseconds
+ *		after the first event held back. nr_arg3 = 0 restores one
+ *		wakeup per event, nr_arg1 = 0 only uses the delay.
+ *		NICs update the ring state in rxsync/txsync, so on
+ *		interrupt there is normally only the delay.
+ *		The thresholds belong to the rings, not to the file
+ *		descriptor, and are kept until the port is unregistered.
+ *
+ *	NETMAP_RING_FILTER	on a file descriptor bound with
+ *		NR_REG_ONE_NIC, programs a hardware filter (e.g. flow
+ *		director/ntuple) that steers the matching frames to the
+ *		bound rx ring, so the host stack never sees them.
+ *		nr_arg2 is the index of the filter in the NIC table,
+ *		nr_arg1 the operation:
+ *		NETMAP_FILTER_5TUPLE	IPv4 frames with protocol nr_arg3,
+ *		    source nr_offset:nr_tx_slots, destination
+ *		    nr_memsize:nr_rx_slots (addresses and ports in network
+ *		    byte order, zero matches anything);
+ *		NETMAP_FILTER_MAC	frames to the MAC address
+ *		    nr_offset (first 4 bytes, as a big endian number)
+ *		    and nr_memsize (last 2 bytes);
+ *		NETMAP_FILTER_DEL	remove filter nr_arg2.
+ *		The filters are removed when the file descriptor is
+ *		unbound. NICs may restrict the filters that can coexist
+ *		(e.g. ixgbe wants the same fields in all filters).
+ *		EOPNOTSUPP if the port has no such filters.
+ *
+ *	NETMAP_PT_HOST_CREATE	on a file descriptor bound with
+ *		NIOCREGIF, lets a guest VM sync one of the bound rings
+ *		(passthrough, see struct ptn_csb below). nr_arg1 is the
+ *		ring, nr_arg2 is 0 for a tx ring and 1 for an rx ring,
+ *		nr_offset the eventfd the hypervisor signals when the
+ *		guest kicks, nr_memsize the eventfd that interrupts the
+ *		guest, nr_arg3 (if not 0) the CPU plus one where the
+ *		kernel thread of the ring runs. On return nr_arg3 is
+ *		the buffer index of the struct ptn_csb of the ring.
+ *		The rings stay with the guest until NETMAP_PT_HOST_DELETE
+ *		or until the file descriptor is unbound, and the file
+ *		descriptor must not be used for NIOC*SYNC or poll().
+ *		EOPNOTSUPP on systems without eventfds (FreeBSD).
+ *
+ *	NETMAP_PT_HOST_DELETE	gives back all the passthrough rings
+ *		of the file descriptor.
+ *
  * nr_arg1, nr_arg2, nr_arg3  (in/out)		command specific
  *
  *
@@ -491,14 +618,23 @@ struct nmreq {
 #define NETMAP_BDG_OFFSET	NETMAP_BDG_VNET_HDR	/* deprecated alias */
 #define NETMAP_BDG_NEWIF	6	/* create a virtual port */
 #define NETMAP_BDG_DELIF	7	/* destroy a virtual port */
+#define NETMAP_BDG_HASHSIZE	8	/* resize the forwarding table */
+#define NETMAP_RING_NOTIFY	9	/* set the notification thresholds */
+#define NETMAP_RING_FILTER	10	/* steer frames to the bound ring */
+#define NETMAP_PT_HOST_CREATE	11	/* guest VM syncs a bound ring */
+#define NETMAP_PT_HOST_DELETE	12	/* stop the passthrough */
 	uint16_t	nr_arg1;	/* reserve extra rings in NIOCREGIF */
 #define NETMAP_BDG_HOST		1	/* attach the host stack on ATTACH */
+#define NETMAP_FILTER_DEL	0	/* NETMAP_RING_FILTER operations */
+#define NETMAP_FILTER_5TUPLE	1
+#define NETMAP_FILTER_MAC	2
 
 	uint16_t	nr_arg2;
 	uint32_t	nr_arg3;	/* req. extra buffers in NIOCREGIF */
 	uint32_t	nr_flags;
 	/* various modes, extends nr_ringid */
-	uint32_t	spare2[1];
+	int16_t		nr_node;	/* NUMA node of the port, -1 if unknown */
+	uint16_t	nr_jbuf_size;	/* large buffers of the region, 0 if none */
 };
 
 #define NR_REG_MASK		0xf /* values for nr_flags */
@@ -513,6 +649,19 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
 /* monitor uses the NR_REG to select the rings to monitor */
 #define NR_MONITOR_TX	0x100
 #define NR_MONITOR_RX	0x200
+/* the monitor copies nr_arg3 bytes (0: all) of each frame, see below */
+#define NR_MONITOR_COPY	0x800
+/* a kernel thread syncs the bound rings, no ioctl()/poll() needed */
+#define NR_BUSY_POLL	0x400
+/* hardware timestamps after the slots, see struct netmap_ring */
+#define NR_HWTS		0x1000
+/* large buffers on the bound rings, see nr_jbuf_size */
+#define NR_JBUF		0x2000
+/* with NR_REG_PIPE_*, bind only ring n of the pipe endpoint */
+#define NR_PIPE_RING_SHIFT	16
+#define NR_PIPE_RING_MASK	0xff0000
+#define NR_PIPE_RING(n)		\
+	((((n) + 1) << NR_PIPE_RING_SHIFT) & NR_PIPE_RING_MASK)
 
 
 /*
@@ -526,6 +675,7 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
 #define NIOCTXSYNC	_IO('i', 148) /* sync tx queues */
 #define NIOCRXSYNC	_IO('i', 149) /* sync rx queues */
 #define NIOCCONFIG	_IOWR('i',150, struct nm_ifreq) /* for ext. modules */
+#define NIOCGSTATS	_IOWR('i', 151, struct nm_stats_req) /* ring counters */
 #endif /* !NIOCREGIF */
 
 
@@ -553,4 +703,67 @@ struct nm_ifreq {
 	char data[NM_IFRDATA_LEN];
 };
 
+/*
+ * Argument of ioctl(fd, NIOCGSTATS, req). ns_ring and ns_tx select
+ * a ring of the port bound to fd (ns_ring equal to the number of
+ * hardware rings is the host ring), ns_stat returns its counters,
+ * indexed by NM_STAT_*. The counters start at 0 when the rings of
+ * the port are created and are never reset. Drops are accounted on
+ * the ring that could not take the packet (the destination of a
+ * VALE port or of a monitor), the others on the ring that moved it.
+ * Entries from NM_STAT_NUM to NM_STAT_MAX are reserved.
+ */
+enum {
+	NM_STAT_PACKETS,	/* packets through the ring */
+	NM_STAT_BYTES,		/* and their bytes */
+	NM_STAT_SYNCS,		/* txsync/rxsync calls */
+	NM_STAT_NOTIFY,		/* wakeups of the waiters */
+	NM_STAT_RETRY,		/* new attempts on a full ring */
+	NM_STAT_DROP_NOSPACE,	/* no space in the ring */
+	NM_STAT_DROP_LOOKUP,	/* discarded by the VALE lookup */
+	NM_STAT_DROP_MONITOR,	/* no space in the monitor ring */
+	NM_STAT_TXERR,		/* emulated adapter, NIC refused a frame */
+	NM_STAT_NUM
+};
+#define NM_STAT_MAX	16
+
+struct nm_stats_req {
+	uint16_t	ns_ring;		/* in: ring index */
+	uint16_t	ns_tx;			/* in: 1 tx ring, 0 rx ring */
+	uint32_t	ns_spare;
+	uint64_t	ns_stat[NM_STAT_MAX];	/* out: counters */
+};
+
+/*
+ * Passthrough (NETMAP_PT_HOST_CREATE). A hypervisor binds a host
+ * port (typically a VALE port) and maps its memory region into a guest
+ * as a PCI memory BAR, so the guest uses the netmap_if, the rings and
+ * the buffers of the host port as they are. A guest application
+ * updates head/cur and reads tail as usual, but instead of NIOC*SYNC
+ * it kicks the host (a write to a doorbell register of the device,
+ * that the hypervisor turns into an eventfd signal without leaving
+ * the host kernel, e.g. a KVM ioeventfd). A host kernel thread per
+ * ring then does the sync on the host kring, and interrupts the guest
+ * (another eventfd, e.g. a KVM irqfd) when it asked for it.
+ * How the guest finds the netmap_if (nr_offset), the csb indexes and
+ * the doorbells is up to the device model of the hypervisor.
+ *
+ * struct ptn_csb is the rest of the state shared by the two sides.
+ * It is in a netmap buffer, one per ring, so it is in the BAR too.
+ * Both flags are hints to save kicks and interrupts, they are set
+ * before looking at the ring a last time, and then going to sleep:
+ *	host_need_kick	(host) the thread sleeps, the guest must kick
+ *		after moving head. Otherwise the thread is running and
+ *		will see the new head anyway.
+ *	guest_need_kick	(guest) the guest waits for tail to move and
+ *		wants an interrupt. The host clears it when it sends one.
+ * See nm_pt_kick() and nm_pt_intr_enable() in netmap_user.h.
+ */
+struct ptn_csb {
+	uint32_t	host_need_kick;
+	uint32_t	ptn_spare1[15];	/* each side writes its own cache line */
+	uint32_t	guest_need_kick;
+	uint32_t	ptn_spare2[15];
+};
+
 #endif /* _NET_NETMAP_H_ */
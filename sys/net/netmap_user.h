@@ -95,6 +95,10 @@
 	( ((char *)(buf) - ((char *)(ring) + (ring)->buf_ofs) ) / \
 		(ring)->nr_buf_size )
 
+/* hardware timestamps of the slots, only on ports bound with NR_HWTS */
+#define NETMAP_RING_TS(ring)				\
+	((uint64_t *)(void *)&(ring)->slot[(ring)->num_slots])
+
 
 static inline uint32_t
 nm_ring_next(struct netmap_ring *r, uint32_t i)
@@ -124,6 +128,46 @@ nm_ring_space(struct netmap_ring *ring)
 }
 
 
+/*
+ * Return 0 if rx ring ri had nothing at the last sync, from the
+ * bitmap that the kernel keeps in the netmap_if (NI_RX_PENDING),
+ * so that the ring itself need not be touched.
+ */
+static inline int
+nm_rx_pending(struct netmap_if *nifp, u_int ri)
+{
+	return !(nifp->ni_flags & NI_RX_PENDING) ||
+		(NETMAP_IF_RX_PENDING(nifp)[ri / 32] & (1U << (ri % 32)));
+}
+
+
+/*
+ * Guest side of a passthrough ring (see struct ptn_csb in netmap.h).
+ * After moving head/cur, nm_pt_kick() replaces NIOC*SYNC: it writes
+ * the doorbell of the ring (any value) only if the host thread sleeps.
+ * Before waiting for an interrupt, call nm_pt_intr_enable() and only
+ * sleep if it returns 0; otherwise the ring is already not empty.
+ */
+static inline void
+nm_pt_kick(struct ptn_csb *csb, volatile uint32_t *doorbell)
+{
+	__sync_synchronize();	/* head/cur before host_need_kick */
+	if (csb->host_need_kick)
+		*doorbell = 1;
+}
+
+static inline int
+nm_pt_intr_enable(struct ptn_csb *csb, struct netmap_ring *ring)
+{
+	csb->guest_need_kick = 1;
+	__sync_synchronize();	/* the flag before tail */
+	if (nm_ring_empty(ring))
+		return 0;
+	csb->guest_need_kick = 0;
+	return 1;
+}
+
+
 #ifdef NETMAP_WITH_LIBS
 /*
  * Support for simple I/O libraries.
@@ -178,6 +222,17 @@ struct nm_pkthdr {	/* same as pcap_pkthdr */
 	uint32_t	len;
 };
 
+/*
+ * A packet in a burst, see nm_recv_burst() and nm_tx_reserve().
+ * slot is in ring, and buf is its buffer.
+ */
+struct nm_burst_pkt {
+	u_char		*buf;
+	uint32_t	len;
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+};
+
 struct nm_stat {	/* same as pcap_stat	*/
 	u_int	ps_recv;
 	u_int	ps_drop;
@@ -284,6 +339,8 @@ typedef void (*nm_cb_t)(u_char *, const struct nm_pkthdr *, const u_char *d);
  *		-NN		bind individual NIC ring pair
  *		{NN		bind master side of pipe NN
  *		}NN		bind slave side of pipe NN
+ *		}NN-RR		bind ring RR of the slave side of pipe NN
+ *				(pipe groups, see netmap.h)
  *
  * req		provides the initial values of nmreq before parsing ifname.
  *		Remember that the ifname parsing will override the ring
@@ -313,6 +370,9 @@ enum {
 	NM_OPEN_ARG2 =		0x200000,
 	NM_OPEN_ARG3 =		0x400000,
 	NM_OPEN_RING_CFG =	0x800000, /* tx|rx rings|slots */
+	NM_OPEN_BUSY_POLL =	0x1000000, /* NR_BUSY_POLL, no syscalls */
+	NM_OPEN_HWTS =		0x2000000, /* NR_HWTS, hardware timestamps */
+	NM_OPEN_JBUF =		0x4000000, /* NR_JBUF, large buffers */
 };
 
 
@@ -332,6 +392,25 @@ static int nm_inject(struct nm_desc *, const void *, size_t);
 static int nm_dispatch(struct nm_desc *, int, nm_cb_t, u_char *);
 static u_char *nm_nextpkt(struct nm_desc *, struct nm_pkthdr *);
 
+/*
+ * Burst versions, to avoid a call and a scan of the rings per packet.
+ *
+ * nm_recv_burst() fills up to n entries of pkts with the packets
+ * received on the rx rings, and returns how many. As with
+ * nm_nextpkt(), the buffers are released to the kernel, and only
+ * valid until the next poll() or ioctl() on the descriptor.
+ *
+ * nm_tx_reserve() fills up to n entries of pkts with free tx slots,
+ * len set to the buffer size, and returns how many; nothing is sent.
+ * The caller builds the packets in place, sets len (and slot->flags
+ * if needed), then nm_tx_commit() queues the first n of them.
+ * Reserved slots that are not committed are reserved again by the
+ * next nm_tx_reserve(). As usual, a poll() or NIOCTXSYNC sends.
+ */
+static int nm_recv_burst(struct nm_desc *, struct nm_burst_pkt *, u_int n);
+static int nm_tx_reserve(struct nm_desc *, struct nm_burst_pkt *, u_int n);
+static void nm_tx_commit(struct nm_desc *, struct nm_burst_pkt *, u_int n);
+
 
 /*
  * Try to open, return descriptor if successful, NULL otherwise.
@@ -343,6 +422,12 @@ static u_char *nm_nextpkt(struct nm_desc *, struct nm_pkthdr *);
  * NM_OPEN_ARG1		use req.nr_arg1 from arg
  * NM_OPEN_ARG2		use req.nr_arg2 from arg
  * NM_OPEN_RING_CFG	user ring config from arg
+ * NM_OPEN_BUSY_POLL	let a kernel thread sync the rings (NR_BUSY_POLL)
+ * NM_OPEN_HWTS		ask for hardware timestamps (NR_HWTS), which
+ *			nm_dispatch() and nm_nextpkt() then report in
+ *			the nm_pkthdr instead of the time of the last sync.
+ * NM_OPEN_JBUF		put large buffers (NR_JBUF) on the rings, of
+ *			req.nr_jbuf_size bytes, when they are created.
  */
 static struct nm_desc *
 nm_open(const char *ifname, const struct nmreq *req,
@@ -392,12 +477,13 @@ nm_open(const char *ifname, const struct nmreq *req,
 		}
 		break;
 	case '{':
-		nr_flags = NR_REG_PIPE_MASTER;
-		nr_ringid = atoi(port + 1);
-		break;
 	case '}':
-		nr_flags = NR_REG_PIPE_SLAVE;
+		nr_flags = (*port == '{' ? NR_REG_PIPE_MASTER :
+			NR_REG_PIPE_SLAVE);
 		nr_ringid = atoi(port + 1);
+		/* optional ring of a pipe group */
+		if ((port = index(port + 1, '-')) != NULL)
+			nr_flags |= NR_PIPE_RING(atoi(port + 1));
 		break;
 	}
 
@@ -462,6 +548,12 @@ nm_open(const char *ifname, const struct nmreq *req,
 	}
 	/* add the *XPOLL flags */
 	d->req.nr_ringid |= new_flags & (NETMAP_NO_TX_POLL | NETMAP_DO_RX_POLL);
+	if (new_flags & NM_OPEN_BUSY_POLL)
+		d->req.nr_flags |= NR_BUSY_POLL;
+	if (new_flags & NM_OPEN_HWTS)
+		d->req.nr_flags |= NR_HWTS;
+	if (new_flags & NM_OPEN_JBUF)
+		d->req.nr_flags |= NR_JBUF;
 
 	if (ioctl(d->fd, NIOCREGIF, &d->req)) {
 		errmsg = "NIOCREGIF failed";
@@ -490,25 +582,28 @@ nm_open(const char *ifname, const struct nmreq *req,
 
 		*(struct netmap_if **)(uintptr_t)&(d->nifp) = nifp;
 		*(struct netmap_ring **)(uintptr_t)&d->some_ring = r;
-		*(void **)(uintptr_t)&d->buf_start = NETMAP_BUF(r, 0);
+		/* the host rings always have normal buffers */
+		*(void **)(uintptr_t)&d->buf_start =
+			NETMAP_BUF(NETMAP_TXRING(nifp, nifp->ni_tx_rings), 0);
 		*(void **)(uintptr_t)&d->buf_end =
 			(char *)d->mem + d->memsize;
 	}
 
-	if (d->req.nr_flags ==  NR_REG_SW) { /* host stack */
+	nr_flags = d->req.nr_flags & NR_REG_MASK;
+	if (nr_flags ==  NR_REG_SW) { /* host stack */
 		d->first_tx_ring = d->last_tx_ring = d->req.nr_tx_rings;
 		d->first_rx_ring = d->last_rx_ring = d->req.nr_rx_rings;
-	} else if (d->req.nr_flags ==  NR_REG_ALL_NIC) { /* only nic */
+	} else if (nr_flags ==  NR_REG_ALL_NIC) { /* only nic */
 		d->first_tx_ring = 0;
 		d->first_rx_ring = 0;
 		d->last_tx_ring = d->req.nr_tx_rings - 1;
 		d->last_rx_ring = d->req.nr_rx_rings - 1;
-	} else if (d->req.nr_flags ==  NR_REG_NIC_SW) {
+	} else if (nr_flags ==  NR_REG_NIC_SW) {
 		d->first_tx_ring = 0;
 		d->first_rx_ring = 0;
 		d->last_tx_ring = d->req.nr_tx_rings;
 		d->last_rx_ring = d->req.nr_rx_rings;
-	} else if (d->req.nr_flags == NR_REG_ONE_NIC) {
+	} else if (nr_flags == NR_REG_ONE_NIC) {
 		/* XXX check validity */
 		d->first_tx_ring = d->last_tx_ring =
 		d->first_rx_ring = d->last_rx_ring = d->req.nr_ringid & NETMAP_RING_MASK;
@@ -557,7 +652,9 @@ nm_close(struct nm_desc *d)
 	 */
 	static void *__xxzt[] __attribute__ ((unused))  =
 		{ (void *)nm_open, (void *)nm_inject,
-		  (void *)nm_dispatch, (void *)nm_nextpkt } ;
+		  (void *)nm_dispatch, (void *)nm_nextpkt,
+		  (void *)nm_recv_burst, (void *)nm_tx_reserve,
+		  (void *)nm_tx_commit } ;
 
 	if (d == NULL || d->self != d)
 		return EINVAL;
@@ -603,6 +700,26 @@ nm_inject(struct nm_desc *d, const void *buf, size_t size)
 }
 
 
+/*
+ * The timestamp of slot i: the hardware one if available, otherwise
+ * the time of the last sync (set with NR_TIMESTAMP in ring->flags).
+ */
+static inline void
+nm_slot_ts(const struct nm_desc *d, const struct netmap_ring *ring,
+	u_int i, struct timeval *tv)
+{
+	uint64_t ts;
+
+	if ((d->req.nr_flags & NR_HWTS) &&
+	    (ts = NETMAP_RING_TS(ring)[i]) != 0) {
+		tv->tv_sec = ts / 1000000000;
+		tv->tv_usec = (ts % 1000000000) / 1000;
+	} else {
+		*tv = ring->ts;
+	}
+}
+
+
 /*
  * Same prototype as pcap_dispatch(), only need to cast.
  */
@@ -625,6 +742,8 @@ nm_dispatch(struct nm_desc *d, int cnt, nm_cb_t cb, u_char *arg)
 		ri = d->cur_rx_ring + c;
 		if (ri > d->last_rx_ring)
 			ri = d->first_rx_ring;
+		if (!nm_rx_pending(d->nifp, ri))
+			continue;
 		ring = NETMAP_RXRING(d->nifp, ri);
 		for ( ; !nm_ring_empty(ring) && cnt != got; got++) {
 			u_int i = ring->cur;
@@ -633,7 +752,7 @@ nm_dispatch(struct nm_desc *d, int cnt, nm_cb_t cb, u_char *arg)
 
 			// __builtin_prefetch(buf);
 			d->hdr.len = d->hdr.caplen = ring->slot[i].len;
-			d->hdr.ts = ring->ts;
+			nm_slot_ts(d, ring, i, &d->hdr.ts);
 			cb(arg, &d->hdr, buf);
 			ring->head = ring->cur = nm_ring_next(ring, i);
 		}
@@ -650,13 +769,13 @@ nm_nextpkt(struct nm_desc *d, struct nm_pkthdr *hdr)
 	do {
 		/* compute current ring to use */
 		struct netmap_ring *ring = NETMAP_RXRING(d->nifp, ri);
-		if (!nm_ring_empty(ring)) {
+		if (nm_rx_pending(d->nifp, ri) && !nm_ring_empty(ring)) {
 			u_int i = ring->cur;
 			u_int idx = ring->slot[i].buf_idx;
 			u_char *buf = (u_char *)NETMAP_BUF(ring, idx);
 
 			// __builtin_prefetch(buf);
-			hdr->ts = ring->ts;
+			nm_slot_ts(d, ring, i, &hdr->ts);
 			hdr->len = hdr->caplen = ring->slot[i].len;
 			ring->cur = nm_ring_next(ring, i);
 			/* we could postpone advancing head if we want
@@ -674,6 +793,102 @@ nm_nextpkt(struct nm_desc *d, struct nm_pkthdr *hdr)
 	return NULL; /* nothing found */
 }
 
+#define NM_BURST_PREFETCH	4	/* buffers ahead */
+
+static int
+nm_recv_burst(struct nm_desc *d, struct nm_burst_pkt *pkts, u_int n)
+{
+	u_int c, got = 0, nrings = d->last_rx_ring - d->first_rx_ring + 1;
+	u_int ri = d->cur_rx_ring;
+
+	for (c = 0; c < nrings && got < n; c++) {
+		struct netmap_ring *ring;
+		u_int i, k, m;
+
+		ri = d->cur_rx_ring + c;
+		if (ri > d->last_rx_ring)
+			ri -= nrings;
+		if (!nm_rx_pending(d->nifp, ri))
+			continue;
+		ring = NETMAP_RXRING(d->nifp, ri);
+		m = nm_ring_space(ring);
+		if (m > n - got)
+			m = n - got;
+		/* start the first buffers, then keep NM_BURST_PREFETCH ahead */
+		for (i = ring->cur, k = 0; k < m && k < NM_BURST_PREFETCH; k++) {
+			__builtin_prefetch(NETMAP_BUF(ring,
+				ring->slot[i].buf_idx));
+			i = nm_ring_next(ring, i);
+		}
+		for (k = 0; k < m; k++) {
+			struct netmap_slot *slot = &ring->slot[ring->cur];
+			struct nm_burst_pkt *p = &pkts[got++];
+
+			if (k + NM_BURST_PREFETCH < m) {
+				__builtin_prefetch(NETMAP_BUF(ring,
+					ring->slot[i].buf_idx));
+				i = nm_ring_next(ring, i);
+			}
+			p->buf = (u_char *)NETMAP_BUF(ring, slot->buf_idx);
+			p->len = slot->len;
+			p->ring = ring;
+			p->slot = slot;
+			ring->cur = nm_ring_next(ring, ring->cur);
+		}
+		ring->head = ring->cur;
+	}
+	d->cur_rx_ring = ri;
+	return got;
+}
+
+static int
+nm_tx_reserve(struct nm_desc *d, struct nm_burst_pkt *pkts, u_int n)
+{
+	u_int c, got = 0, nrings = d->last_tx_ring - d->first_tx_ring + 1;
+
+	for (c = 0; c < nrings && got < n; c++) {
+		struct netmap_ring *ring;
+		u_int i, m, ri = d->cur_tx_ring + c;
+
+		if (ri > d->last_tx_ring)
+			ri -= nrings;
+		ring = NETMAP_TXRING(d->nifp, ri);
+		m = nm_ring_space(ring);
+		if (m > n - got)
+			m = n - got;
+		if (m > 0 && got == 0)
+			d->cur_tx_ring = ri; /* start here next time */
+		for (i = ring->cur; m > 0; m--) {
+			struct nm_burst_pkt *p = &pkts[got++];
+
+			p->slot = &ring->slot[i];
+			p->ring = ring;
+			p->buf = (u_char *)NETMAP_BUF(ring, p->slot->buf_idx);
+			p->len = ring->nr_buf_size;
+			i = nm_ring_next(ring, i);
+		}
+	}
+	return got;
+}
+
+static void
+nm_tx_commit(struct nm_desc *d, struct nm_burst_pkt *pkts, u_int n)
+{
+	u_int k;
+
+	(void)d;
+
+	for (k = 0; k < n; k++) {
+		struct netmap_ring *ring = pkts[k].ring;
+		u_int i = pkts[k].slot - ring->slot;
+
+		pkts[k].slot->len = pkts[k].len;
+		/* the last one of each ring moves head and cur */
+		if (k == n - 1 || pkts[k + 1].ring != ring)
+			ring->head = ring->cur = nm_ring_next(ring, i);
+	}
+}
+
 #endif /* !HAVE_NETMAP_WITH_LIBS */
 
 #endif /* NETMAP_WITH_LIBS */